@@ -34,6 +34,8 @@
 
 #include "common.h"
 
+#include <zlib.h>
+
 #include "bh_upload.h"
 #include "share.h"
 #include "bsched.h"
@@ -53,6 +55,7 @@
 
 #include "lib/array.h"
 #include "lib/concat.h"
+#include "lib/cq.h"
 #include "lib/gnet_host.h"
 #include "lib/halloc.h"
 #include "lib/header.h"
@@ -62,7 +65,9 @@
 #include "lib/stringify.h"
 #include "lib/unsigned.h"
 #include "lib/url.h"
+#include "lib/tm.h"
 #include "lib/walloc.h"
+#include "lib/zlib_util.h"
 
 #include "lib/override.h"	/* Must be the last header included */
 
@@ -80,6 +85,11 @@
 
 #define BH_BUFSIZ			16384	/**< Buffer size for TX deflation */
 
+#define BH_CACHE_LIFETIME	600		/**< secs: max age of cached hits */
+#define BH_CACHE_MAXLEN		(64 * 1024 * 1024)	/**< Max cached stream */
+#define BH_DEFLATE_CHUNK	65536	/**< Bytes compressed per step */
+#define BH_DEFLATE_PERIOD	50		/**< ms: delay between deflating steps */
+
 enum bh_state {
 	BH_STATE_HEADER = 0,	/* Sending header */
 	BH_STATE_LIBRARY_INFO,	/* Info on library */
@@ -96,6 +106,35 @@ enum bh_type {
 	BH_TYPE_QHIT			/* Send back Gnutella query hits */
 };
 
+enum bh_format {
+	BH_FMT_GNUTELLA = 0,	/* Gnutella query hits */
+	BH_FMT_G2,				/* G2 /QH2 messages */
+
+	BH_FMT_COUNT
+};
+
+enum bh_cache_magic { BH_CACHE_MAGIC = 0x3d9b5c17 };
+
+/**
+ * A cached browse stream, shared by all the browses serving it.
+ */
+struct bh_cache {
+	enum bh_cache_magic magic;
+	int refcnt;				/**< Reference count */
+	char *data;				/**< Stream data (halloc'ed) */
+	size_t len;				/**< Length of stream */
+	time_t created;			/**< When stream generation started */
+	uint generation;		/**< Library generation of the stream */
+};
+
+static inline void
+bh_cache_check(const struct bh_cache * const bc)
+{
+	g_assert(bc != NULL);
+	g_assert(BH_CACHE_MAGIC == bc->magic);
+	g_assert(bc->refcnt > 0);
+}
+
 struct browse_host_upload {
 	struct special_upload special;	/**< vtable, MUST be first field */
 	enum bh_type type;		/**< Type of data to send back */
@@ -109,6 +148,15 @@ struct browse_host_upload {
 	uint file_index;		/**< Current file index (iterator) */
 	enum bh_state state;	/**< Current state of the state machine */
 	pslist_t *hits;			/**< Pending query hits to send back */
+	enum bh_format format;	/**< Query hit format */
+	struct bh_cache *cache;	/**< Cached stream we are serving, if any */
+	size_t cache_offset;	/**< Offset of next byte to serve in cache */
+	char *build;			/**< Stream being recorded for the cache */
+	size_t build_len;		/**< Length of recorded stream */
+	size_t build_size;		/**< Size of the `build' buffer */
+	time_t build_start;		/**< When we started recording */
+	uint build_gen;			/**< Library generation when we started */
+	bool build_abort;		/**< Whether recording must be discarded */
 	special_upload_closed_t cb;	/**< Callback to invoke when TX fully flushed */
 	void *cb_arg;			/**< Callback argument */
 };
@@ -120,6 +168,283 @@ cast_to_browse_host_upload(struct special_upload *p)
 	return (void *) p;
 }
 
+/*
+ * Browse stream cache.
+ *
+ * The query hits we send back to a browse-host request only depend on the
+ * library and on our servent information in the hit trailers, not on who
+ * is browsing.  We therefore record the stream generated by a complete
+ * browse, for each hit format, and serve later browses from it.  Once
+ * recorded, the stream is also deflated in the background so that browses
+ * requesting deflate encoding do not need a compressing TX layer.
+ *
+ * A cached stream is discarded when the library changes.  It also expires
+ * after some time, since the trailers hold information that can change:
+ * push-proxies, firewalled status, our address.
+ */
+
+static struct bh_format_cache {
+	struct bh_cache *identity;			/**< Uncompressed stream */
+	struct bh_cache *deflated;			/**< Stream in zlib format */
+	struct browse_host_upload *builder;	/**< Browse recording the stream */
+	struct bh_cache *source;			/**< Stream being deflated */
+	zlib_deflater_t *zd;				/**< Background deflater */
+	cevent_t *deflate_ev;				/**< Next deflating step */
+} bh_cache[BH_FMT_COUNT];
+
+/**
+ * Create a new cached stream, taking ownership of the data.
+ */
+static struct bh_cache *
+bh_cache_alloc(char *data, size_t len, time_t created, uint generation)
+{
+	struct bh_cache *bc;
+
+	WALLOC0(bc);
+	bc->magic = BH_CACHE_MAGIC;
+	bc->refcnt = 1;
+	bc->data = data;
+	bc->len = len;
+	bc->created = created;
+	bc->generation = generation;
+
+	return bc;
+}
+
+/**
+ * Add a reference to cached stream.
+ */
+static struct bh_cache *
+bh_cache_ref(struct bh_cache *bc)
+{
+	bh_cache_check(bc);
+
+	bc->refcnt++;
+	return bc;
+}
+
+/**
+ * Remove a reference to cached stream, freeing it when no longer referenced,
+ * and nullify the pointer.
+ */
+static void
+bh_cache_unref(struct bh_cache **bc_ptr)
+{
+	struct bh_cache *bc = *bc_ptr;
+
+	if (bc != NULL) {
+		bh_cache_check(bc);
+
+		if (0 == --bc->refcnt) {
+			HFREE_NULL(bc->data);
+			bc->magic = 0;
+			WFREE(bc);
+		}
+		*bc_ptr = NULL;
+	}
+}
+
+/**
+ * @return whether cached stream can still be served.
+ */
+static bool
+bh_cache_is_valid(const struct bh_cache *bc)
+{
+	bh_cache_check(bc);
+
+	return bc->generation == shared_files_generation() &&
+		delta_time(tm_time(), bc->created) < BH_CACHE_LIFETIME;
+}
+
+/**
+ * Stop background deflating of the stream for the format.
+ */
+static void
+bh_cache_deflate_cancel(struct bh_format_cache *fc)
+{
+	cq_cancel(&fc->deflate_ev);
+	if (fc->zd != NULL) {
+		zlib_deflater_free(fc->zd, TRUE);
+		fc->zd = NULL;
+	}
+	bh_cache_unref(&fc->source);
+}
+
+/**
+ * Discard the cached streams for the format that can no longer be served.
+ */
+static void
+bh_cache_purge(struct bh_format_cache *fc)
+{
+	if (fc->identity != NULL && !bh_cache_is_valid(fc->identity))
+		bh_cache_unref(&fc->identity);
+
+	if (fc->deflated != NULL && !bh_cache_is_valid(fc->deflated))
+		bh_cache_unref(&fc->deflated);
+
+	if (fc->source != NULL && !bh_cache_is_valid(fc->source))
+		bh_cache_deflate_cancel(fc);
+}
+
+/**
+ * Callout queue callback to perform the next deflating step.
+ */
+static void
+bh_cache_deflate_step(cqueue_t *cq, void *obj)
+{
+	struct bh_format_cache *fc = obj;
+	const struct bh_cache *src = fc->source;
+
+	cq_zero(cq, &fc->deflate_ev);
+	bh_cache_check(src);
+
+	if (!bh_cache_is_valid(src)) {
+		bh_cache_deflate_cancel(fc);
+		return;
+	}
+
+	switch (zlib_deflate(fc->zd, BH_DEFLATE_CHUNK)) {
+	case 1:
+		fc->deflate_ev = cq_insert(cq, BH_DEFLATE_PERIOD,
+			bh_cache_deflate_step, fc);
+		return;
+	case 0:
+		bh_cache_unref(&fc->deflated);
+		fc->deflated = bh_cache_alloc(zlib_deflater_out(fc->zd),
+			zlib_deflater_outlen(fc->zd), src->created, src->generation);
+		zlib_deflater_free(fc->zd, FALSE);	/* Output now held in cache */
+		fc->zd = NULL;
+		bh_cache_unref(&fc->source);
+
+		if (GNET_PROPERTY(upload_debug)) {
+			g_debug("%s(): cached %s browse stream of %zu bytes, "
+				"deflated to %zu", G_STRFUNC,
+				fc == &bh_cache[BH_FMT_G2] ? "G2" : "Gnutella",
+				fc->identity != NULL ? fc->identity->len : 0,
+				fc->deflated->len);
+		}
+		return;
+	default:
+		g_warning("%s(): cannot deflate cached browse stream", G_STRFUNC);
+		bh_cache_deflate_cancel(fc);
+		return;
+	}
+}
+
+/**
+ * Install the stream recorded by a browse in the cache, if still valid.
+ */
+static void
+bh_cache_install(struct browse_host_upload *bh)
+{
+	struct bh_format_cache *fc = &bh_cache[bh->format];
+
+	g_assert(fc->builder == bh);
+
+	fc->builder = NULL;
+
+	if (
+		bh->build_abort || 0 == bh->build_len ||
+		bh->build_gen != shared_files_generation()
+	) {
+		HFREE_NULL(bh->build);
+		return;
+	}
+
+	bh_cache_unref(&fc->identity);
+	bh_cache_unref(&fc->deflated);
+	bh_cache_deflate_cancel(fc);
+
+	fc->identity = bh_cache_alloc(bh->build, bh->build_len,
+		bh->build_start, bh->build_gen);
+	bh->build = NULL;
+
+	/*
+	 * Deflate the stream in the background, a little bit at a time.
+	 */
+
+	fc->zd = zlib_deflater_make(fc->identity->data, fc->identity->len,
+		Z_DEFAULT_COMPRESSION);
+
+	if (NULL == fc->zd)
+		return;
+
+	fc->source = bh_cache_ref(fc->identity);
+	fc->deflate_ev = cq_main_insert(BH_DEFLATE_PERIOD,
+		bh_cache_deflate_step, fc);
+}
+
+/**
+ * Record data we are about to send, for the cache.
+ */
+static void
+bh_cache_record(struct browse_host_upload *bh, const void *data, size_t len)
+{
+	if (bh->build_abort)
+		return;
+
+	if (bh->build_len + len > BH_CACHE_MAXLEN) {
+		bh->build_abort = TRUE;		/* Library too large to cache */
+		HFREE_NULL(bh->build);
+		return;
+	}
+
+	if (bh->build_len + len > bh->build_size) {
+		bh->build_size = MAX(bh->build_size * 2, bh->build_len + len);
+		bh->build_size = MIN(bh->build_size, BH_CACHE_MAXLEN);
+		bh->build = hrealloc(bh->build, bh->build_size);
+	}
+
+	memcpy(&bh->build[bh->build_len], data, len);
+	bh->build_len += len;
+}
+
+/**
+ * Determine how browse will be served: from a cached stream or by
+ * generating the query hits, in which case it may record them for the cache.
+ *
+ * @return TRUE if browse will serve a deflated stream.
+ */
+static bool
+bh_cache_attach(struct browse_host_upload *bh)
+{
+	struct bh_format_cache *fc = &bh_cache[bh->format];
+
+	bh_cache_purge(fc);
+
+	if ((bh->flags & BH_F_DEFLATE) && fc->deflated != NULL) {
+		bh->cache = bh_cache_ref(fc->deflated);
+		return TRUE;
+	}
+
+	if (fc->identity != NULL) {
+		bh->cache = bh_cache_ref(fc->identity);
+	} else if (NULL == fc->builder) {
+		fc->builder = bh;
+		bh->build_start = tm_time();
+		bh->build_gen = shared_files_generation();
+	}
+
+	return FALSE;
+}
+
+/**
+ * Discard all the cached browse streams.
+ */
+void
+browse_host_shutdown(void)
+{
+	size_t i;
+
+	for (i = 0; i < N_ITEMS(bh_cache); i++) {
+		struct bh_format_cache *fc = &bh_cache[i];
+
+		bh_cache_deflate_cancel(fc);
+		bh_cache_unref(&fc->identity);
+		bh_cache_unref(&fc->deflated);
+	}
+}
+
 /**
  * Copies up to ``*size'' bytes from current data block
  * (bh->b_data + bh->b_offset) to the buffer ``dest''.
@@ -416,6 +741,20 @@ browse_host_read_qhits(struct special_upload *ctx,
 	size_t remain = size;
 	char *p = dest;
 
+	/*
+	 * If we are serving a cached stream, simply copy the next bytes.
+	 */
+
+	if (bh->cache != NULL) {
+		size_t len = bh->cache->len - bh->cache_offset;
+
+		len = MIN(len, size);
+		memcpy(dest, &bh->cache->data[bh->cache_offset], len);
+		bh->cache_offset += len;
+
+		return len;
+	}
+
 	/*
 	 * If we have no hit pending that we can send, build some more.
 	 */
@@ -433,14 +772,22 @@ browse_host_read_qhits(struct special_upload *ctx,
 				sf = shared_file_sorted(bh->file_index);
 			} while (NULL == sf && bh->file_index <= shared_files_scanned());
 
-			if (SHARE_REBUILDING == sf || NULL == sf)
+			if (SHARE_REBUILDING == sf) {
+				bh->build_abort = TRUE;		/* Incomplete stream */
+				break;
+			}
+
+			if (NULL == sf)
 				break;
 
 			files = pslist_prepend(files, sf);
 		}
 
-		if (NULL == files)		/* Did not find any more file to include */
+		if (NULL == files) {	/* Did not find any more file to include */
+			if (bh == bh_cache[bh->format].builder)
+				bh_cache_install(bh);
 			return 0;			/* We're done */
+		}
 
 		/*
 		 * Now build the query hits containing the files we selected.
@@ -475,6 +822,8 @@ browse_host_read_qhits(struct special_upload *ctx,
 		int r;
 
 		r = pmsg_read(mb, p, remain);
+		if (bh == bh_cache[bh->format].builder)
+			bh_cache_record(bh, p, r);
 		p += r;
 		remain -= r;
 
@@ -559,6 +908,11 @@ browse_host_close(struct special_upload *ctx, bool fully_served)
 	}
 	pslist_free_null(&bh->hits);
 
+	bh_cache_unref(&bh->cache);
+	if (bh == bh_cache[bh->format].builder)
+		bh_cache[bh->format].builder = NULL;
+	HFREE_NULL(bh->build);
+
 	if (bh->w_buf) {
 		wfree(bh->w_buf, bh->w_buf_size);
 		bh->w_buf = NULL;
@@ -608,6 +962,7 @@ browse_host_open(
 	int flags)
 {
 	struct browse_host_upload *bh;
+	bool deflated = FALSE;
 
 	/* BH_HTML xor BH_QHITS set */
 	g_assert(flags & (BH_F_HTML|BH_F_QHITS));
@@ -626,6 +981,19 @@ browse_host_open(
 	bh->hits = NULL;
 	bh->file_index = 0;
 	bh->flags = flags;
+	bh->format = (flags & BH_F_G2) ? BH_FMT_G2 : BH_FMT_GNUTELLA;
+	bh->cache = NULL;
+	bh->cache_offset = 0;
+	bh->build = NULL;
+	bh->build_len = bh->build_size = 0;
+	bh->build_abort = FALSE;
+
+	/*
+	 * Query hits can be served from the cache, possibly already deflated.
+	 */
+
+	if (flags & BH_F_QHITS)
+		deflated = bh_cache_attach(bh);
 
 	/*
 	 * Instantiate the TX stack.
@@ -644,7 +1012,7 @@ browse_host_open(
 	if (flags & BH_F_CHUNKED) {
 		bh->tx = tx_make_above(bh->tx, tx_chunk_get_ops(), 0);
 	}
-	if (flags & (BH_F_DEFLATE | BH_F_GZIP)) {
+	if ((flags & (BH_F_DEFLATE | BH_F_GZIP)) && !deflated) {
 		struct tx_deflate_args args;
 		txdrv_t *tx;
 
@@ -661,6 +1029,9 @@ browse_host_open(
 			tx_free(bh->tx);
 			link_cb->eof_remove(owner,
 				"%s(): cannot setup compressing TX stack", G_STRFUNC);
+			bh_cache_unref(&bh->cache);
+			if (bh == bh_cache[bh->format].builder)
+				bh_cache[bh->format].builder = NULL;
 			WFREE(bh);
 			return NULL;
 		}
@@ -42,7 +42,9 @@
 #include "if/gnet_property.h"
 #include "if/gnet_property_priv.h"
 
+#include "lib/atomic.h"
 #include "lib/compat_sendfile.h"
+#include "lib/elist.h"
 #include "lib/entropy.h"
 #include "lib/halloc.h"
 #include "lib/hstrfn.h"
@@ -114,15 +116,29 @@ enum bsched_magic {
  * of the period, any amount of bandwidth that has been unused will be
  * given as "stolen" bandwidth to some of the schedulers stealing from us.
  * Priority is given to schedulers that used up all their bandwidth.
+ *
+ * To keep the periodic work proportional to the amount of sources doing
+ * I/O and not to the total amount of sources, each scheduler maintains a
+ * "live" list holding the sources that were used during the period, the
+ * passive ones which must be triggered at each period, and the ones whose
+ * bandwidth statistics are still decaying.  Idle sources are only visited
+ * when they must be re-enabled after the scheduler ran out of bandwidth.
+ *
+ * Each scheduler belongs to a traffic class (HTTP, Gnutella ultrapeer, leaf
+ * or UDP traffic, DHT) whose configurable weight determines its share of the
+ * bandwidth stolen from other schedulers.  The ceiling of a class is its
+ * configured bandwidth plus what it may borrow from its lenders.
  */
 
 struct bsched {
 	enum bsched_magic magic;
 	tm_t last_period;			/**< Last time we ran our period */
 	plist_t *sources;			/**< List of bio_source_t */
+	elist_t live;				/**< Sources needing periodic processing */
 	pslist_t *stealers;			/**< List of bsched_t stealing bw */
 	char *name;					/**< Name, for tracing purposes */
 	property_t byte_count;		/**< Property used to count transferred bytes */
+	property_t weight;			/**< Property holding class weight, if any */
 	int count;					/**< Amount of sources */
 	uint type;					/**< Scheduling type */
 	uint flags;					/**< Processing flags */
@@ -143,6 +159,11 @@ struct bsched {
 	int64 bw_unwritten;			/**< Data that we could not write */
 	int64 bw_capped;			/**< Bandwidth we refused to sources */
 	int64 bw_urgent;			/**< Urgent b/w required in stealing */
+	int64 bw_allocated;			/**< Sum of b/w pre-allocated to sources */
+	int64 util_ema;				/**< EMA of per-mille of allowed b/w used */
+	int64 starved_ema;			/**< EMA of time starved per period, in ms */
+	tm_t nobw_time;				/**< When we ran out of bandwidth */
+	AU64(bytes_pending);		/**< Traffic not yet added to `byte_count' */
 	int last_used;				/**< Nb of active sources last period */
 	int current_used;			/**< Nb of active sources this period */
 	uint io_favours;			/**< Amount of sources wanting favours */
@@ -188,19 +209,71 @@ bio_check(const bio_source_t * const bio)
 	g_assert(BIO_SOURCE_MAGIC == bio->magic);
 }
 
+/**
+ * Add the traffic accounted for since last flush to the scheduler's global
+ * byte counter property.
+ *
+ * The property is updated once per period rather than after each I/O since
+ * updating a property means locking it and notifying its listeners.
+ */
+static void
+bsched_flush_byte_count(bsched_t *bs)
+{
+	property_t p = bs->byte_count;
+	uint64 pending, value;
+
+	bsched_check(bs);
+
+	pending = AU64_VALUE(&bs->bytes_pending);
+	if (0 == pending)
+		return;
+
+	/*
+	 * Substract what we read instead of zeroing the counter, to not lose
+	 * concurrent updates.  On 32-bit machines, at most MAX_INT_VAL(long)
+	 * can be substracted at a time.
+	 */
+
+	for (value = pending; value != 0; /* empty */) {
+		long n = MIN(value, MAX_INT_VAL(long));
+		AU64_SUB(&bs->bytes_pending, n);
+		value -= n;
+	}
+
+	gnet_prop_lock(p);
+	gnet_prop_get_guint64_val(p, &value);
+	value += pending;
+	gnet_prop_set_guint64_val(p, value);
+	gnet_prop_unlock(p);
+}
+
+/**
+ * Make sure source is part of the scheduler's live list, so that it gets
+ * processed at the next timeslice.
+ */
+static inline void
+bsched_bio_live(bsched_t *bs, bio_source_t *bio)
+{
+	if G_UNLIKELY(0 == (bio->flags & BIO_F_LIVE)) {
+		bio->flags |= BIO_F_LIVE;
+		elist_append(&bs->live, bio);
+	}
+}
+
 /**
  * Create a new bandwidth scheduler.
  *
  * @param `name' brief description.
  * @param `account' property used to account for traffic
+ * @param `weight' property holding the weight of the class, or NO_PROP
  * @param `type' refers to the scheduling model.  Only BS_T_STREAM for now.
  * @param `mode' refers to the nature of the sources: either reading or writing.
  * @param `bandwidth' is the expected bandwidth in bytes per second.
  * @param `period' is the scheduling period in ms.
  */
 static bsched_t *
-bsched_make(const char *name, property_t account, uint type, uint32 mode,
-	int64 bandwidth, uint period)
+bsched_make(const char *name, property_t account, property_t weight,
+	uint type, uint32 mode, int64 bandwidth, uint period)
 {
 	bsched_t *bs;
 
@@ -217,6 +290,7 @@ bsched_make(const char *name, property_t account, uint type, uint32 mode,
 	WALLOC0(bs);
 	bs->magic = BSCHED_MAGIC;
 	bs->byte_count = account;
+	bs->weight = weight;
 	bs->name = h_strdup(name);
 	bs->flags = mode;
 	bs->type = type;
@@ -226,6 +300,7 @@ bsched_make(const char *name, property_t account, uint type, uint32 mode,
 	bs->period_ema = period;
 	bs->bw_per_second = bandwidth;
 	bs->bw_max = (int64) (bandwidth / 1000.0 * period);
+	elist_init(&bs->live, offsetof(bio_source_t, live_lk));
 
 	return bs;
 }
@@ -260,8 +335,11 @@ bsched_free(bsched_t *bs)
 		bio_check(bio);
 		g_assert(bsched_get(bio->bws) == bs);
 		bio->bws = BSCHED_BWS_INVALID;	/* Mark orphan source */
+		bio->flags &= ~BIO_F_LIVE;
 	}
 
+	bsched_flush_byte_count(bs);
+	elist_discard(&bs->live);
 	plist_free_null(&bs->sources);
 	pslist_free_null(&bs->stealers);
 	HFREE_NULL(bs->name);
@@ -354,6 +432,46 @@ bsched_set_urgent(bsched_bws_t bws, int64 amount)
 	bs->bw_urgent = MAX(amount, 0);
 }
 
+/**
+ * @return the weight of the scheduler's traffic class.
+ */
+static uint32
+bsched_weight(const bsched_t *bs)
+{
+	uint32 weight;
+
+	if (NO_PROP == bs->weight)
+		return 1;
+
+	gnet_prop_get_guint32_val(bs->weight, &weight);
+	return MAX(weight, 1);
+}
+
+/**
+ * Fill statistics about the scheduler.
+ */
+void
+bsched_get_stats(bsched_bws_t bws, bsched_stats_t *stats)
+{
+	const bsched_t *bs = bsched_get(bws);
+
+	g_assert(stats != NULL);
+
+	ZERO(stats);
+	stats->name = bs->name;
+	stats->bw_per_second = bs->bw_per_second;
+	stats->bps = bsched_bps(bws);
+	stats->avg_bps = bsched_avg_bps(bws);
+	stats->stolen_bps = bs->bw_stolen_ema * 1000 / bs->period;
+	stats->utilisation = bs->util_ema;
+	stats->starved_ms = bs->starved_ema;
+	stats->period = bs->period;
+	stats->weight = bsched_weight(bs);
+	stats->sources = bs->count;
+	stats->live = elist_count(&bs->live);
+	stats->enabled = booleanize(bs->flags & BS_F_ENABLED);
+}
+
 /**
  * Add `stealer' as a bandwidth stealer for underused bandwidth in `bws'.
  * Both must be either reading or writing schedulers.
@@ -512,27 +630,29 @@ bsched_early_init(void)
 #define PCGI(x)	PROP_BC_GNET_ ## x ## _IN
 #define RD		M(READ)
 #define WR		M(WRITE)
+#define W(x)	PROP_BW_WEIGHT_ ## x
 
 	static struct bws_set_init {
 		int id;
 		const char *name;
 		uint32 mode;
 		property_t bc;
+		property_t weight;
 	} schedulers[] = {
-		{ BS(OUT),			"out",			WR, PCO(HTTP)      },
-		{ BS(GOUT),			"G TCP out",	WR, PCGO(TCP_UP)   },
-		{ BS(GOUT_UDP),		"G UDP out",	WR, PCGO(UDP)      },
-		{ BS(GLOUT),		"GL out",		WR, PCGO(TCP_LEAF) },
-		{ BS(LOOPBACK_OUT),	"loopback out",	WR, PCO(LOOPBACK)  },
-		{ BS(PRIVATE_OUT),	"private out",	WR, PCO(PRIVATE)   },
-		{ BS(DHT_OUT),		"DHT out",		WR, PCO(DHT)       },
-		{ BS(IN),			"in",			RD, PCI(HTTP)      },
-		{ BS(GIN),			"G TCP in",		RD, PCGI(TCP_UP)   },
-		{ BS(GIN_UDP),		"G UDP in",		RD, PCGI(UDP)      },
-		{ BS(GLIN),			"GL in",		RD, PCGI(TCP_LEAF) },
-		{ BS(LOOPBACK_IN),	"loopback in",	RD, PCI(LOOPBACK)  },
-		{ BS(PRIVATE_IN),	"private in",	RD, PCI(PRIVATE)   },
-		{ BS(DHT_IN),		"DHT in",		RD, PCI(DHT)       },
+		{ BS(OUT),			"out",			WR, PCO(HTTP),      W(HTTP) },
+		{ BS(GOUT),			"G TCP out",	WR, PCGO(TCP_UP),   W(GNET) },
+		{ BS(GOUT_UDP),		"G UDP out",	WR, PCGO(UDP),      W(UDP)  },
+		{ BS(GLOUT),		"GL out",		WR, PCGO(TCP_LEAF), W(LEAF) },
+		{ BS(LOOPBACK_OUT),	"loopback out",	WR, PCO(LOOPBACK),  NO_PROP },
+		{ BS(PRIVATE_OUT),	"private out",	WR, PCO(PRIVATE),   NO_PROP },
+		{ BS(DHT_OUT),		"DHT out",		WR, PCO(DHT),       W(DHT)  },
+		{ BS(IN),			"in",			RD, PCI(HTTP),      W(HTTP) },
+		{ BS(GIN),			"G TCP in",		RD, PCGI(TCP_UP),   W(GNET) },
+		{ BS(GIN_UDP),		"G UDP in",		RD, PCGI(UDP),      W(UDP)  },
+		{ BS(GLIN),			"GL in",		RD, PCGI(TCP_LEAF), W(LEAF) },
+		{ BS(LOOPBACK_IN),	"loopback in",	RD, PCI(LOOPBACK),  NO_PROP },
+		{ BS(PRIVATE_IN),	"private in",	RD, PCI(PRIVATE),   NO_PROP },
+		{ BS(DHT_IN),		"DHT in",		RD, PCI(DHT),       W(DHT)  },
 	};
 
 #undef BS
@@ -544,6 +664,7 @@ bsched_early_init(void)
 #undef PCGO
 #undef PCI
 #undef PCGI
+#undef W
 
 	bws_list = bssched_load_bws(NULL,     out, N_ITEMS(out));
 	bws_list = bssched_load_bws(bws_list, in,  N_ITEMS(in));
@@ -553,8 +674,8 @@ bsched_early_init(void)
 
 	for (i = 0; i < N_ITEMS(schedulers); i++) {
 		const struct bws_set_init *b = &schedulers[i];
-		bws_set[b->id] =
-			bsched_make(b->name, b->bc, BS_T_STREAM, b->mode, 0, 1000);
+		bws_set[b->id] = bsched_make(b->name, b->bc, b->weight,
+			BS_T_STREAM, b->mode, 0, 1000);
 	}
 }
 
@@ -902,6 +1023,9 @@ bio_add_passive_callback(bio_source_t *bio, inputevt_handler_t cb, void *arg)
 	bio->io_callback = cb;
 	bio->io_arg = arg;
 	bio->flags |= BIO_F_PASSIVE;		/* Don't call bio_enable() */
+
+	/* Passive sources are triggered at each period, keep them live */
+	bsched_bio_live(bsched_get(bio->bws), bio);
 }
 
 /**
@@ -940,6 +1064,9 @@ bsched_no_more_bandwidth(bsched_t *bs)
 			bio_disable(bio);
 	}
 
+	if (!(bs->flags & BS_F_NOBW))
+		tm_now(&bs->nobw_time);		/* Starts starving our sources */
+
 	bs->flags |= BS_F_NOBW;
 }
 
@@ -949,12 +1076,15 @@ bsched_no_more_bandwidth(bsched_t *bs)
 static void
 bsched_clear_active(bsched_t *bs)
 {
-	plist_t *iter;
+	bio_source_t *bio;
 
 	bsched_check(bs);
-	PLIST_FOREACH(bs->sources, iter) {
-		bio_source_t *bio = iter->data;
 
+	/*
+	 * Active sources were used this period, hence they are all live.
+	 */
+
+	ELIST_FOREACH_DATA(&bs->live, bio) {
 		bio_check(bio);
 		bio->flags &= ~BIO_F_ACTIVE;
 	}
@@ -970,10 +1100,9 @@ bsched_clear_active(bsched_t *bs)
 static void
 bsched_begin_timeslice(bsched_t *bs)
 {
-	plist_t *iter, *last = NULL;
+	link_t *lk, *next;
 	pslist_t *trigger = NULL;
 	double norm_factor;
-	int count;
 	int64 bw_max;
 
 	bsched_check(bs);
@@ -1015,20 +1144,65 @@ bsched_begin_timeslice(bsched_t *bs)
 		}
 	}
 
+	/*
+	 * If we ran out of bandwidth during the period, all the sources were
+	 * disabled and must be re-enabled, including idle ones which are not
+	 * in the live list.
+	 *
+	 * Rotate sources, since we don't know how glib handles callbacks on
+	 * the registered sources.  We don't want to always have the same
+	 * sources get most of the bandwidth because they simply get added
+	 * first as I/O sources.
+	 */
+
+	if (bs->flags & BS_F_NOBW) {
+		plist_t *iter, *last = NULL;
+		int count = 0;
+
+		PLIST_FOREACH(bs->sources, iter) {
+			bio_source_t *bio = iter->data;
+
+			bio_check(bio);
+
+			last = iter;		/* Remember last seen source for rotation */
+			count++;			/* Count them for assertion */
+
+			if (
+				0 == bio->io_tag && bio->io_callback &&
+				0 == (bio->flags & BIO_F_PASSIVE)
+			)
+				bio_enable(bio);
+		}
+
+		g_assert(bs->count == count);	/* All sources are there */
+
+		if (last != NULL && last != bs->sources) {
+			bio_source_t *bio;
+
+			g_assert(bs->sources != NULL);
+			bio = bs->sources->data;
+			bio_check(bio);
+			bs->sources = plist_remove(bs->sources, bio);
+			bs->sources = plist_insert_after(bs->sources, last, bio);
+		}
+	}
+
+	/*
+	 * Pre-allocated banwdwidth is substracted from the available maximum
+	 * to not fully starve other sources and not cause over-spending.
+	 */
+
 	norm_factor = 1000.0 / bs->period;
-	bs->io_favours = 0;
-	bw_max = bs->bw_max;
-	count = 0;
+	bw_max = bs->bw_max - MIN(bs->bw_max, bs->bw_allocated);
 
-	PLIST_FOREACH(bs->sources, iter) {
-		bio_source_t *bio = iter->data;
+	for (lk = elist_first(&bs->live); lk != NULL; lk = next) {
+		bio_source_t *bio = elist_data(&bs->live, lk);
 		uint64 actual;
 
 		bio_check(bio);
+		g_assert(bio->flags & BIO_F_LIVE);
 
-		last = iter;		/* Remember last seen source for rotation */
-		count++;			/* Count them for assertion */
-
+		next = elist_next(lk);
 		bio->flags &= ~(BIO_F_ACTIVE | BIO_F_USED);
 
 		if (bio->io_tag == 0 && bio->io_callback) {
@@ -1038,16 +1212,6 @@ bsched_begin_timeslice(bsched_t *bs)
 				bio_enable(bio);
 		}
 
-		if (bio->flags & BIO_F_FAVOUR)
-			bs->io_favours++;
-
-		/*
-		 * Pre-allocated banwdwidth is substracted from the available maximum
-		 * to not fully starve other sources and not cause over-spending.
-		 */
-
-		bw_max -= MIN(bw_max, bio->bw_allocated);
-
 		/*
 		 * Fast EMA of bandwidth is computed on the last n=3 terms.
 		 * The smoothing factor, sm=2/(n+1), is therefore 0.5, which is easy
@@ -1070,28 +1234,28 @@ bsched_begin_timeslice(bsched_t *bs)
 		bio->bw_fast_ema += (actual >> 1) - (bio->bw_fast_ema >> 1);
 		bio->bw_slow_ema += (actual >> 6) - (bio->bw_slow_ema >> 6);
 		bio->bw_last_bps = (int64) (bio->bw_actual * norm_factor);
-		bio->bw_actual = 0;
-	}
 
-	g_assert(bs->count == count);	/* All sources are there */
-
-	/*
-	 * Rotate sources, since we don't know how glib handles callbacks on
-	 * the registered sources.  We don't want to always have the same
-	 * sources get most of the bandwidth because they simply get added
-	 * first as I/O sources.
-	 */
+		/*
+		 * Once a source is idle and its EMAs can no longer decrease due to
+		 * the integer arithmetic, further periods would not change anything
+		 * and the source leaves the live list, unless it is passive since
+		 * these must be triggered at each period.
+		 */
 
-	if (last != NULL && last != bs->sources) {
-		bio_source_t *bio;
+		if (
+			0 == bio->bw_actual &&
+			0 == (bio->bw_fast_ema >> 1) && 0 == (bio->bw_slow_ema >> 6) &&
+			!((bio->flags & BIO_F_PASSIVE) && bio->io_callback)
+		) {
+			bio->flags &= ~BIO_F_LIVE;
+			elist_link_remove(&bs->live, lk);
+		}
 
-		g_assert(bs->sources != NULL);
-		bio = bs->sources->data;
-		bio_check(bio);
-		bs->sources = plist_remove(bs->sources, bio);
-		bs->sources = plist_insert_after(bs->sources, last, bio);
+		bio->bw_actual = 0;
 	}
 
+	elist_rotate_left(&bs->live);
+
 	bs->flags &= ~(BS_F_NOBW|BS_F_FROZEN_SLOT|BS_F_CHANGED_BW|BS_F_CLEARED);
 
 	/*
@@ -1204,6 +1368,16 @@ bsched_bio_remove(bsched_bws_t bws, bio_source_t *bio)
 	bs->sources = plist_remove(bs->sources, bio);
 	bs->count--;
 
+	if (bio->flags & BIO_F_LIVE) {
+		bio->flags &= ~BIO_F_LIVE;
+		elist_remove(&bs->live, bio);
+	}
+
+	if (bio->flags & BIO_F_FAVOUR)
+		bs->io_favours--;
+
+	bs->bw_allocated -= bio->bw_allocated;
+
 	if (bs->count)
 		bs->bw_slot = (bs->bw_max + bs->bw_stolen) / bs->count;
 
@@ -1402,6 +1576,7 @@ bw_available(bio_source_t *bio, int len)
 	if (!used) {
 		bs->current_used++;
 		bio->flags |= BIO_F_USED;
+		bsched_bio_live(bs, bio);
 	}
 
 	bio->flags |= BIO_F_ACTIVE;
@@ -1696,19 +1871,11 @@ bsched_bw_update(bsched_t *bs, ssize_t used, size_t requested)
 	/*
 	 * Global byte counters are not displayed by the GUI on a permanent
 	 * basis but can be fetched in the properties and are persisted for
-	 * the session.
+	 * the session.  They are updated at each heartbeat.
 	 */
 
-	{
-		property_t p = bs->byte_count;
-		uint64 value;
-
-		gnet_prop_lock(p);
-		gnet_prop_get_guint64_val(p, &value);
-		value += used;
-		gnet_prop_set_guint64_val(p, value);
-		gnet_prop_unlock(p);
-	}
+	if (used != 0)
+		AU64_ADD(&bs->bytes_pending, used);
 
 	if (!(bs->flags & BS_F_ENABLED))		/* Scheduler disabled */
 		return;								/* Nothing to update */
@@ -1729,17 +1896,30 @@ bsched_bw_update(bsched_t *bs, ssize_t used, size_t requested)
 	 * When all bandwidth has been used, disable all sources.
 	 */
 
-	if (bs->bw_actual >= (bs->bw_max + bs->bw_stolen))
+	if (
+		!(bs->flags & BS_F_NOBW) &&
+		bs->bw_actual >= (bs->bw_max + bs->bw_stolen)
+	)
 		bsched_no_more_bandwidth(bs);
 }
 
 static inline ALWAYS_INLINE void
 bio_bw_update(bio_source_t *bio, ssize_t used)
 {
+	if G_UNLIKELY(0 == used)
+		return;
+
 	bio->bw_actual += used;
 
-	if G_UNLIKELY(0 != bio->bw_allocated)
-		bio->bw_allocated -= MIN(bio->bw_allocated, used);
+	if G_UNLIKELY(0 == (bio->flags & BIO_F_LIVE))
+		bsched_bio_live(bsched_get(bio->bws), bio);
+
+	if G_UNLIKELY(0 != bio->bw_allocated) {
+		int64 n = MIN(bio->bw_allocated, used);
+
+		bio->bw_allocated -= n;
+		bsched_get(bio->bws)->bw_allocated -= n;
+	}
 }
 
 /**
@@ -1756,8 +1936,19 @@ bio_set_favour(bio_source_t *bio, bool on)
 
 	old = booleanize(bio->flags & BIO_F_FAVOUR);
 
+	if (BSCHED_BWS_INVALID != bio->bws && old != on) {
+		bsched_t *bs = bsched_get(bio->bws);
+
+		if (on)
+			bs->io_favours++;
+		else
+			bs->io_favours--;
+	}
+
 	if (on) {
 		bio->flags |= BIO_F_FAVOUR;
+		if (BSCHED_BWS_INVALID != bio->bws)
+			bsched_get(bio->bws)->bw_allocated -= bio->bw_allocated;
 		bio->bw_allocated = 0;
 	} else {
 		bio->flags &= ~BIO_F_FAVOUR;
@@ -1774,10 +1965,16 @@ bio_set_favour(bio_source_t *bio, bool on)
 unsigned
 bio_add_allocated(bio_source_t *bio, unsigned bw)
 {
+	int64 old;
+
 	bio_check(bio);
 
+	old = bio->bw_allocated;
 	bio->bw_allocated = uint_saturate_add(bio->bw_allocated, bw);
 
+	if (BSCHED_BWS_INVALID != bio->bws)
+		bsched_get(bio->bws)->bw_allocated += bio->bw_allocated - old;
+
 	return bio->bw_allocated;
 }
 
@@ -2806,7 +3003,7 @@ bws_can_connect(enum socket_type type)
 static void
 bsched_heartbeat(bsched_t *bs, tm_t *tv)
 {
-	plist_t *iter;
+	bio_source_t *bio;
 	int delay;
 	int64 overused;
 	int64 theoric;
@@ -2855,6 +3052,8 @@ bsched_heartbeat(bsched_t *bs, tm_t *tv)
 
 	bs->last_period = *tv;		/* struct copy */
 
+	bsched_flush_byte_count(bs);
+
 	g_assert(delay > 0);
 
 	/*
@@ -2872,6 +3071,28 @@ bsched_heartbeat(bsched_t *bs, tm_t *tv)
 	g_assert(bs->bw_ema >= 0);
 	g_assert(bs->bw_stolen_ema >= 0);
 
+	/*
+	 * Traffic class statistics: the fraction of the allowed bandwidth that
+	 * was used, and how long sources were denied bandwidth until the end of
+	 * the period, which is the latency added by traffic shaping.
+	 */
+
+	if (bs->flags & BS_F_ENABLED) {
+		int64 allowed = bs->bw_max + bs->bw_stolen;
+		int64 util = 0, starved = 0;
+
+		if (allowed > 0)
+			util = MIN(bs->bw_actual * 1000 / allowed, 1000);
+
+		if (bs->flags & BS_F_NOBW) {
+			starved = tm_elapsed_ms(tv, &bs->nobw_time);
+			starved = MIN(MAX(starved, 0), delay);
+		}
+
+		bs->util_ema += (util >> 2) - (bs->util_ema >> 2);
+		bs->starved_ema += (starved >> 2) - (bs->starved_ema >> 2);
+	}
+
 	/*
 	 * If scheduler is disabled, we don't need to recompute bandwidth.
 	 *
@@ -2952,9 +3173,7 @@ bsched_heartbeat(bsched_t *bs, tm_t *tv)
 
 	last_used = 0;
 
-	PLIST_FOREACH(bs->sources, iter) {
-		bio_source_t *bio = iter->data;
-
+	ELIST_FOREACH_DATA(&bs->live, bio) {
 		bio_check(bio);
 
 		if (bio->flags & BIO_F_USED)
@@ -3009,7 +3228,8 @@ bsched_stealbeat(bsched_t *bs)
 	pslist_t *all_used = NULL;		/* List of bsched_t that used all b/w */
 	int all_used_count = 0;			/* Amount of bsched_t that used all b/w */
 	int all_favour_count = 0;		/* I/O sources wanting favours */
-	uint64 all_bw_count = 0;		/* Sum of configured bandwidth */
+	uint64 all_bw_count = 0;		/* Sum of weighted bandwidth */
+	uint64 all_weight = 0;			/* Sum of stealer weights */
 	int steal_count = 0;
 	int64 underused;
 
@@ -3087,11 +3307,12 @@ bsched_stealbeat(bsched_t *bs)
 
 		steal_count++;
 		all_favour_count += xbs->io_favours;
+		all_weight += bsched_weight(xbs);
 
 		if (xbs->bw_last_period >= xbs->bw_max) {
 			all_used = pslist_prepend(all_used, xbs);
 			all_used_count++;
-			all_bw_count += xbs->bw_max;
+			all_bw_count += xbs->bw_max * bsched_weight(xbs);
 		}
 
 		/*
@@ -3127,8 +3348,9 @@ bsched_stealbeat(bsched_t *bs)
 	 * distribute our surplus proportionally to the amount of sources.
 	 *
 	 * Distribute our available bandwidth proportionally to all the
-	 * schedulers that saturated their bandwidth, or evenly to all the
-	 * stealers if noone saturated.
+	 * schedulers that saturated their bandwidth, or to all the stealers
+	 * if noone saturated.  In both cases, the share of each stealer is
+	 * also proportional to the weight of its traffic class.
 	 */
 
 	if (all_favour_count != 0) {
@@ -3156,12 +3378,15 @@ bsched_stealbeat(bsched_t *bs)
 	} else if (all_used_count == 0) {
 		PSLIST_FOREACH(bs->stealers, l) {
 			bsched_t *xbs = l->data;
-			xbs->bw_stolen += underused / steal_count;
+			int64 amount = underused * bsched_weight(xbs) / all_weight;
+
+			xbs->bw_stolen += amount;
 
 			if (GNET_PROPERTY(bsched_debug) > 4)
-				g_debug("BSCHED %s: \"%s\" evenly giving %s bytes to \"%s\"",
-					G_STRFUNC, bs->name,
-					int64_to_string(underused / steal_count), xbs->name);
+				g_debug("BSCHED %s: \"%s\" giving %s bytes to \"%s\" "
+					"(weight %u/%s)",
+					G_STRFUNC, bs->name, int64_to_string(amount), xbs->name,
+					bsched_weight(xbs), uint64_to_string(all_weight));
 		}
 	} else {
 		PSLIST_FOREACH(all_used, l) {
@@ -3171,7 +3396,8 @@ bsched_stealbeat(bsched_t *bs)
 			if (xbs->bw_max == 0)
 				continue;
 
-			amount = (double) underused * (double) xbs->bw_max / all_bw_count;
+			amount = (double) underused *
+				(double) (xbs->bw_max * bsched_weight(xbs)) / all_bw_count;
 
 			if ((double) xbs->bw_stolen + amount > (double) BS_BW_MAX)
 				xbs->bw_stolen = BS_BW_MAX;
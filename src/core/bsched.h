@@ -48,6 +48,24 @@ typedef struct sendfile_ctx {
 	fileoffset_t map_start, map_end;
 } sendfile_ctx_t;
 
+/**
+ * Bandwidth scheduler statistics, filled by bsched_get_stats().
+ */
+typedef struct bsched_stats {
+	const char *name;			/**< Scheduler name */
+	uint64 bw_per_second;		/**< Configured bandwidth, 0 if unlimited */
+	uint64 bps;					/**< Bandwidth used last period, per second */
+	uint64 avg_bps;				/**< EMA of bandwidth used, per second */
+	uint64 stolen_bps;			/**< EMA of stolen bandwidth, per second */
+	uint utilisation;			/**< EMA of per-mille of allowed b/w used */
+	uint starved_ms;			/**< EMA of time starved per period, in ms */
+	uint period;				/**< Scheduling period, in ms */
+	uint weight;				/**< Weight of the traffic class */
+	uint sources;				/**< Amount of I/O sources */
+	uint live;					/**< Sources processed each period */
+	bool enabled;				/**< Whether bandwidth is limited */
+} bsched_stats_t;
+
 /*
  * Public interface.
  */
@@ -113,6 +131,7 @@ ulong bsched_avg_pct(bsched_bws_t bws);
 uint64 bsched_bw_per_second(bsched_bws_t bws);
 int64 bsched_urgent(bsched_bws_t bws);
 void bsched_set_urgent(bsched_bws_t bws, int64 amount);
+void bsched_get_stats(bsched_bws_t bws, bsched_stats_t *stats);
 
 void bsched_config_steal_http_gnet(void);
 void bsched_config_steal_gnet(void);
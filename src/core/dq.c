@@ -102,6 +102,12 @@
 #define DQ_MQ_EPSILON		2048   /**< Queues identical at +/- 2K */
 #define DQ_FUZZY_FACTOR		0.80   /**< Corrector for theoretical horizon */
 
+#define DQ_MAX_BURST		3	   /**< Max UPs queried at once if rare */
+#define DQ_LEARN_MIN		10	   /**< Min routed results to learn reach */
+#define DQ_LEARN_WEIGHT		0.2	   /**< Weight of new sample in averages */
+#define DQ_REACH_MIN		0.05   /**< Lowest reach factor we learn */
+#define DQ_REACH_MAX		20.0   /**< Highest reach factor we learn */
+
 #define DQ_TTL_PROBE		(1 << 8)	/**< Flags probed requests */
 #define DQ_TTL_MASK			(DQ_TTL_PROBE - 1)
 
@@ -131,6 +137,7 @@ struct next_up {
 	query_hashvec_t *qhv;	/**< Query hash vector for the query */
 	int can_route;			/**< -1 = unknown, otherwise TRUE / FALSE */
 	int queue_pending;		/**< -1 = unknown, otherwise cached queue size */
+	double score;			/**< Learned value of node, see dq_peer_score() */
 };
 
 typedef enum {
@@ -149,6 +156,7 @@ typedef struct dquery {
 	pmsg_t *mb;				/**< The search messsage "template" */
 	query_hashvec_t *qhv;	/**< Query hash vector for QRP filtering */
 	htable_t *queried;		/**< Contains node IDs that we queried so far */
+	htable_t *sent;			/**< Node IDs we sent to => struct dq_sent */
 	hset_t *enqueued;		/**< Contains node IDs with enqueued queries */
 	const struct guid *lmuid;/**< For proxied query: the original leaf MUID */
 	uint16 query_flags;		/**< Flags from the marked query speed field */
@@ -166,11 +174,16 @@ typedef struct dquery {
 	uint32 kept_results;	/**< Results they say they kept after filtering */
 	uint32 result_timeout;	/**< The current timeout for getting results */
 	uint32 stat_timeouts;	/**< The amount of status request timeouts we had */
+	uint32 sent_horizon;	/**< Theoretical horizon of messages sent */
+	uint32 routed_results;	/**< Results routed back by the nodes we queried */
+	uint32 first_result_ms;	/**< Delay before first result, 0 if none yet */
+	uint32 bursts;			/**< Times we queried several UPs at once */
 	cevent_t *expire_ev;	/**< Callout queue global expiration event */
 	cevent_t *results_ev;	/**< Callout queue results expiration event */
 	void *alive;			/**< Alive ping stats for computing timeouts */
 	time_t start;			/**< Time at which it started */
 	time_t stop;			/**< Time at which it was terminated */
+	tm_t launched;			/**< Precise starting time */
 	struct next_up *nv;		/**< Previous "next UP vector" */
 	int nv_count;			/**< Number of items allocated for `nv' */
 	int nv_found;			/**< Valid entries in `nv' */
@@ -178,6 +191,7 @@ typedef struct dquery {
 } dquery_t;
 
 enum {
+	DQ_F_RARE			= 1 << 9,	/**< Query seems to be for rare content */
 	DQ_F_LOCAL			= 1 << 8,	/**< Local query made by this node */
 	DQ_F_EXITING		= 1 << 7,	/**< Final cleanup at exit time */
 	DQ_F_ROUTING_HITS	= 1 << 6,	/**< We'll be routing all hits */
@@ -241,6 +255,43 @@ struct dq_pmsg_info {
 	uint8 probe;		/**< Whether query is just a probe */
 };
 
+/**
+ * Messages sent to a given node, recorded in the `sent' table of the dynamic
+ * query once the message queue tells us it was actually sent.
+ */
+struct dq_sent {
+	tm_t sent;			/**< When first message was sent to the node */
+	uint32 horizon;		/**< Largest theoretical horizon of messages */
+	uint32 results;		/**< Results routed back by the node */
+};
+
+/**
+ * Learned statistics about an ultrapeer neighbour.
+ *
+ * The theoretical horizon given by dq_get_horizon() only depends on the
+ * degree advertised by the node and on the TTL.  In practice, neighbours
+ * reach quite different amounts of hosts, due to flow-control, overlapping
+ * horizons or QRP filtering.  So, for each dynamic query, we compare the
+ * share of the routed results a node brought back with its share of the
+ * theoretical horizon: the running average of that ratio is its "reach",
+ * by which we correct the horizon we expect from the node.
+ */
+struct dq_peer {
+	struct nid *node_id;	/**< The node ID (key in `dq_peers') */
+	double reach;			/**< Actual vs. theoretical horizon ratio */
+	double yield;			/**< Average results routed back per query */
+	double latency;			/**< Average ms before first routed result */
+	uint32 queries;			/**< Dynamic queries sent to node */
+	uint32 answered;		/**< Queries to which node routed back results */
+	uint32 samples;			/**< Samples averaged into `reach' */
+};
+
+/**
+ * This table keeps the learned statistics about the ultrapeers to which
+ * we sent dynamic queries, indexed by node ID.
+ */
+static hikset_t *dq_peers;
+
 /*
  * This table stores the pre-compution:
  *
@@ -313,6 +364,215 @@ dq_get_horizon(int degree, int ttl)
 	return hosts[i][j] * pow(DQ_FUZZY_FACTOR, j);
 }
 
+/**
+ * Fold new sample into running average.
+ *
+ * The first samples are averaged evenly, then each new sample accounts for
+ * DQ_LEARN_WEIGHT of the result so that we can follow changes.
+ *
+ * @param avg		the current average
+ * @param sample	the new sample
+ * @param n			amount of samples, including the new one
+ *
+ * @return the new average.
+ */
+static double
+dq_average(double avg, double sample, uint32 n)
+{
+	double w;
+
+	g_assert(n != 0);
+
+	w = MAX(DQ_LEARN_WEIGHT, 1.0 / n);
+	return avg + w * (sample - avg);
+}
+
+/**
+ * Get learned statistics for node, creating an empty entry if missing.
+ *
+ * This must only be called for live nodes, since entries are otherwise
+ * only reclaimed by dq_node_removed().
+ */
+static struct dq_peer *
+dq_peer_get(const struct nid *node_id)
+{
+	struct dq_peer *dp;
+
+	dp = hikset_lookup(dq_peers, node_id);
+	if (dp != NULL)
+		return dp;
+
+	WALLOC0(dp);
+	dp->node_id = nid_ref(node_id);
+	dp->reach = 1.0;
+	hikset_insert_key(dq_peers, &dp->node_id);
+
+	return dp;
+}
+
+/**
+ * Forget learned statistics about node.
+ */
+static void
+dq_peer_remove(const struct nid *node_id)
+{
+	struct dq_peer *dp;
+
+	dp = hikset_lookup(dq_peers, node_id);
+	if (NULL == dp)
+		return;
+
+	if (GNET_PROPERTY(dq_debug) > 2) {
+		g_debug("DQ node #%s gone: queries=%u, answered=%u, reach=%.2f "
+			"(%u sample%s), yield=%.1f, latency=%.0f ms",
+			nid_to_string(dp->node_id), dp->queries, dp->answered,
+			dp->reach, PLURAL(dp->samples), dp->yield, dp->latency);
+	}
+
+	hikset_remove(dq_peers, node_id);
+	nid_unref(dp->node_id);
+	WFREE(dp);
+}
+
+/**
+ * @return the learned reach factor of node, 1.0 if unknown.
+ */
+static double
+dq_peer_reach(const struct nid *node_id)
+{
+	const struct dq_peer *dp = hikset_lookup(dq_peers, node_id);
+
+	return NULL == dp ? 1.0 : dp->reach;
+}
+
+/**
+ * Compute the value of querying a node, based on what we learned about it:
+ * the more hosts it reaches and the faster its results come back (before
+ * we move on to other nodes), the better.
+ *
+ * Nodes we know nothing about yet are given the benefit of the doubt, so
+ * that we learn about them.
+ */
+static double
+dq_peer_score(const struct nid *node_id)
+{
+	const struct dq_peer *dp = hikset_lookup(dq_peers, node_id);
+
+	if (NULL == dp)
+		return 1.0;
+
+	return dp->reach / (1.0 + dp->latency / DQ_QUERY_TIMEOUT);
+}
+
+/**
+ * Record that a message was sent to a node.
+ *
+ * @param dq		the dynamic query
+ * @param node_id	the node to which message was sent
+ * @param horizon	theoretical horizon of the message
+ */
+static void
+dq_sent_record(dquery_t *dq, const struct nid *node_id, uint32 horizon)
+{
+	struct dq_sent *ds;
+
+	ds = htable_lookup(dq->sent, node_id);
+
+	if (NULL == ds) {
+		WALLOC0(ds);
+		tm_now_exact(&ds->sent);
+		htable_insert(dq->sent, nid_ref(node_id), ds);
+	}
+
+	/*
+	 * When we requery a node after a probe, the new horizon encompasses
+	 * the one of the probe.
+	 */
+
+	if (horizon > ds->horizon) {
+		dq->sent_horizon += horizon - ds->horizon;
+		ds->horizon = horizon;
+	}
+}
+
+/**
+ * Account for results routed back by a node to which we sent the query.
+ */
+static void
+dq_sent_results(dquery_t *dq, const struct nid *node_id, uint count)
+{
+	struct dq_sent *ds;
+
+	ds = htable_lookup(dq->sent, node_id);
+	if (NULL == ds)
+		return;		/* Not a node we queried, or message not sent yet */
+
+	if (0 == ds->results) {
+		struct dq_peer *dp = hikset_lookup(dq_peers, node_id);
+
+		if (dp != NULL) {
+			tm_t now;
+
+			tm_now_exact(&now);
+			dp->answered++;
+			dp->latency = dq_average(dp->latency,
+				tm_elapsed_ms(&now, &ds->sent), dp->answered);
+		}
+	}
+
+	ds->results += count;
+	dq->routed_results += count;
+}
+
+/**
+ * htable_foreach() callback to update the learned node statistics with
+ * the outcome of the dynamic query.
+ */
+static void
+dq_learn_peer(const void *key, void *value, void *data)
+{
+	const struct dq_sent *ds = value;
+	const dquery_t *dq = data;
+	struct dq_peer *dp;
+	double share, expected;
+
+	dp = hikset_lookup(dq_peers, key);
+	if (NULL == dp)
+		return;		/* Node is gone */
+
+	dp->queries++;
+	dp->yield = dq_average(dp->yield, ds->results, dp->queries);
+
+	/*
+	 * Learning the reach requires enough routed results and several
+	 * nodes to compare with.
+	 */
+
+	if (dq->routed_results < DQ_LEARN_MIN || dq->up_sent < 2)
+		return;
+
+	share = ds->results / (double) dq->routed_results;
+	expected = ds->horizon / (double) dq->sent_horizon;
+
+	dp->samples++;
+	dp->reach = dq_average(dp->reach,
+		MIN(MAX(share / expected, DQ_REACH_MIN), DQ_REACH_MAX), dp->samples);
+}
+
+/**
+ * htable_foreach() callback to free the `sent' table entries.
+ */
+static void
+free_sent(const void *key, void *value, void *unused_udata)
+{
+	struct dq_sent *ds = value;
+
+	(void) unused_udata;
+
+	nid_unref(key);
+	WFREE(ds);
+}
+
 /**
  * Compute amount of results "kept" for the query, if we have this
  * information available.
@@ -359,6 +619,7 @@ dq_select_ttl(dquery_t *dq, gnutella_node_t *node, int connections)
 	double results_per_up;
 	double hosts_to_reach;
 	double hosts_to_reach_via_node;
+	double reach;
 	int ttl;
 
 	dquery_check(dq);
@@ -369,17 +630,24 @@ dq_select_ttl(dquery_t *dq, gnutella_node_t *node, int connections)
 
 	g_assert(needed > 0);		/* Or query would have been stopped */
 
-	results_per_up = dq->results / MAX(dq->horizon, 1);
+	results_per_up = dq->results / (double) MAX(dq->horizon, 1);
 	hosts_to_reach = (double) needed / MAX(results_per_up, (double) 0.000001);
 	hosts_to_reach_via_node = hosts_to_reach / (double) connections;
 
 	/*
 	 * Now iteratively find the TTL needed to reach the desired number
 	 * of hosts, rounded to the lowest TTL to be conservative.
+	 *
+	 * The theoretical horizon of the node is corrected by what we learned
+	 * about its actual reach.
 	 */
 
+	reach = dq_peer_reach(NODE_ID(node));
+
 	for (ttl = MIN(node->max_ttl, dq->ttl); ttl > 0; ttl--) {
-		if (dq_get_horizon(node->degree, ttl) <= hosts_to_reach_via_node)
+		double horizon = dq_get_horizon(node->degree, ttl) * reach;
+
+		if (horizon <= hosts_to_reach_via_node)
 			break;
 	}
 
@@ -542,12 +810,16 @@ dq_pmsg_free(pmsg_t *mb, void *arg)
 			cq_resched(dq->results_ev, 1);
 
 	} else {
+		uint32 horizon = dq_get_horizon(pmi->degree, pmi->ttl);
+
 		/*
-		 * The message was sent.  Adjust the total horizon reached thus far.
+		 * The message was sent.  Adjust the total horizon reached thus far,
+		 * as corrected by the learned reach of the node.
 		 */
 
-		dq->horizon += dq_get_horizon(pmi->degree, pmi->ttl);
+		dq->horizon += horizon * dq_peer_reach(pmi->node_id);
 		dq->up_sent++;
+		dq_sent_record(dq, pmi->node_id, horizon);
 
 		if (dq->flags & DQ_F_LOCAL)
 			search_query_sent(dq->sh);
@@ -829,6 +1101,9 @@ dq_fill_next_up(dquery_t *dq, struct next_up *nv, int ncount)
 			nup->can_route = old_nup->can_route;
 		} else
 			nup->can_route = -1;	/* We don't know yet */
+
+		nup->queue_pending = -1;	/* Computed lazily when sorting */
+		nup->score = dq_peer_score(nup->node_id);
 	}
 
 	/*
@@ -912,9 +1187,30 @@ dq_free(dquery_t *dq)
 			nid_to_string2(dq->node_id), dq->ttl, dq->up_sent, dq->horizon,
 			dq->results, dq->linger_results);
 
+	if (GNET_PROPERTY(dq_debug) && !(dq->flags & DQ_F_EXITING)) {
+		g_debug("DQ[%s] %soutcome: %s%ssecs=%d, first=%u ms, UPs=%u, "
+			"bursts=%u, horizon=%u, results=%u (routed=%u, kept=%u, "
+			"linger=%u), wanted=%u",
+			nid_to_string(&dq->qid),
+			node_id_self(dq->node_id) ? "local " : "",
+			(dq->flags & DQ_F_RARE) ? "rare, " : "",
+			(dq->flags & DQ_F_USR_CANCELLED) ? "cancelled, " : "",
+			(int) delta_time(dq->stop != 0 ? dq->stop : tm_time(), dq->start),
+			dq->first_result_ms, dq->up_sent, dq->bursts, dq->horizon,
+			dq->results, dq->routed_results, dq->kept_results,
+			dq->linger_results, dq->max_results);
+	}
+
 	cq_cancel(&dq->results_ev);
 	cq_cancel(&dq->expire_ev);
 
+	/*
+	 * Update what we learned about the nodes we queried.
+	 */
+
+	if (!(dq->flags & DQ_F_EXITING))
+		htable_foreach(dq->sent, dq_learn_peer, dq);
+
 	/*
 	 * Update statistics.
 	 *
@@ -946,6 +1242,8 @@ dq_free(dquery_t *dq)
 
 	htable_foreach(dq->queried, free_node_id, NULL);
 	htable_free_null(&dq->queried);
+	htable_foreach(dq->sent, free_sent, NULL);
+	htable_free_null(&dq->sent);
 	hset_free_null(&dq->enqueued);
 
 	qhvec_free(dq->qhv);
@@ -1284,7 +1582,8 @@ node_mq_cmp(const void *np1, const void *np2)
 
 /**
  * qsort() callback for sorting nodes by increasing queue size, with a
- * preference towards nodes that have a QRP match.
+ * preference towards nodes that have a QRP match, then towards nodes
+ * which proved more valuable in previous queries.
  */
 static int
 node_mq_qrp_cmp(const void *np1, const void *np2)
@@ -1324,7 +1623,9 @@ node_mq_qrp_cmp(const void *np1, const void *np2)
 			nu2->can_route = qrp_node_can_route(n2, nu2->qhv);
 
 		if (!nu1->can_route == !nu2->can_route) {
-			/* Both can equally route or not route */
+			/* Both can equally route or not route, prefer best learned */
+			if (nu1->score != nu2->score)
+				return nu1->score > nu2->score ? -1 : +1;
 			return CMP(qs1, qs2);
 		}
 
@@ -1351,6 +1652,13 @@ dq_send_query(dquery_t *dq, gnutella_node_t *n, int ttl, bool probe)
 
 	pmi = dq_pmi_alloc(dq, n->degree, MIN(n->max_ttl, ttl), NODE_ID(n), probe);
 
+	/*
+	 * Make sure we'll learn about the node whilst it is still alive: by
+	 * the time the message is reported as sent, the node may be gone.
+	 */
+
+	(void) dq_peer_get(NODE_ID(n));
+
 	/*
 	 * Now for the magic...
 	 *
@@ -1386,8 +1694,37 @@ dq_send_query(dquery_t *dq, gnutella_node_t *n, int ttl, bool probe)
 }
 
 /**
- * Iterate over the UPs which have not seen our query yet, select one and
- * send it the query.
+ * Compute how many UPs we can query at once.
+ *
+ * Querying UPs one at a time and waiting for their results is what keeps
+ * dynamic querying frugal, but when the query looks rare it mostly makes
+ * it slow, so we then query several UPs in parallel.
+ */
+static int
+dq_burst(const dquery_t *dq)
+{
+	uint32 max_up, used, burst;
+
+	dquery_check(dq);
+
+	if (!(dq->flags & DQ_F_RARE))
+		return 1;
+
+	max_up = GNET_PROPERTY(max_connections) -
+		GNET_PROPERTY(normal_connections);
+	used = dq->up_sent + dq->pending;
+
+	burst = DQ_MAX_BURST;
+	burst = MIN(burst, DQ_MAX_PENDING - dq->pending);
+	if (used < max_up)
+		burst = MIN(burst, max_up - used);
+
+	return MAX(burst, 1);
+}
+
+/**
+ * Iterate over the UPs which have not seen our query yet, select one (or
+ * several ones if the query is for rare content) and send it the query.
  *
  * If no more UP remain, terminate this query.
  */
@@ -1398,8 +1735,9 @@ dq_send_next(dquery_t *dq)
 	int ncount = GNET_PROPERTY(max_connections);
 	int found;
 	int timeout;
+	int burst;
 	int i;
-	bool sent = FALSE;
+	int sent = 0;
 	uint32 results;
 
 	dquery_check(dq);
@@ -1510,12 +1848,15 @@ dq_send_next(dquery_t *dq)
 
 	/*
 	 * Select the first node, and compute the proper TTL for the query.
+	 * If query is rare, select the first nodes of the burst instead.
 	 *
 	 * If the selected TTL is 1 and the node is QRP-capable and says
 	 * it won't match, pick the next...
 	 */
 
-	for (i = 0; i < found; i++) {
+	burst = dq_burst(dq);
+
+	for (i = 0; i < found && sent < burst; i++) {
 		gnutella_node_t *node;
 		struct nid *nid = nv[i].node_id;
 		const void *knid;
@@ -1565,16 +1906,19 @@ dq_send_next(dquery_t *dq)
 		}
 
 		dq_send_query(dq, node, ttl, FALSE);
-		sent = TRUE;
-		break;
+		sent++;
 	}
 
-	if (!sent)
+	if (0 == sent)
 		goto terminate;
 
+	if (sent > 1)
+		dq->bursts++;
+
 	/*
 	 * Adjust waiting period if we don't get enough results, indicating
-	 * that the query might be for rare content.
+	 * that the query might be for rare content, in which case we'll also
+	 * query UPs by bursts from now on.
 	 */
 
 	if (
@@ -1583,25 +1927,29 @@ dq_send_next(dquery_t *dq)
 	) {
 		dq->result_timeout -= DQ_TIMEOUT_ADJUST;
 		dq->result_timeout = MAX(DQ_MIN_TIMEOUT, dq->result_timeout);
+		dq->flags |= DQ_F_RARE;
 	}
 
 	/*
 	 * Install a watchdog for the query, to go on if we don't get
 	 * all the results we want by then.
+	 *
+	 * Messages from the burst we just sent do not extend the waiting
+	 * period, only the older ones still pending.
 	 */
 
 	timeout = dq->result_timeout;
-	if (dq->pending > 1) {
+	if (dq->pending > UNSIGNED(sent)) {
 		uint t = timeout;
 
-		t += (dq->pending - 1) * DQ_PENDING_TIMEOUT;
+		t += (dq->pending - sent) * DQ_PENDING_TIMEOUT;
 		timeout = t > UNSIGNED(timeout) ? t : INT_MAX;
 	}
 
 	if (GNET_PROPERTY(dq_debug) > 1)
-		g_debug("DQ[%s] (%d secs) timeout set to %d ms (pending=%d)",
+		g_debug("DQ[%s] (%d secs) timeout set to %d ms (pending=%d, sent=%d)",
 			nid_to_string(&dq->qid), (int) (tm_time() - dq->start),
-			timeout, dq->pending);
+			timeout, dq->pending, sent);
 
 	dq->results_ev = cq_main_insert(timeout, dq_results_expired, dq);
 	return;
@@ -1638,10 +1986,11 @@ dq_send_probe(dquery_t *dq)
 	/*
 	 * If we don't find any suitable UP holding that content, then
 	 * the query might be for something that is rare enough.  Start
-	 * the sequential probing.
+	 * the probing, by bursts.
 	 */
 
 	if (found == 0) {
+		dq->flags |= DQ_F_RARE;
 		dq_send_next(dq);
 		goto cleanup;
 	}
@@ -1710,9 +2059,11 @@ dq_common_init(dquery_t *dq)
 	dquery_check(dq);
 	dq->qid = dquery_id_create();
 	dq->queried = htable_create_any(nid_hash, nid_hash2, nid_equal);
+	dq->sent = htable_create_any(nid_hash, nid_hash2, nid_equal);
 	dq->enqueued = hset_create_any(nid_hash, nid_hash2, nid_equal);
 	dq->result_timeout = DQ_QUERY_TIMEOUT;
 	dq->start = tm_time();
+	tm_now_exact(&dq->launched);
 
 	/*
 	 * Make sure the dynamic query structure is cleaned up in at most
@@ -2207,7 +2558,8 @@ ignore:
 
 /**
  * Tells us a node ID has been removed.
- * Get rid of all the queries registered for that node.
+ * Get rid of all the queries registered for that node and of the
+ * statistics we learned about it.
  */
 void
 dq_node_removed(const struct nid *node_id)
@@ -2215,6 +2567,8 @@ dq_node_removed(const struct nid *node_id)
 	void *value;
 	pslist_t *sl;
 
+	dq_peer_remove(node_id);
+
 	if (!htable_lookup_extended(by_node_id, node_id, NULL, &value))
 		return;		/* No dynamic query for this node */
 
@@ -2250,12 +2604,15 @@ dq_node_removed(const struct nid *node_id)
  * awaiting, but which have not been claimed yet.  If FALSE, the results
  * have been validated and will be sent to the queryier.
  * @param status	result set `status' flags gathered during parsing
+ * @param from is the ID of the neighbour which routed back the results,
+ * NULL if unknown (OOB results).
  *
  * @return FALSE if the query was explicitly cancelled by the user or if we
  * should not forward the results anyway.
  */
 static bool
-dq_count_results(const struct guid *muid, int count, uint16 status, bool oob)
+dq_count_results(const struct guid *muid, int count, uint16 status, bool oob,
+	const struct nid *from)
 {
 	dquery_t *dq;
 
@@ -2311,6 +2668,16 @@ dq_count_results(const struct guid *muid, int count, uint16 status, bool oob)
 		return FALSE;		/* Don't forward those results */
 	}
 
+	if (0 == dq->first_result_ms && !(dq->flags & DQ_F_LINGER)) {
+		tm_t now;
+
+		tm_now_exact(&now);
+		dq->first_result_ms = MAX(1, tm_elapsed_ms(&now, &dq->launched));
+	}
+
+	if (from != NULL)
+		dq_sent_results(dq, from, count);
+
 	if (dq->flags & DQ_F_LINGER)
 		dq->linger_results += count;
 	else if (oob)
@@ -2354,15 +2721,18 @@ dq_count_results(const struct guid *muid, int count, uint16 status, bool oob)
  * @param muid		the query's MUID
  * @param count		how many results we parsed
  * @param status	result set `status' flags gathered during parsing
+ * @param n			the node from which we got the query hit
  *
  * @return FALSE if the query was explicitly cancelled by the user and
  * results should be dropped, TRUE otherwise.  In other words, returns
  * whether we should forward the results.
  */
 bool
-dq_got_results(const struct guid *muid, uint count, uint32 status)
+dq_got_results(const struct guid *muid, uint count, uint32 status,
+	const gnutella_node_t *n)
 {
-	return dq_count_results(muid, count, status, FALSE);
+	return dq_count_results(muid, count, status, FALSE,
+		NODE_IS_UDP(n) ? NULL : NODE_ID(n));
 }
 
 /**
@@ -2375,7 +2745,7 @@ dq_got_results(const struct guid *muid, uint count, uint32 status)
 bool
 dq_oob_results_ind(const struct guid *muid, int count)
 {
-	return dq_count_results(muid, count, 0, TRUE);
+	return dq_count_results(muid, count, 0, TRUE, NULL);
 }
 
 /**
@@ -2624,6 +2994,8 @@ dq_init(void)
 	by_muid = htable_create(HASH_KEY_FIXED, GUID_RAW_SIZE);
 	by_leaf_muid = hikset_create(
 		offsetof(struct dquery, lmuid), HASH_KEY_FIXED, GUID_RAW_SIZE);
+	dq_peers = hikset_create_any(
+		offsetof(struct dq_peer, node_id), nid_hash, nid_equal);
 	fill_hosts();
 }
 
@@ -2700,6 +3072,20 @@ free_leaf_muid(void *value, void *unused_udata)
 		guid_hex_str(dq->lmuid));
 }
 
+/**
+ * Hashtable iteration callback to free the learned node statistics.
+ */
+static void
+free_peer(void *value, void *unused_udata)
+{
+	struct dq_peer *dp = value;
+
+	(void) unused_udata;
+
+	nid_unref(dp->node_id);
+	WFREE(dp);
+}
+
 /**
  * Cleanup data structures used by dynamic querying.
  */
@@ -2717,6 +3103,9 @@ dq_close(void)
 
 	hikset_foreach(by_leaf_muid, free_leaf_muid, NULL);
 	hikset_free_null(&by_leaf_muid);
+
+	hikset_foreach(dq_peers, free_peer, NULL);
+	hikset_free_null(&dq_peers);
 }
 
 /* vi: set ts=4 sw=4 cindent: */
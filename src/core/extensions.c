@@ -324,18 +324,105 @@ rw_is_sorted(const char *name,
 	}
 }
 
+/*
+ * GGEP ID perfect hashing.
+ *
+ * Rather than performing a binary search in ggeptable[] for each GGEP
+ * extension we parse, we hash the ID as we read its bytes and index a
+ * table where each known ID has a slot of its own: recognizing an ID
+ * then costs a single string comparison.  The hash multiplier is chosen
+ * at initialization time so that no two known IDs collide.
+ */
+
+#define GGEP_PHASH_BITS		12
+#define GGEP_PHASH_SIZE		(1U << GGEP_PHASH_BITS)
+#define GGEP_PHASH_MULT		0x9e3779b1U	/**< First multiplier we try */
+#define GGEP_PHASH_TRIES	1000		/**< Multipliers we try at most */
+
+static uint32 ggep_phash_mult;
+static uint8 ggep_phash[GGEP_PHASH_SIZE];	/**< Index in ggeptable[] + 1 */
+
+/**
+ * Fold next ID character into the running hash value.
+ */
+static inline uint32
+ggep_phash_step(uint32 h, uchar c)
+{
+	return (h + c) * ggep_phash_mult;
+}
+
+/**
+ * @return the slot in ggep_phash[] for the final hash value.
+ */
+static inline uint
+ggep_phash_slot(uint32 h)
+{
+	return h >> (32 - GGEP_PHASH_BITS);
+}
+
 /**
  * @return the GGEP token value upon success, EXT_T_UNKNOWN_GGEP if not found.
  * If keyword was found, its static shared string is returned in `retkw'.
+ *
+ * @param word		the NUL-terminated GGEP ID
+ * @param h			the hash of the ID, computed with ggep_phash_step()
+ * @param retkw		where the static ID string is written, NULL if unknown
  */
-static ext_token_t
-rw_ggep_screen(char *word, const char **retkw)
+static inline ext_token_t
+rw_ggep_screen(const char *word, uint32 h, const char **retkw)
 {
-	ext_token_t t;
+	uint idx = ggep_phash[ggep_phash_slot(h)];
 
-	t = rw_screen(TRUE, ggeptable, N_ITEMS(ggeptable), word, retkw);
+	if (idx != 0) {
+		const struct rwtable *rw = &ggeptable[idx - 1];
+
+		if (0 == strcmp(rw->rw_name, word)) {
+			*retkw = rw->rw_name;
+			return rw->rw_token;
+		}
+	}
 
-	return (t == EXT_T_UNKNOWN) ? EXT_T_UNKNOWN_GGEP : t;
+	*retkw = NULL;
+	return EXT_T_UNKNOWN_GGEP;
+}
+
+/**
+ * Compute the GGEP ID perfect hash table.
+ */
+static void G_COLD
+rw_ggep_phash_init(void)
+{
+	uint n;
+
+	STATIC_ASSERT(N_ITEMS(ggeptable) < MAX_INT_VAL(uint8));
+
+	for (n = 0; n < GGEP_PHASH_TRIES; n++) {
+		size_t i;
+
+		ggep_phash_mult = GGEP_PHASH_MULT + 2 * n;	/* Always odd */
+		ZERO(&ggep_phash);
+
+		for (i = 0; i < N_ITEMS(ggeptable); i++) {
+			const char *w = ggeptable[i].rw_name;
+			uint32 h = 0;
+			uint slot;
+
+			while (*w != '\0')
+				h = ggep_phash_step(h, *w++);
+
+			slot = ggep_phash_slot(h);
+			if (ggep_phash[slot] != 0)
+				break;				/* Collision, try next multiplier */
+
+			ggep_phash[slot] = i + 1;
+		}
+
+		if (N_ITEMS(ggeptable) == i)
+			return;
+	}
+
+	g_error("%s(): no perfect hash for the %zu GGEP IDs after %u attempts",
+		G_STRFUNC, N_ITEMS(ggeptable), n);
 }
 
 /**
@@ -427,178 +514,224 @@ ext_names_kv_free(const void *key, void *value, void *unused_udata)
  ***/
 
 /**
- * Parses a GGEP block (can hold several extensions).
+ * A parsed GGEP extension header.
  */
-static int G_HOT
-ext_ggep_parse(const char **retp, int len, extvec_t *exv, int exvcnt)
+struct ggep_header {
+	const char *payload;		/**< Start of physical payload */
+	uint paylen;				/**< Physical payload length */
+	uchar flags;				/**< GGEP flags */
+	ext_token_t token;			/**< Extension token */
+	const char *name;			/**< Static ID string, NULL if unknown */
+	char id[GGEP_F_IDLEN + 1];	/**< The NUL-terminated ID */
+};
+
+/**
+ * Parse and validate the header of the GGEP extension starting at `p'.
+ *
+ * The extension ID is recognized in the same pass that validates it, and
+ * the payload is only checked for consistency, not decoded.
+ *
+ * @param p		start of the extension (flags byte)
+ * @param end	first byte beyond the GGEP block
+ * @param h		filled with the parsed header
+ *
+ * @return TRUE if the extension is valid.
+ */
+static bool G_HOT
+ext_ggep_header(const char *p, const char *end, struct ggep_header *h)
 {
-	const char *p = *retp;
-	const char *end = &p[len];
-	const char *lastp = p;				/* Last parsed point */
-	int count;
+	uint id_len, data_length, i;
+	bool length_ended = FALSE;
+	uint32 hash = 0;
 
-	for (count = 0; count < exvcnt && p < end; /* empty */) {
-		uchar flags;
-		char id[GGEP_F_IDLEN + 1];
-		uint id_len, data_length, i;
-		bool length_ended = FALSE;
-		const char *name;
-		extdesc_t *d;
+	/*
+	 * First byte is GGEP flags.
+	 */
 
-		g_assert(exv->opaque == NULL);
+	h->flags = (uchar) *p++;
 
-		/*
-		 * First byte is GGEP flags.
-		 */
+	if (h->flags & GGEP_F_MBZ)		/* A byte that Must Be Zero is set */
+		return FALSE;
 
-		flags = (uchar) *p++;
+	id_len = h->flags & GGEP_F_IDLEN;
+	g_assert(id_len < sizeof h->id);
 
-		if (flags & GGEP_F_MBZ)		/* A byte that Must Be Zero is set */
-			goto abort;
+	if (id_len == 0)
+		return FALSE;
 
-		id_len = flags & GGEP_F_IDLEN;
-		g_assert(id_len < sizeof id);
+	if ((size_t) (end - p) < id_len) /* Not enough bytes to store the ID! */
+		return FALSE;
 
-		if (id_len == 0)
-			goto abort;
+	/*
+	 * Read ID, and NUL-terminate it.
+	 *
+	 * As a safety precaution, only allow ASCII IDs, and nothing in
+	 * the control space.  It's not really in the GGEP specs, but it's
+	 * safer that way, and should protect us if we parse garbage starting
+	 * with 0xC3....
+	 *		--RAM, 2004-11-12
+	 */
 
-		if ((size_t) (end - p) < id_len) /* Not enough bytes to store the ID! */
-			goto abort;
+	for (i = 0; i < id_len; i++) {
+		int c = *p++;
+		if (c == '\0' || !isascii(c) || is_ascii_cntrl(c))
+			return FALSE;
+		h->id[i] = c;
+		hash = ggep_phash_step(hash, c);
+	}
+	h->id[i] = '\0';
 
-		/*
-		 * Read ID, and NUL-terminate it.
-		 *
-		 * As a safety precaution, only allow ASCII IDs, and nothing in
-		 * the control space.  It's not really in the GGEP specs, but it's
-		 * safer that way, and should protect us if we parse garbage starting
-		 * with 0xC3....
-		 *		--RAM, 2004-11-12
-		 */
+	/*
+	 * Read the payload length (maximum of 3 bytes).
+	 */
 
-		for (i = 0; i < id_len; i++) {
-			int c = *p++;
-			if (c == '\0' || !isascii(c) || is_ascii_cntrl(c))
-				goto abort;
-			id[i] = c;
-		}
-		id[i] = '\0';
+	data_length = 0;
+	for (i = 0; i < 3 && p < end; i++) {
+		uchar b = *p++;
 
 		/*
-		 * Read the payload length (maximum of 3 bytes).
+		 * Either GGEP_L_CONT or GGEP_L_LAST must be set, thereby
+		 * ensuring that the byte cannot be NUL.
 		 */
 
-		data_length = 0;
-		for (i = 0; i < 3 && p < end; i++) {
-			uchar b = *p++;
+		if (((b & GGEP_L_XFLAGS) == GGEP_L_XFLAGS) || !(b & GGEP_L_XFLAGS))
+			return FALSE;
 
-			/*
-			 * Either GGEP_L_CONT or GGEP_L_LAST must be set, thereby
-			 * ensuring that the byte cannot be NUL.
-			 */
+		data_length = (data_length << GGEP_L_VSHIFT) | (b & GGEP_L_VALUE);
 
-			if (((b & GGEP_L_XFLAGS) == GGEP_L_XFLAGS) || !(b & GGEP_L_XFLAGS))
-				goto abort;
+		if (b & GGEP_L_LAST) {
+			length_ended = TRUE;
+			break;
+		}
+	}
 
-			data_length = (data_length << GGEP_L_VSHIFT) | (b & GGEP_L_VALUE);
+	if (!length_ended)
+		return FALSE;
 
-			if (b & GGEP_L_LAST) {
-				length_ended = TRUE;
-				break;
-			}
-		}
+	/*
+	 * Ensure we have enough bytes left for the payload.  If not, it
+	 * means the length is garbage.
+	 */
 
-		if (!length_ended)
-			goto abort;
+	/* Check whether there are enough bytes for the payload */
+	if ((size_t) (end - p) < data_length)
+		return FALSE;
 
-		/*
-		 * Ensure we have enough bytes left for the payload.  If not, it
-		 * means the length is garbage.
-		 */
+	/*
+	 * Some sanity checks:
+	 *
+	 * A COBS-encoded buffer can be trivially validated.
+	 * A deflated payload must be at least 6 bytes with a valid header.
+	 */
 
-		/* Check whether there are enough bytes for the payload */
-		if ((size_t) (end - p) < data_length)
-			goto abort;
+	if (h->flags & (GGEP_F_COBS|GGEP_F_DEFLATE)) {
+		uint d_len = data_length;
 
-		/*
-		 * Some sanity checks:
-		 *
-		 * A COBS-encoded buffer can be trivially validated.
-		 * A deflated payload must be at least 6 bytes with a valid header.
-		 */
+		if (h->flags & GGEP_F_COBS) {
+			if (d_len == 0 || !cobs_is_valid(p, d_len))
+				return FALSE;
+			d_len--;					/* One byte of overhead */
+		}
 
-		if (flags & (GGEP_F_COBS|GGEP_F_DEFLATE)) {
-			uint d_len = data_length;
+		if (h->flags & GGEP_F_DEFLATE) {
+			uint offset = 0;
 
-			if (flags & GGEP_F_COBS) {
-				if (d_len == 0 || !cobs_is_valid(p, d_len))
-					goto abort;
-				d_len--;					/* One byte of overhead */
-			}
+			if (d_len < 6)
+				return FALSE;
 
-			if (flags & GGEP_F_DEFLATE) {
-				uint offset = 0;
-
-				if (d_len < 6)
-					goto abort;
-
-				/*
-				 * If COBS-ed, since neither the first byte nor the
-				 * second byte of the raw deflated payload can be NUL,
-				 * the leading COBS code will be at least 3.  Then
-				 * the next 2 bytes are the raw deflated header.
-				 *
-				 * If not COBS-ed, check whether payload holds a valid
-				 * deflated header.
-				 */
-
-				if (flags & GGEP_F_COBS) {
-					if ((uchar) *p < 3)
-						goto abort;
-					offset = 1;			/* Skip leading byte */
-				}
+			/*
+			 * If COBS-ed, since neither the first byte nor the
+			 * second byte of the raw deflated payload can be NUL,
+			 * the leading COBS code will be at least 3.  Then
+			 * the next 2 bytes are the raw deflated header.
+			 *
+			 * If not COBS-ed, check whether payload holds a valid
+			 * deflated header.
+			 */
 
-				if (!zlib_is_valid_header(p + offset, d_len))
-					goto abort;
+			if (h->flags & GGEP_F_COBS) {
+				if ((uchar) *p < 3)
+					return FALSE;
+				offset = 1;			/* Skip leading byte */
 			}
+
+			if (!zlib_is_valid_header(p + offset, d_len))
+				return FALSE;
 		}
+	}
 
-		/*
-		 * OK, at this point we have validated the GGEP header.
-		 */
+	h->payload = p;
+	h->paylen = data_length;
+	h->token = rw_ggep_screen(h->id, hash, &h->name);
+
+	return TRUE;
+}
 
-		WALLOC(d);
+/**
+ * Fill extension vector entry from a validated GGEP header.
+ *
+ * @param exv		the extension vector entry to fill
+ * @param h			the parsed GGEP header
+ * @param base		start of the extension (flags byte)
+ */
+static void
+ext_ggep_fill(extvec_t *exv, const struct ggep_header *h, const char *base)
+{
+	extdesc_t *d;
 
-		d->ext_phys_payload = p;
-		d->ext_phys_paylen = data_length;
-		d->ext_phys_len = (p - lastp) + data_length;
-		d->ext_ggep_cobs = booleanize(flags & GGEP_F_COBS);
-		d->ext_ggep_deflate = booleanize(flags & GGEP_F_DEFLATE);
+	g_assert(exv->opaque == NULL);
 
-		if (0 == (flags & (GGEP_F_COBS|GGEP_F_DEFLATE))) {
-			d->ext_payload = d->ext_phys_payload;
-			d->ext_paylen = d->ext_phys_paylen;
-		} else
-			d->ext_payload = NULL;		/* Will lazily compute, if accessed */
+	WALLOC(d);
 
-		exv->opaque = d;
+	d->ext_phys_payload = h->payload;
+	d->ext_phys_paylen = h->paylen;
+	d->ext_phys_len = (h->payload - base) + h->paylen;
+	d->ext_ggep_cobs = booleanize(h->flags & GGEP_F_COBS);
+	d->ext_ggep_deflate = booleanize(h->flags & GGEP_F_DEFLATE);
 
-		g_assert(ext_phys_headlen(d) >= 0);
+	if (0 == (h->flags & (GGEP_F_COBS|GGEP_F_DEFLATE))) {
+		d->ext_payload = d->ext_phys_payload;
+		d->ext_paylen = d->ext_phys_paylen;
+	} else
+		d->ext_payload = NULL;		/* Will lazily compute, if accessed */
 
-		/*
-		 * Look whether we know about this extension.
-		 *
-		 * If we do, the name is the ID as well.  Otherwise, for tracing
-		 * and debugging purposes, save the name away, once.
-		 */
+	exv->opaque = d;
 
-		exv->ext_type = EXT_GGEP;
-		exv->ext_token = rw_ggep_screen(id, &name);
-		exv->ext_name = name;
+	g_assert(ext_phys_headlen(d) >= 0);
 
-		if (name != NULL)
-			d->ext_ggep_id = name;
-		else
-			d->ext_ggep_id = ext_name_atom(id);
+	/*
+	 * If we know about this extension, the name is the ID as well.
+	 * Otherwise, for tracing and debugging purposes, save the name away, once.
+	 */
+
+	exv->ext_type = EXT_GGEP;
+	exv->ext_token = h->token;
+	exv->ext_name = h->name;
+
+	if (h->name != NULL)
+		d->ext_ggep_id = h->name;
+	else
+		d->ext_ggep_id = ext_name_atom(h->id);
+}
+
+/**
+ * Parses a GGEP block (can hold several extensions).
+ */
+static int G_HOT
+ext_ggep_parse(const char **retp, int len, extvec_t *exv, int exvcnt)
+{
+	const char *p = *retp;
+	const char *end = &p[len];
+	const char *lastp = p;				/* Last parsed point */
+	int count;
+
+	for (count = 0; count < exvcnt && p < end; /* empty */) {
+		struct ggep_header h;
+
+		if (!ext_ggep_header(p, end, &h))
+			goto abort;
+
+		ext_ggep_fill(exv, &h, lastp);
 
 		/*
 		 * One more entry, prepare next iteration.
@@ -606,14 +739,14 @@ ext_ggep_parse(const char **retp, int len, extvec_t *exv, int exvcnt)
 
 		exv++;
 		count++;
-		lastp = p + data_length;
+		lastp = h.payload + h.paylen;
 		p = lastp;
 
 		/*
 		 * Was this the last extension?
 		 */
 
-		if (flags & GGEP_F_LAST)
+		if (h.flags & GGEP_F_LAST)
 			break;
 	}
 
@@ -1296,6 +1429,74 @@ ext_ggep_nextblock(const char *buf, int len)
 	return NULL;	/* Did not find any GGEP start */
 }
 
+/**
+ * Lookup the first GGEP extension bearing the specified token.
+ *
+ * This is a lazy alternative to ext_parse() for callers that are only
+ * interested in a single extension: the GGEP blocks are walked over in
+ * the raw buffer and only the matching extension is recorded in `exv',
+ * the others being validated but neither recorded nor decoded.
+ *
+ * Upon success, the extension must be released through ext_reset().
+ *
+ * @param buf		the buffer to parse
+ * @param len		size of buffer in bytes
+ * @param token		the GGEP extension token we are looking for
+ * @param exv		the extension vector entry filled on success
+ *
+ * @return TRUE if the extension was found.
+ */
+bool
+ext_ggep_find(const char *buf, int len, ext_token_t token, extvec_t *exv)
+{
+	const char *p = buf, *end = &buf[len];
+
+	g_assert(buf != NULL);
+	g_assert(len >= 0);
+	g_assert(exv != NULL);
+	g_assert(exv->opaque == NULL);
+
+	while (p < end && NULL != (p = ext_ggep_nextblock(p, end - p))) {
+		const char *start = p, *base = NULL;
+		struct ggep_header h, match;
+		bool valid = TRUE;
+
+		/*
+		 * Go through the whole block: an invalid extension anywhere makes
+		 * ext_parse() ignore the whole block, and so must we.
+		 */
+
+		while (p < end) {
+			if (!ext_ggep_header(p, end, &h)) {
+				valid = FALSE;
+				break;
+			}
+
+			if (NULL == base && token == h.token) {
+				match = h;
+				base = p;
+			}
+
+			p = h.payload + h.paylen;
+
+			if (h.flags & GGEP_F_LAST)
+				break;
+		}
+
+		if (!valid) {
+			p = start;		/* Not a GGEP block, look for the next one */
+			continue;
+		}
+
+		if (base != NULL) {
+			ext_ggep_fill(exv, &match, base);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
 /**
  * Strip instances of a particular GGEP key from the current GGEP block, moving
  * data around to fill the gaps.
@@ -2260,6 +2461,7 @@ ext_init(void)
 
 	rw_is_sorted("ggeptable", ggeptable, N_ITEMS(ggeptable));
 	rw_is_sorted("urntable", urntable, N_ITEMS(urntable));
+	rw_ggep_phash_init();
 }
 
 /**
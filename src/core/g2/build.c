@@ -74,6 +74,8 @@
 
 #define G2_BUILD_QH2_THRESH		8192	/**< Flush /QH2 larger than this */
 #define G2_BUILD_QH2_MAX_ALT	16		/**< Max amount of alt-locs we send */
+#define G2_BUILD_QH2_EXTRA		1024	/**< Extra room for last hit in /QH2 */
+#define G2_BUILD_Q2_SIZE		256		/**< Initial buffer size for /Q2 */
 
 enum g2_qht_type {
 	G2_QHT_RESET = 0,
@@ -163,18 +165,28 @@ g2_build_pmsg(const g2_tree_t *t)
 }
 
 /**
- * Create new message holding serialized tree, with associated free routine.
+ * Create new message holding the packet serialized by a streaming writer.
  *
- * @param t			the tree to serialize
- * @param freecb	the freeing callback to invoke
- * @param arg		additional argument for the freeing callback
+ * @param w			the writer holding the serialized packet
+ * @param prio		priority of the message
+ * @param freecb	if non-NULL, the free routine to attach to message
+ * @param arg		additional argument for the free routine
  *
- * @return a message containing the serialized tree.
+ * @return a message containing the serialized packet.
  */
-static inline pmsg_t *
-g2_build_pmsg_extended(const g2_tree_t *t, pmsg_free_t freecb, void *arg)
+static pmsg_t *
+g2_build_writer_pmsg(const g2_frame_writer_t *w, int prio,
+	pmsg_free_t freecb, void *arg)
 {
-	return g2_build_pmsg_prio(t, PMSG_P_DATA, freecb, arg);
+	const void *data;
+	size_t len;
+
+	data = g2_frame_writer_data(w, &len);
+
+	if (NULL == freecb)
+		return pmsg_new(prio, data, len);
+	else
+		return pmsg_new_extend(prio, data, len, freecb, arg);
 }
 
 /**
@@ -324,24 +336,23 @@ g2_build_add_vendor(g2_tree_t *t)
 	g2_tree_add_child(t, c);
 }
 
+#define G2_BUILD_HOST_LEN	18	/* Large enough for IPv6 as well, one day? */
+
 /**
- * Add child to the node, carrying an IP:port.
+ * Fill payload with an IP:port.
  *
- * @param t		the tree node where child must be added
- * @param name	the name of the child
- * @param addr	the IP address
- * @param port	the port address
+ * @param payload	the buffer to fill, at least G2_BUILD_HOST_LEN bytes
+ * @param addr		the IP address
+ * @param port		the port address
  *
- * @return the added child node
+ * @return the length of the payload.
  */
-static g2_tree_t *
-g2_build_add_host(g2_tree_t *t, const char *name, host_addr_t addr, uint16 port)
+static size_t
+g2_build_host_payload(void *payload, host_addr_t addr, uint16 port)
 {
 	struct packed_host_addr packed;
 	uint alen;
-	char payload[18];		/* Large enough for IPv6 as well, one day? */
 	void *p;
-	g2_tree_t *c;
 
 	packed = host_addr_pack(addr);
 	alen = packed_host_addr_size(packed) - 1;	/* skip network byte */
@@ -349,7 +360,28 @@ g2_build_add_host(g2_tree_t *t, const char *name, host_addr_t addr, uint16 port)
 	p = mempcpy(payload, &packed.addr, alen);
 	p = poke_le16(p, port);
 
-	c = g2_tree_alloc_copy(name, payload, ptr_diff(p, payload));
+	return ptr_diff(p, payload);
+}
+
+/**
+ * Add child to the node, carrying an IP:port.
+ *
+ * @param t		the tree node where child must be added
+ * @param name	the name of the child
+ * @param addr	the IP address
+ * @param port	the port address
+ *
+ * @return the added child node
+ */
+static g2_tree_t *
+g2_build_add_host(g2_tree_t *t, const char *name, host_addr_t addr, uint16 port)
+{
+	char payload[G2_BUILD_HOST_LEN];
+	size_t len;
+	g2_tree_t *c;
+
+	len = g2_build_host_payload(payload, addr, port);
+	c = g2_tree_alloc_copy(name, payload, len);
 	g2_tree_add_child(t, c);
 
 	return c;
@@ -618,16 +650,28 @@ pmsg_t *
 g2_build_q2(const guid_t *muid, const char *query,
 	unsigned mtype, const void *query_key, uint8 length)
 {
-	g2_tree_t *t, *c;
+	g2_frame_writer_t w;
 	pmsg_t *mb;
+	char payload[G2_BUILD_HOST_LEN];
+	size_t plen;
 	static const char interest[] = "URL\0PFS\0DN\0A";
 
-	t = g2_tree_alloc_copy(G2_NAME(Q2), PTRLEN(muid));
-	c = g2_build_add_listening_address(t, "UDP");
-	g2_tree_append_payload(c, query_key, length);
+	/*
+	 * The /Q2 is streamed directly, children first, the MUID payload last.
+	 */
 
-	c = g2_tree_alloc_copy("DN", query, vstrlen(query));
-	g2_tree_add_child(t, c);
+	g2_frame_writer_init(&w, G2_BUILD_Q2_SIZE);
+	g2_frame_writer_open(&w, G2_NAME(Q2));
+
+	plen = g2_build_host_payload(payload,
+		listen_addr_primary(), socket_listen_port());
+
+	g2_frame_writer_open(&w, "UDP");
+	g2_frame_writer_payload(&w, payload, plen);
+	g2_frame_writer_payload(&w, query_key, length);
+	g2_frame_writer_close(&w);
+
+	g2_frame_writer_leaf(&w, "DN", query, vstrlen(query));
 
 	/*
 	 * Due to an important Shareaza parsing bug in versions <= 2.7.1.0,
@@ -637,40 +681,29 @@ g2_build_q2(const guid_t *muid, const char *query,
 	 *		--RAM, 2014-02-28
 	 */
 
-	c = g2_tree_alloc("I", interest, sizeof interest);
-	g2_tree_add_child(t, c);
+	g2_frame_writer_leaf(&w, "I", interest, sizeof interest);
 
 	if (mtype != 0) {
+		const char *md = NULL;
+
 		/*
 		 * Don't know how we can combine these flags on G2, hence only
 		 * emit for simple flags.
 		 */
 
-		c = NULL;
-
-		if (SEARCH_AUDIO_TYPE == (mtype & SEARCH_AUDIO_TYPE)) {
-			static const char audio[] = "<audio/>";
-			c = g2_tree_alloc("MD", audio, CONST_STRLEN(audio));
-		}
-		else if (SEARCH_VIDEO_TYPE == (mtype & SEARCH_VIDEO_TYPE)) {
-			static const char video[] = "<video/>";
-			c = g2_tree_alloc("MD", video, CONST_STRLEN(video));
-		}
-		else if (SEARCH_IMG_TYPE == (mtype & SEARCH_IMG_TYPE)) {
-			static const char image[] = "<image/>";
-			c = g2_tree_alloc("MD", image, CONST_STRLEN(image));
-		}
-		else if (SEARCH_DOC_TYPE == (mtype & SEARCH_DOC_TYPE)) {
-			static const char doc[] = "<document/>";
-			c = g2_tree_alloc("MD", doc, CONST_STRLEN(doc));
-		}
-		else if (mtype & (SEARCH_WIN_TYPE | SEARCH_UNIX_TYPE)) {
-			static const char archive[] = "<archive/>";
-			c = g2_tree_alloc("MD", archive, CONST_STRLEN(archive));
-		}
-
-		if (c != NULL)
-			g2_tree_add_child(t, c);
+		if (SEARCH_AUDIO_TYPE == (mtype & SEARCH_AUDIO_TYPE))
+			md = "<audio/>";
+		else if (SEARCH_VIDEO_TYPE == (mtype & SEARCH_VIDEO_TYPE))
+			md = "<video/>";
+		else if (SEARCH_IMG_TYPE == (mtype & SEARCH_IMG_TYPE))
+			md = "<image/>";
+		else if (SEARCH_DOC_TYPE == (mtype & SEARCH_DOC_TYPE))
+			md = "<document/>";
+		else if (mtype & (SEARCH_WIN_TYPE | SEARCH_UNIX_TYPE))
+			md = "<archive/>";
+
+		if (md != NULL)
+			g2_frame_writer_leaf(&w, "MD", md, vstrlen(md));
 	}
 
 	if (GNET_PROPERTY(is_firewalled) || GNET_PROPERTY(is_udp_firewalled)) {
@@ -679,14 +712,14 @@ g2_build_q2(const guid_t *muid, const char *query,
 		 * firewalled.  Why didn't they choose /Q2/FW for consistency?
 		 */
 
-		c = g2_tree_alloc_empty("NAT");
-		g2_tree_add_child(t, c);
+		g2_frame_writer_leaf(&w, "NAT", NULL, 0);
 	}
 
-	g2_tree_reverse_children(t);
+	g2_frame_writer_payload(&w, muid, GUID_RAW_SIZE);
+	g2_frame_writer_close(&w);
 
-	mb = g2_build_pmsg(t);
-	g2_tree_free_null(&t);
+	mb = g2_build_writer_pmsg(&w, PMSG_P_DATA, NULL, NULL);
+	g2_frame_writer_discard(&w);
 
 	return mb;
 }
@@ -754,18 +787,27 @@ struct g2_qh2_builder {
 	const gnutella_node_t *hub;	/**< The hub that gave us the query */
 	const gnutella_node_t *n;	/**< The node to which results are sent */
 	hset_t *hs;					/**< Records SHA1 atoms we sent */
-	g2_tree_t *t;				/**< Current message */
+	g2_frame_writer_t w;		/**< Streams current message, if started */
+	char *common;				/**< Serialized common children (template) */
+	size_t common_len;			/**< Length of common children */
 	g2_build_qh2_cb_t cb;		/**< (optional) Processing callback */
 	void *arg;					/**< Processing callback argument */
 	size_t max_size;			/**< Max query hit size we want */
-	size_t common_size;			/**< Serialized size with common fields only */
-	size_t current_size;		/**< Estimated current size */
 	int messages;				/**< Counts flushed messages, for logging */
 	uint flags;					/**< Flags for optional entries in hit */
 	uint from_gtkg:1;			/**< Whether query comes from GTKG */
 	uint to_udp:1;				/**< Whether results are sent via UDP */
 };
 
+/**
+ * @return whether a /QH2 message is being built.
+ */
+static inline bool
+g2_build_qh2_started(const struct g2_qh2_builder *ctx)
+{
+	return ctx->w.depth != 0;
+}
+
 /**
  * Flush current /QH2.
  *
@@ -778,15 +820,17 @@ g2_build_qh2_flush(struct g2_qh2_builder *ctx)
 	pmsg_t *mb;
 
 	g_assert(ctx != NULL);
-	g_assert(ctx->t != NULL);
+	g_assert(g2_build_qh2_started(ctx));
 	g_assert((ctx->n != NULL) ^ (ctx->cb != NULL));
 
 	/*
-	 * Restore the order of children in the root packet to be the order we
-	 * used when we added the nodes, since we prepend new children.
+	 * The payload of the /QH2 message is one byte hop count + the MUID.
+	 * It comes after all the children, and closing the root packet sets
+	 * its final length.
 	 */
 
-	g2_tree_reverse_children(ctx->t);
+	g2_frame_writer_payload(&ctx->w, ARYLEN(ctx->payload));
+	g2_frame_writer_close(&ctx->w);
 
 	/*
 	 * If sending over UDP, ask for reliable delivery of the query hit.
@@ -800,20 +844,27 @@ g2_build_qh2_flush(struct g2_qh2_builder *ctx)
 		WALLOC0(pmi);
 		pmi->magic = G2_QH2_PMI_MAGIC;
 		pmi->hub_id = nid_ref(NODE_ID(ctx->hub));
-		mb = g2_build_pmsg_extended(ctx->t, g2_qh2_pmsg_free, pmi);
+		mb = g2_build_writer_pmsg(&ctx->w, PMSG_P_DATA, g2_qh2_pmsg_free, pmi);
 		pmsg_mark_reliable(mb);
 	} else {
-		mb = g2_build_pmsg(ctx->t);
+		mb = g2_build_writer_pmsg(&ctx->w, PMSG_P_DATA, NULL, NULL);
 	}
 
 	if (GNET_PROPERTY(g2_debug) > 3) {
+		g2_tree_t *t;
+
 		g_debug("%s(): flushing the following hit for "
 			"Q2 #%s to %s%s (%d bytes):",
 			G_STRFUNC, guid_hex_str(ctx->muid),
 			NULL == ctx->n ?
 				stacktrace_function_name(ctx->cb) : node_infostr(ctx->n),
 			NULL == ctx->n ? "()" : "", pmsg_size(mb));
-		g2_tfmt_tree_dump(ctx->t, stderr, G2FMT_O_PAYLOAD | G2FMT_O_PAYLEN);
+
+		t = g2_frame_deserialize(pmsg_start(mb), pmsg_size(mb), NULL, FALSE);
+		if (t != NULL) {
+			g2_tfmt_tree_dump(t, stderr, G2FMT_O_PAYLOAD | G2FMT_O_PAYLEN);
+			g2_tree_free_null(&t);
+		}
 	}
 
 	if (ctx->n != NULL)
@@ -822,34 +873,37 @@ g2_build_qh2_flush(struct g2_qh2_builder *ctx)
 		(*ctx->cb)(mb, ctx->arg);
 
 	ctx->messages++;
-	ctx->current_size = 0;
-	g2_tree_free_null(&ctx->t);
+	g2_frame_writer_reset(&ctx->w);
 }
 
 /**
- * Create new /QH2 and fill it with fields that do not depend on the hits
- * themselves, i.e. all the common fields we have to send in every /QH2 anyway.
+ * Serialize the fields that do not depend on the hits themselves, i.e. all
+ * the common children we have to send in every /QH2 anyway.
+ *
+ * This is done once per query hit series, the result being copied verbatim
+ * into each /QH2 we generate.
  */
 static void
-g2_build_qh2_start(struct g2_qh2_builder *ctx)
+g2_build_qh2_common(struct g2_qh2_builder *ctx)
 {
-	g_assert(NULL == ctx->t);
+	g2_tree_t *t;
+	const g2_tree_t *c;
+	size_t len = 0;
+	char *p;
 
-	/*
-	 * The payload of the /QH2 message is one byte hop count + the MUID.
-	 */
+	g_assert(NULL == ctx->common);
 
-	ctx->t = g2_tree_alloc(G2_NAME(QH2), ARYLEN(ctx->payload));
+	t = g2_tree_alloc_empty(G2_NAME(QH2));
 
-	g2_build_add_node_address(ctx->t);	/* NA -- the IP:port of this node */
-	g2_build_add_guid(ctx->t);			/* GU -- the GUID of this node */
-	g2_build_add_vendor(ctx->t);		/* V  -- vendor code */
-	g2_build_add_firewalled(ctx->t);	/* FW -- when servent is firewalled */
-	g2_build_add_browsable(ctx->t);		/* BH -- when browsing is allowed */
-	g2_build_add_tls(ctx->t);			/* TLS -- whether TLS is supported */
-	g2_build_add_uptime(ctx->t);		/* UP -- servent uptime */
-	g2_build_add_neighbours(ctx->t);	/* NH -- neighbouring hubs, if FW */
-	g2_build_add_hostname(ctx->t);		/* HN -- DNS hostname, if defined */
+	g2_build_add_node_address(t);	/* NA -- the IP:port of this node */
+	g2_build_add_guid(t);			/* GU -- the GUID of this node */
+	g2_build_add_vendor(t);			/* V  -- vendor code */
+	g2_build_add_firewalled(t);		/* FW -- when servent is firewalled */
+	g2_build_add_browsable(t);		/* BH -- when browsing is allowed */
+	g2_build_add_tls(t);			/* TLS -- whether TLS is supported */
+	g2_build_add_uptime(t);			/* UP -- servent uptime */
+	g2_build_add_neighbours(t);		/* NH -- neighbouring hubs, if FW */
+	g2_build_add_hostname(t);		/* HN -- DNS hostname, if defined */
 
 	/*
 	 * If the query comes from a GTKG node (not 100% safe, there can be some
@@ -858,16 +912,47 @@ g2_build_qh2_start(struct g2_qh2_builder *ctx)
 	 */
 
 	if (ctx->from_gtkg)
-		g2_build_add_gtkgv(ctx->t);		/* gtkgV -- GTKG version info */
+		g2_build_add_gtkgv(t);		/* gtkgV -- GTKG version info */
 
 	/*
-	 * Compute size we have so far, once per query hit series.
+	 * Restore the order of children to be the order we used when we added
+	 * the nodes, since we prepend new children.
 	 */
 
-	if G_UNLIKELY(0 == ctx->common_size)
-		ctx->common_size = g2_frame_serialize(ctx->t, NULL, 0);
+	g2_tree_reverse_children(t);
+
+	G2_TREE_CHILD_FOREACH(t, c) {
+		len += g2_frame_serialize(c, NULL, 0);
+	}
+
+	ctx->common = p = halloc(len);
+	ctx->common_len = len;
+
+	G2_TREE_CHILD_FOREACH(t, c) {
+		p += g2_frame_serialize(c, p, ptr_diff(ctx->common + len, p));
+	}
+
+	g_assert(ptr_diff(p, ctx->common) == len);
 
-	ctx->current_size = ctx->common_size;
+	g2_tree_free_null(&t);
+}
+
+/**
+ * Start new /QH2 and fill it with the common fields.
+ */
+static void
+g2_build_qh2_start(struct g2_qh2_builder *ctx)
+{
+	g_assert(!g2_build_qh2_started(ctx));
+
+	if G_UNLIKELY(NULL == ctx->common)
+		g2_build_qh2_common(ctx);
+
+	if G_UNLIKELY(NULL == ctx->w.buf)
+		g2_frame_writer_init(&ctx->w, ctx->max_size + G2_BUILD_QH2_EXTRA);
+
+	g2_frame_writer_open(&ctx->w, G2_NAME(QH2));
+	g2_frame_writer_children(&ctx->w, ctx->common, ctx->common_len);
 }
 
 /**
@@ -879,7 +964,7 @@ static bool
 g2_build_qh2_add(struct g2_qh2_builder *ctx, const shared_file_t *sf)
 {
 	const sha1_t *sha1;
-	g2_tree_t *h, *c;
+	g2_frame_writer_t *w;
 
 	shared_file_check(sf);
 
@@ -917,14 +1002,14 @@ g2_build_qh2_add(struct g2_qh2_builder *ctx, const shared_file_t *sf)
 	}
 
 	/*
-	 * Create the "H" child and attach it to the current tree.
+	 * Stream the "H" child into the current message.
 	 */
 
-	if (NULL == ctx->t)
+	if (!g2_build_qh2_started(ctx))
 		g2_build_qh2_start(ctx);
 
-	h = g2_tree_alloc_empty("H");
-	g2_tree_add_child(ctx->t, h);
+	w = &ctx->w;
+	g2_frame_writer_open(w, "H");
 
 	/*
 	 * URN -- Universal Resource Name
@@ -954,8 +1039,7 @@ g2_build_qh2_add(struct g2_qh2_builder *ctx, const shared_file_t *sf)
 
 		g_assert(ptr_diff(p, payload) <= sizeof payload);
 
-		c = g2_tree_alloc_copy("URN", payload, ptr_diff(p, payload));
-		g2_tree_add_child(h, c);
+		g2_frame_writer_leaf(w, "URN", payload, ptr_diff(p, payload));
 	}
 
 	/*
@@ -966,8 +1050,7 @@ g2_build_qh2_add(struct g2_qh2_builder *ctx, const shared_file_t *sf)
 		uint known;
 		uint16 csc;
 
-		c = g2_tree_alloc_empty("URL");
-		g2_tree_add_child(h, c);
+		g2_frame_writer_leaf(w, "URL", NULL, 0);
 
 		/*
 		 * CSC -- if we know alternate sources, indicate how many in "CSC".
@@ -982,8 +1065,7 @@ g2_build_qh2_add(struct g2_qh2_builder *ctx, const shared_file_t *sf)
 			char payload[2];
 
 			poke_le16(payload, csc);
-			c = g2_tree_alloc_copy("CSC", ARYLEN(payload));
-			g2_tree_add_child(h, c);
+			g2_frame_writer_leaf(w, "CSC", ARYLEN(payload));
 		}
 
 		/*
@@ -998,30 +1080,30 @@ g2_build_qh2_add(struct g2_qh2_builder *ctx, const shared_file_t *sf)
 			uint32 av32;
 			time_t mtime = shared_file_modification_time(sf);
 
-			c = g2_tree_alloc_empty("PART");
-			g2_tree_add_child(h, c);
+			g2_frame_writer_open(w, "PART");
+
+			/*
+			 * GTKG extension: encode the last modification time of the
+			 * partial file in an "MT" child.  This lets the other party
+			 * determine whether the host is still able to actively complete
+			 * the file.
+			 */
+
+			poke_le32(payload, (uint32) mtime);
+			g2_frame_writer_leaf(w, "MT", payload, sizeof(uint32));
 
 			av32 = available;
 			if (av32 == available) {
 				/* Fits within a 32-bit quantity */
 				poke_le32(payload, av32);
-				g2_tree_set_payload(c, payload, sizeof av32, TRUE);
+				g2_frame_writer_payload(w, payload, sizeof av32);
 			} else {
 				/* Encode as a 64-bit quantity then */
 				poke_le64(payload, available);
-				g2_tree_set_payload(c, ARYLEN(payload), TRUE);
+				g2_frame_writer_payload(w, ARYLEN(payload));
 			}
 
-			/*
-			 * GTKG extension: encode the last modification time of the
-			 * partial file in an "MT" child.  This lets the other party
-			 * determine whether the host is still able to actively complete
-			 * the file.
-			 */
-
-			poke_le32(payload, (uint32) mtime);
-			g2_tree_add_child(c,
-				g2_tree_alloc_copy("MT", payload, sizeof(uint32)));
+			g2_frame_writer_close(w);
 		}
 
 		/*
@@ -1037,8 +1119,7 @@ g2_build_qh2_add(struct g2_qh2_builder *ctx, const shared_file_t *sf)
 
 				create_time = MAX(0, create_time);
 				n = vlint_encode(create_time, payload);
-				g2_tree_add_child(h,
-					g2_tree_alloc_copy("CT", payload, n));	/* No trailing 0s */
+				g2_frame_writer_leaf(w, "CT", payload, n);	/* No trailing 0s */
 			}
 		}
 	}
@@ -1054,25 +1135,16 @@ g2_build_qh2_add(struct g2_qh2_builder *ctx, const shared_file_t *sf)
 		char payload[8];		/* If we have to encode file size as 64-bit */
 		uint32 fs32;
 		filesize_t fs = shared_file_size(sf);
-		const char *name;
 		const char *rp;
 
-		c = g2_tree_alloc_empty("DN");
-
 		fs32 = fs;
-		if (fs32 == fs) {
-			/* Fits within a 32-bit quantity */
-			poke_le32(payload, fs32);
-			g2_tree_set_payload(c, payload, sizeof fs32, TRUE);
-		} else {
+		if (fs32 != fs) {
 			/* Does not fit a 32-bit quantity, emit a SZ child */
 			poke_le64(payload, fs);
-			g2_tree_add_child(h, g2_tree_alloc_copy("SZ", ARYLEN(payload)));
+			g2_frame_writer_leaf(w, "SZ", ARYLEN(payload));
 		}
 
-		name = shared_file_name_nfc(sf);
-		g2_tree_append_payload(c, name, shared_file_name_nfc_len(sf));
-		g2_tree_add_child(h, c);
+		g2_frame_writer_open(w, "DN");
 
 		/*
 		 * GTKG extension: if there is a file path, expose it as a "P" child
@@ -1080,9 +1152,18 @@ g2_build_qh2_add(struct g2_qh2_builder *ctx, const shared_file_t *sf)
 		 */
 
 		rp = shared_file_relative_path(sf);
-		if (rp != NULL) {
-			g2_tree_add_child(c, g2_tree_alloc_copy("P", rp, vstrlen(rp)));
+		if (rp != NULL)
+			g2_frame_writer_leaf(w, "P", rp, vstrlen(rp));
+
+		if (fs32 == fs) {
+			/* Fits within a 32-bit quantity */
+			poke_le32(payload, fs32);
+			g2_frame_writer_payload(w, payload, sizeof fs32);
 		}
+
+		g2_frame_writer_payload(w,
+			shared_file_name_nfc(sf), shared_file_name_nfc_len(sf));
+		g2_frame_writer_close(w);
 	}
 
 	/*
@@ -1096,48 +1177,34 @@ g2_build_qh2_add(struct g2_qh2_builder *ctx, const shared_file_t *sf)
 
 	if (ctx->flags & QHIT_F_G2_ALT) {
 		gnet_host_t hvec[G2_BUILD_QH2_MAX_ALT];
-		int hcnt = 0;
+		char payload[6 * G2_BUILD_QH2_MAX_ALT];
+		size_t plen = 0;
+		int i, hcnt;
 
 		hcnt = dmesh_fill_alternate(sha1, hvec, N_ITEMS(hvec));
 
-		if (hcnt > 0) {
-			int i;
-
-			c = g2_tree_alloc_empty("ALT");
-
-			for (i = 0; i < hcnt; i++) {
-				host_addr_t addr;
-				uint16 port;
+		for (i = 0; i < hcnt; i++) {
+			host_addr_t addr;
+			uint16 port;
 
-				addr = gnet_host_get_addr(&hvec[i]);
-				port = gnet_host_get_port(&hvec[i]);
+			addr = gnet_host_get_addr(&hvec[i]);
+			port = gnet_host_get_port(&hvec[i]);
 
-				if (host_addr_is_ipv4(addr)) {
-					char payload[6];
-
-					host_ip_port_poke(payload, addr, port, NULL);
-					g2_tree_append_payload(c, ARYLEN(payload));
-				}
+			if (host_addr_is_ipv4(addr)) {
+				host_ip_port_poke(&payload[plen], addr, port, NULL);
+				plen += 6;
 			}
+		}
 
-			/*
-			 * If the payload is still empty, then drop the "ALT" child.
-			 * Otherwise, attach it to the "H" node.
-			 */
+		/*
+		 * Only emit the "ALT" child when we have IPv4 alt-locs to give.
+		 */
 
-			if (NULL == g2_tree_node_payload(c, NULL)) {
-				g2_tree_free_null(&c);
-			} else {
-				g2_tree_add_child(h, c);
-			}
-		}
+		if (plen != 0)
+			g2_frame_writer_leaf(w, "ALT", payload, plen);
 	}
 
-	/*
-	 * Update the size of the query hit we're generating.
-	 */
-
-	ctx->current_size += g2_frame_serialize(h, NULL, 0);
+	g2_frame_writer_close(w);		/* The "H" child */
 
 	return TRUE;
 }
@@ -1159,16 +1226,18 @@ g2_build_qh2_process(const pslist_t *files, struct g2_qh2_builder *ctx)
 		if (g2_build_qh2_add(ctx, sf))
 			sent++;
 
-		if (ctx->current_size >= ctx->max_size)
+		if (g2_build_qh2_started(ctx) && ctx->w.len >= ctx->max_size)
 			g2_build_qh2_flush(ctx);
 
 		shared_file_unref(&sf);
 	}
 
-	if (ctx->t != NULL)					/* Still some unflushed results */
+	if (g2_build_qh2_started(ctx))		/* Still some unflushed results */
 		g2_build_qh2_flush(ctx);		/* Send last packet */
 
 	hset_free_null(&ctx->hs);
+	g2_frame_writer_discard(&ctx->w);
+	HFREE_NULL(ctx->common);
 
 	return sent;
 }
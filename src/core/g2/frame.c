@@ -30,6 +30,11 @@
  * A G2 packet is represented as a tree, much alike an XML tree, hence the
  * "tree" name of its interface.
  *
+ * For the hot paths, a packet can also be parsed into a flat array of nodes
+ * by g2_frame_parse(), which does not allocate any memory and lets payloads
+ * point into the original buffer.  Names are then compared as 64-bit codes.
+ * A tree can be built afterwards from that flat parse, via g2_frame_tree().
+ *
  * Relevant documentation extracted from the g2.doxu.org website:
  *
  * FRAMING
@@ -541,6 +546,367 @@ g2_frame_deserialize(const void *buf, size_t len, size_t *packet_len, bool copy)
 	return t;
 }
 
+/**
+ * Compute the code of a G2 name.
+ *
+ * @param name		the start of the name (not necessarily NUL-terminated)
+ * @param len		the length of the name
+ *
+ * @return the packed name, as G2_FRAME_CODE() would compute for a literal.
+ */
+uint64
+g2_frame_code(const char *name, size_t len)
+{
+	uint64 code = 0;
+	size_t i;
+
+	g_assert(name != NULL);
+	g_assert(len <= G2_FRAME_NAME_LEN_MAX);
+
+	for (i = 0; i < len; i++)
+		code |= (uint64) (uchar) name[i] << (8 * i);
+
+	return code;
+}
+
+/**
+ * Recursively parse the G2 packet into the flat node array.
+ *
+ * This performs the same validation as g2_frame_recursive_deserialize() but
+ * does not allocate any memory: each packet is recorded in the next free
+ * slot of the node array, and payloads refer to the input buffer.
+ *
+ * @param f			the flat parse being filled
+ * @param dctx		the deserialization context
+ * @param idx		where the index of the parsed node is written
+ *
+ * @return TRUE if OK, FALSE on error or when the node array is too small.
+ */
+static bool
+g2_frame_recursive_parse(g2_frame_t *f, struct frame_dctx *dctx, size_t *idx)
+{
+	uint8 control;
+	size_t length, bytelen, namelen, remain, paylen, i;
+	g2_frame_node_t *node;
+	const void *start;
+	const char *name;
+
+	/*
+	 * Decode the header: control byte, length, name.
+	 */
+
+	if (!g2_frame_read_byte(dctx, &control))
+		return FALSE;
+
+	if (control & G2_FRAME_BE)
+		return FALSE;				/* Only handle little-endian packets */
+
+	if (0 == control)
+		return FALSE;				/* End of stream */
+
+	bytelen = G2_BYTELEN(control);
+	namelen = G2_NAMELEN(control);
+
+	if (0 != bytelen) {
+		if (!g2_frame_read_length(dctx, bytelen, &length))
+			return FALSE;
+	} else {
+		length = 0;
+	}
+
+	name = dctx->p;
+	start = const_ptr_add_offset(name, namelen);	/* After header */
+
+	if G_UNLIKELY(ptr_cmp(dctx->end, start) < 0)
+		return FALSE;
+
+	dctx->p = start;
+
+	/*
+	 * Make sure the whole packet fits into what we were given to parse.
+	 */
+
+	remain = ptr_diff(dctx->end, dctx->p);
+	if (remain < length)
+		return FALSE;
+
+	if G_UNLIKELY(f->count >= f->max) {
+		f->overflow = TRUE;
+		return FALSE;
+	}
+
+	i = f->count++;
+	node = &f->node[i];
+	node->code = g2_frame_code(name, namelen);
+	node->payload = NULL;
+	node->paylen = 0;
+	node->child = node->sibling = 0;
+
+	/*
+	 * If it is a compound packet, parse its children, linking them in order.
+	 */
+
+	if (length != 0 && (control & G2_FRAME_CF)) {
+		struct frame_dctx childctx;
+		size_t last = 0;
+
+		childctx.p = dctx->p;
+		childctx.end = const_ptr_add_offset(dctx->p, length);
+		childctx.copy = FALSE;
+
+		while (ptr_cmp(childctx.p, childctx.end) < 0) {
+			const uint8 *cptr = childctx.p;		/* Control byte location */
+			size_t c;
+
+			if (0 == *cptr) {		/* End of child stream */
+				childctx.p = const_ptr_add_offset(childctx.p, 1);
+				break;
+			}
+
+			if (!g2_frame_recursive_parse(f, &childctx, &c))
+				return FALSE;
+
+			if (0 == last)
+				node->child = c;
+			else
+				f->node[last].sibling = c;
+			last = c;
+		}
+
+		if (0 == last)
+			return FALSE;			/* No children, root cannot be a child */
+
+		dctx->p = childctx.p;
+	}
+
+	/*
+	 * Record the payload, if any.
+	 */
+
+	paylen = length - ptr_diff(dctx->p, start);
+
+	if (!size_is_non_negative(paylen))
+		return FALSE;				/* Length was bad, we got garbage */
+
+	if (0 != paylen) {
+		node->payload = dctx->p;
+		node->paylen = paylen;
+		dctx->p = const_ptr_add_offset(dctx->p, paylen);
+	}
+
+	g_assert(ptr_cmp(dctx->p, dctx->end) <= 0);
+
+	*idx = i;
+	return TRUE;
+}
+
+/**
+ * Parse the first G2 packet held in the supplied buffer into a flat array
+ * of nodes, without allocating any memory nor copying any data.
+ *
+ * The root packet is at index 0, its children and their own children follow
+ * in depth-first order.  The supplied buffer must remain valid as long as the
+ * parsed frame is used, since payloads point into it.
+ *
+ * When the node array is too small to hold all the packets, the parse fails
+ * and the "overflow" field of the frame is set: the caller can then resort
+ * to g2_frame_deserialize() to get the packet.
+ *
+ * @param f				the frame to fill
+ * @param nodes			the node array to use (typically on the stack)
+ * @param max			amount of entries in the node array
+ * @param buf			start of buffer where packet lies
+ * @param len			amount of data held in the buffer
+ * @param packet_len	if non-NULL, set with the amount of data consumed
+ *
+ * @return TRUE if data was valid, FALSE if packet was malformed, incompletely
+ * held in the buffer or had too many nodes.
+ */
+bool
+g2_frame_parse(g2_frame_t *f, g2_frame_node_t *nodes, size_t max,
+	const void *buf, size_t len, size_t *packet_len)
+{
+	struct frame_dctx dctx;
+	size_t root;
+	bool ok;
+
+	g_assert(f != NULL);
+	g_assert(nodes != NULL);
+	g_assert(size_is_positive(max));
+	g_assert(max <= MAX_INT_VAL(uint16));
+	g_assert(buf != NULL);
+	g_assert(size_is_positive(len));
+
+	f->base = buf;
+	f->node = nodes;
+	f->count = 0;
+	f->max = max;
+	f->overflow = FALSE;
+
+	dctx.p = buf;
+	dctx.end = const_ptr_add_offset(buf, len);
+	dctx.copy = FALSE;
+
+	ok = g2_frame_recursive_parse(f, &dctx, &root);
+
+	g_assert(!ok || 0 == root);
+
+	if (packet_len != NULL)
+		*packet_len = ptr_diff(dctx.p, buf);
+
+	return ok;
+}
+
+/**
+ * Get the name of a node from a flat parse.
+ *
+ * @param f		the parsed frame
+ * @param i		the node index
+ * @param buf	buffer where the NUL-terminated name is written
+ * @param len	buffer length, at least G2_FRAME_NAME_LEN_MAX + 1 bytes
+ *
+ * @return the name, i.e. `buf'.
+ */
+const char *
+g2_frame_node_name(const g2_frame_t *f, size_t i, char *buf, size_t len)
+{
+	uint64 code;
+	size_t n = 0;
+
+	g_assert(f != NULL);
+	g_assert(i < f->count);
+	g_assert(len > G2_FRAME_NAME_LEN_MAX);
+
+	for (code = f->node[i].code; code != 0; code >>= 8)
+		buf[n++] = code & 0xff;
+
+	buf[n] = '\0';
+	return buf;
+}
+
+/**
+ * Look for an immediate child of a node in a flat parse.
+ *
+ * @param f		the parsed frame
+ * @param i		the node index
+ * @param code	the code of the child name, as given by G2_FRAME_CODE()
+ *
+ * @return the index of the first child bearing that name, 0 if none.
+ */
+size_t
+g2_frame_child(const g2_frame_t *f, size_t i, uint64 code)
+{
+	size_t c;
+
+	g_assert(f != NULL);
+	g_assert(i < f->count);
+
+	G2_FRAME_CHILD_FOREACH(f, i, c) {
+		if (code == f->node[c].code)
+			return c;
+	}
+
+	return 0;
+}
+
+/**
+ * Fetch the payload of a node in a flat parse.
+ *
+ * @param f			the parsed frame
+ * @param i			the node index
+ * @param paylen	if non-NULL, where the size of the payload is returned
+ *
+ * @return the start of the payload held in the node, NULL if none.
+ */
+const void *
+g2_frame_payload(const g2_frame_t *f, size_t i, size_t *paylen)
+{
+	const g2_frame_node_t *node;
+
+	g_assert(f != NULL);
+	g_assert(i < f->count);
+
+	node = &f->node[i];
+
+	if (paylen != NULL)
+		*paylen = node->paylen;
+
+	return node->payload;
+}
+
+/**
+ * Fetch the payload of an immediate child of a node in a flat parse.
+ *
+ * @param f			the parsed frame
+ * @param i			the node index
+ * @param code		the code of the child name, as given by G2_FRAME_CODE()
+ * @param paylen	if non-NULL, where the size of the payload is returned
+ *
+ * @return the start of the payload held in the child, NULL if none or if
+ * there is no such child.
+ */
+const void *
+g2_frame_child_payload(const g2_frame_t *f, size_t i,
+	uint64 code, size_t *paylen)
+{
+	size_t c = g2_frame_child(f, i, code);
+
+	if (0 == c) {
+		if (paylen != NULL)
+			*paylen = 0;
+		return NULL;
+	}
+
+	return g2_frame_payload(f, c, paylen);
+}
+
+/**
+ * Recursively build the G2 tree rooted at given node of a flat parse.
+ */
+static g2_tree_t *
+g2_frame_tree_build(const g2_frame_t *f, size_t i)
+{
+	char name[G2_FRAME_NAME_LEN_MAX + 1];
+	const g2_frame_node_t *node = &f->node[i];
+	g2_tree_t *t;
+	size_t c;
+
+	t = g2_tree_alloc(g2_frame_node_name(f, i, ARYLEN(name)),
+			node->payload, node->paylen);
+
+	G2_FRAME_CHILD_FOREACH(f, i, c) {
+		g2_tree_add_child(t, g2_frame_tree_build(f, c));
+	}
+
+	/*
+	 * Restore the order of children since g2_tree_add_child() prepends.
+	 */
+
+	if (node->child != 0)
+		g2_tree_reverse_children(t);
+
+	return t;
+}
+
+/**
+ * Build a G2 tree out of a flat parse, for code that needs a tree.
+ *
+ * As with g2_frame_deserialize() when not copying, the payloads of the tree
+ * refer to the parsed buffer.
+ *
+ * @param f		the parsed frame
+ *
+ * @return a newly created G2 tree.
+ */
+g2_tree_t *
+g2_frame_tree(const g2_frame_t *f)
+{
+	g_assert(f != NULL);
+	g_assert(size_is_positive(f->count));
+
+	return g2_frame_tree_build(f, 0);
+}
+
 /**
  * Serialization context.
  */
@@ -782,4 +1148,296 @@ g2_frame_serialize(const g2_tree_t *root, void *dest, size_t len)
 	return sctx.len;
 }
 
+/**
+ * Initialize a streaming writer.
+ *
+ * Packets are written as they are opened, fed with children and payload,
+ * and closed, at which time their length is back-patched in the header.
+ * The serialized data are identical to what g2_frame_serialize() would
+ * produce for the equivalent tree, but no tree needs to be built and the
+ * data are only walked once.
+ *
+ * The buffer is grown as needed and can be reused for other packets through
+ * g2_frame_writer_reset().  It must be freed via g2_frame_writer_discard().
+ *
+ * @param w			the writer to initialize
+ * @param size		initial size of the serialization buffer
+ */
+void
+g2_frame_writer_init(g2_frame_writer_t *w, size_t size)
+{
+	g_assert(w != NULL);
+	g_assert(size_is_positive(size));
+
+	ZERO(w);
+	w->buf = halloc(size);
+	w->size = size;
+}
+
+/**
+ * Reset writer so that a new packet can be serialized, reusing the buffer.
+ */
+void
+g2_frame_writer_reset(g2_frame_writer_t *w)
+{
+	g_assert(w != NULL);
+
+	w->len = 0;
+	w->depth = 0;
+}
+
+/**
+ * Release the writer buffer.
+ */
+void
+g2_frame_writer_discard(g2_frame_writer_t *w)
+{
+	g_assert(w != NULL);
+
+	HFREE_NULL(w->buf);
+	w->size = w->len = w->depth = 0;
+}
+
+/**
+ * Make sure there is room for ``len'' more bytes in the writer.
+ *
+ * @return pointer to the first byte we can write to.
+ */
+static char *
+g2_frame_writer_room(g2_frame_writer_t *w, size_t len)
+{
+	size_t needed = size_saturate_add(w->len, len);
+
+	if G_UNLIKELY(needed > w->size) {
+		w->size = MAX(needed, size_saturate_mult(w->size, 2));
+		w->buf = hrealloc(w->buf, w->size);
+	}
+
+	return &w->buf[w->len];
+}
+
+/**
+ * Flag the currently opened packet as having children.
+ */
+static void
+g2_frame_writer_parent(g2_frame_writer_t *w)
+{
+	struct g2_frame_wpacket *wp;
+
+	if (0 == w->depth)
+		return;
+
+	wp = &w->stack[w->depth - 1];
+
+	g_assert_log(!wp->payload,
+		"%s(): children must be written before the payload", G_STRFUNC);
+
+	if (!wp->children) {
+		wp->children = TRUE;
+		w->buf[wp->offset] |= G2_FRAME_CF;
+	}
+}
+
+/**
+ * Open new packet, as a child of the currently opened packet if any.
+ *
+ * @param w			the writer
+ * @param name		the packet name
+ */
+void
+g2_frame_writer_open(g2_frame_writer_t *w, const char *name)
+{
+	struct g2_frame_wpacket *wp;
+	size_t namelen;
+	char *p;
+
+	g_assert(w != NULL);
+	g_assert(name != NULL);
+	g_assert_log(w->depth < N_ITEMS(w->stack),
+		"%s(): too many nested packets", G_STRFUNC);
+
+	namelen = vstrlen(name);
+
+	g_assert(namelen != 0);
+	g_assert_log(namelen <= G2_FRAME_NAME_LEN_MAX,
+		"%s(): node name too long (%zu bytes): \"%.*s\"%s",
+		G_STRFUNC, namelen, (int) MIN(namelen, 20), name,
+		namelen > 20 ? " (truncated)" : "");
+
+	g2_frame_writer_parent(w);
+
+	wp = &w->stack[w->depth++];
+	wp->offset = w->len;
+	wp->namelen = namelen;
+	wp->children = wp->payload = FALSE;
+
+	/*
+	 * Assume 1 byte will be enough to store the packet length, as in
+	 * g2_frame_recursive_serialize(): the header is fixed when closing.
+	 */
+
+	p = g2_frame_writer_room(w, 2 + namelen);
+	*p++ = ((namelen - 1) << 3) | (1 << 6);
+	*p++ = 0;				/* The length, fixed up later */
+	memcpy(p, name, namelen);
+	w->len += 2 + namelen;
+}
+
+/**
+ * Append already serialized children to the currently opened packet.
+ *
+ * This allows a constant set of children to be serialized once and then
+ * reused in several packets.
+ *
+ * @param w			the writer
+ * @param data		the serialized child packets
+ * @param len		length of data
+ */
+void
+g2_frame_writer_children(g2_frame_writer_t *w, const void *data, size_t len)
+{
+	g_assert(w != NULL);
+	g_assert(w->depth != 0);
+	g_assert(data != NULL || 0 == len);
+
+	if (0 == len)
+		return;
+
+	g2_frame_writer_parent(w);
+	memcpy(g2_frame_writer_room(w, len), data, len);
+	w->len += len;
+}
+
+/**
+ * Append payload data to the currently opened packet.
+ *
+ * Payload can be written in several chunks, but no child can be added to
+ * the packet once payload has been written.
+ *
+ * @param w			the writer
+ * @param data		the payload data
+ * @param len		length of data
+ */
+void
+g2_frame_writer_payload(g2_frame_writer_t *w, const void *data, size_t len)
+{
+	struct g2_frame_wpacket *wp;
+	char *p;
+
+	g_assert(w != NULL);
+	g_assert(w->depth != 0);
+	g_assert(data != NULL || 0 == len);
+
+	if (0 == len)
+		return;
+
+	wp = &w->stack[w->depth - 1];
+
+	if (wp->children && !wp->payload) {
+		p = g2_frame_writer_room(w, 1 + len);
+		*p++ = 0;						/* End of child stream */
+		w->len++;
+	} else {
+		p = g2_frame_writer_room(w, len);
+	}
+
+	memcpy(p, data, len);
+	w->len += len;
+	wp->payload = TRUE;
+}
+
+/**
+ * Close the currently opened packet, back-patching its length.
+ */
+void
+g2_frame_writer_close(g2_frame_writer_t *w)
+{
+	struct g2_frame_wpacket *wp;
+	size_t length;
+	uint8 *start;
+
+	g_assert(w != NULL);
+	g_assert(w->depth != 0);
+
+	wp = &w->stack[--w->depth];
+	start = (uint8 *) &w->buf[wp->offset];
+	length = w->len - wp->offset - 2 - wp->namelen;
+
+	if (0 == length) {
+		uint8 control = (wp->namelen - 1) << 3;
+
+		/*
+		 * Packet has no payload and no children: we don't emit any length
+		 * but must set the CF flag if the control byte would end-up being
+		 * zero.
+		 */
+
+		if (0 == control)
+			control |= G2_FRAME_CF;
+
+		start[0] = control;
+		memmove(&start[1], &start[2], wp->namelen);
+		w->len--;
+	} else if G_LIKELY(length < 256) {
+		start[1] = length;
+	} else {
+		uint8 bytlen = (length < 65536) ? 2 : 3;
+		char lbuf[4];
+
+		g_assert(length < 256 * 256 * 256);	/* 3 bytes max for length */
+
+		poke_le32(lbuf, length);
+
+		/*
+		 * We reserved one byte for the length, make room for the extra ones.
+		 * The buffer may be moved, hence the start pointer is recomputed.
+		 */
+
+		g2_frame_writer_room(w, bytlen - 1);
+		start = (uint8 *) &w->buf[wp->offset];
+
+		memmove(&start[1 + bytlen], &start[2], w->len - wp->offset - 2);
+		memcpy(&start[1], lbuf, bytlen);
+		start[0] = (start[0] & 0x3f) | (bytlen << 6);
+		w->len += bytlen - 1;
+	}
+}
+
+/**
+ * Write a packet without children.
+ *
+ * @param w			the writer
+ * @param name		the packet name
+ * @param payload	the payload data (may be NULL if paylen is 0)
+ * @param paylen	length of payload
+ */
+void
+g2_frame_writer_leaf(g2_frame_writer_t *w, const char *name,
+	const void *payload, size_t paylen)
+{
+	g2_frame_writer_open(w, name);
+	g2_frame_writer_payload(w, payload, paylen);
+	g2_frame_writer_close(w);
+}
+
+/**
+ * Get the serialized data, once all the opened packets were closed.
+ *
+ * @param w			the writer
+ * @param len		where length of serialized data is written
+ *
+ * @return the start of the serialized data.
+ */
+const void *
+g2_frame_writer_data(const g2_frame_writer_t *w, size_t *len)
+{
+	g_assert(w != NULL);
+	g_assert(len != NULL);
+	g_assert_log(0 == w->depth,
+		"%s(): %zu opened packets left", G_STRFUNC, w->depth);
+
+	*len = w->len;
+	return w->buf;
+}
+
 /* vi: set ts=4 sw=4 cindent: */
@@ -38,6 +38,75 @@
 #define G2_FRAME_CF				(1U << 2)	/**< The CF flag */
 #define G2_FRAME_BE				(1U << 1)	/**< The BE flag */
 
+/**
+ * Name codes.
+ *
+ * A G2 name is at most 8 bytes long and cannot contain any NUL byte, so it
+ * can be packed into a 64-bit integer, the first byte being the least
+ * significant one.  Comparing names then becomes a single integer comparison.
+ *
+ * G2_FRAME_CODE() computes the code of a string literal at compile time.
+ */
+#define G2_FRAME_CODE_BYTE(s,i) \
+	(sizeof(s) > (i) + 1 ? \
+		(uint64) (uchar) (s)[(i) < sizeof(s) ? (i) : 0] << (8 * (i)) : 0)
+
+#define G2_FRAME_CODE(s)	( \
+	G2_FRAME_CODE_BYTE(s, 0) | G2_FRAME_CODE_BYTE(s, 1) | \
+	G2_FRAME_CODE_BYTE(s, 2) | G2_FRAME_CODE_BYTE(s, 3) | \
+	G2_FRAME_CODE_BYTE(s, 4) | G2_FRAME_CODE_BYTE(s, 5) | \
+	G2_FRAME_CODE_BYTE(s, 6) | G2_FRAME_CODE_BYTE(s, 7))
+
+/**
+ * A node in a flat G2 packet parse.
+ *
+ * Nodes are stored in depth-first order, the root being at index 0, hence
+ * index 0 can be used to indicate a missing child or sibling.  Payloads
+ * point directly into the parsed buffer.
+ */
+typedef struct g2_frame_node {
+	uint64 code;			/**< Packed name, see G2_FRAME_CODE() */
+	const void *payload;	/**< Payload, NULL if none */
+	uint32 paylen;			/**< Payload length */
+	uint16 child;			/**< Index of first child, 0 if none */
+	uint16 sibling;			/**< Index of next sibling, 0 if none */
+} g2_frame_node_t;
+
+/**
+ * A flat G2 packet parse, made over a caller-supplied node array.
+ */
+typedef struct g2_frame {
+	const void *base;		/**< Start of parsed buffer */
+	g2_frame_node_t *node;	/**< Parsed nodes */
+	size_t count;			/**< Amount of parsed nodes */
+	size_t max;				/**< Capacity of the node array */
+	bool overflow;			/**< Whether parse failed due to lack of room */
+} g2_frame_t;
+
+#define G2_FRAME_NODES	128		/**< Suggested node array size for parsing */
+
+#define G2_FRAME_CHILD_FOREACH(f, i, c) \
+	for (c = (f)->node[i].child; c != 0; c = (f)->node[c].sibling)
+
+#define G2_FRAME_WRITER_DEPTH	8	/**< Max nesting of opened packets */
+
+/**
+ * A streaming G2 writer, serializing packets as they are opened and closed
+ * into a growing buffer, without building an intermediate tree.
+ */
+typedef struct g2_frame_writer {
+	char *buf;				/**< Serialization buffer (halloc()'ed) */
+	size_t size;			/**< Size of buffer */
+	size_t len;				/**< Amount of bytes written so far */
+	size_t depth;			/**< Amount of currently opened packets */
+	struct g2_frame_wpacket {
+		size_t offset;		/**< Offset of the packet's control byte */
+		uint8 namelen;		/**< Length of the packet name */
+		uint8 children;		/**< Whether packet has children */
+		uint8 payload;		/**< Whether packet has a payload */
+	} stack[G2_FRAME_WRITER_DEPTH];
+} g2_frame_writer_t;
+
 /*
  * Public interface.
  */
@@ -50,6 +119,30 @@ struct g2_tree *g2_frame_deserialize(const void *buf,
 size_t g2_frame_whole_length(const void *buf, size_t len);
 const char *g2_frame_name(const void *buf, size_t len, size_t *namelen);
 
+bool g2_frame_parse(g2_frame_t *f, g2_frame_node_t *nodes, size_t max,
+	const void *buf, size_t len, size_t *packet_len);
+uint64 g2_frame_code(const char *name, size_t len);
+const char *g2_frame_node_name(const g2_frame_t *f, size_t i,
+	char *buf, size_t len);
+size_t g2_frame_child(const g2_frame_t *f, size_t i, uint64 code);
+const void *g2_frame_payload(const g2_frame_t *f, size_t i, size_t *paylen);
+const void *g2_frame_child_payload(const g2_frame_t *f, size_t i,
+	uint64 code, size_t *paylen);
+struct g2_tree *g2_frame_tree(const g2_frame_t *f);
+
+void g2_frame_writer_init(g2_frame_writer_t *w, size_t size);
+void g2_frame_writer_reset(g2_frame_writer_t *w);
+void g2_frame_writer_discard(g2_frame_writer_t *w);
+void g2_frame_writer_open(g2_frame_writer_t *w, const char *name);
+void g2_frame_writer_children(g2_frame_writer_t *w,
+	const void *data, size_t len);
+void g2_frame_writer_payload(g2_frame_writer_t *w,
+	const void *data, size_t len);
+void g2_frame_writer_close(g2_frame_writer_t *w);
+void g2_frame_writer_leaf(g2_frame_writer_t *w, const char *name,
+	const void *payload, size_t paylen);
+const void *g2_frame_writer_data(const g2_frame_writer_t *w, size_t *len);
+
 #endif /* _core_g2_frame_h_ */
 
 /* vi: set ts=4 sw=4 cindent: */
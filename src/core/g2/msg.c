@@ -351,28 +351,29 @@ const char *
 g2_msg_search_get_text(const pmsg_t *mb)
 {
 	str_t *s = str_private(G_STRFUNC, 64);
-	const g2_tree_t *t;
+	g2_frame_node_t nodes[G2_FRAME_NODES];
+	g2_frame_t f;
+	const char *payload;
+	size_t paylen;
 
-	t = g2_frame_deserialize(
-			pmsg_phys_base(mb), pmsg_written_size(mb), NULL, FALSE);
+	/*
+	 * A flat parse is enough to reach /Q2/DN, no need to build a tree.
+	 * Queries with more nodes than we can parse here are not worth logging.
+	 */
 
-	if (NULL == t) {
+	if (!g2_frame_parse(&f, ARYLEN(nodes),
+			pmsg_phys_base(mb), pmsg_written_size(mb), NULL))
 		return NULL;
-	} else {
-		const char *payload;
-		size_t paylen;
 
-		payload = g2_tree_payload(t, "/Q2/DN", &paylen);
+	if (f.node[0].code != G2_FRAME_CODE("Q2"))
+		return NULL;
 
-		if (NULL == payload) {
-			g2_tree_free_null_const(&t);
-			return NULL;
-		}
+	payload = g2_frame_child_payload(&f, 0, G2_FRAME_CODE("DN"), &paylen);
 
-		str_cpy_len(s, payload, paylen);
-	}
+	if (NULL == payload)
+		return NULL;
 
-	g2_tree_free_null_const(&t);
+	str_cpy_len(s, payload, paylen);
 	return str_2c(s);
 }
 
@@ -109,6 +109,11 @@ static const tokenizer_t g2_q2_children[] = {
 	{ "URN",	G2_Q2_URN },
 };
 
+/**
+ * Name codes of the /Q2 children, computed at init time from g2_q2_children.
+ */
+static uint64 g2_q2_children_code[N_ITEMS(g2_q2_children)];
+
 static const tokenizer_t g2_lni_children[] = {
 	/* Sorted array */
 	{ "GU",		G2_LNI_GU },
@@ -273,7 +278,7 @@ g2_node_send_lni(gnutella_node_t *n)
  *
  * @param routine		routine where we're coming from (the one dropping)
  * @param n				source node of message
- * @param t				the message tree
+ * @param t				the message tree (NULL if not built)
  * @param reason		optional reason
  */
 static void G_PRINTF(4, 5)
@@ -292,8 +297,9 @@ g2_node_drop(const char *routine, gnutella_node_t *n, const g2_tree_t *t,
 			buf[0] = '\0';
 
 		g_debug("%s(): dropping /%s from %s%s%s",
-			routine, g2_tree_name(t), node_infostr(n),
-			NULL == fmt ? "" : ": ", buf);
+			routine,
+			NULL == t ? g2_msg_raw_name(n->data, n->size) : g2_tree_name(t),
+			node_infostr(n), NULL == fmt ? "" : ": ", buf);
 
 		va_end(args);
 	}
@@ -301,7 +307,16 @@ g2_node_drop(const char *routine, gnutella_node_t *n, const g2_tree_t *t,
 	gnet_stats_count_dropped(n, MSG_DROP_G2_UNEXPECTED);
 
 	if (GNET_PROPERTY(log_dropped_g2)) {
-		g2_tfmt_tree_dump(t, stderr, G2FMT_O_PAYLEN);
+		if (NULL == t) {
+			g2_tree_t *tree;
+
+			tree = g2_frame_deserialize(n->data, n->size, NULL, FALSE);
+			if (tree != NULL)
+				g2_tfmt_tree_dump(tree, stderr, G2FMT_O_PAYLEN);
+			g2_tree_free_null(&tree);
+		} else {
+			g2_tfmt_tree_dump(t, stderr, G2FMT_O_PAYLEN);
+		}
 	}
 }
 
@@ -596,22 +611,18 @@ g2_node_handle_khl(const g2_tree_t *t)
 }
 
 /**
- * Extract min/max sizes from the payload of a /Q2/SZR tree node.
+ * Extract min/max sizes from the payload of a /Q2/SZR packet.
  *
  * @return TRUE if we successfully extracted the information.
  */
-static bool NON_NULL_PARAM((2, 3))
-g2_node_extract_size_request(const g2_tree_t *t, uint64 *min, uint64 *max)
+static bool NON_NULL_PARAM((3, 4))
+g2_node_extract_size_request(const char *p, size_t paylen,
+	uint64 *min, uint64 *max)
 {
-	const char *p;
-	size_t paylen;
-
 	/*
 	 * The payload can be 2 32-bit or 2 64-bit values.
 	 */
 
-	p = g2_tree_node_payload(t, &paylen);
-
 	if (8 == paylen) {
 		*min = (uint64) peek_le32(p);
 		*max = (uint64) peek_le32(&p[4]);
@@ -626,18 +637,17 @@ g2_node_extract_size_request(const g2_tree_t *t, uint64 *min, uint64 *max)
 }
 
 /**
- * Extract interest flags from the payload of a /Q2/I tree node.
+ * Extract interest flags from the payload of a /Q2/I packet.
  *
  * @return the consolidated flags G2_Q2_F_* requested by the payload.
  */
 static uint32
-g2_node_extract_interest(const g2_tree_t *t)
+g2_node_extract_interest(const char *payload, size_t paylen)
 {
 	const char *p, *q, *end;
-	size_t paylen;
 	uint32 flags = 0;
 
-	p = q = g2_tree_node_payload(t, &paylen);
+	p = q = payload;
 
 	if (NULL == p)
 		return 0;
@@ -665,10 +675,8 @@ g2_node_extract_interest(const g2_tree_t *t)
  * if it is a SHA1 (or bitprint, which contains a SHA1).
  */
 static void
-g2_node_extract_urn(const g2_tree_t *t, search_request_info_t *sri)
+g2_node_extract_urn(const char *p, size_t paylen, search_request_info_t *sri)
 {
-	const char *p;
-	size_t paylen;
 	uint i;
 
 	/*
@@ -678,8 +686,6 @@ g2_node_extract_urn(const g2_tree_t *t, search_request_info_t *sri)
 	if (sri->exv_sha1cnt == N_ITEMS(sri->exv_sha1))
 		return;
 
-	p = g2_tree_node_payload(t, &paylen);
-
 	if (NULL == p)
 		return;
 
@@ -723,14 +729,9 @@ g2_node_extract_urn(const g2_tree_t *t, search_request_info_t *sri)
  * if we have a valid address.
  */
 static void
-g2_node_extract_udp(const g2_tree_t *t, search_request_info_t *sri,
+g2_node_extract_udp(const char *p, size_t paylen, search_request_info_t *sri,
 	const gnutella_node_t *n)
 {
-	const char *p;
-	size_t paylen;
-
-	p = g2_tree_node_payload(t, &paylen);
-
 	/*
 	 * Only handle if we have an IP:port entry.
 	 * We only handle IPv4 because G2 does not support IPv6.
@@ -806,15 +807,36 @@ g2_node_intuit_media_type(const char *md)
 	return 0;
 }
 
+/**
+ * Map the name code of a /Q2 child to its type.
+ *
+ * @return the child type, 0 if unknown.
+ */
+static enum g2_q2_child
+g2_node_q2_child(uint64 code)
+{
+	uint i;
+
+	for (i = 0; i < N_ITEMS(g2_q2_children_code); i++) {
+		if (code == g2_q2_children_code[i])
+			return g2_q2_children[i].value;
+	}
+
+	return 0;
+}
+
 /**
  * Handle reception of a /Q2
+ *
+ * Queries are the bulk of the G2 traffic, hence they are processed directly
+ * from the flat parse of the packet, without building any tree.
  */
 static void
-g2_node_handle_q2(gnutella_node_t *n, const g2_tree_t *t)
+g2_node_handle_q2(gnutella_node_t *n, const g2_frame_t *f)
 {
 	const guid_t *muid;
 	size_t paylen;
-	const g2_tree_t *c;
+	size_t c;
 	char *dn = NULL;
 	char *md = NULL;
 	uint32 iflags = 0;
@@ -829,7 +851,7 @@ g2_node_handle_q2(gnutella_node_t *n, const g2_tree_t *t)
 	 */
 
 	if (NODE_IS_UDP(n)) {
-		g2_node_drop(G_STRFUNC, n, t, "coming from UDP");
+		g2_node_drop(G_STRFUNC, n, NULL, "coming from UDP");
 		return;
 	}
 
@@ -837,10 +859,10 @@ g2_node_handle_q2(gnutella_node_t *n, const g2_tree_t *t)
 	 * The MUID of the query is the payload of the root node.
 	 */
 
-	muid = g2_tree_node_payload(t, &paylen);
+	muid = g2_frame_payload(f, 0, &paylen);
 
 	if (paylen != GUID_RAW_SIZE) {
-		g2_node_drop(G_STRFUNC, n, t, "missing MUID");
+		g2_node_drop(G_STRFUNC, n, NULL, "missing MUID");
 		return;
 	}
 
@@ -883,13 +905,12 @@ g2_node_handle_q2(gnutella_node_t *n, const g2_tree_t *t)
 	 * Handle the children of /Q2.
 	 */
 
-	G2_TREE_CHILD_FOREACH(t, c) {
-		enum g2_q2_child ct = TOKENIZE(g2_tree_name(c), g2_q2_children);
-		const char *payload;
+	G2_FRAME_CHILD_FOREACH(f, 0, c) {
+		enum g2_q2_child ct = g2_node_q2_child(f->node[c].code);
+		const char *payload = g2_frame_payload(f, c, &paylen);
 
 		switch (ct) {
 		case G2_Q2_DN:
-			payload = g2_tree_node_payload(c, &paylen);
 			if (payload != NULL && NULL == dn) {
 				uint off = 0;
 				/* Not NUL-terminated, need to h_strndup() it */
@@ -905,12 +926,11 @@ g2_node_handle_q2(gnutella_node_t *n, const g2_tree_t *t)
 
 		case G2_Q2_I:
 			if (!has_interest)
-				iflags = g2_node_extract_interest(c);
+				iflags = g2_node_extract_interest(payload, paylen);
 			has_interest = TRUE;
 			break;
 
 		case G2_Q2_MD:
-			payload = g2_tree_node_payload(c, &paylen);
 			if (payload != NULL && NULL == md) {
 				/* Not NUL-terminated, need to h_strndup() it */
 				md = h_strndup(payload, paylen);
@@ -922,17 +942,18 @@ g2_node_handle_q2(gnutella_node_t *n, const g2_tree_t *t)
 			break;
 
 		case G2_Q2_SZR:			/* Size limits */
-			if (g2_node_extract_size_request(c, &sri.minsize, &sri.maxsize))
+			if (g2_node_extract_size_request(payload, paylen,
+					&sri.minsize, &sri.maxsize))
 				sri.size_restrictions = TRUE;
 			break;
 
 		case G2_Q2_UDP:
 			if (!sri.oob)
-				g2_node_extract_udp(c, &sri, n);
+				g2_node_extract_udp(payload, paylen, &sri, n);
 			break;
 
 		case G2_Q2_URN:
-			g2_node_extract_urn(c, &sri);
+			g2_node_extract_urn(payload, paylen, &sri);
 			break;
 		}
 	}
@@ -1012,29 +1033,63 @@ done:
 	HFREE_NULL(md);
 }
 
+/**
+ * Count the nodes of a G2 tree.
+ */
+static size_t
+g2_node_tree_count(const g2_tree_t *t)
+{
+	const g2_tree_t *c;
+	size_t count = 1;
+
+	for (c = g2_tree_first_child(t); c != NULL; c = g2_tree_next_sibling(c))
+		count += g2_node_tree_count(c);
+
+	return count;
+}
+
 /**
  * Handle message coming from G2 node.
+ *
+ * The packet is first parsed into a flat array of nodes held on the stack,
+ * which does not allocate nor copy anything.  The G2 tree is only built for
+ * the messages whose handlers need one, or when the packet has too many
+ * nodes for the stack array.
  */
 void
 g2_node_handle(gnutella_node_t *n)
 {
-	g2_tree_t *t;
+	g2_frame_node_t nodes[G2_FRAME_NODES], *bignodes = NULL;
+	g2_frame_t f;
+	g2_tree_t *t = NULL;
 	size_t plen;
 	enum g2_msg type;
 
 	node_check(n);
 	g_assert(NODE_TALKS_G2(n));
 
-	t = g2_frame_deserialize(n->data, n->size, &plen, FALSE);
-	if (NULL == t) {
-		if (GNET_PROPERTY(g2_debug) > 0 || GNET_PROPERTY(log_bad_g2)) {
-			g_warning("%s(): cannot deserialize /%s from %s",
-				G_STRFUNC, g2_msg_raw_name(n->data, n->size), node_infostr(n));
+	if (!g2_frame_parse(&f, ARYLEN(nodes), n->data, n->size, &plen)) {
+		/*
+		 * If the packet has too many nodes for our array, fall back to
+		 * the regular deserialization.
+		 */
+
+		if (f.overflow)
+			t = g2_frame_deserialize(n->data, n->size, &plen, FALSE);
+
+		if (NULL == t) {
+			if (GNET_PROPERTY(g2_debug) > 0 || GNET_PROPERTY(log_bad_g2)) {
+				g_warning("%s(): cannot deserialize /%s from %s",
+					G_STRFUNC, g2_msg_raw_name(n->data, n->size),
+					node_infostr(n));
+			}
+			if (GNET_PROPERTY(log_bad_g2))
+				dump_hex(stderr, "G2 Packet", n->data, n->size);
+			return;
 		}
-		if (GNET_PROPERTY(log_bad_g2))
-			dump_hex(stderr, "G2 Packet", n->data, n->size);
-		return;
-	} else if (plen != n->size) {
+	}
+
+	if (plen != n->size) {
 		if (GNET_PROPERTY(g2_debug) > 0 || GNET_PROPERTY(log_bad_g2)) {
 			g_warning("%s(): consumed %zu bytes but /%s from %s had %u",
 				G_STRFUNC, plen, g2_msg_raw_name(n->data, n->size),
@@ -1045,12 +1100,46 @@ g2_node_handle(gnutella_node_t *n)
 		hostiles_dynamic_add(n->addr,
 			"cannot parse incoming messages", HSTL_GIBBERISH);
 		goto done;
-	} else if (GNET_PROPERTY(g2_debug) > 19) {
+	}
+
+	if (GNET_PROPERTY(g2_debug) > 19) {
+		if (NULL == t)
+			t = g2_frame_tree(&f);
 		g_debug("%s(): received packet from %s", G_STRFUNC, node_infostr(n));
 		g2_tfmt_tree_dump(t, stderr, G2FMT_O_PAYLEN);
 	}
 
-	type = g2_msg_name_type(g2_tree_name(t));
+	type = g2_msg_type(n->data, n->size);
+
+	/*
+	 * Queries are handled from the flat parse, everything else needs a tree.
+	 *
+	 * A query with more nodes than our stack array can hold is parsed again
+	 * into an array sized from its deserialized tree.
+	 */
+
+	if (G2_MSG_Q2 == type) {
+		if (f.overflow) {
+			size_t count = g2_node_tree_count(t);
+
+			if (count > MAX_INT_VAL(uint16)) {
+				g2_node_drop(G_STRFUNC, n, t, "too many nodes (%zu)", count);
+				goto done;
+			}
+
+			HALLOC_ARRAY(bignodes, count);
+
+			if (!g2_frame_parse(&f, bignodes, count, n->data, n->size, NULL)) {
+				g2_node_drop(G_STRFUNC, n, t, "cannot parse %zu nodes", count);
+				goto done;
+			}
+		}
+		g2_node_handle_q2(n, &f);
+		goto done;
+	}
+
+	if (NULL == t)
+		t = g2_frame_tree(&f);
 
 	switch (type) {
 	case G2_MSG_PI:
@@ -1068,9 +1157,6 @@ g2_node_handle(gnutella_node_t *n)
 	case G2_MSG_PUSH:
 		handle_push_request(n, t);
 		break;
-	case G2_MSG_Q2:
-		g2_node_handle_q2(n, t);
-		break;
 	case G2_MSG_QA:
 	case G2_MSG_QKA:
 		g2_node_handle_rpc_answer(n, t, type);
@@ -1085,6 +1171,7 @@ g2_node_handle(gnutella_node_t *n)
 
 done:
 	g2_tree_free_null(&t);
+	HFREE_NULL(bignodes);
 }
 
 /**
@@ -1093,6 +1180,8 @@ done:
 void G_COLD
 g2_node_init(void)
 {
+	uint i;
+
 	/*
 	 * Limit asnwering to UDP pings to 1 every G2_UDP_PING_FREQ seconds
 	 */
@@ -1104,6 +1193,15 @@ g2_node_init(void)
 	TOKENIZE_CHECK_SORTED(g2_lni_children);
 	TOKENIZE_CHECK_SORTED(g2_q2_i);
 	TOKENIZE_CHECK_SORTED(g2_q2_md);
+
+	/*
+	 * Precompute the name codes of the /Q2 children, for g2_node_q2_child().
+	 */
+
+	for (i = 0; i < N_ITEMS(g2_q2_children); i++) {
+		const char *name = g2_q2_children[i].token;
+		g2_q2_children_code[i] = g2_frame_code(name, vstrlen(name));
+	}
 }
 
 /**
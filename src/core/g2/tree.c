@@ -751,6 +751,58 @@ g2_tree_test(void)
 	g_assert(node != c2);
 	g_assert(0 == strcmp("c2", g2_tree_name(node)));
 
+	/*
+	 * Flat parsing testing.
+	 */
+
+	{
+		g2_frame_node_t nodes[G2_FRAME_NODES];
+		g2_frame_t f;
+		g2_tree_t *flat;
+		const void *payload;
+		size_t c, paylen;
+		void *rebuilt;
+
+		ok = g2_frame_parse(&f, ARYLEN(nodes), buffer, length, &rlen);
+		g_assert(ok);
+		g_assert(length == rlen);
+		g_assert(8 == f.count);
+		g_assert(G2_FRAME_CODE("root") == f.node[0].code);
+		g_assert(g2_frame_code("root", 4) == f.node[0].code);
+
+		payload = g2_frame_payload(&f, 0, &paylen);
+		g_assert(vstrlen(root_payload) == paylen);
+		g_assert(0 == memcmp(payload, root_payload, paylen));
+
+		c = g2_frame_child(&f, 0, G2_FRAME_CODE("rchild"));
+		g_assert(c != 0);
+		c = g2_frame_child(&f, c, G2_FRAME_CODE("c2"));
+		g_assert(c != 0);
+		g_assert(0 != g2_frame_child(&f, c, G2_FRAME_CODE("d1")));
+		g_assert(0 == g2_frame_child(&f, c, G2_FRAME_CODE("c2")));
+
+		payload = g2_frame_child_payload(&f, 0,
+			G2_FRAME_CODE("schild"), &paylen);
+		g_assert(vstrlen(second) == paylen);
+		g_assert(0 == memcmp(payload, second, paylen));
+
+		/*
+		 * The tree built from the flat parse must serialize identically.
+		 */
+
+		flat = g2_frame_tree(&f);
+		g_assert(length == g2_frame_serialize(flat, NULL, 0));
+		rebuilt = halloc(length);
+		g_assert(length == g2_frame_serialize(flat, rebuilt, length));
+		g_assert(0 == memcmp(rebuilt, buffer, length));
+		HFREE_NULL(rebuilt);
+		g2_tree_free_null(&flat);
+
+		ok = g2_frame_parse(&f, nodes, 3, buffer, length, NULL);
+		g_assert(!ok);
+		g_assert(f.overflow);
+	}
+
 	HFREE_NULL(buffer);
 	HFREE_NULL(large);
 	g2_tree_free_null(&root);
@@ -542,13 +542,26 @@ gip_retrieve(unsigned n)
 }
 
 /**
- * Called on startup. Loads the geo-ip.txt file into memory.
+ * Called on startup, creates the (empty) geographic IP database.
+ *
+ * Until gip_retrieve_all() is called, all lookups will return an
+ * unknown country.
  */
 void
 gip_init(void)
 {
 	geo_db = iprange_new();
+}
 
+/**
+ * Loads the geo-ip.txt files into memory.
+ *
+ * This is not needed to get the node going, hence it is deferred until
+ * after startup.
+ */
+void
+gip_retrieve_all(void)
+{
 	gip_retrieve(GIP_IPV4);
 	gip_retrieve(GIP_IPV6);
 }
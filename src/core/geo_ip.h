@@ -38,6 +38,7 @@
 #include "lib/host_addr.h"
 
 void gip_init(void);
+void gip_retrieve_all(void);
 void gip_close(void);
 
 uint16 gip_country(const host_addr_t addr);
@@ -710,6 +710,91 @@ ggep_stream_close(ggep_stream_t *gs)
 	return len;
 }
 
+/**
+ * Append all the extensions held in a complete GGEP block to the stream.
+ *
+ * The `block' is typically the output of a previous ggep_stream_close(),
+ * leading magic byte included, which was saved to avoid re-encoding the
+ * same extensions over and over.  Its extensions are copied verbatim,
+ * the last one losing its "last" flag since more extensions may follow.
+ *
+ * @return TRUE if OK, FALSE if there's not enough room in the output or if
+ * the block is malformed, with ggep_errno set.  On error, the stream is
+ * left in a clean state.
+ */
+bool
+ggep_stream_splice(ggep_stream_t *gs, const void *block, size_t len)
+{
+	const uchar *p = block, *end = &p[len], *last = NULL;
+	size_t n;
+
+	g_assert(ggep_stream_is_valid(gs));
+	g_assert(gs->outbuf != NULL);		/* Stream not closed */
+	g_assert(!gs->begun);				/* Not in the middle of an extension */
+
+	if (0 == len)
+		return TRUE;
+
+	if (GGEP_MAGIC != *p++)
+		goto malformed;
+
+	/*
+	 * Locate the flags of the last extension, validating the block
+	 * structure on the way since we're going to emit it blindly.
+	 */
+
+	while (p < end) {
+		uint8 flags = *p;
+		size_t plen = 0;
+		int i;
+
+		last = p;
+		p += 1 + (flags & GGEP_F_IDLEN);
+
+		for (i = 0; i < 3; i++) {
+			if (p >= end)
+				goto malformed;
+			plen = (plen << GGEP_L_VSHIFT) | (*p & GGEP_L_VALUE);
+			if (*p++ & GGEP_L_LAST)
+				break;
+		}
+
+		if (3 == i || plen > UNSIGNED(end - p))
+			goto malformed;
+
+		p += plen;
+
+		if (flags & GGEP_F_LAST)
+			break;
+	}
+
+	if (NULL == last || p != end)
+		goto malformed;
+
+	n = len - 1;						/* Leading magic byte not copied */
+	if (n + (gs->magic_sent ? 0 : 1) > ggep_stream_avail(gs)) {
+		ggep_errno = GGEP_E_SPACE;
+		return FALSE;
+	}
+
+	if (!gs->magic_sent) {
+		*gs->o++ = GGEP_MAGIC;
+		gs->magic_sent = TRUE;
+	}
+
+	gs->last_fp = gs->o + (last - (const uchar *) block - 1);
+	gs->o = mempcpy(gs->o, const_ptr_add_offset(block, 1), n);
+	*gs->last_fp &= ~GGEP_F_LAST;		/* Set back by ggep_stream_close() */
+
+	g_assert((size_t) (gs->end - gs->o) <= gs->size);	/* No overwriting */
+
+	return TRUE;
+
+malformed:
+	ggep_errno = GGEP_E_INTERNAL;
+	return FALSE;
+}
+
 /**
  * The vectorized version of ggep_stream_pack().
  *
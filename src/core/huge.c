@@ -54,19 +54,27 @@
 
 #include "lib/atoms.h"
 #include "lib/base32.h"
+#include "lib/bit_array.h"
 #include "lib/cq.h"
+#include "lib/endian.h"
+#include "lib/fd.h"
 #include "lib/file.h"
 #include "lib/gnet_host.h"
 #include "lib/halloc.h"
 #include "lib/hashing.h"
 #include "lib/header.h"
 #include "lib/hikset.h"
+#include "lib/htable.h"
 #include "lib/parse.h"
 #include "lib/pattern.h"
+#include "lib/pow2.h"
 #include "lib/sha1.h"
+#include "lib/str.h"
 #include "lib/stringify.h"
+#include "lib/thread.h"
 #include "lib/tm.h"
 #include "lib/urn.h"
+#include "lib/vmm.h"
 #include "lib/walloc.h"
 
 #include "if/gnet_property.h"
@@ -74,25 +82,28 @@
 
 #include "lib/override.h"		/* Must be the last header included */
 
-#define HUGE_SHA1_CACHE_FREQ	60	/* seconds, for SHA1 cache dumps */
+#define HUGE_SHA1_CACHE_FREQ	60		/* seconds, for SHA1 cache compaction */
+#define HUGE_SHA1_CACHE_POLL	1000	/* ms, polling of compaction thread */
 
 /**
  * There's an in-core cache (the hash table ``sha1_cache''), and a
- * persistent copy (normally in ~/.gtk-gnutella/sha1_cache). The
- * in-core cache is filled with the persistent one at launch. When the
+ * persistent copy (normally in ~/.gtk-gnutella/sha1_cache.bin). When the
  * "shared_file" (the records describing the shared files, see
- * share.h) are created, a call is made to sha1_set_digest to fill the
+ * share.h) are created, a call is made to request_sha1 to fill the
  * SHA1 digest part of the shared_file. If the digest isn't found in
- * the in-core cache, it's computed, stored in the in-core cache and
- * appended at the end of the persistent cache. If the digest is found
- * in the cache, a check is made based on the file size and last
- * modification time. If they're identical to the ones in the cache,
- * the digest is considered to be accurate, and is used. If the file
- * size or last modification time don't match, the digest is computed
- * again and stored in the in-core cache, but it isn't stored in the
- * persistent one. Instead, the cache is marked as dirty, and will be
- * entirely overwritten by dump_cache, called when everything has been
- * computed.
+ * the cache, it's computed, stored in the in-core cache and appended at
+ * the end of the persistent cache. If the digest is found in the cache,
+ * a check is made based on the file size and last modification time.
+ * If they're identical to the ones in the cache, the digest is considered
+ * to be accurate, and is used. If the file size or last modification time
+ * don't match, the digest is computed again and a new record is appended
+ * to the persistent cache, superseding the previous one.
+ *
+ * The persistent cache is mapped in memory at launch and indexed, but its
+ * entries are only brought into the in-core cache when the file they
+ * describe is looked up.  From time to time, the persistent cache is
+ * compacted by a separate thread, to get rid of superseded records and of
+ * files that are no longer shared.
  */
 
 struct sha1_cache_entry {
@@ -108,7 +119,7 @@ struct sha1_cache_entry {
 static hikset_t *sha1_cache;
 
 /**
- * cache_dirty = TRUE means that in-core cache is different from the disk one.
+ * cache_dirty = TRUE means that the persistent cache needs to be compacted.
  */
 static bool cache_dirty;
 static time_t cache_dumped;
@@ -142,8 +153,10 @@ static void update_volatile_cache(
 
 /**
  * Add a new entry to the in-memory cache.
+ *
+ * @return the new entry.
  */
-static void
+static struct sha1_cache_entry *
 add_volatile_cache_entry(const char *filename, filesize_t size, time_t mtime,
 	const struct sha1 *sha1, const struct tth *tth, bool known_to_be_shared)
 {
@@ -157,124 +170,905 @@ add_volatile_cache_entry(const char *filename, filesize_t size, time_t mtime,
 	item->tth = tth ? atom_tth_get(tth) : NULL;
 	item->shared = known_to_be_shared;
 	hikset_insert_key(sha1_cache, &item->file_name);
+
+	return item;
 }
 
 /* Disk cache */
 
-static const char sha1_persistent_cache_file_header[] =
-"#\n"
-"# gtk-gnutella SHA1 cache file.\n"
-"# This file is automatically generated.\n"
-"# Format is: URN<TAB>file_size<TAB>file_mtime<TAB>file_name\n"
-"# Comment lines start with a sharp (#)\n"
-"#\n"
-"\n";
+/*
+ * The persistent cache starts with a header made of the magic string,
+ * followed by the version number (LE32) and a reserved field (LE32).
+ *
+ * It is then a sequence of records, each starting with its type byte:
+ *
+ * 'D' records name a directory: LE16 length of the path, including its
+ * trailing NUL, followed by the path.  Directories are numbered, starting
+ * at 0, in the order of appearance of their records.
+ *
+ * 'F' records describe a file: LE32 number of its directory, LE16 length
+ * of its base name, flags, LE64 size, LE64 mtime, the SHA-1, the TTH (all
+ * zeroes when not known) and the base name, which is not NUL-terminated.
+ *
+ * When there are several records for the same file, the last one wins.
+ */
+
+#define SHA1_CACHE_FILE		"sha1_cache.bin"
+#define SHA1_CACHE_TEXT		"sha1_cache"	/* Former text format */
+#define SHA1_CACHE_MAGIC	"GTKGSHA1"
+#define SHA1_CACHE_VERSION	1
+#define SHA1_CACHE_HDR_LEN	16
+#define SHA1_CACHE_MODE		(S_IRUSR | S_IWUSR)		/* 0600 */
+
+#define SHA1_CACHE_REC_DIR	'D'
+#define SHA1_CACHE_REC_FILE	'F'
+
+#define SHA1_CACHE_DIR_LEN	3		/* Type + path length */
+
+#define SHA1_CACHE_OFF_DIR		1	/* Directory number */
+#define SHA1_CACHE_OFF_NAMELEN	5	/* Base name length */
+#define SHA1_CACHE_OFF_FLAGS	7	/* Flags */
+#define SHA1_CACHE_OFF_SIZE		8	/* File size */
+#define SHA1_CACHE_OFF_MTIME	16	/* Last modification time */
+#define SHA1_CACHE_OFF_SHA1		24	/* SHA-1 */
+#define SHA1_CACHE_OFF_TTH		(SHA1_CACHE_OFF_SHA1 + SHA1_RAW_SIZE)
+#define SHA1_CACHE_FILE_LEN		(SHA1_CACHE_OFF_TTH + TTH_RAW_SIZE)
+
+#define SHA1_CACHE_F_TTH	(1U << 0)	/**< TTH field is valid */
+
+/**
+ * Directory table of a persistent cache.
+ */
+struct sha1_cache_dirs {
+	htable_t *index;		/**< Directory path (atom) -> number + 1 */
+	const char **name;		/**< Directory number -> path (atom) */
+	size_t count;			/**< Amount of directories */
+	size_t capacity;		/**< Allocated entries in ``name'' */
+};
+
+/**
+ * The persistent cache, as mapped in memory.
+ *
+ * File records are located through an open-addressed table holding their
+ * offset in the file, hashed on their directory number and base name.
+ * No record can start at offset 0, which therefore flags empty slots.
+ */
+static struct sha1_cache_map {
+	struct sha1_cache_dirs dirs;	/**< Directory table */
+	const char *base;				/**< Start of file data, NULL if none */
+	size_t size;					/**< Size of file data */
+	uint32 *slot;					/**< Record offsets */
+	size_t slots;					/**< Amount of slots, a power of 2 */
+	size_t length;					/**< Length of valid data in file */
+	size_t live;					/**< Amount of live file records */
+	size_t waste;					/**< Amount of superseded records */
+	bool appendable;				/**< Whether we can append to file */
+	bool mapped;					/**< Whether ``base'' was mmap()ed */
+} sha1_map;
+
+/**
+ * A serialized persistent cache, or a serialized record.
+ */
+struct sha1_cache_buf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+static bool sha1_cache_pruned;		/**< Unshared entries were pruned */
+static bool sha1_cache_compacting;	/**< Compaction thread running */
+static uint sha1_cache_compact_id;	/**< Compaction thread ID */
+static struct sha1_cache_buf *sha1_cache_compact_buf;
+static cperiodic_t *sha1_cache_compact_ev;
 
+/**
+ * Initialize directory table.
+ */
 static void
-cache_entry_print(FILE *f, const char *filename,
-	const struct sha1 *sha1, const struct tth *tth,
-	filesize_t size, time_t mtime)
+sha1_cache_dirs_init(struct sha1_cache_dirs *d)
 {
-	char size_buf[UINT64_DEC_BUFLEN], mtime_buf[UINT64_DEC_BUFLEN];
+	ZERO(d);
+	d->index = htable_create(HASH_KEY_STRING, 0);
+}
 
-	g_return_if_fail(f);
-	g_return_if_fail(filename);
-	g_return_if_fail(sha1);
-	g_return_if_fail(size > 0);
+/**
+ * Free directory table.
+ */
+static void
+sha1_cache_dirs_free(struct sha1_cache_dirs *d)
+{
+	size_t i;
+
+	for (i = 0; i < d->count; i++)
+		atom_str_free_null(&d->name[i]);
+
+	HFREE_NULL(d->name);
+	htable_free_null(&d->index);
+	d->count = d->capacity = 0;
+}
+
+/**
+ * Record new directory in the table.
+ *
+ * @return the number of the directory.
+ */
+static uint32
+sha1_cache_dirs_add(struct sha1_cache_dirs *d, const char *dir)
+{
+	const char *atom;
+
+	g_assert(d->count < MAX_INT_VAL(uint32));
+
+	if (d->count == d->capacity) {
+		d->capacity = MAX(64, d->capacity * 2);
+		HREALLOC_ARRAY(d->name, d->capacity);
+	}
+
+	atom = atom_str_get(dir);
+	d->name[d->count] = atom;
+	htable_insert_const(d->index, atom, size_to_pointer(d->count + 1));
+
+	return d->count++;
+}
+
+/**
+ * Look up directory in the table.
+ *
+ * @param d		the directory table
+ * @param dir	the directory path
+ * @param num	where the number of the directory is written, if found
+ *
+ * @return TRUE if the directory is known.
+ */
+static bool
+sha1_cache_dirs_lookup(const struct sha1_cache_dirs *d, const char *dir,
+	uint32 *num)
+{
+	size_t n = pointer_to_size(htable_lookup(d->index, dir));
+
+	if (0 == n)
+		return FALSE;
+
+	*num = n - 1;
+	return TRUE;
+}
+
+/**
+ * Split path into its directory and its base name.
+ *
+ * @param path		the full path name
+ * @param dir		where the directory is written, NUL-terminated
+ * @param size		size of the ``dir'' buffer
+ *
+ * @return the base name within ``path'', NULL if path cannot be split.
+ */
+static const char *
+sha1_cache_path_split(const char *path, char *dir, size_t size)
+{
+	const char *p = vstrrchr(path, G_DIR_SEPARATOR);
+	size_t len;
+
+	if (NULL == p)
+		return NULL;
+
+	len = p - path;
+	if (len >= size || vstrlen(p + 1) > MAX_INT_VAL(uint16))
+		return NULL;
+
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+
+	return p + 1;
+}
+
+/**
+ * Reserve room at the end of the buffer.
+ *
+ * @return pointer to the reserved area.
+ */
+static char *
+sha1_cache_buf_grow(struct sha1_cache_buf *b, size_t len)
+{
+	char *p;
+
+	if (b->size - b->len < len) {
+		b->size = MAX(b->size * 2, size_saturate_add(b->len, len));
+		b->data = hrealloc(b->data, b->size);
+	}
+
+	p = &b->data[b->len];
+	b->len += len;
+
+	return p;
+}
+
+/**
+ * Free buffer and nullify its pointer.
+ */
+static void
+sha1_cache_buf_free(struct sha1_cache_buf **b_ptr)
+{
+	struct sha1_cache_buf *b = *b_ptr;
+
+	if (b != NULL) {
+		HFREE_NULL(b->data);
+		WFREE(b);
+		*b_ptr = NULL;
+	}
+}
+
+/**
+ * Emit the persistent cache header.
+ */
+static void
+sha1_cache_buf_header(struct sha1_cache_buf *b)
+{
+	char *p = sha1_cache_buf_grow(b, SHA1_CACHE_HDR_LEN);
+
+	memcpy(p, SHA1_CACHE_MAGIC, CONST_STRLEN(SHA1_CACHE_MAGIC));
+	p += CONST_STRLEN(SHA1_CACHE_MAGIC);
+	p = poke_le32(p, SHA1_CACHE_VERSION);
+	poke_le32(p, 0);
+}
+
+/**
+ * Emit a file record, preceded by a directory record when the directory
+ * is not already present in the directory table, which is then updated.
+ *
+ * @return FALSE if the path cannot be recorded.
+ */
+static bool
+sha1_cache_buf_entry(struct sha1_cache_buf *b, struct sha1_cache_dirs *d,
+	const char *path, filesize_t size, time_t mtime,
+	const struct sha1 *sha1, const struct tth *tth)
+{
+	char dir[MAX_PATH_LEN];
+	const char *name;
+	size_t len;
+	uint32 num;
+	char *p;
+
+	name = sha1_cache_path_split(path, ARYLEN(dir));
+	if (NULL == name)
+		return FALSE;
+
+	if (!sha1_cache_dirs_lookup(d, dir, &num)) {
+		size_t dlen = vstrlen(dir) + 1;
+
+		p = sha1_cache_buf_grow(b, SHA1_CACHE_DIR_LEN + dlen);
+		*p++ = SHA1_CACHE_REC_DIR;
+		p = poke_le16(p, dlen);
+		memcpy(p, dir, dlen);
+		num = sha1_cache_dirs_add(d, dir);
+	}
+
+	len = vstrlen(name);
+	p = sha1_cache_buf_grow(b, SHA1_CACHE_FILE_LEN + len);
+	*p++ = SHA1_CACHE_REC_FILE;
+	p = poke_le32(p, num);
+	p = poke_le16(p, len);
+	*p++ = NULL == tth ? 0 : SHA1_CACHE_F_TTH;
+	p = poke_le64(p, size);
+	p = poke_le64(p, mtime);
+	memcpy(p, sha1, SHA1_RAW_SIZE);
+	p += SHA1_RAW_SIZE;
+	if (tth != NULL)
+		memcpy(p, tth, TTH_RAW_SIZE);
+	else
+		memset(p, 0, TTH_RAW_SIZE);
+	p += TTH_RAW_SIZE;
+	memcpy(p, name, len);
+
+	return TRUE;
+}
+
+/**
+ * Hash the key of a file record.
+ */
+static inline uint32
+sha1_cache_rec_hash(uint32 dir, const char *name, size_t len)
+{
+	return hashing_mix32(binary_hash(name, len) + dir);
+}
+
+/**
+ * Locate the slot of a file record in the mapped persistent cache.
+ *
+ * @return the slot holding the record, or the empty slot where it belongs.
+ */
+static uint32 *
+sha1_cache_map_slot(uint32 dir, const char *name, size_t len)
+{
+	size_t mask = sha1_map.slots - 1;
+	size_t i = sha1_cache_rec_hash(dir, name, len) & mask;
+
+	for (;;) {
+		uint32 *slot = &sha1_map.slot[i];
+		const char *rec;
+
+		if (0 == *slot)
+			return slot;
+
+		rec = &sha1_map.base[*slot];
+
+		if (
+			peek_le32(&rec[SHA1_CACHE_OFF_DIR]) == dir &&
+			peek_le16(&rec[SHA1_CACHE_OFF_NAMELEN]) == len &&
+			0 == memcmp(&rec[SHA1_CACHE_FILE_LEN], name, len)
+		)
+			return slot;
+
+		i = (i + 1) & mask;
+	}
+}
+
+/**
+ * Look up a path in the mapped persistent cache.
+ *
+ * @return the file record, NULL if not found.
+ */
+static const char *
+sha1_cache_map_lookup(const char *path)
+{
+	char dir[MAX_PATH_LEN];
+	const char *name;
+	uint32 num, *slot;
+
+	if (NULL == sha1_map.slot)
+		return NULL;
+
+	name = sha1_cache_path_split(path, ARYLEN(dir));
+	if (NULL == name || !sha1_cache_dirs_lookup(&sha1_map.dirs, dir, &num))
+		return NULL;
+
+	slot = sha1_cache_map_slot(num, name, vstrlen(name));
+
+	return 0 == *slot ? NULL : &sha1_map.base[*slot];
+}
+
+/**
+ * Index the records of the mapped persistent cache.
+ *
+ * Parsing stops at the first invalid record, which can be a truncated
+ * one if we crashed whilst appending to the file.
+ */
+static void G_COLD
+sha1_cache_map_index(void)
+{
+	const char *p = sha1_map.base, *end = p + sha1_map.size;
+
+	if (
+		sha1_map.size < SHA1_CACHE_HDR_LEN ||
+		0 != memcmp(p, SHA1_CACHE_MAGIC, CONST_STRLEN(SHA1_CACHE_MAGIC)) ||
+		SHA1_CACHE_VERSION != peek_le32(&p[CONST_STRLEN(SHA1_CACHE_MAGIC)])
+	) {
+		g_warning("%s(): ignoring SHA-1 cache with invalid header", G_STRFUNC);
+		return;
+	}
+
+	/*
+	 * Records are at least SHA1_CACHE_FILE_LEN bytes, which bounds the
+	 * amount of records we can index: keep the table at most half full.
+	 */
+
+	sha1_map.slots = next_pow2(2 * (sha1_map.size / SHA1_CACHE_FILE_LEN) + 2);
+	HALLOC0_ARRAY(sha1_map.slot, sha1_map.slots);
+
+	for (p += SHA1_CACHE_HDR_LEN; p < end; /* empty */) {
+		size_t left = end - p;
+
+		if (SHA1_CACHE_REC_DIR == *p) {
+			size_t len;
+
+			if (left < SHA1_CACHE_DIR_LEN)
+				break;
+
+			len = peek_le16(&p[1]);
+			if (
+				0 == len || left - SHA1_CACHE_DIR_LEN < len ||
+				'\0' != p[SHA1_CACHE_DIR_LEN + len - 1]
+			)
+				break;
+
+			sha1_cache_dirs_add(&sha1_map.dirs, &p[SHA1_CACHE_DIR_LEN]);
+			p += SHA1_CACHE_DIR_LEN + len;
+		} else if (SHA1_CACHE_REC_FILE == *p) {
+			uint32 num, *slot;
+			size_t len;
+
+			if (left < SHA1_CACHE_FILE_LEN)
+				break;
+
+			num = peek_le32(&p[SHA1_CACHE_OFF_DIR]);
+			len = peek_le16(&p[SHA1_CACHE_OFF_NAMELEN]);
+			if (num >= sha1_map.dirs.count || left - SHA1_CACHE_FILE_LEN < len)
+				break;
+
+			slot = sha1_cache_map_slot(num, &p[SHA1_CACHE_FILE_LEN], len);
+			if (0 == *slot)
+				sha1_map.live++;
+			else
+				sha1_map.waste++;
+			*slot = p - sha1_map.base;
+			p += SHA1_CACHE_FILE_LEN + len;
+		} else {
+			break;
+		}
+	}
+
+	sha1_map.length = p - sha1_map.base;
+
+	if (p != end) {
+		g_warning("%s(): ignoring last %zu bytes of SHA-1 cache",
+			G_STRFUNC, (size_t) (end - p));
+	}
+}
+
+/**
+ * Release the mapped persistent cache.
+ */
+static void
+sha1_cache_map_free(void)
+{
+	if (sha1_map.base != NULL) {
+#ifdef HAS_MMAP
+		if (sha1_map.mapped)
+			vmm_munmap(deconstify_char(sha1_map.base), sha1_map.size);
+		else
+#endif
+			hfree(deconstify_char(sha1_map.base));
+	}
+
+	sha1_cache_dirs_free(&sha1_map.dirs);
+	HFREE_NULL(sha1_map.slot);
+	ZERO(&sha1_map);
+}
+
+/**
+ * Map the persistent cache in memory and index it.
+ *
+ * @return TRUE if the persistent cache exists, even if unusable.
+ */
+static bool G_COLD
+sha1_cache_map_load(void)
+{
+	char *path;
+	filestat_t sb;
+	void *p = NULL;
+	size_t size;
+	int fd;
+
+	sha1_cache_map_free();
+	sha1_cache_dirs_init(&sha1_map.dirs);
+	sha1_map.appendable = TRUE;
+
+	path = make_pathname(settings_config_dir(), SHA1_CACHE_FILE);
+	fd = file_open_missing(path, O_RDONLY);
+	if (-1 == fd) {
+		bool exists = ENOENT != errno;
+		HFREE_NULL(path);
+		return exists;
+	}
+
+	if (-1 == fstat(fd, &sb)) {
+		g_warning("%s(): could not stat \"%s\": %m", G_STRFUNC, path);
+		goto done;
+	}
+
+	if (0 == sb.st_size || UNSIGNED(sb.st_size) >= MAX_INT_VAL(uint32)) {
+		if (sb.st_size != 0)
+			g_warning("%s(): ignoring oversized \"%s\"", G_STRFUNC, path);
+		goto done;
+	}
+
+	size = sb.st_size;
+
+#ifdef HAS_MMAP
+	p = vmm_mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (MAP_FAILED == p) {
+		g_warning("%s(): could not mmap() \"%s\": %m", G_STRFUNC, path);
+		p = NULL;
+	} else {
+		sha1_map.mapped = TRUE;
+	}
+#endif	/* HAS_MMAP */
+
+	if (NULL == p) {
+		ssize_t r;
 
-	uint64_to_string_buf(size, ARYLEN(size_buf));
-	uint64_to_string_buf(mtime, ARYLEN(mtime_buf));
+		p = halloc(size);
+		r = read(fd, p, size);
+		if (UNSIGNED(r) != size) {
+			g_warning("%s(): could not read \"%s\": %m", G_STRFUNC, path);
+			HFREE_NULL(p);
+			goto done;
+		}
+	}
+
+	sha1_map.base = p;
+	sha1_map.size = size;
+	sha1_cache_map_index();
+
+	/*
+	 * Drop any trailing garbage so that we can safely append new records.
+	 * When the header was invalid, the whole file will be rewritten.
+	 */
 
-	fprintf(f, "%s\t%s\t%s\t%s\n", bitprint_to_urn_string(sha1, tth),
-		size_buf, mtime_buf, filename);
+	if (sha1_map.length != 0 && sha1_map.length != size) {
+		if (-1 == truncate(path, sha1_map.length)) {
+			g_warning("%s(): could not truncate \"%s\": %m", G_STRFUNC, path);
+			sha1_map.appendable = FALSE;
+			cache_dirty = TRUE;
+		}
+	}
+
+done:
+	fd_close(&fd);
+	HFREE_NULL(path);
+	return TRUE;
 }
 
+/**
+ * Look up path in the cache, bringing the entry from the persistent cache
+ * into the in-core cache if needed.
+ *
+ * @return the cache entry, NULL if not found.
+ */
+static struct sha1_cache_entry *
+sha1_cache_lookup(const char *path)
+{
+	struct sha1_cache_entry *cached;
+	const char *rec;
+
+	cached = hikset_lookup(sha1_cache, path);
+	if (cached != NULL)
+		return cached;
+
+	rec = sha1_cache_map_lookup(path);
+	if (NULL == rec)
+		return NULL;
+
+	return add_volatile_cache_entry(path,
+		peek_le64(&rec[SHA1_CACHE_OFF_SIZE]),
+		peek_le64(&rec[SHA1_CACHE_OFF_MTIME]),
+		(const struct sha1 *) &rec[SHA1_CACHE_OFF_SHA1],
+		(SHA1_CACHE_F_TTH & rec[SHA1_CACHE_OFF_FLAGS]) ?
+			(const struct tth *) &rec[SHA1_CACHE_OFF_TTH] : NULL,
+		FALSE);
+}
+
+static void cache_dump_schedule(void);
+
 /**
  * Add an entry to the persistent cache.
+ *
+ * @param superseding	whether the entry supersedes an earlier one
  */
 static void
 add_persistent_cache_entry(const char *filename, filesize_t size,
-	time_t mtime, const struct sha1 *sha1, const struct tth *tth)
+	time_t mtime, const struct sha1 *sha1, const struct tth *tth,
+	bool superseding)
 {
+	struct sha1_cache_buf b;
 	char *pathname;
-	FILE *f;
+	int fd, flags;
+	bool ok = FALSE;
 
-	pathname = make_pathname(settings_config_dir(), "sha1_cache");
-	f = file_fopen(pathname, "a");
-	if (f) {
-		filestat_t sb;
+	/*
+	 * Whilst the persistent cache is being compacted, appended records
+	 * would be lost when the compacted file replaces the current one:
+	 * flag the cache as dirty instead, so that it gets compacted again.
+	 */
+
+	if (sha1_cache_compacting || !sha1_map.appendable) {
+		cache_dump_schedule();
+		return;
+	}
+
+	ZERO(&b);
+
+	if (0 == sha1_map.length)
+		sha1_cache_buf_header(&b);
+
+	if (
+		!sha1_cache_buf_entry(&b, &sha1_map.dirs,
+			filename, size, mtime, sha1, tth)
+	) {
+		g_warning("%s(): cannot record \"%s\"", G_STRFUNC, filename);
+		HFREE_NULL(b.data);
+		return;
+	}
+
+	flags = O_WRONLY | O_CREAT | (0 == sha1_map.length ? O_TRUNC : O_APPEND);
+	pathname = make_pathname(settings_config_dir(), SHA1_CACHE_FILE);
+	fd = file_open(pathname, flags, SHA1_CACHE_MODE);
+
+	if (fd != -1) {
+		ok = UNSIGNED(write(fd, b.data, b.len)) == b.len;
+		if (!ok)
+			g_warning("%s(): could not write \"%s\": %m", G_STRFUNC, pathname);
+		fd_close(&fd);
+	}
+
+	HFREE_NULL(pathname);
+	HFREE_NULL(b.data);
+
+	/*
+	 * If we could not write the records, the file may now end with a
+	 * partial record, or lack the directory record we just registered:
+	 * stop appending and rewrite the whole file instead.
+	 */
+
+	if (!ok) {
+		sha1_map.appendable = FALSE;
+		cache_dump_schedule();
+		return;
+	}
+
+	sha1_map.length += b.len;
+
+	if (superseding)
+		sha1_map.waste++;
+	else
+		sha1_map.live++;
+
+	if (sha1_map.waste > sha1_map.live)
+		cache_dump_schedule();
+}
+
+/**
+ * Serialize the entries that need to be kept in the compacted cache.
+ *
+ * When ``force'' is TRUE, all the in-core entries are kept, otherwise only
+ * the shared ones are kept, as soon as the cache was pruned.  Before the
+ * cache is pruned, we also keep entries from the mapped persistent cache
+ * that were not brought into the in-core cache.
+ *
+ * @return the serialized persistent cache.
+ */
+static struct sha1_cache_buf *
+sha1_cache_compact_data(bool force)
+{
+	struct sha1_cache_buf *b;
+	struct sha1_cache_dirs dirs;
+	bit_array_t *seen = NULL;
+	hikset_iter_t *iter;
+	void *v;
+
+	WALLOC0(b);
+	sha1_cache_dirs_init(&dirs);
+	sha1_cache_buf_header(b);
+
+	if (!sha1_cache_pruned && sha1_map.slot != NULL)
+		seen = halloc0(BIT_ARRAY_BYTE_SIZE(sha1_map.slots));
+
+	iter = hikset_iter_new(sha1_cache);
+
+	while (hikset_iter_next(iter, &v)) {
+		const struct sha1_cache_entry *e = v;
 
 		/*
-		 * If we're adding the very first entry (file empty), then emit header.
+		 * In-core entries supersede the ones in the mapped file.
 		 */
 
-		if (fstat(fileno(f), &sb)) {
-			g_warning("%s(): could not stat \"%s\": %m", G_STRFUNC, pathname);
-		} else {
-			if (0 == sb.st_size) {
-				fputs(sha1_persistent_cache_file_header, f);
+		if (seen != NULL) {
+			char dir[MAX_PATH_LEN];
+			const char *name;
+			uint32 num;
+
+			name = sha1_cache_path_split(e->file_name, ARYLEN(dir));
+			if (
+				name != NULL &&
+				sha1_cache_dirs_lookup(&sha1_map.dirs, dir, &num)
+			) {
+				uint32 *slot = sha1_cache_map_slot(num, name, vstrlen(name));
+				bit_array_set(seen, slot - sha1_map.slot);
 			}
-			cache_entry_print(f, filename, sha1, tth, size, mtime);
 		}
-		fclose(f);
-	} else {
-		g_warning("%s(): could not open \"%s\": %m", G_STRFUNC, pathname);
+
+		if (force || e->shared || !sha1_cache_pruned) {
+			sha1_cache_buf_entry(b, &dirs,
+				e->file_name, e->size, e->mtime, e->sha1, e->tth);
+		}
 	}
-	HFREE_NULL(pathname);
+
+	hikset_iter_release(&iter);
+
+	if (seen != NULL) {
+		size_t i;
+
+		for (i = 0; i < sha1_map.slots; i++) {
+			const char *rec;
+			char path[MAX_PATH_LEN];
+			size_t len;
+
+			if (0 == sha1_map.slot[i] || bit_array_get(seen, i))
+				continue;
+
+			rec = &sha1_map.base[sha1_map.slot[i]];
+			len = peek_le16(&rec[SHA1_CACHE_OFF_NAMELEN]);
+
+			if (
+				UNSIGNED(str_bprintf(ARYLEN(path), "%s%c%.*s",
+					sha1_map.dirs.name[peek_le32(&rec[SHA1_CACHE_OFF_DIR])],
+					G_DIR_SEPARATOR, (int) len, &rec[SHA1_CACHE_FILE_LEN]))
+				>= sizeof path - 1
+			)
+				continue;		/* Truncated */
+
+			sha1_cache_buf_entry(b, &dirs, path,
+				peek_le64(&rec[SHA1_CACHE_OFF_SIZE]),
+				peek_le64(&rec[SHA1_CACHE_OFF_MTIME]),
+				(const struct sha1 *) &rec[SHA1_CACHE_OFF_SHA1],
+				(SHA1_CACHE_F_TTH & rec[SHA1_CACHE_OFF_FLAGS]) ?
+					(const struct tth *) &rec[SHA1_CACHE_OFF_TTH] : NULL);
+		}
+
+		HFREE_NULL(seen);
+	}
+
+	sha1_cache_dirs_free(&dirs);
+
+	return b;
 }
 
-struct dump_cache_context {
+/**
+ * Write the compacted persistent cache.
+ *
+ * This can be called from any thread.
+ *
+ * @return TRUE on success.
+ */
+static bool
+sha1_cache_compact_write(const struct sha1_cache_buf *b)
+{
+	file_path_t fp;
 	FILE *f;
-	bool forced;
-};
+	bool ok;
+
+	file_path_set(&fp, settings_config_dir(), SHA1_CACHE_FILE);
+	f = file_config_open_write("SHA-1 cache", &fp);
+	if (NULL == f)
+		return FALSE;
+
+	ok = 1 == fwrite(b->data, b->len, 1, f);
+	if (!ok)
+		g_warning("%s(): could not write SHA-1 cache: %m", G_STRFUNC);
+
+	return file_config_close(f, &fp) && ok;
+}
+
+/**
+ * Thread writing the compacted persistent cache.
+ */
+static void *
+sha1_cache_compact_thread(void *arg)
+{
+	const struct sha1_cache_buf *b = arg;
+
+	return bool_to_pointer(sha1_cache_compact_write(b));
+}
 
 /**
- * Dump one (in-memory) cache into the persistent cache. This is a callback
- * called by dump_cache to dump the whole in-memory cache onto disk.
+ * Called in the main thread once the compacted cache was written.
+ *
+ * @param ok		whether the compacted cache was successfully written
  */
 static void
-dump_cache_one_entry(void *value, void *udata)
+sha1_cache_compact_done(bool ok)
+{
+	sha1_cache_compacting = FALSE;
+	sha1_cache_buf_free(&sha1_cache_compact_buf);
+
+	if (ok)
+		sha1_cache_map_load();
+	else
+		cache_dirty = TRUE;
+
+	/*
+	 * Entries updated whilst we were compacting could not be appended.
+	 */
+
+	if (cache_dirty)
+		cache_dump_schedule();
+}
+
+/**
+ * Callout queue periodic event to check whether compaction completed.
+ */
+static bool
+sha1_cache_compact_poll(void *unused_obj)
 {
-	struct sha1_cache_entry *e = value;
-	struct dump_cache_context *ctx = udata;
+	void *result;
 
-	if (ctx->forced || e->shared) {
-		cache_entry_print(ctx->f,
-			e->file_name, e->sha1, e->tth, e->size, e->mtime);
+	(void) unused_obj;
+
+	if (-1 == thread_join_try(sha1_cache_compact_id, &result)) {
+		if (EAGAIN == errno)
+			return TRUE;		/* Still running, keep polling */
+		g_warning("%s(): cannot join with %s: %m",
+			G_STRFUNC, thread_id_name(sha1_cache_compact_id));
+		result = NULL;
 	}
+
+	sha1_cache_compact_ev = NULL;
+	sha1_cache_compact_done(pointer_to_bool(result));
+
+	return FALSE;			/* Stop polling */
 }
 
 /**
- * Dump the whole in-memory cache onto disk.
+ * Wait for the compaction thread, if any.
  */
 static void
-dump_cache(bool force)
+sha1_cache_compact_wait(void)
 {
-	FILE *f;
-	file_path_t fp;
+	void *result;
+
+	if (!sha1_cache_compacting)
+		return;
+
+	cq_periodic_remove(&sha1_cache_compact_ev);
+
+	if (-1 == thread_join(sha1_cache_compact_id, &result)) {
+		g_warning("%s(): cannot join with %s: %m",
+			G_STRFUNC, thread_id_name(sha1_cache_compact_id));
+		result = NULL;
+	}
+
+	sha1_cache_compact_done(pointer_to_bool(result));
+}
+
+/**
+ * Compact the persistent cache.
+ *
+ * The cache entries are serialized in the main thread, but the file is
+ * written by a separate thread unless ``sync'' is TRUE.
+ *
+ * @param force		whether to keep all the in-core entries
+ * @param sync		whether to write the file synchronously
+ */
+static void
+dump_cache(bool force, bool sync)
+{
+	struct sha1_cache_buf *b;
+	int id;
 
 	if (!force && !cache_dirty)
 		return;
 
-	file_path_set(&fp, settings_config_dir(), "sha1_cache");
-	f = file_config_open_write("SHA-1 cache", &fp);
-	if (f) {
-		struct dump_cache_context ctx;
-
-		fputs(sha1_persistent_cache_file_header, f);
-		ctx.f = f;
-		ctx.forced = force;
-		hikset_foreach(sha1_cache, dump_cache_one_entry, &ctx);
-		if (file_config_close(f, &fp)) {
-			cache_dirty = FALSE;
-		}
+	if (sha1_cache_compacting) {
+		if (!sync)
+			return;		/* Dumped again when thread completes */
+		sha1_cache_compact_wait();
 	}
 
+	b = sha1_cache_compact_data(force);
+	cache_dirty = FALSE;
+
 	/*
 	 * Update the timestamp even on failure to avoid that we retry this
 	 * too frequently.
 	 */
+
 	cache_dumped = tm_time();
+
+	if (!sync) {
+		id = thread_create(sha1_cache_compact_thread, b,
+				THREAD_F_WARN, THREAD_STACK_MIN);
+
+		if (id != -1) {
+			sha1_cache_compacting = TRUE;
+			sha1_cache_compact_id = id;
+			sha1_cache_compact_buf = b;
+			sha1_cache_compact_ev = cq_periodic_main_add(
+				HUGE_SHA1_CACHE_POLL, sha1_cache_compact_poll, NULL);
+			return;
+		}
+	}
+
+	sha1_cache_compact_buf = b;
+	sha1_cache_compact_done(sha1_cache_compact_write(b));
 }
 
 /**
@@ -385,7 +1179,10 @@ failure:
 }
 
 /**
- * Read the whole persistent cache into memory.
+ * Load the persistent cache.
+ *
+ * When there is no persistent cache yet, the former text cache is read
+ * into memory and converted.
  */
 static void G_COLD
 sha1_read_cache(void)
@@ -396,7 +1193,10 @@ sha1_read_cache(void)
 
 	g_return_if_fail(settings_config_dir());
 
-	file_path_set(fp, settings_config_dir(), "sha1_cache");
+	if (sha1_cache_map_load())
+		return;
+
+	file_path_set(fp, settings_config_dir(), SHA1_CACHE_TEXT);
 	f = file_config_open_read("SHA-1 cache", fp, N_ITEMS(fp));
 	if (f) {
 		for (;;) {
@@ -414,7 +1214,7 @@ sha1_read_cache(void)
 			}
 		}
 		fclose(f);
-		dump_cache(TRUE);
+		dump_cache(TRUE, TRUE);
 	}
 }
 
@@ -447,11 +1247,11 @@ cache_dump_due(cqueue_t *cq, void *unused_obj)
 	(void) unused_obj;
 
 	cq_zero(cq, &cache_dump_ev);	/* Indicates callback fired */
-	dump_cache(FALSE);
+	dump_cache(FALSE, FALSE);
 }
 
 /**
- * Dump the cache at most about once per HUGE_SHA1_CACHE_FREQ secs..
+ * Compact the cache at most about once per HUGE_SHA1_CACHE_FREQ secs.
  */
 static void
 cache_dump_schedule(void)
@@ -470,7 +1270,7 @@ cache_dump_schedule(void)
 			t = HUGE_SHA1_CACHE_FREQ - t;
 	}
 	if (0 == t) {
-		dump_cache(FALSE);
+		dump_cache(FALSE, FALSE);
 	} else if (NULL == cache_dump_ev) {
 		cache_dump_ev = cq_main_insert(t * 1000, cache_dump_due, NULL);
 	}
@@ -532,21 +1332,20 @@ huge_update_hashes(shared_file_t *sf,
 
 	/* Update cache */
 
-	cached = hikset_lookup(sha1_cache, shared_file_path(sf));
+	cached = sha1_cache_lookup(shared_file_path(sf));
 
 	if (cached) {
 		update_volatile_cache(cached, shared_file_size(sf),
 			shared_file_modification_time(sf), sha1, tth);
-
-		cache_dump_schedule(); 	/* Dump cache once per minute */
 	} else {
 		add_volatile_cache_entry(shared_file_path(sf),
 			shared_file_size(sf), shared_file_modification_time(sf),
 			sha1, tth, TRUE);
-		add_persistent_cache_entry(shared_file_path(sf),
-			shared_file_size(sf), shared_file_modification_time(sf),
-			sha1, tth);
 	}
+
+	add_persistent_cache_entry(shared_file_path(sf),
+		shared_file_size(sf), shared_file_modification_time(sf),
+		sha1, tth, cached != NULL);
 	return TRUE;
 }
 
@@ -577,7 +1376,7 @@ huge_need_sha1(shared_file_t *sf)
 	if G_UNLIKELY(NULL == sha1_cache)
 		return FALSE;		/* Shutdown occurred (processing TEQ event?) */
 
-	cached = hikset_lookup(sha1_cache, shared_file_path(sf));
+	cached = sha1_cache_lookup(shared_file_path(sf));
 
 	if (cached != NULL) {
 		filestat_t sb;
@@ -686,7 +1485,7 @@ sha1_is_cached(const shared_file_t *sf)
 {
 	const struct sha1_cache_entry *cached;
 
-	cached = hikset_lookup(sha1_cache, shared_file_path(sf));
+	cached = sha1_cache_lookup(shared_file_path(sf));
 	return cached && cached_entry_up_to_date(cached, sf);
 }
 
@@ -706,11 +1505,23 @@ bool
 huge_cached_is_uptodate(const char *path, filesize_t size, time_t mtime)
 {
 	const struct sha1_cache_entry *cached = hikset_lookup(sha1_cache, path);
+	const char *rec;
+
+	if (cached != NULL)
+		return cached->size == size && cached->mtime == mtime;
+
+	/*
+	 * No need to bring the entry into the in-core cache, we can check
+	 * the mapped persistent cache record directly.
+	 */
+
+	rec = sha1_cache_map_lookup(path);
 
-	if (NULL == cached)
+	if (NULL == rec)
 		return FALSE;
 
-	return cached->size == size && cached->mtime == mtime;
+	return peek_le64(&rec[SHA1_CACHE_OFF_SIZE]) == size &&
+		(time_t) peek_le64(&rec[SHA1_CACHE_OFF_MTIME]) == mtime;
 }
 
 /**
@@ -726,10 +1537,9 @@ request_sha1(shared_file_t *sf)
 	if (!shared_file_indexed(sf))
 		return;		/* "stale" shared file, has been superseded or removed */
 
-	cached = hikset_lookup(sha1_cache, shared_file_path(sf));
+	cached = sha1_cache_lookup(shared_file_path(sf));
 
 	if (cached && cached_entry_up_to_date(cached, sf)) {
-		cache_dirty = TRUE;
 		cached->shared = TRUE;
 		shared_file_set_sha1(sf, cached->sha1);
 		shared_file_set_tth(sf, cached->tth);
@@ -1060,8 +1870,13 @@ huge_sha1_cache_prune(void)
 			G_STRFUNC, pruned, plural_y(pruned));
 	}
 
-	if (pruned != 0)
-		cache_dump_schedule();
+	/*
+	 * Entries of the persistent cache that were not looked up during the
+	 * rescan are not shared either: always compact to get rid of them.
+	 */
+
+	sha1_cache_pruned = TRUE;
+	cache_dump_schedule();
 }
 
 /**
@@ -1098,7 +1913,10 @@ cache_free_entry(void *v, void *unused_udata)
 void
 huge_close(void)
 {
-	dump_cache(FALSE);
+	sha1_cache_compact_wait();
+	dump_cache(FALSE, TRUE);
+	cq_cancel(&cache_dump_ev);
+	sha1_cache_map_free();
 
 	hikset_foreach(sha1_cache, cache_free_entry, NULL);
 	hikset_free_null(&sha1_cache);
@@ -165,6 +165,24 @@ io_get_read_bytes(const void *opaque)
 	return ih->read_bytes;
 }
 
+/**
+ * Discard the leading bytes of the socket buffer which have already been
+ * parsed, resetting the parsing offset.
+ */
+static inline void
+io_header_consume(struct gnutella_socket *s, size_t *offset)
+{
+	g_assert(*offset <= s->pos);
+
+	if (0 == *offset)
+		return;
+
+	if (s->pos != *offset)
+		memmove(s->buf, &s->buf[*offset], s->pos - *offset);
+	s->pos -= *offset;
+	*offset = 0;
+}
+
 /**
  * This routine is called to parse the input buffer (the socket's buffer),
  * a line at a time, until EOH is reached.
@@ -174,17 +192,25 @@ io_header_parse(struct io_header *ih)
 {
 	struct gnutella_socket *s = ih->socket;
 	header_t *header = ih->header;
-	size_t parsed;
+	size_t parsed, offset = 0;
 	int error;
 
 	/*
 	 * Read header a line at a time.  We have exacly s->pos chars to handle.
 	 * NB: we're using a goto label to loop over.
+	 *
+	 * Lines are consumed by moving ``offset'' forward in the socket buffer:
+	 * the unparsed data is only shifted back at the start of the buffer
+	 * when we leave, instead of after each line, which would be quadratic
+	 * in the amount of lines we got from a single read.
 	 */
 
 nextline:
-	switch (getline_read(ih->getline, s->buf, s->pos, &parsed)) {
+	switch (
+		getline_read(ih->getline, &s->buf[offset], s->pos - offset, &parsed)
+	) {
 	case READ_OVERFLOW:
+		io_header_consume(s, &offset);
 		g_warning("%s(): line too long, disconnecting from %s",
 			G_STRFUNC, host_addr_to_string(s->addr));
 		if (log_printable(LOG_STDERR)) {
@@ -196,12 +222,11 @@ nextline:
 		return;
 		/* NOTREACHED */
 	case READ_DONE:
-		if (s->pos != parsed)
-			memmove(s->buf, &s->buf[parsed], s->pos - parsed);
-		s->pos -= parsed;
+		offset += parsed;
+		g_assert(offset <= s->pos);
 		break;
 	case READ_MORE:		/* ok, but needs more data */
-		g_assert(parsed == s->pos);
+		g_assert(parsed == s->pos - offset);
 		s->pos = 0;
 		return;
 	}
@@ -248,6 +273,7 @@ nextline:
 
 		g_assert(s->gdk_tag);
 
+		io_header_consume(s, &offset);
 		socket_evt_clear(s);
 
 		ih->process_header(ih->resource, ih->header);
@@ -263,13 +289,16 @@ nextline:
 		goto nextline;			/* Go process other lines we may have read */
 		/* NOTREACHED */
 	case HEAD_EOH:				/* We reached the end of the header */
+		io_header_consume(s, &offset);
 		break;
 	case HEAD_TOO_LARGE:
 	case HEAD_MANY_LINES:
+		io_header_consume(s, &offset);
 		if (ih->error->header_error_tell)
 			(*ih->error->header_error_tell)(ih->resource, error);
 		/* FALL THROUGH */
 	case HEAD_EOH_REACHED:
+		io_header_consume(s, &offset);
 		g_warning("%s(): %s, disconnecting from %s",
 			G_STRFUNC, header_strerror(error), host_addr_to_string(s->addr));
 		if (log_printable(LOG_STDERR)) {
@@ -37,9 +37,12 @@
 #include "lib/atomic.h"
 #include "lib/atoms.h"
 #include "lib/halloc.h"
+#include "lib/hashing.h"
+#include "lib/hashlist.h"
 #include "lib/hset.h"
 #include "lib/pattern.h"
 #include "lib/pslist.h"
+#include "lib/spinlock.h"
 #include "lib/stringify.h"	/* For hex_escape() */
 #include "lib/utf8.h"
 #include "lib/walloc.h"
@@ -50,6 +53,7 @@
 #include "lib/override.h"		/* Must be the last header included */
 
 #define WOVEC_DFLT	10			/**< Default size of word-vectors */
+#define ST_QUERY_CACHE_MAX	1024	/**< Max amount of cached query strings */
 
 typedef uint64 st_mask_t;
 
@@ -598,6 +602,350 @@ entry_match(const char *text, size_t tlen,
 	return TRUE;
 }
 
+/*
+ * Query normalization cache.
+ *
+ * The same query strings are seen over and over again: a popular query is
+ * relayed to us by several neighbours, and leaves repeat their queries.
+ * Each time, we would canonize the string, split it into words, compute
+ * the QRP hashes of these words and the matching mask, before even looking
+ * at the search table.
+ *
+ * We therefore keep a bounded LRU cache of the recently processed query
+ * strings, indexed by the raw query, which holds all the information that
+ * depends solely on the query string.
+ *
+ * Entries are reference-counted so that they can be used outside of the
+ * cache lock and survive eviction whilst a search is in progress.
+ */
+
+enum st_query_magic { ST_QUERY_MAGIC = 0x37c2a0f1 };
+
+struct st_query {
+	enum st_query_magic magic;
+	int refcnt;					/**< Reference count */
+	const char *query;			/**< Raw query string (atom), the key */
+	const char *canonic;		/**< Canonized query string (atom) */
+	word_vec_t *wovec;			/**< Word vector for canonic string */
+	uint wocnt;					/**< Amount of words in vector */
+	query_hashvec_t *qhv;		/**< QRP hashes of words, NULL if none */
+	st_mask_t mask;				/**< Character mask of canonic string */
+	size_t minlen;				/**< Minimum length of matching names */
+};
+
+static inline void
+st_query_check(const struct st_query * const sq)
+{
+	g_assert(sq != NULL);
+	g_assert(ST_QUERY_MAGIC == sq->magic);
+	g_assert(sq->refcnt > 0);
+}
+
+static hash_list_t *st_query_cache;		/**< LRU cache of st_query entries */
+static spinlock_t st_query_cache_slk = SPINLOCK_INIT;
+
+#define ST_QUERY_CACHE_LOCK		spinlock(&st_query_cache_slk)
+#define ST_QUERY_CACHE_UNLOCK	spinunlock(&st_query_cache_slk)
+
+static uint
+st_query_hash(const void *p)
+{
+	const struct st_query *sq = p;
+
+	return string_mix_hash(sq->query);
+}
+
+static bool
+st_query_eq(const void *a, const void *b)
+{
+	const struct st_query *qa = a, *qb = b;
+
+	return qa->query == qb->query || 0 == strcmp(qa->query, qb->query);
+}
+
+/**
+ * Fill the matching information of a query description from its canonic
+ * form: word vector, character mask and minimum length of matching names.
+ *
+ * @param sq		the query description to fill
+ * @param canonic	the canonic query string, referenced by the description
+ *
+ * @return the amount of query words long enough to be hashed for QRP.
+ */
+static uint
+st_query_fill(struct st_query *sq, const char *canonic)
+{
+	uint i, nw;
+
+	sq->canonic = canonic;
+	sq->wocnt = word_vec_make(sq->canonic, &sq->wovec);
+	sq->mask = mask_hash(sq->canonic);
+
+	/*
+	 * Since all words in the query must match the exact amount of time,
+	 * we can compute the minimum length the searched file must have.
+	 * We add one character after each word but the last, to account for
+	 * space between words.
+	 *		--RAM, 11/07/2002
+	 */
+
+	for (nw = 0, i = 0; i < sq->wocnt; i++) {
+		sq->minlen += sq->wovec[i].len * sq->wovec[i].amount + 1;
+		if (sq->wovec[i].len >= QRP_MIN_WORD_LENGTH)
+			nw++;
+	}
+	if (sq->minlen != 0)
+		sq->minlen--;
+	g_assert(sq->minlen <= INT_MAX);	/* No overflows */
+
+	return nw;
+}
+
+/**
+ * Allocate a new query description.
+ *
+ * @param query		the raw query string
+ *
+ * @return a new query description with a single reference.
+ */
+static struct st_query *
+st_query_alloc(const char *query)
+{
+	struct st_query *sq;
+	char *canonic;
+	uint i, nw;
+
+	WALLOC0(sq);
+	sq->magic = ST_QUERY_MAGIC;
+	sq->refcnt = 1;
+	sq->query = atom_str_get(query);
+
+	/*
+	 * We use a canonic search string, which simplifies matching.
+	 *
+	 * A canonic string has all letters lower-cased, most non-alphanumeric
+	 * replaced by a " ".  However, important non-space marks like "\n"
+	 * or japanese kana marks are kept.
+	 */
+
+	canonic = UNICODE_CANONIZE(query);
+	nw = st_query_fill(sq,
+			canonic == query ? sq->query : atom_str_get(canonic));
+
+	if (canonic != query)
+		HFREE_NULL(canonic);
+
+	/*
+	 * Pre-compute the QRP hashes of the words for query routing.
+	 */
+
+	if (nw != 0) {
+		sq->qhv = qhvec_alloc(nw);
+		for (i = 0; i < sq->wocnt; i++) {
+			if (sq->wovec[i].len >= QRP_MIN_WORD_LENGTH)
+				qhvec_add(sq->qhv, sq->wovec[i].word, QUERY_H_WORD);
+		}
+	}
+
+	return sq;
+}
+
+/**
+ * Remove a reference on the query description, freeing it when the last
+ * reference goes away.
+ */
+void
+st_query_unref(struct st_query *sq)
+{
+	st_query_check(sq);
+
+	if (!atomic_int_dec_is_zero(&sq->refcnt))
+		return;
+
+	if (sq->wocnt != 0)
+		word_vec_free(sq->wovec, sq->wocnt);
+	if (sq->qhv != NULL)
+		qhvec_free(sq->qhv);
+	if (sq->canonic != sq->query)
+		atom_str_free_null(&sq->canonic);
+	atom_str_free_null(&sq->query);
+	sq->magic = 0;
+	WFREE(sq);
+}
+
+/**
+ * Free routine for hash_list_free_all().
+ */
+static void
+st_query_free(void *p)
+{
+	st_query_unref(p);
+}
+
+/**
+ * Look for the query description of the raw query string in the cache.
+ *
+ * This is a plain lookup: the cache hit and miss statistics are left
+ * untouched, and nothing is inserted in the cache.
+ *
+ * @return a query description, which must be released via st_query_unref(),
+ * or NULL if the query string is not present in the cache.
+ */
+static struct st_query *
+st_query_find(const char *query)
+{
+	struct st_query key, *sq = NULL;
+	const void *orig;
+
+	key.query = query;
+
+	ST_QUERY_CACHE_LOCK;
+
+	if (
+		st_query_cache != NULL &&
+		hash_list_find(st_query_cache, &key, &orig)
+	) {
+		sq = deconstify_pointer(orig);
+		st_query_check(sq);
+		atomic_int_inc(&sq->refcnt);
+		hash_list_moveto_tail(st_query_cache, sq);
+	}
+
+	ST_QUERY_CACHE_UNLOCK;
+
+	return sq;
+}
+
+/**
+ * Get the query description for the raw query string, from the cache if
+ * possible, computing it otherwise.
+ *
+ * This is the lookup accounted in the cache hit and miss statistics, so
+ * it must be done only once per incoming query, the description being
+ * then passed along to all the routines needing it.
+ *
+ * @return a query description, which must be released via st_query_unref().
+ */
+struct st_query *
+st_query_get(const char *query)
+{
+	struct st_query key, *sq;
+	const void *orig;
+	size_t count;
+
+	sq = st_query_find(query);
+
+	if (sq != NULL) {
+		gnet_stats_inc_general(GNR_QUERY_NORM_CACHE_HITS);
+		return sq;
+	}
+
+	gnet_stats_inc_general(GNR_QUERY_NORM_CACHE_MISSES);
+
+	/*
+	 * Compute the query description without holding the lock, then insert
+	 * it in the cache, unless another thread did so concurrently.
+	 */
+
+	sq = st_query_alloc(query);
+	key.query = query;
+
+	ST_QUERY_CACHE_LOCK;
+
+	if G_UNLIKELY(NULL == st_query_cache) {
+		ST_QUERY_CACHE_UNLOCK;
+		return sq;		/* Not initialized yet, or shutdown in progress */
+	}
+
+	if (hash_list_find(st_query_cache, &key, &orig)) {
+		struct st_query *other = deconstify_pointer(orig);
+
+		st_query_check(other);
+		atomic_int_inc(&other->refcnt);
+		ST_QUERY_CACHE_UNLOCK;
+		st_query_unref(sq);
+		return other;
+	}
+
+	atomic_int_inc(&sq->refcnt);		/* One reference held by the cache */
+	hash_list_append(st_query_cache, sq);
+
+	while (hash_list_length(st_query_cache) > ST_QUERY_CACHE_MAX)
+		st_query_unref(hash_list_shift(st_query_cache));
+
+	count = hash_list_length(st_query_cache);
+
+	ST_QUERY_CACHE_UNLOCK;
+
+	gnet_stats_set_general(GNR_QUERY_NORM_CACHE_ENTRIES, count);
+
+	return sq;
+}
+
+/**
+ * Canonize query string, reusing the query normalization cache when the
+ * query is already known there.
+ *
+ * This does not account for a cache lookup, nor does it insert the query
+ * in the cache: only the actual matching of an incoming query does.
+ *
+ * @param query		the raw query string
+ *
+ * @return the canonic form of the query as an atom, which must be freed
+ * by the caller via atom_str_free().
+ */
+const char *
+st_query_canonic(const char *query)
+{
+	struct st_query *sq;
+	const char *canonic;
+
+	g_assert(query != NULL);
+
+	sq = st_query_find(query);
+
+	if (sq != NULL) {
+		canonic = atom_str_get(sq->canonic);
+		st_query_unref(sq);
+	} else {
+		char *str = UNICODE_CANONIZE(query);
+
+		canonic = atom_str_get(str);
+		if (str != query)
+			HFREE_NULL(str);
+	}
+
+	return canonic;
+}
+
+/**
+ * Initialize the query normalization cache.
+ */
+void
+st_init(void)
+{
+	ST_QUERY_CACHE_LOCK;
+	g_assert(NULL == st_query_cache);
+	st_query_cache = hash_list_new(st_query_hash, st_query_eq);
+	ST_QUERY_CACHE_UNLOCK;
+}
+
+/**
+ * Dispose of the query normalization cache.
+ */
+void
+st_close(void)
+{
+	hash_list_t *hl;
+
+	ST_QUERY_CACHE_LOCK;
+	hl = st_query_cache;
+	st_query_cache = NULL;
+	ST_QUERY_CACHE_UNLOCK;
+
+	hash_list_free_all(&hl, st_query_free);
+}
+
 /**
  * Fill non-NULL query hash vector for query routing.
  *
@@ -609,27 +957,15 @@ entry_match(const char *text, size_t tlen,
 void
 st_fill_qhv(const char *search_term, query_hashvec_t *qhv)
 {
-	char *search;
-	word_vec_t *wovec;
-	uint wocnt;
-	uint i;
+	struct st_query *sq;
 
 	if (NULL == qhv)
 		return;
 
-	search = UNICODE_CANONIZE(search_term);
-	wocnt = word_vec_make(search, &wovec);
-
-	for (i = 0; i < wocnt; i++) {
-		if (wovec[i].len >= QRP_MIN_WORD_LENGTH)
-			qhvec_add(qhv, wovec[i].word, QUERY_H_WORD);
-	}
-
-	if (search != search_term)
-		HFREE_NULL(search);
-
-	if (wocnt > 0)
-		word_vec_free(wovec, wocnt);
+	sq = st_query_get(search_term);
+	if (sq->qhv != NULL)
+		qhvec_append(qhv, sq->qhv);
+	st_query_unref(sq);
 }
 
 /**
@@ -671,7 +1007,7 @@ typedef size_t (*st_filename_len_fn_t)(const shared_file_t *sf);
  *
  * @param mode			search mode
  * @param set			set containing organized entries to search from
- * @param search		the query string (canonized)
+ * @param sq			the query description (canonized string, words, ...)
  * @param sri			search meta-information, for applying query limits
  * @param result		list where results are added
  * @param qhv			query hash vector built from query string, for routing
@@ -682,7 +1018,7 @@ static uint G_HOT
 st_run_search(
 	enum search_mode mode,
 	struct st_set *set,
-	const char *search,
+	const struct st_query *sq,
 	const search_request_info_t *sri,
 	pslist_t **result,
 	query_hashvec_t *qhv)
@@ -702,9 +1038,12 @@ st_run_search(
 	size_t minlen;
 	hset_t *already_matched = NULL;	/* entries that are already in the list */
 	st_filename_len_fn_t flen;
+	const char *search;
 
+	st_query_check(sq);
 	g_assert(implies(SEARCH_ALIAS == mode, NULL == qhv));
 
+	search = sq->canonic;
 	len = vstrlen(search);
 
 	/*
@@ -777,30 +1116,25 @@ st_run_search(
 	}
 
 	/*
-	 * Prepare matching patterns
+	 * Matching words were computed once, along with their QRP hashes,
+	 * when the query description was built.
 	 */
 
-	wocnt = word_vec_make(search, &wovec);
+	wovec = sq->wovec;
+	wocnt = sq->wocnt;
 
 	/*
-	 * Compute the query hashing information for query routing, if needed.
+	 * Fill the query hashing information for query routing, if needed.
 	 *
 	 * The hash vector needs to be build only when we are given the normal
 	 * search string, not the aliases one.
 	 */
 
-	if (qhv != NULL) {
-		for (i = 0; i < wocnt; i++) {
-			if (wovec[i].len >= QRP_MIN_WORD_LENGTH)
-				qhvec_add(qhv, wovec[i].word, QUERY_H_WORD);
-		}
-	}
+	if (qhv != NULL && sq->qhv != NULL)
+		qhvec_append(qhv, sq->qhv);
 
-	if (wocnt == 0 || best_bin == NULL) {
-		if (wocnt > 0)
-			word_vec_free(wovec, wocnt);
+	if (wocnt == 0 || best_bin == NULL)
 		goto finish;
-	}
 
 	g_assert(best_bin_size > 0);	/* Allocated bin, it must hold something */
 
@@ -813,28 +1147,22 @@ st_run_search(
 	 * lowercased file name, using one bit per different letter, roughly
 	 * (see mask_hash() for the exact algorigthm).
 	 *
-	 * We're now going to compute the same mask on the query, and compare
-	 * it bitwise with the mask for each file.  If the file does not hold
-	 * at least all the chars present in the query, it's no use applying
-	 * the pattern matching algorithm, it won't match at all.
+	 * The same mask was computed on the query, and we compare it bitwise
+	 * with the mask for each file.  If the file does not hold at least
+	 * all the chars present in the query, it's no use applying the pattern
+	 * matching algorithm, it won't match at all.
 	 *
 	 *		--RAM, 01/10/2001
 	 */
 
-	search_mask = mask_hash(search);
+	search_mask = sq->mask;
 
 	/*
-	 * Prepare second matching optimization: since all words in the query
-	 * must match the exact amount of time, we can compute the minimum length
-	 * the searched file must have.  We add one character after each word
-	 * but the last, to account for space between words.
-	 *		--RAM, 11/07/2002
+	 * Second matching optimization: the minimum length the searched file
+	 * must have, computed by st_query_alloc().
 	 */
 
-	for (minlen = 0, i = 0; i < wocnt; i++)
-		minlen += wovec[i].len * wovec[i].amount + 1;
-	minlen--;
-	g_assert(minlen <= INT_MAX);		/* No overflows */
+	minlen = sq->minlen;
 
 	flen = SEARCH_NORMAL == mode ?
 		shared_file_name_canonic_len : shared_file_name_normalized_len;
@@ -925,7 +1253,6 @@ st_run_search(
 	}
 
 	WFREE_ARRAY(pattern, wocnt);
-	word_vec_free(wovec, wocnt);
 
 	/* FALL THROUGH */
 
@@ -939,7 +1266,7 @@ finish:
  * Do an actual search.
  *
  * @param table			table containing organized entries to search from
- * @param search_term	the query string
+ * @param sq			the query description, from st_query_get()
  * @param sri			search meta-information, for applying query limits
  * @param callback		routine to invoke for each match
  * @param ctx			user-supplied data to pass on to callback
@@ -951,7 +1278,7 @@ finish:
 int G_HOT
 st_search(
 	search_table_t *table,
-	const char *search_term,
+	const struct st_query *sq,
 	const search_request_info_t *sri,
 	st_search_callback callback,
 	void *ctx,
@@ -961,36 +1288,30 @@ st_search(
 	uint nres = 0;
 	uint i;
 	pslist_t *result = NULL;
-	char *search, *alias;
+	const char *search;
+	char *alias;
 
-	/*
-	 * We use a canonic search string, which simplifies matching.
-	 *
-	 * A canonic string has all letters lower-cased, most non-alphanumeric
-	 * replaced by a " ".  However, important non-space marks like "\n"
-	 * or japanese kana marks are kept.
-	 */
+	st_query_check(sq);
 
-	search = UNICODE_CANONIZE(search_term);
+	search = sq->canonic;
 
-	if (GNET_PROPERTY(query_debug) > 4 && 0 != strcmp(search, search_term)) {
+	if (GNET_PROPERTY(query_debug) > 4 && search != sq->query) {
 		char *safe_search = hex_escape(search, FALSE);
-		char *safe_search_term = hex_escape(search_term, FALSE);
+		char *safe_search_term = hex_escape(sq->query, FALSE);
 		g_debug("%s(): original=\"%s\", canonic=\"%s\"",
 			G_STRFUNC, safe_search_term, safe_search);
 		if (safe_search != search)
 			HFREE_NULL(safe_search);
-		if (safe_search_term != search_term)
+		if (safe_search_term != sq->query)
 			HFREE_NULL(safe_search_term);
 	}
 
-
 	/*
 	 * Run the original query, unmangled.
 	 */
 
 	nres = st_run_search(
-				SEARCH_NORMAL, &table->plain, search, sri, &result, qhv);
+				SEARCH_NORMAL, &table->plain, sq, sri, &result, qhv);
 
 	/*
 	 * Handle aliases if needed.
@@ -1002,13 +1323,29 @@ st_search(
 	alias = 0 == table->alias.nentries ? NULL : alias_normalize(search, " ");
 
 	if (alias != NULL) {
+		struct st_query aq;
 		uint ares;
 
 		gnet_stats_inc_general(GNR_QUERY_ALIASED_WORDS);
 
+		/*
+		 * The aliased query is already canonic and is never used for
+		 * routing: a transient description holding its words is enough,
+		 * without any atom nor QRP hashes.
+		 */
+
+		ZERO(&aq);
+		aq.magic = ST_QUERY_MAGIC;
+		aq.refcnt = 1;
+		(void) st_query_fill(&aq, alias);
+
 		ares = st_run_search(
-					SEARCH_ALIAS, &table->alias, alias, sri, &result, NULL);
+					SEARCH_ALIAS, &table->alias, &aq, sri, &result, NULL);
 		nres += ares;
+
+		if (aq.wocnt != 0)
+			word_vec_free(aq.wovec, aq.wocnt);
+		aq.magic = 0;
 		HFREE_NULL(alias);
 
 		if (ares != 0)
@@ -1043,9 +1380,6 @@ st_search(
 		pslist_free_null(&result);
 	}
 
-	if (search != search_term)
-		HFREE_NULL(search);
-
 	return nres;
 }
 
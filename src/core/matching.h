@@ -95,10 +95,14 @@ bool st_insert_item(search_table_t *, enum match_set which, const char *key,
 typedef bool (*st_search_callback)(void *ctx, const void *data, bool limits);
 
 struct search_request_info;
+struct st_query;
+
+struct st_query *st_query_get(const char *query);
+void st_query_unref(struct st_query *sq);
 
 int st_search(
 	search_table_t *table,
-	const char *search,
+	const struct st_query *sq,
 	const struct search_request_info *sri,
 	st_search_callback callback,
 	void *ctx,
@@ -106,6 +110,10 @@ int st_search(
 	struct query_hashvec *qhv);
 
 void st_fill_qhv(const char *search_term, struct query_hashvec *qhv);
+const char *st_query_canonic(const char *query);
+
+void st_init(void);
+void st_close(void);
 
 #endif	/* _core_matching_h_ */
 
@@ -110,6 +110,7 @@
 #include "lib/dbus_util.h"
 #include "lib/endian.h"
 #include "lib/entropy.h"
+#include "lib/eslist.h"
 #include "lib/file.h"
 #include "lib/getdate.h"
 #include "lib/getline.h"
@@ -196,6 +197,10 @@
 #define NODE_TSYNC_PERIOD_MS	300000	/**< Synchronize every 5 minutes */
 #define NODE_TSYNC_CHECK		15		/**< 15 secs before a timeout */
 
+#define NODE_HPONG_MAX			256		/**< Max deferred header pong lines */
+#define NODE_HPONG_MS			10		/**< Max time per harvesting run */
+#define NODE_HPONG_DELAY_MS		100		/**< Delay between harvesting runs */
+
 #define TCP_CRAWLER_FREQ		300		/**< once every 5 minutes */
 #define UDP_CRAWLER_FREQ		120		/**< once every 2 minutes */
 
@@ -2412,10 +2417,8 @@ node_remove_v(gnutella_node_t *n, const char *reason, va_list ap)
 		hsep_connection_close(n, in_shutdown);
 
 	if (!in_shutdown) {
-		if (NODE_IS_LEAF(n)) {
-			/* Purge dynamic queries for that node */
-			dq_node_removed(NODE_ID(n));
-		}
+		/* Purge dynamic queries for that node, or what we learned about it */
+		dq_node_removed(NODE_ID(n));
 		node_fire_node_info_changed(n);
 		node_fire_node_flags_changed(n);
 	}
@@ -5717,33 +5720,24 @@ node_intuit_address(gnutella_node_t *n,  header_t *header)
 	return FALSE;
 }
 
+typedef void (*header_pong_cb_t)(const char *name, const char *value,
+	host_type_t type, void *data);
+
 /**
- * Extract host:port information out of a header field and add those to our
- * pong cache. If ``gnet'' is TRUE, the header names without a leading
- * "X-" are checked as variants as well.
+ * Iterate over the header fields which can list host:port information,
+ * invoking the callback on each of them.  If ``gnet'' is TRUE, the header
+ * names without a leading "X-" are checked as variants as well.
  *
  * @param header	a valid header_t.
  * @param sender	the host_type_t of the sender, if unknown use HOST_ANY.
  * @param gnet		should be set to TRUE if the headers come from a
 					Gnutella handshake.
- * @param peer		the peer address who sent the headers.
- * @param vendor	the vendor who sent the headers, for error logging
- *
- * @return the amount of valid peer addresses we parsed.
- *
- * The syntax we expect is:
- *
- *   <header>: <peer> ("," <peer>)*
- *
- *   peer =		<host> [":" <port>] [any except ","]*
- *   header =	"Alt" | Listen-Ip" | "Listen-Ip" |
- *				"My-Address" | "Node" | "Try" | "Try-Ultrapeers"
- *
+ * @param cb		callback invoked with header name, value and host type
+ * @param data		additional callback argument
  */
-uint
-feed_host_cache_from_headers(header_t *header,
-	host_type_t sender, bool gnet, const host_addr_t peer,
-	const char *vendor)
+static void
+header_pongs_foreach(header_t *header,
+	host_type_t sender, bool gnet, header_pong_cb_t cb, void *data)
 {
 	static const struct {
 		const char *name;	/* Name of the header */
@@ -5761,7 +5755,7 @@ feed_host_cache_from_headers(header_t *header,
 		{ "X-Try-Ultrapeers",	FALSE,	TRUE,  HOST_ULTRA },
 		{ "X-Try-Hubs",			FALSE,	TRUE,  HOST_G2HUB },
 	};
-	uint i, n = 0;
+	uint i;
 
 	g_assert(header);
     g_assert(UNSIGNED(sender) < HOST_MAX);
@@ -5769,8 +5763,6 @@ feed_host_cache_from_headers(header_t *header,
 	for (;;) {
 		for (i = 0; i < N_ITEMS(headers); i++) {
 			const char *val, *name, *p;
-			host_type_t type;
-			uint r;
 
 			/*
 			 * One cannot assume that the same port will always be used for
@@ -5785,43 +5777,201 @@ feed_host_cache_from_headers(header_t *header,
 			if (gnet && NULL != (p = is_strprefix(name, "X-")))
 				name = p;
 
-			type = headers[i].sender ? sender : headers[i].type;
 			val = header_get(header, name);
 			if (!val)
 				continue;
 
-			r = feed_host_cache_from_string(val, type, name);
-			n += r;
-
-			if (GNET_PROPERTY(node_debug) > 0) {
-				if (r > 0)
-					g_debug("peer %s sent %u pong%s in %s header (%s)",
-						host_addr_to_string(peer), PLURAL(r), name,
-						host_type_to_string(type));
-				else
-					g_debug("peer %s <%s> sent unparseable %s header: \"%s\"",
-						host_addr_to_string(peer), vendor, name, val);
-			}
+			(*cb)(name, val,
+				headers[i].sender ? sender : headers[i].type, data);
 		}
 		if (!gnet)
 			break;
 		gnet = FALSE;
 	}
+}
+
+struct header_pong_ctx {
+	const char *vendor;		/* The vendor who sent the headers */
+	host_addr_t peer;		/* The peer address who sent the headers */
+	uint n;					/* Amount of valid peer addresses parsed */
+};
+
+/**
+ * header_pongs_foreach() callback to feed the host cache.
+ */
+static void
+feed_host_cache_from_header_line(const char *name, const char *val,
+	host_type_t type, void *data)
+{
+	struct header_pong_ctx *ctx = data;
+	uint r;
+
+	r = feed_host_cache_from_string(val, type, name);
+	ctx->n += r;
+
+	if (GNET_PROPERTY(node_debug) > 0) {
+		if (r > 0)
+			g_debug("peer %s sent %u pong%s in %s header (%s)",
+				host_addr_to_string(ctx->peer), PLURAL(r), name,
+				host_type_to_string(type));
+		else
+			g_debug("peer %s <%s> sent unparseable %s header: \"%s\"",
+				host_addr_to_string(ctx->peer), ctx->vendor, name, val);
+	}
+}
 
-	return n;
+/**
+ * Extract host:port information out of a header field and add those to our
+ * pong cache. If ``gnet'' is TRUE, the header names without a leading
+ * "X-" are checked as variants as well.
+ *
+ * @param header	a valid header_t.
+ * @param sender	the host_type_t of the sender, if unknown use HOST_ANY.
+ * @param gnet		should be set to TRUE if the headers come from a
+					Gnutella handshake.
+ * @param peer		the peer address who sent the headers.
+ * @param vendor	the vendor who sent the headers, for error logging
+ *
+ * @return the amount of valid peer addresses we parsed.
+ *
+ * The syntax we expect is:
+ *
+ *   <header>: <peer> ("," <peer>)*
+ *
+ *   peer =		<host> [":" <port>] [any except ","]*
+ *   header =	"Alt" | Listen-Ip" | "Listen-Ip" |
+ *				"My-Address" | "Node" | "Try" | "Try-Ultrapeers"
+ *
+ */
+uint
+feed_host_cache_from_headers(header_t *header,
+	host_type_t sender, bool gnet, const host_addr_t peer,
+	const char *vendor)
+{
+	struct header_pong_ctx ctx;
+
+	ctx.vendor = vendor;
+	ctx.peer = peer;
+	ctx.n = 0;
+
+	header_pongs_foreach(header, sender, gnet,
+		feed_host_cache_from_header_line, &ctx);
+
+	return ctx.n;
+}
+
+/**
+ * Header line listing host:port information, whose harvesting into the
+ * host cache is deferred.
+ */
+struct node_hpong {
+	slink_t lk;				/**< Embedded link in node_hpongs */
+	host_addr_t peer;		/**< Peer who sent us the header line */
+	const char *vendor;		/**< Vendor of the peer (atom), for logging */
+	const char *name;		/**< Header name (static string) */
+	char *value;			/**< Header value (halloc'ed) */
+	host_type_t type;		/**< Type of the listed hosts */
+};
+
+static eslist_t node_hpongs = ESLIST_INIT(offsetof(struct node_hpong, lk));
+static cevent_t *node_hpong_ev;
+
+static void
+node_hpong_free(void *data, void *unused)
+{
+	struct node_hpong *hp = data;
+
+	(void) unused;
+
+	atom_str_free_null(&hp->vendor);
+	HFREE_NULL(hp->value);
+	WFREE(hp);
+}
+
+/**
+ * Callout queue callback to feed the host cache with the header pongs
+ * we collected during handshakes.
+ */
+static void
+node_hpong_harvest(cqueue_t *cq, void *unused)
+{
+	tm_t start;
+	struct node_hpong *hp;
+
+	(void) unused;
+	cq_zero(cq, &node_hpong_ev);	/* freed before calling this function */
+
+	tm_now_exact(&start);
+
+	while (NULL != (hp = eslist_shift(&node_hpongs))) {
+		struct header_pong_ctx ctx;
+		tm_t now;
+
+		ctx.vendor = hp->vendor;
+		ctx.peer = hp->peer;
+		ctx.n = 0;
+
+		feed_host_cache_from_header_line(hp->name, hp->value, hp->type, &ctx);
+		node_hpong_free(hp, NULL);
+
+		tm_now_exact(&now);
+		if (tm_elapsed_ms(&now, &start) > NODE_HPONG_MS)
+			break;
+	}
+
+	if (0 != eslist_count(&node_hpongs)) {
+		node_hpong_ev =
+			cq_main_insert(NODE_HPONG_DELAY_MS, node_hpong_harvest, NULL);
+	}
+}
+
+/**
+ * header_pongs_foreach() callback to record header pongs for deferred
+ * harvesting.
+ */
+static void
+node_hpong_record(const char *name, const char *val,
+	host_type_t type, void *data)
+{
+	const gnutella_node_t *n = data;
+	struct node_hpong *hp;
+
+	if (eslist_count(&node_hpongs) >= NODE_HPONG_MAX) {
+		if (GNET_PROPERTY(node_debug) > 1) {
+			g_debug("%s(): ignoring %s header from %s: backlog full",
+				G_STRFUNC, name, node_infostr(n));
+		}
+		return;
+	}
+
+	WALLOC0(hp);
+	hp->peer = n->addr;
+	hp->vendor = atom_str_get(node_vendor(n));
+	hp->name = name;
+	hp->value = h_strdup(val);
+	hp->type = type;
+
+	eslist_append(&node_hpongs, hp);
+
+	if (NULL == node_hpong_ev)
+		node_hpong_ev = cq_main_insert(1, node_hpong_harvest, NULL);
 }
 
 /**
  * Extract the header pongs from the header (X-Try lines).
  * The node is only given for tracing purposes.
+ *
+ * The header lines are only copied here: parsing them and updating the
+ * host cache is deferred, so that floods of handshakes carrying large
+ * X-Try-Ultrapeers lists do not delay message processing.
  */
 static void
 extract_header_pongs(header_t *header, gnutella_node_t *n)
 {
-	feed_host_cache_from_headers(header,
+	header_pongs_foreach(header,
 		NODE_P_G2HUB == n->peermode ? HOST_G2HUB :
 		NODE_P_ULTRA == n->peermode ? HOST_ULTRA : HOST_ANY,
-		TRUE, n->addr, node_vendor(n));
+		TRUE, node_hpong_record, n);
 }
 
 static inline bool
@@ -11838,6 +11988,10 @@ node_close(void)
 	pslist_free_null(&unstable_servents);
 	htable_free_null(&unstable_servent);
 
+	cq_cancel(&node_hpong_ev);
+	eslist_foreach(&node_hpongs, node_hpong_free, NULL);
+	eslist_clear(&node_hpongs);
+
 	/* Clean up node info */
 	while (sl_nodes) {
 		gnutella_node_t *n = sl_nodes->data;
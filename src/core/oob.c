@@ -60,6 +60,7 @@
 #include "lib/random.h"
 #include "lib/str.h"		/* For str_bprintf() */
 #include "lib/stringify.h"
+#include "lib/tm.h"
 #include "lib/walloc.h"
 
 #include "lib/override.h"		/* Must be the last header included */
@@ -67,8 +68,7 @@
 #define OOB_EXPIRE_LARGE_MS	(2*60*1000)		/**< 2 minutes at most for large hits */
 #define OOB_EXPIRE_SMALL_MS	(3*60*1000)		/**< 3 minutes at most for small hits */
 #define OOB_TIMEOUT_MS		(80*1000)		/**< 80 secs for them to reply */
-#define OOB_DELIVER_BASE_MS	2500			/**< 1 msg queued every 2.5 secs */
-#define OOB_DELIVER_RAND_MS	5000			/**< ... + up to 5 random secs */
+#define OOB_DELIVER_TICK_MS	250				/**< Delivery scheduler period */
 
 #define OOB_MAX_QUEUED		50				/**< Max # of messages per host */
 #define OOB_MAX_RETRY		3				/**< Retry # if LIME/12v2 dropped */
@@ -107,24 +107,38 @@ static hikset_t *results_by_muid;
 
 /**
  * Each servent, as identified by its IP:port, is given a FIFO for queuing
- * messages and sending them at a rate of 1 message every OOB_DELIVER_MS, to
- * avoid UDP flooding on the remote side.
+ * messages and sending them at a rate of 1 message every few seconds (see
+ * deliver_delay()), to avoid UDP flooding on the remote side.
  *
  * This hash table records gnet_host_t => "struct gservent"
  */
 static hikset_t *servent_by_host = NULL;
 
+/**
+ * Delivery scheduler, servicing all the servents from `servent_by_host'
+ * every OOB_DELIVER_TICK_MS.  Only installed when there are servents.
+ */
+static cperiodic_t *oob_deliver_ev;
+
 /**
  * A servent entry, used as values in the `servent_by_host' table.
  */
 struct gservent {
-	cevent_t *ev_service; /**< Callout event for servicing FIFO */
+	tm_t next;			  /**< Time at which we can deliver next message */
 	gnet_host_t *host;	  /**< The servent host (also used as key for table) */
-	fifo_t *fifo;		  /**< The servent's FIFO, holding pmsg_t items */
+	fifo_t *fifo;		  /**< The servent's FIFO, holding oob_hit items */
 	uint can_deflate:1;	  /**< Whether servent supports UDP compression */
 	uint reliable:1;	  /**< Whether servent supports semi-reliable UDP */
 };
 
+/**
+ * A query hit message queued for delivery in the servent's FIFO.
+ */
+struct oob_hit {
+	pmsg_t *mb;			  /**< The query hit message */
+	time_t claimed;		  /**< When the hits were claimed */
+};
+
 /*
  * High-level description of what's happening here.
  *
@@ -143,13 +157,13 @@ struct gservent {
  *
  * On reception of LIME/11v2, prepare all hits, put them in the FIFO
  * for this servent, then free the list.
- * Every OOB_DELIVER_MS, enqueue a hit to the UDP MQ for sending.
+ * At most every deliver_delay() ms, enqueue a hit to the UDP MQ for sending.
  */
 
 static void results_destroy(cqueue_t *cq, void *obj);
 static void servent_free(struct gservent *s);
 static bool oob_send_reply_ind(struct oob_results *r);
-static void servent_service(struct gservent *s, cqueue_t *cq);
+static bool servent_service(struct gservent *s, const tm_t *now);
 
 static int num_oob_records;	/**< Leak and duplicate free detector */
 static bool oob_shutdowning;
@@ -425,40 +439,56 @@ servent_free_remove(struct gservent *s)
  *
  * Per a suggestion of Daniel Stutzbach, we wait BASE + RAND*random secs,
  * where "random" is a real random number between 0 and 1.
+ *
+ * BASE is configured by the "oob_deliver_delay" property, and RAND is
+ * twice that amount.
  */
 static int
 deliver_delay(void)
 {
-	return OOB_DELIVER_BASE_MS + random_value(OOB_DELIVER_RAND_MS);
+	uint32 base = GNET_PROPERTY(oob_deliver_delay);
+
+	return base + random_value(2 * base);
 }
 
 /**
- * Callout queue event to service the servent's FIFO.
+ * Account for the delivery delay of a query hit, since it was claimed.
  */
 static void
-servent_call_service(cqueue_t *cq, void *obj)
+deliver_delay_stats(time_t claimed)
 {
-	struct gservent *s = obj;
-
-	cq_zero(cq, &s->ev_service);	/* The callback that just triggered */
-	servent_service(s, cq);
+	time_delta_t d = delta_time(tm_time(), claimed);
+
+	if (d < 5)
+		gnet_stats_inc_general(GNR_OOB_HITS_SENT_WITHIN_5S);
+	else if (d < 15)
+		gnet_stats_inc_general(GNR_OOB_HITS_SENT_WITHIN_15S);
+	else if (d < 60)
+		gnet_stats_inc_general(GNR_OOB_HITS_SENT_WITHIN_60S);
+	else
+		gnet_stats_inc_general(GNR_OOB_HITS_SENT_AFTER_60S);
 }
 
 /**
- * Service servent's FIFO: send next packet, and re-arm servicing callback
- * if there are more data to send.
+ * Service servent's FIFO: send next packet and compute when the following
+ * one, if any, can be sent.
+ *
+ * @return TRUE if servent has nothing more to deliver and can be disposed of.
  */
-static void
-servent_service(struct gservent *s, cqueue_t *cq)
+static bool
+servent_service(struct gservent *s, const tm_t *now)
 {
+	struct oob_hit *h;
 	pmsg_t *mb;
 	mqueue_t *q;
 	enum net_type nt;
+	tm_t delay;
 
-	mb = fifo_remove(s->fifo);
-	if (mb == NULL)
-		goto remove;
+	h = fifo_remove(s->fifo);
+	if (NULL == h)
+		return TRUE;
 
+	mb = h->mb;
 	nt = host_addr_net(gnet_host_get_addr(s->host));
 	q = s->reliable ? node_udp_sr_get_outq(nt) : node_udp_get_outq(nt);
 	if (q == NULL)
@@ -480,21 +510,69 @@ servent_service(struct gservent *s, cqueue_t *cq)
 			gnet_stats_inc_general(GNR_UDP_TX_COMPRESSED);
 	}
 
+	deliver_delay_stats(h->claimed);
 	mq_udp_putq(q, mb, s->host);
+	WFREE(h);
 
 	if (0 == fifo_count(s->fifo))
-		goto remove;
+		return TRUE;
 
-	s->ev_service = cq_insert(cq, deliver_delay(), servent_call_service, s);
+	tm_fill_ms(&delay, deliver_delay());
+	s->next = *now;		/* Struct copy */
+	tm_add(&s->next, &delay);
 
-	return;
+	return FALSE;
 
 udp_disabled:
 	pmsg_free(mb);
-	/* FALL THROUGH */
+	WFREE(h);
+	return TRUE;
+}
+
+/**
+ * hikset_foreach_remove() callback to service servents whose next delivery
+ * time has come.
+ *
+ * @return TRUE if the servent was freed and must be removed from the table.
+ */
+static bool
+servent_service_due(void *value, void *data)
+{
+	struct gservent *s = value;
+	const tm_t *now = data;
 
-remove:
-	servent_free_remove(s);
+	if (tm_cmp(&s->next, now) > 0)
+		return FALSE;
+
+	if (!servent_service(s, now))
+		return FALSE;
+
+	servent_free(s);
+	return TRUE;
+}
+
+/**
+ * Periodic callback servicing all the servents with pending hits.
+ *
+ * Instead of having one callout event per servent, this delivers all the
+ * messages whose time has come at each tick, with OOB_DELIVER_TICK_MS
+ * being the added latency at most.
+ */
+static bool
+oob_deliver_tick(void *unused_data)
+{
+	tm_t now;
+
+	(void) unused_data;
+
+	tm_now(&now);
+	hikset_foreach_remove(servent_by_host, servent_service_due, &now);
+
+	if (0 != hikset_count(servent_by_host))
+		return TRUE;		/* Keep servicing */
+
+	oob_deliver_ev = NULL;
+	return FALSE;			/* No more servents, remove periodic event */
 }
 
 /**
@@ -507,10 +585,9 @@ servent_make(gnet_host_t *host, bool can_deflate, bool reliable)
 {
 	struct gservent *s;
 
-	WALLOC(s);
+	WALLOC0(s);
 	s->host = gnet_host_dup(host);
 	s->fifo = fifo_make();
-	s->ev_service = NULL;
 	s->can_deflate = booleanize(can_deflate);
 	s->reliable = booleanize(reliable);
 
@@ -522,12 +599,13 @@ servent_make(gnet_host_t *host, bool can_deflate, bool reliable)
  * -- fifo_free_all() callback.
  */
 static void
-free_pmsg(void *item, void *unused_udata)
+free_hit(void *item, void *unused_udata)
 {
-	pmsg_t *mb = item;
+	struct oob_hit *h = item;
 
 	(void) unused_udata;
-	pmsg_free(mb);
+	pmsg_free(h->mb);
+	WFREE(h);
 }
 
 /**
@@ -536,9 +614,8 @@ free_pmsg(void *item, void *unused_udata)
 static void
 servent_free(struct gservent *s)
 {
-	cq_cancel(&s->ev_service);
 	gnet_host_free(s->host);
-	fifo_free_all(s->fifo, free_pmsg, NULL);
+	fifo_free_all(s->fifo, free_hit, NULL);
 	WFREE(s);
 }
 
@@ -550,6 +627,7 @@ static void
 oob_record_hit(void *data, size_t len, void *udata)
 {
 	struct gservent *s = udata;
+	struct oob_hit *h;
 	pmsg_t *mb;
 
 	g_assert(len <= INT_MAX);
@@ -565,7 +643,10 @@ oob_record_hit(void *data, size_t len, void *udata)
 	if (s->reliable)
 		pmsg_mark_reliable(mb);
 
-	fifo_put(s->fifo, mb);
+	WALLOC(h);
+	h->mb = mb;
+	h->claimed = tm_time();
+	fifo_put(s->fifo, h);
 }
 
 /**
@@ -673,8 +754,6 @@ oob_deliver_hits(gnutella_node_t *n, const struct guid *muid,
 		servent_created = TRUE;
 	}
 
-	g_assert(servent_created || s->ev_service != NULL);
-
 	/*
 	 * Build the query hits, enqueuing them to the servent's FIFO.
 	 */
@@ -718,12 +797,24 @@ oob_deliver_hits(gnutella_node_t *n, const struct guid *muid,
 
 	/*
 	 * If we just created a new servent entry, service it to send a
-	 * first query hit.  Otherwise, we already have a callback installed
-	 * for servicing it at regular interval.
+	 * first query hit.  Otherwise, the delivery scheduler will service
+	 * it when its next delivery time comes.
 	 */
 
-	if (servent_created)
-		servent_service(s, cq_main());
+	if (servent_created) {
+		tm_t now;
+
+		tm_now(&now);
+		if (servent_service(s, &now)) {
+			servent_free_remove(s);
+			return;
+		}
+	}
+
+	if (NULL == oob_deliver_ev) {
+		oob_deliver_ev =
+			cq_periodic_main_add(OOB_DELIVER_TICK_MS, oob_deliver_tick, NULL);
+	}
 }
 
 /**
@@ -1001,6 +1092,7 @@ oob_close(void)
 	hikset_foreach(results_by_muid, free_oob_kv, NULL);
 	hikset_free_null(&results_by_muid);
 
+	cq_periodic_remove(&oob_deliver_ev);
 	hikset_foreach(servent_by_host, free_servent_kv, NULL);
 	hikset_free_null(&servent_by_host);
 
@@ -56,9 +56,12 @@
 #include "if/core/main.h"			/* For main_get_build() */
 
 #include "lib/array.h"
+#include "lib/atoms.h"
 #include "lib/endian.h"
 #include "lib/getdate.h"
+#include "lib/halloc.h"
 #include "lib/hashing.h"
+#include "lib/hashlist.h"
 #include "lib/hset.h"
 #include "lib/product.h"
 #include "lib/pslist.h"
@@ -66,6 +69,7 @@
 #include "lib/sequence.h"
 #include "lib/stringify.h"
 #include "lib/tm.h"
+#include "lib/walloc.h"
 
 #include "lib/override.h"			/* Must be the last header included */
 
@@ -83,6 +87,8 @@
  * Minimal trailer length is our code NAME, the open flags, and the GUID.
  */
 #define QHIT_MIN_TRAILER_LEN	(4+3+16)	/**< NAME + open flags + GUID */
+#define QHIT_RECORD_MAX		8192	/**< Max amount of cached file records */
+#define QHIT_RECORD_GGEP	160		/**< Static GGEP room, besides "PATH" */
 
 /*
  * Buffer where query hit packet is built.
@@ -613,6 +619,311 @@ qhit_random_index(void)
 	g_error("%s(): no luck with random number generator", G_STRFUNC);
 }
 
+/*
+ * Cache of pre-serialized hit entries.
+ *
+ * Apart from the file index, the "PRU" extension of partial files and the
+ * alternate locations, the hit entry generated for a given file is the same
+ * each time the file matches, for a given QHIT_F_GGEP_H setting.  Popular
+ * files match many queries, so we keep that static part of the entry ready
+ * to be copied, rebuilding it only when the file changes.
+ *
+ * Records are keyed by the shared_file_t address and validated against the
+ * file attributes they were built from, for which we hold atom references:
+ * a record can therefore never be used for a file whose entry would differ,
+ * even if the address was recycled by the library.  The cache is LRU-managed
+ * to limit the memory used by records of files that are no longer shared.
+ */
+
+enum qhit_record_magic { QHIT_RECORD_MAGIC = 0x5e04a17bU };
+
+struct qhit_record {
+	const shared_file_t *sf;	/**< The file (key, not referenced) */
+	enum qhit_record_magic magic;
+	const struct sha1 *sha1;	/**< SHA1 atom, if available when built */
+	const struct tth *tth;		/**< TTH atom, if any when built */
+	const char *name;			/**< NFC name atom */
+	const char *path;			/**< Exposed relative path atom, if any */
+	filesize_t size;			/**< File size */
+	time_t ctime;				/**< File creation time */
+	char *entry[2];				/**< Entry data, by GGEP "H" support */
+	size_t entry_len[2];		/**< Length of entry data */
+	size_t ggep_off[2];			/**< Offset of GGEP block in entry data */
+};
+
+static inline void
+qhit_record_check(const struct qhit_record * const qr)
+{
+	g_assert(qr != NULL);
+	g_assert(QHIT_RECORD_MAGIC == qr->magic);
+}
+
+static hash_list_t *qhit_records;	/**< Cached records, in LRU order */
+
+static uint
+qhit_record_hash(const void *key)
+{
+	const struct qhit_record *qr = key;
+
+	return pointer_hash(qr->sf);
+}
+
+static bool
+qhit_record_eq(const void *a, const void *b)
+{
+	const struct qhit_record *qa = a, *qb = b;
+
+	return qa->sf == qb->sf;
+}
+
+/**
+ * Discard the serialized entries held in the record.
+ */
+static void
+qhit_record_clear(struct qhit_record *qr)
+{
+	uint i;
+
+	for (i = 0; i < N_ITEMS(qr->entry); i++) {
+		HFREE_NULL(qr->entry[i]);
+		qr->entry_len[i] = qr->ggep_off[i] = 0;
+	}
+
+	atom_sha1_free_null(&qr->sha1);
+	atom_tth_free_null(&qr->tth);
+	atom_str_free_null(&qr->name);
+	atom_str_free_null(&qr->path);
+}
+
+/**
+ * Free cached record.
+ */
+static void
+qhit_record_free(void *p)
+{
+	struct qhit_record *qr = p;
+
+	qhit_record_check(qr);
+
+	qhit_record_clear(qr);
+	qr->magic = 0;
+	WFREE(qr);
+}
+
+/**
+ * Does the record still describe the current state of the file?
+ */
+static bool
+qhit_record_matches(const struct qhit_record *qr, const shared_file_t *sf)
+{
+	const struct sha1 *sha1;
+
+	sha1 = sha1_hash_available(sf) ? shared_file_sha1(sf) : NULL;
+
+	/*
+	 * All the strings and digests are atoms and we hold a reference on the
+	 * ones the record was built from, hence comparing pointers is enough.
+	 */
+
+	return
+		qr->sha1 == sha1 &&
+		qr->tth == (NULL == sha1 ? NULL : shared_file_tth(sf)) &&
+		qr->name == shared_file_name_nfc(sf) &&
+		qr->path == shared_file_relative_path(sf) &&
+		qr->size == shared_file_size(sf) &&
+		qr->ctime == shared_file_creation_time(sf);
+}
+
+/**
+ * Record the file attributes on which the serialized entries depend.
+ */
+static void
+qhit_record_capture(struct qhit_record *qr, const shared_file_t *sf)
+{
+	const struct sha1 *sha1;
+	const char *path;
+
+	sha1 = sha1_hash_available(sf) ? shared_file_sha1(sf) : NULL;
+	path = shared_file_relative_path(sf);
+
+	if (sha1 != NULL) {
+		const struct tth *tth = shared_file_tth(sf);
+
+		qr->sha1 = atom_sha1_get(sha1);
+		qr->tth = NULL == tth ? NULL : atom_tth_get(tth);
+	}
+
+	qr->name = atom_str_get(shared_file_name_nfc(sf));
+	qr->path = NULL == path ? NULL : atom_str_get(path);
+	qr->size = shared_file_size(sf);
+	qr->ctime = shared_file_creation_time(sf);
+}
+
+/**
+ * Serialize the static part of the hit entry for the file described by the
+ * record, for the given GGEP "H" support.
+ *
+ * The entry data start with the 32-bit file size, since the file index is
+ * not static, and end with the GGEP block holding the static extensions,
+ * without the terminating NUL.
+ */
+static void
+qhit_record_build(struct qhit_record *qr, bool ggep_h)
+{
+	size_t namelen, len, room;
+	uint32 fs32;
+	ggep_stream_t gs;
+	char *p;
+	bool ok;
+	uint i = ggep_h ? 1 : 0;
+
+	g_assert(NULL == qr->entry[i]);
+
+	/*
+	 * If size is greater than 2^31-1, we store ~0 as the file size and will
+	 * use the "LF" GGEP extension to hold the real size.
+	 */
+
+	fs32 = qr->size >= (1U << 31) ? ~0U : qr->size;
+	namelen = vstrlen(qr->name);
+
+	len = 4 + namelen + 1;
+	if (qr->sha1 != NULL && !ggep_h)
+		len += SHA1_URN_LENGTH + 1;
+	room = QHIT_RECORD_GGEP + (NULL == qr->path ? 0 : vstrlen(qr->path));
+
+	p = qr->entry[i] = halloc(len + room);
+
+	poke_le32(p, fs32);
+	memcpy(&p[4], qr->name, namelen + 1);		/* Trailing NUL included */
+
+	/*
+	 * Emit the SHA1 as a plain ASCII URN if they don't grok "H".
+	 */
+
+	if (qr->sha1 != NULL && !ggep_h) {
+		memcpy(&p[4 + namelen + 1],
+			sha1_to_urn_string(qr->sha1), SHA1_URN_LENGTH);
+		p[len - 1] = '\x1c';
+	}
+
+	ggep_stream_init(&gs, &p[len], room);
+
+	/*
+	 * Emit the SHA1 as GGEP "H" if they said they understand it. The modern
+	 * way is GGEP "H" for binary URN but only gtk-gnutella implements it.
+	 */
+
+	if (qr->sha1 != NULL && ggep_h) {
+		const uint8 type = qr->tth ? GGEP_H_BITPRINT : GGEP_H_SHA1;
+
+		ok =
+			ggep_stream_begin(&gs, GGEP_NAME(H), GGEP_W_COBS) &&
+			ggep_stream_write(&gs, &type, 1) &&
+			ggep_stream_write(&gs, qr->sha1->data, SHA1_RAW_SIZE) &&
+			(qr->tth ?
+				ggep_stream_write(&gs, qr->tth->data, TTH_RAW_SIZE) : TRUE) &&
+			ggep_stream_end(&gs);
+
+		if (!ok)
+			qhit_log_ggep_write_failure("H");
+	}
+
+	/*
+	 * First LimeWire emitted TTHs as plain text urn:ttroot:<base32 TTH>.
+	 * Now they are still unaware of GGEP "H" but emit GGEP "TT" with the
+	 * hash in binary form.
+	 */
+
+	if (qr->tth != NULL && !ggep_h) {
+		ok = ggep_stream_pack(&gs,
+					GGEP_NAME(TT), qr->tth->data, TTH_RAW_SIZE, GGEP_W_COBS);
+		if (!ok)
+			qhit_log_ggep_write_failure("TT");
+	}
+
+	/*
+	 * If the 32-bit size is the magic ~0 escape value, we need to emit
+	 * the real size in the "LF" extension.
+	 */
+
+	if (fs32 == ~0U) {
+		char buf[sizeof(uint64)];
+		int n;
+
+		n = ggept_filesize_encode(qr->size, ARYLEN(buf));
+		ok = ggep_stream_pack(&gs, GGEP_NAME(LF), buf, n, GGEP_W_COBS);
+
+		if (!ok)
+			qhit_log_ggep_write_failure("LF");
+	}
+
+	if (qr->path != NULL) {
+		ok = ggep_stream_pack(&gs,
+				GGEP_NAME(PATH), qr->path, vstrlen(qr->path), 0);
+		if (!ok)
+			qhit_log_ggep_write_failure("PATH");
+	}
+
+	if ((time_t) -1 != qr->ctime) {
+		char buf[sizeof(uint64)];
+		int n;
+
+		/*
+		 * Suppress negative values (if time_t is signed) as this would
+		 * be interpreted as a date far in this future.
+		 */
+
+		n = ggept_ct_encode(MAX(0, qr->ctime), ARYLEN(buf));
+		g_assert(UNSIGNED(n) <= sizeof buf);
+
+		ok = ggep_stream_pack(&gs, GGEP_NAME(CT), buf, n, GGEP_W_COBS);
+		if (!ok)
+			qhit_log_ggep_write_failure("CT");
+	}
+
+	qr->ggep_off[i] = len;
+	qr->entry_len[i] = len + ggep_stream_close(&gs);
+	qr->entry[i] = hrealloc(qr->entry[i], qr->entry_len[i]);
+}
+
+/**
+ * Get the cached record for the file, making sure the serialized entry for
+ * the given GGEP "H" support is available and up-to-date.
+ */
+static const struct qhit_record *
+qhit_record_get(const shared_file_t *sf, bool ggep_h)
+{
+	struct qhit_record key, *qr;
+
+	key.sf = sf;
+	qr = hash_list_lookup(qhit_records, &key);
+
+	if (qr != NULL) {
+		qhit_record_check(qr);
+
+		if (!qhit_record_matches(qr, sf)) {
+			qhit_record_clear(qr);
+			qhit_record_capture(qr, sf);
+		}
+		hash_list_moveto_tail(qhit_records, qr);
+	} else {
+		WALLOC0(qr);
+		qr->magic = QHIT_RECORD_MAGIC;
+		qr->sf = sf;
+		qhit_record_capture(qr, sf);
+		hash_list_append(qhit_records, qr);
+
+		while (hash_list_length(qhit_records) > QHIT_RECORD_MAX)
+			qhit_record_free(hash_list_shift(qhit_records));
+	}
+
+	if (NULL == qr->entry[ggep_h ? 1 : 0])
+		qhit_record_build(qr, ggep_h);
+
+	return qr;
+}
+
 /**
  * Add file to current query hit.
  *
@@ -625,7 +936,7 @@ add_file(const shared_file_t *sf)
 	bool sha1_available;
 	gnet_host_t hvec[QHIT_MAX_ALT];
 	int hcnt = 0;
-	uint32 fs32, fs32_le, idx_le;
+	uint32 idx_le;
 	int ggep_len;
 	bool ok;
 	ggep_stream_t gs;
@@ -633,6 +944,8 @@ add_file(const shared_file_t *sf)
 	void *start;
 	bool is_partial;
 	uint32 file_index;
+	const struct qhit_record *qr;
+	uint ggep_h = found_ggep_h() ? 1 : 0;
 
 	is_partial = shared_file_is_partial(sf);
 	needed = 8 + 2 + shared_file_name_nfc_len(sf);	/* size of hit entry */
@@ -743,43 +1056,17 @@ add_file(const shared_file_t *sf)
 		return FALSE;
 
 	/*
-	 * If size is greater than 2^31-1, we store ~0 as the file size and will
-	 * use the "LF" GGEP extension to hold the real size.
+	 * The static part of the entry (file size, name, URN and the GGEP
+	 * extensions describing the file) comes pre-serialized from the cache.
 	 */
 
-	fs32 = shared_file_size(sf) >= (1U << 31) ? ~0U : shared_file_size(sf);
+	qr = qhit_record_get(sf, ggep_h);
 
 	poke_le32(&idx_le, file_index);
 	if (!found_write(&idx_le, sizeof idx_le))
 		return FALSE;
-	poke_le32(&fs32_le, fs32);
-	if (!found_write(&fs32_le, sizeof fs32_le))
+	if (!found_write(qr->entry[ggep_h], qr->ggep_off[ggep_h]))
 		return FALSE;
-	if (!found_write(shared_file_name_nfc(sf), shared_file_name_nfc_len(sf)))
-		return FALSE;
-
-	/* Position equals the next byte to be written to */
-
-	if (!found_write("", 1))
-		return FALSE;
-
-	/*
-	 * We're now between the two NULs at the end of the hit entry.
-	 */
-
-	/*
-	 * Emit the SHA1 as a plain ASCII URN if they don't grok "H".
-	 */
-
-	if (sha1_available && !found_ggep_h()) {
-		const struct sha1 * const sha1 = shared_file_sha1(sf);
-
-		/* Good old way: ASCII URN */
-		if (!found_write(sha1_to_urn_string(sha1), SHA1_URN_LENGTH))
-			return FALSE;
-		if (!found_write("\x1c", 1))
-			return FALSE;
-	}
 
 	/*
 	 * From now on, we emit GGEP extensions, if we emit at all.
@@ -822,58 +1109,13 @@ add_file(const shared_file_t *sf)
 	}
 
 	/*
-	 * Emit the SHA1 as GGEP "H" if they said they understand it. The modern
-	 * way is GGEP "H" for binary URN but only gtk-gnutella implements it.
-	 */
-
-	if (sha1_available && found_ggep_h()) {
-		const struct sha1 * const sha1 = shared_file_sha1(sf);
-		const struct tth * const tth = shared_file_tth(sf);
-		const uint8 type = tth ? GGEP_H_BITPRINT : GGEP_H_SHA1;
-
-		ok =
-			ggep_stream_begin(&gs, GGEP_NAME(H), GGEP_W_COBS) &&
-			ggep_stream_write(&gs, &type, 1) &&
-			ggep_stream_write(&gs, sha1->data, SHA1_RAW_SIZE) &&
-			(tth ? ggep_stream_write(&gs, tth->data, TTH_RAW_SIZE) : TRUE) &&
-			ggep_stream_end(&gs);
-
-		if (!ok)
-			qhit_log_ggep_write_failure("H");
-	}
-
-	/*
-	 * First LimeWire emitted TTHs as plain text urn:ttroot:<base32 TTH>.
-	 * Now they are still unaware of GGEP "H" but emit GGEP "TT" with the
-	 * hash in binary form.
-	 */
-
-	if (sha1_available && !found_ggep_h()) {
-		const struct tth * const tth = shared_file_tth(sf);
-
-		if (tth) {
-			ok = ggep_stream_pack(&gs,
-						GGEP_NAME(TT), tth->data, TTH_RAW_SIZE, GGEP_W_COBS);
-			if (!ok)
-				qhit_log_ggep_write_failure("TT");
-		}
-	}
-
-	/*
-	 * If the 32-bit size is the magic ~0 escape value, we need to emit
-	 * the real size in the "LF" extension.
+	 * The cached extensions: "H" or "TT", "LF", "PATH" and "CT".
 	 */
 
-	if (fs32 == ~0U) {
-		char buf[sizeof(uint64)];
-		int len;
-
-		len = ggept_filesize_encode(shared_file_size(sf), ARYLEN(buf));
-		ok = ggep_stream_pack(&gs, GGEP_NAME(LF), buf, len, GGEP_W_COBS);
-
-		if (!ok)
-			qhit_log_ggep_write_failure("LF");
-	}
+	ok = ggep_stream_splice(&gs, &qr->entry[ggep_h][qr->ggep_off[ggep_h]],
+			qr->entry_len[ggep_h] - qr->ggep_off[ggep_h]);
+	if (!ok)
+		qhit_log_ggep_write_failure("H/TT/LF/PATH/CT");
 
 	/*
 	 * If we have known alternate locations, include a few of them for
@@ -889,39 +1131,6 @@ add_file(const shared_file_t *sf)
 			qhit_log_ggep_write_failure("ALT");
 	}
 
-	{
-		const char *rp = shared_file_relative_path(sf);
-
-		if (rp) {
-			ok = ggep_stream_pack(&gs, GGEP_NAME(PATH), rp, vstrlen(rp), 0);
-			if (!ok)
-				qhit_log_ggep_write_failure("PATH");
-		}
-	}
-
-	{
-		time_t create_time;
-
-		create_time = shared_file_creation_time(sf);
-		if ((time_t) -1 != create_time) {
-			char buf[sizeof(uint64)];
-			int len;
-
-			/*
-			 * Suppress negative values (if time_t is signed) as this would
-			 * be interpreted as a date far in this future.
-			 */
-			create_time = MAX(0, create_time);
-
-			len = ggept_ct_encode(create_time, ARYLEN(buf));
-			g_assert(UNSIGNED(len) <= sizeof buf);
-
-			ok = ggep_stream_pack(&gs, GGEP_NAME(CT), buf, len, GGEP_W_COBS);
-			if (!ok)
-				qhit_log_ggep_write_failure("CT");
-		}
-	}
-
 	/*
 	 * Because we don't know exactly the size of the GGEP extension
 	 * (could be COBS-encoded or not), we need to adjust the real
@@ -1087,7 +1296,7 @@ qhit_build_results(const pslist_t *files, int count, size_t max_msgsize,
 void
 qhit_init(void)
 {
-	/* Nada */
+	qhit_records = hash_list_new(qhit_record_hash, qhit_record_eq);
 }
 
 /**
@@ -1096,7 +1305,7 @@ qhit_init(void)
 void
 qhit_close(void)
 {
-	/* Nada */
+	hash_list_free_all(&qhit_records, qhit_record_free);
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -5274,11 +5274,11 @@ qhvec_clone(const query_hashvec_t *qsrc)
 }
 
 /**
- * Add the `word' coming from `src' into the query hash vector.
- * If the vector is already full, do nothing.
+ * Add the pre-computed QRP `hashcode' coming from `src' into the query
+ * hash vector.  If the vector is already full, do nothing.
  */
-void
-qhvec_add(query_hashvec_t *qhvec, const char *word, enum query_hsrc src)
+static void
+qhvec_add_hash(query_hashvec_t *qhvec, uint32 hashcode, enum query_hsrc src)
 {
 	struct query_hash *qh = NULL;
 
@@ -5310,10 +5310,45 @@ qhvec_add(query_hashvec_t *qhvec, const char *word, enum query_hsrc src)
 	g_assert(qh != NULL);
 
 	qhvec->count++;
-	qh->hashcode = qrp_hashcode(word);
+	qh->hashcode = hashcode;
 	qh->source = src;
 }
 
+/**
+ * Add the `word' coming from `src' into the query hash vector.
+ * If the vector is already full, do nothing.
+ */
+void
+qhvec_add(query_hashvec_t *qhvec, const char *word, enum query_hsrc src)
+{
+	if G_UNLIKELY(qhvec->count >= qhvec->size)
+		return;
+
+	qhvec_add_hash(qhvec, qrp_hashcode(word), src);
+}
+
+/**
+ * Append all the hashes held in `src' to the `dst' query hash vector,
+ * without recomputing them.  Hashes that do not fit in `dst' are dropped.
+ *
+ * This is used to replay a cached hash vector for a query whose words
+ * were already hashed.
+ */
+void
+qhvec_append(query_hashvec_t *dst, const query_hashvec_t *src)
+{
+	uint i;
+
+	g_assert(dst != NULL);
+	g_assert(src != NULL);
+	g_assert(dst != src);
+
+	for (i = 0; i < src->count; i++) {
+		const struct query_hash *qh = &src->vec[i];
+		qhvec_add_hash(dst, qh->hashcode, qh->source);
+	}
+}
+
 /**
  * Check whether we can route a query identified by its hash vector
  * to a node given its routing table.
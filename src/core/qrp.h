@@ -105,6 +105,8 @@ void qhvec_reset(struct query_hashvec *qhvec);
 query_hashvec_t * qhvec_clone(const query_hashvec_t *qsrc);
 void qhvec_add(struct query_hashvec *qhvec, const char *word,
 	enum query_hsrc src);
+void qhvec_append(struct query_hashvec *dst,
+	const struct query_hashvec *src);
 bool qhvec_has_urn(const struct query_hashvec *qhv);
 bool qhvec_whats_new(const struct query_hashvec *qhv);
 void qhvec_set_whats_new(struct query_hashvec *qhv, bool val);
@@ -129,7 +129,7 @@ struct ut_rmsg {
 	struct ut_mid id;				/* Message ID (embedded key) */
 	iovec_t *fragments;				/* Array of received fragments */
 	bit_array_t *fbits;				/* Bitmap of received fragments */
-	bit_array_t *facks;				/* Bitmap of fragments pending ACK */
+	bit_array_t *facks;				/* Fragments pending ACK (in fbits block) */
 	cevent_t *expire_ev;			/* Expire timer for the whole message */
 	cevent_t *acks_ev;				/* Expire timer for delayed ACKs */
 	struct attr *attr;				/* Layer attributes */
@@ -235,8 +235,8 @@ ut_rmsg_free(struct ut_rmsg *um, bool free_sequence)
 	cq_cancel(&um->expire_ev);
 	cq_cancel(&um->acks_ev);
 	atom_host_free_null(&um->id.from);
-	WFREE_NULL(um->fbits, BIT_ARRAY_BYTE_SIZE(um->fragcnt));
-	WFREE_NULL(um->facks, BIT_ARRAY_BYTE_SIZE(um->fragcnt));
+	WFREE_NULL(um->fbits, 2 * BIT_ARRAY_BYTE_SIZE(um->fragcnt));
+	um->facks = NULL;				/* Was allocated along with fbits */
 
 	um->magic = 0;
 	WFREE(um);
@@ -426,8 +426,13 @@ ut_rmsg_create(struct attr *attr, const struct ut_header *header,
 	um->improved_acks = attr->improved_acks ||
 		booleanize(header->flags & UDP_RF_IMPROVED_ACKS);
 	um->attr = attr;
-	um->fbits = walloc0(BIT_ARRAY_BYTE_SIZE(um->fragcnt));
-	um->facks = walloc0(BIT_ARRAY_BYTE_SIZE(um->fragcnt));
+
+	/*
+	 * Both fragment bitmaps are allocated as a single block.
+	 */
+
+	um->fbits = walloc0(2 * BIT_ARRAY_BYTE_SIZE(um->fragcnt));
+	um->facks = ptr_add_offset(um->fbits, BIT_ARRAY_BYTE_SIZE(um->fragcnt));
 
 	g_assert(!hevset_contains(attr->mseq, &um->id));	/* New message! */
 
@@ -58,6 +58,7 @@
 #include "huge.h"
 #include "ignore.h"
 #include "ipv6-ready.h"
+#include "matching.h"
 #include "nodes.h"
 #include "oob.h"
 #include "oob_proxy.h"
@@ -394,19 +395,19 @@ record_query_string(const guid_t *muid, const char *query, unsigned media_types)
 			hash_list_moveto_tail(query_muids, orig_key);
 		} else {
 			struct query_desc *qd;
-			char *canonized;
 
 			/*
 			 * New query must be remembered and put at the tail of the list.
+			 *
+			 * The canonic form of the query is taken from the query
+			 * normalization cache when the query string is already known
+			 * there, without accounting for a cache lookup.
 			 */
 
 			WALLOC(qd);
-			canonized = UNICODE_CANONIZE(query);
 			qd->muid = atom_guid_get(muid);
-			qd->query = atom_str_get(canonized);
+			qd->query = st_query_canonic(query);
 			qd->media_mask = media_types;
-			if (canonized != query)
-				HFREE_NULL(canonized);
 
 			hash_list_append(query_muids, qd);
 		}
@@ -5957,7 +5958,7 @@ search_results_process(gnutella_node_t *n, const g2_tree_t *t, int *results)
 		if (
 			t != NULL ||	/* Don't forward G2 hits, don't pass them to DQ */
 			!dq_got_results(gnutella_header_get_muid(&n->header),
-				rs->num_recs, rs->status)
+				rs->num_recs, rs->status, n)
 		)
 			forward_it = FALSE;
 
@@ -36,6 +36,10 @@
 
 #include "common.h"
 
+#ifdef HAS_INOTIFY
+#include <sys/inotify.h>
+#endif	/* HAS_INOTIFY */
+
 #include "share.h"
 
 #include "alias.h"
@@ -70,9 +74,11 @@
 #include "lib/atoms.h"
 #include "lib/barrier.h"
 #include "lib/bg.h"
+#include "lib/cond.h"
 #include "lib/cq.h"
 #include "lib/crash.h"
 #include "lib/endian.h"
+#include "lib/fd.h"
 #include "lib/file.h"
 #include "lib/getcpucount.h"
 #include "lib/halloc.h"
@@ -80,8 +86,10 @@
 #include "lib/hikset.h"
 #include "lib/hset.h"
 #include "lib/htable.h"
+#include "lib/inputevt.h"
 #include "lib/listener.h"
 #include "lib/mime_type.h"
+#include "lib/mutex.h"
 #include "lib/pslist.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
@@ -201,6 +209,7 @@ static struct shared_library {
 	shared_file_t **sorted_file_table;	/* Sorted by name */
 } shared_libfile;
 static spinlock_t shared_libfile_slk = SPINLOCK_INIT;
+static uint shared_libfile_generation;	/* Bumped when library changes */
 
 #define SHARED_LIBFILE_LOCK		spinlock(&shared_libfile_slk)
 #define SHARED_LIBFILE_UNLOCK	spinunlock(&shared_libfile_slk)
@@ -270,12 +279,14 @@ static struct share_thread_vars {
 	spinlock_t lock;					/* Lock to allow concurrent access */
 	bgsched_t *sched;					/* Background task scheduler */
 	struct bgtask *task;				/* Current task, NULL if none */
+	htable_t *changes;					/* Pending library changes */
 	bool qrp_rebuild;					/* Whether QRP rebuild is pending */
 	bool exiting;						/* Whether thread should exit */
 } share_thread_vars = {
 	SPINLOCK_INIT,			/* lock */
 	NULL,					/* sched */
 	NULL,					/* task */
+	NULL,					/* changes */
 	FALSE,					/* qrp_rebuild */
 	FALSE,					/* exiting */
 };
@@ -476,6 +487,45 @@ shared_file_alloc(void)
 	return sf;
 }
 
+/**
+ * Clone a library file, for inclusion into a new library without having to
+ * scan the file again.
+ *
+ * Only the file attributes and names are copied over: the clone is not
+ * indexed and its digests will be set again through request_sha1().
+ *
+ * @return new shared file.
+ */
+static shared_file_t *
+shared_file_clone(const shared_file_t *sf)
+{
+	shared_file_t *cf;
+
+	shared_file_check(sf);
+	g_assert(!(SHARE_F_SPECIAL & sf->flags));
+
+	cf = shared_file_alloc();
+	cf->file_path = atom_str_get(sf->file_path);
+	if (sf->relative_path != NULL)
+		cf->relative_path = atom_str_get(sf->relative_path);
+	if (sf->name_nfc != NULL)
+		cf->name_nfc = atom_str_get(sf->name_nfc);
+	if (sf->name_canonic != NULL)
+		cf->name_canonic = atom_str_get(sf->name_canonic);
+	if (sf->name_normal != NULL)
+		cf->name_normal = atom_str_get(sf->name_normal);
+	cf->name_nfc_len = sf->name_nfc_len;
+	cf->name_canonic_len = sf->name_canonic_len;
+	cf->name_normal_len = sf->name_normal_len;
+	cf->mtime = sf->mtime;
+	cf->ctime = sf->ctime;
+	cf->file_size = sf->file_size;
+	cf->mime_type = sf->mime_type;
+	cf->media_type = sf->media_type;
+
+	return cf;
+}
+
 static void
 shared_file_deindex(shared_file_t *sf)
 {
@@ -521,6 +571,8 @@ shared_file_deindex(shared_file_t *sf)
 
 	SHARED_LIBFILE_UNLOCK;
 
+	atomic_uint_inc(&shared_libfile_generation);
+
 	/*
 	 * Shared file is no longer indexed so it no longer belongs to the
 	 * shared set and needs to be removed if it was referenced there.
@@ -754,6 +806,7 @@ shared_files_match(const char *query,
 	int n;
 	int remain;
 	search_table_t *gt, *pt;
+	struct st_query *sq;
 	bool partials = booleanize(flags & SHARE_FM_PARTIALS);
 	bool g2_query = booleanize(flags & SHARE_FM_G2);
 
@@ -768,11 +821,16 @@ shared_files_match(const char *query,
 	SHARED_LIBFILE_UNLOCK;
 
 	/*
-	 * First search from the library.
+	 * Get the query description once, for both searches.
 	 */
 
-	n = st_search(gt, query, sri, callback, user_data, max_res, qhv);
+	sq = st_query_get(query);
 
+	/*
+	 * First search from the library.
+	 */
+
+	n = st_search(gt, sq, sri, callback, user_data, max_res, qhv);
 
 	gnet_stats_count_general(g2_query ? GNR_LOCAL_G2_HITS : GNR_LOCAL_HITS, n);
 	remain = max_res - n;
@@ -787,11 +845,12 @@ shared_files_match(const char *query,
 	 */
 
 	if (partials && remain > 0 && share_can_answer_partials()) {
-		n = st_search(pt, query, sri, callback, user_data, remain, NULL);
+		n = st_search(pt, sq, sri, callback, user_data, remain, NULL);
 		gnet_stats_count_general(
 			g2_query ? GNR_LOCAL_G2_PARTIAL_HITS : GNR_LOCAL_PARTIAL_HITS, n);
 	}
 
+	st_query_unref(sq);
 	st_free(&gt);
 	st_free(&pt);
 }
@@ -1496,6 +1555,680 @@ share_tthset_free(hset_t *set)
 	hset_free_null(&set);
 }
 
+/*
+ * Library watching.
+ *
+ * When "library_watch" is set, each directory opened during a library scan
+ * is also watched for changes (Linux inotify).  Changes are recorded in a
+ * change set, mapping a directory path to the extent of the rescan it
+ * requires, and after a short delay the library thread is asked to update
+ * the library: files in unchanged directories are carried over as-is and
+ * only the changed directories are read again.
+ *
+ * Whenever the changes cannot be reliably tracked (event queue overflow,
+ * no more watches available), we fall back to full rescans.
+ */
+
+enum share_change {
+	SHARE_CHANGE_DIR = 1,		/* Files in the directory changed */
+	SHARE_CHANGE_TREE			/* The whole directory tree changed */
+};
+
+#define SHARE_WATCH_DELAY	5000	/* ms, delay before processing changes */
+#define SHARE_WATCH_BUFLEN	16384	/* Size of inotify read buffer */
+
+static struct share_watch {
+	mutex_t lock;				/* Thread-safe access */
+	htable_t *dirs;				/* Watch descriptor -> directory (atom) */
+	int fd;						/* The inotify file descriptor, -1 if none */
+	bool failed;				/* Whether we failed to watch a directory */
+} share_watch = {
+	MUTEX_INIT,			/* lock */
+	NULL,				/* dirs */
+	-1,					/* fd */
+	FALSE,				/* failed */
+};
+
+static unsigned share_watch_id;		/* I/O event ID for inotify events */
+static htable_t *share_changes;		/* Change set, main thread only */
+static cevent_t *share_changes_ev;	/* Callout to process the changes */
+
+/**
+ * Record change in the change set, a TREE change superseding a DIR one.
+ *
+ * @param changes	the change set (path atom -> enum share_change)
+ * @param path		the changed directory
+ * @param type		the kind of change
+ */
+static void
+share_changes_record(htable_t *changes, const char *path,
+	enum share_change type)
+{
+	const void *key;
+	void *value;
+
+	if (htable_lookup_extended(changes, path, &key, &value)) {
+		if (UNSIGNED(type) > pointer_to_uint(value))
+			htable_insert(changes, key, uint_to_pointer(type));
+	} else {
+		htable_insert(changes, atom_str_get(path), uint_to_pointer(type));
+	}
+}
+
+static bool
+share_changes_merge_kv(const void *key, void *value, void *data)
+{
+	share_changes_record(data, key, pointer_to_uint(value));
+	atom_str_free(key);
+	return TRUE;
+}
+
+/**
+ * Merge all the changes from one change set into another one.
+ *
+ * @param dest		the change set where changes are merged
+ * @param src		the change set that is freed and nullified
+ */
+static void
+share_changes_merge(htable_t *dest, htable_t **src)
+{
+	htable_foreach_remove(*src, share_changes_merge_kv, dest);
+	htable_free_null(src);
+}
+
+static void
+share_changes_free_key(void *key, void *unused_data)
+{
+	(void) unused_data;
+	atom_str_free(key);
+}
+
+/**
+ * Free change set and nullify its pointer.
+ */
+static void
+share_changes_free_null(htable_t **changes_ptr)
+{
+	htable_t *changes = *changes_ptr;
+
+	if (changes != NULL) {
+		htable_foreach_key(changes, share_changes_free_key, NULL);
+		htable_free_null(changes_ptr);
+	}
+}
+
+/**
+ * Check whether a directory needs to be read again for the given change set.
+ *
+ * @param changes	the change set
+ * @param dir		the directory to check
+ * @param tree		if TRUE, only consider changes in parent directories
+ *
+ * @return TRUE if the directory is changed.
+ */
+static bool
+share_changes_contain(const htable_t *changes, const char *dir, bool tree)
+{
+	char path[MAX_PATH_LEN];
+	char *p;
+
+	if (!tree && htable_contains(changes, dir))
+		return TRUE;
+
+	clamp_strcpy(path, sizeof path, dir);
+
+	while (NULL != (p = strrchr(path, G_DIR_SEPARATOR)) && p != path) {
+		*p = '\0';
+		if (SHARE_CHANGE_TREE == pointer_to_uint(htable_lookup(changes, path)))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Watch directory being scanned for changes, if we are watching the library.
+ *
+ * This routine is called from the library thread.
+ *
+ * @param dir		the directory to watch
+ */
+static void
+share_watch_add(const char *dir)
+{
+#ifdef HAS_INOTIFY
+	struct share_watch *w = &share_watch;
+	int wd;
+
+	mutex_lock(&w->lock);
+
+	if (-1 == w->fd || w->failed)
+		goto done;
+
+	wd = inotify_add_watch(w->fd, dir,
+			IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+			IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF |
+			IN_ONLYDIR);
+
+	if (-1 == wd) {
+		g_warning("cannot watch directory \"%s\": %m", dir);
+		w->failed = TRUE;
+	} else {
+		const char *old = htable_lookup(w->dirs, int_to_pointer(wd));
+
+		/*
+		 * A renamed directory keeps its watch descriptor, so we need to
+		 * update the path of the watched directory.
+		 */
+
+		if (NULL == old || 0 != strcmp(old, dir)) {
+			const char *path = atom_str_get(dir);
+			htable_insert_const(w->dirs, int_to_pointer(wd), path);
+			atom_str_free_null(&old);
+		}
+	}
+
+done:
+	mutex_unlock(&w->lock);
+#else
+	(void) dir;
+#endif	/* HAS_INOTIFY */
+}
+
+static void
+share_watch_free_kv(const void *unused_key, void *value, void *unused_data)
+{
+	(void) unused_key;
+	(void) unused_data;
+
+	atom_str_free(value);
+}
+
+/**
+ * Stop watching the library, discarding pending changes.
+ */
+static void
+share_watch_close(void)
+{
+	struct share_watch *w = &share_watch;
+
+	inputevt_remove(&share_watch_id);
+	cq_cancel(&share_changes_ev);
+	share_changes_free_null(&share_changes);
+
+	mutex_lock(&w->lock);
+
+	fd_close(&w->fd);
+	if (w->dirs != NULL) {
+		htable_foreach(w->dirs, share_watch_free_kv, NULL);
+		htable_free_null(&w->dirs);
+	}
+	w->failed = FALSE;
+
+	mutex_unlock(&w->lock);
+}
+
+/**
+ * Classify an entry read from a shared directory.
+ *
+ * This routine is thread-safe and is also used by the directory walkers.
+ *
+ * @param dir		the directory being read
+ * @param dir_entry	the directory entry
+ * @param flat		whether sub-directories are to be skipped
+ * @param sb		where the status of the entry is returned
+ *
+ * @return the full path of the entry (to be freed with hfree()) if it is a
+ * regular file or a directory to consider, NULL if the entry is skipped.
+ */
+static char *
+recursive_scan_entry(const char *dir, const struct dirent *dir_entry,
+	bool flat, filestat_t *sb)
+{
+	const char *filename = dir_entry_filename(dir_entry);
+	char *fullpath = NULL;
+
+	if (GNET_PROPERTY(share_debug) > 19)
+		g_debug("SHARE considering entry \"%s\"", filename);
+
+	if ('.' == filename[0]) {
+		/* Hidden file, or "." or ".." */
+		goto skip;
+	}
+
+	sb->st_mode = dir_entry_mode(dir_entry);
+	switch (sb->st_mode) {
+	case S_IFDIR:
+		if (flat)
+			goto skip;
+		/* FALL THROUGH */
+	case 0:
+	case S_IFREG:
+	case S_IFLNK:
+		break;
+	default:
+		if (GNET_PROPERTY(share_debug)) {
+			g_warning("skipping file of unknown type \"%s\" in \"%s\"",
+				dir, filename);
+		}
+		goto skip;
+	}
+
+	if (
+		S_ISLNK(sb->st_mode) &&
+		GNET_PROPERTY(scan_ignore_symlink_dirs) &&
+		GNET_PROPERTY(scan_ignore_symlink_regfiles)
+	) {
+		if (GNET_PROPERTY(share_debug) > 15) {
+			g_debug("SHARE to-be-ignored symlink, discarding \"%s\"",
+				filename);
+		}
+		goto skip;
+	}
+
+	if (
+		S_ISREG(sb->st_mode) &&
+		!shared_file_valid_extension(filename)
+	) {
+		if (GNET_PROPERTY(share_debug) > 15) {
+			g_debug("SHARE unshared extension, discarding \"%s\"",
+				filename);
+		}
+		goto skip;
+	}
+
+	fullpath = make_pathname(dir, filename);
+	if (S_ISREG(sb->st_mode) || S_ISDIR(sb->st_mode)) {
+		if (stat(fullpath, sb)) {
+			g_warning("stat() failed %s: %m", fullpath);
+			goto skip;
+		}
+	} else if (!S_ISLNK(sb->st_mode)) {
+		if (lstat(fullpath, sb)) {
+			g_warning("lstat() failed %s: %m", fullpath);
+			goto skip;
+		}
+
+		if (
+			S_ISLNK(sb->st_mode) &&
+			GNET_PROPERTY(scan_ignore_symlink_dirs) &&
+			GNET_PROPERTY(scan_ignore_symlink_regfiles)
+		) {
+			/*
+			 * We check this again because dir_entry_mode() does not
+			 * work everywhere.
+			 */
+			if (GNET_PROPERTY(share_debug) > 15) {
+				g_debug("SHARE to-be-ignored symlink, discarding \"%s\"",
+					filename);
+			}
+			goto skip;
+		}
+	}
+
+	/* Get info on the symlinked file */
+	if (S_ISLNK(sb->st_mode)) {
+		if (stat(fullpath, sb)) {
+			g_warning("broken symlink %s: %m", fullpath);
+			goto skip;
+		}
+
+		/*
+		 * For symlinks, we check whether we are supposed to process
+		 * symlinks for that type of entry, then either proceed or skip the
+		 * entry.
+		 */
+
+		if (
+			S_ISDIR(sb->st_mode) &&
+			GNET_PROPERTY(scan_ignore_symlink_dirs)
+		) {
+			if (GNET_PROPERTY(share_debug) > 15)
+				g_debug("SHARE discarding symlink dir \"%s\"", filename);
+			goto skip;
+		}
+		if (
+			S_ISREG(sb->st_mode) &&
+			GNET_PROPERTY(scan_ignore_symlink_regfiles)
+		) {
+			if (GNET_PROPERTY(share_debug) > 15)
+				g_debug("SHARE discarding symlink file \"%s\"", filename);
+			goto skip;
+		}
+	}
+
+	/*
+	 * Directories are skipped when we are only updating the files of the
+	 * directory being read.
+	 */
+
+	if (S_ISREG(sb->st_mode) || (S_ISDIR(sb->st_mode) && !flat))
+		return fullpath;
+
+skip:
+	HFREE_NULL(fullpath);
+	return NULL;
+}
+
+/*
+ * Parallel directory walking.
+ *
+ * On network filesystems or large disk arrays, reading directories is bound
+ * by the latency of each stat() call, which we cannot hide when reading one
+ * entry at a time.  During full rescans, a small pool of walker threads
+ * therefore reads several directories at once.  Each directory is read
+ * entirely by a walker, which queues its sub-directories for the other
+ * walkers and hands the regular files it found back to the library thread,
+ * where the shared files are created as usual.
+ */
+
+#define SHARE_WALK_WAIT		100		/* ms, max wait for a read directory */
+
+struct share_walk_file {
+	char *path;					/* Full path of the file */
+	filestat_t sb;				/* File status */
+};
+
+struct share_walk_dir {
+	const char *base_dir;		/* Shared directory we're under (atom) */
+	char *path;					/* Directory path */
+	pslist_t *files;			/* List of struct share_walk_file */
+};
+
+enum share_walk_magic { SHARE_WALK_MAGIC = 0x27e1caabU };
+
+struct share_walk {
+	enum share_walk_magic magic;
+	mutex_t lock;				/* Protects fields below */
+	cond_t work;				/* Signals queued directories or stop */
+	cond_t ready;				/* Signals read directories */
+	slist_t *pending;			/* Directories to read */
+	slist_t *done;				/* Directories read, for the library thread */
+	uint busy;					/* Amount of walkers reading a directory */
+	uint count;					/* Amount of walker threads */
+	int *tid;					/* Walker thread IDs */
+	bool stop;					/* Whether walkers must exit */
+};
+
+static inline void
+share_walk_check(const struct share_walk * const sw)
+{
+	g_assert(sw != NULL);
+	g_assert(SHARE_WALK_MAGIC == sw->magic);
+}
+
+/**
+ * Allocate directory to read.
+ *
+ * @param base_dir	the shared directory under which the directory lies
+ * @param path		the path of the directory, taken over
+ */
+static struct share_walk_dir *
+share_walk_dir_alloc(const char *base_dir, char *path)
+{
+	struct share_walk_dir *wd;
+
+	WALLOC0(wd);
+	wd->base_dir = atom_str_get(base_dir);
+	wd->path = path;
+
+	return wd;
+}
+
+static void
+share_walk_dir_free(void *data)
+{
+	struct share_walk_dir *wd = data;
+	pslist_t *sl;
+
+	PSLIST_FOREACH(wd->files, sl) {
+		struct share_walk_file *f = sl->data;
+
+		HFREE_NULL(f->path);
+		WFREE(f);
+	}
+
+	pslist_free_null(&wd->files);
+	atom_str_free_null(&wd->base_dir);
+	HFREE_NULL(wd->path);
+	WFREE(wd);
+}
+
+/**
+ * Read directory, recording its regular files and queueing its
+ * sub-directories.
+ *
+ * This routine is run by the walker threads.
+ */
+static void
+share_walk_read(struct share_walk *sw, struct share_walk_dir *wd)
+{
+	struct dirent *dir_entry;
+	pslist_t *sub_dirs = NULL, *sl;
+	DIR *dir;
+
+	if (directory_is_unshareable(wd->path))
+		return;
+
+	if (NULL == (dir = opendir(wd->path))) {
+		g_warning("can't open directory %s: %m", wd->path);
+		return;
+	}
+
+	share_watch_add(wd->path);
+
+	if (GNET_PROPERTY(share_debug) > 5)
+		g_debug("SHARE scanning directory \"%s\"", wd->path);
+
+	while (NULL != (dir_entry = readdir(dir))) {
+		filestat_t sb;
+		char *fullpath;
+
+		if (atomic_bool_get(&sw->stop))
+			break;
+
+		fullpath = recursive_scan_entry(wd->path, dir_entry, FALSE, &sb);
+
+		if (NULL == fullpath)
+			continue;
+
+		if (S_ISDIR(sb.st_mode)) {
+			sub_dirs = pslist_prepend(sub_dirs, fullpath);
+		} else {
+			struct share_walk_file *f;
+
+			WALLOC(f);
+			f->path = fullpath;
+			f->sb = sb;
+			wd->files = pslist_prepend(wd->files, f);
+		}
+	}
+
+	closedir(dir);
+
+	if (NULL == sub_dirs)
+		return;
+
+	mutex_lock(&sw->lock);
+
+	PSLIST_FOREACH(sub_dirs, sl) {
+		struct share_walk_dir *sd;
+
+		sd = share_walk_dir_alloc(wd->base_dir, sl->data);
+		slist_prepend(sw->pending, sd);
+	}
+	cond_broadcast(&sw->work, &sw->lock);
+
+	mutex_unlock(&sw->lock);
+
+	pslist_free_null(&sub_dirs);
+}
+
+/**
+ * Walker thread main loop.
+ */
+static void *
+share_walk_thread(void *arg)
+{
+	struct share_walk *sw = arg;
+
+	share_walk_check(sw);
+	thread_set_name("walker");
+
+	mutex_lock(&sw->lock);
+
+	for (;;) {
+		struct share_walk_dir *wd;
+
+		while (0 == slist_length(sw->pending) && !sw->stop)
+			cond_wait(&sw->work, &sw->lock);
+
+		if (sw->stop)
+			break;
+
+		wd = slist_shift(sw->pending);
+		sw->busy++;
+
+		mutex_unlock(&sw->lock);
+		share_walk_read(sw, wd);
+		mutex_lock(&sw->lock);
+
+		sw->busy--;
+		slist_append(sw->done, wd);
+		cond_signal(&sw->ready, &sw->lock);
+	}
+
+	mutex_unlock(&sw->lock);
+
+	return NULL;
+}
+
+/**
+ * Stop the walkers and free the pool, nullifying its pointer.
+ */
+static void
+share_walk_free_null(struct share_walk **sw_ptr)
+{
+	struct share_walk *sw = *sw_ptr;
+	uint i;
+
+	if (NULL == sw)
+		return;
+
+	share_walk_check(sw);
+
+	mutex_lock(&sw->lock);
+	atomic_bool_set(&sw->stop, TRUE);
+	cond_broadcast(&sw->work, &sw->lock);
+	mutex_unlock(&sw->lock);
+
+	for (i = 0; i < sw->count; i++) {
+		if (-1 == thread_join(sw->tid[i], NULL)) {
+			g_warning("%s(): cannot join with %s: %m",
+				G_STRFUNC, thread_id_name(sw->tid[i]));
+		}
+	}
+
+	slist_free_all(&sw->pending, share_walk_dir_free);
+	slist_free_all(&sw->done, share_walk_dir_free);
+	cond_destroy(&sw->work);
+	cond_destroy(&sw->ready);
+	mutex_destroy(&sw->lock);
+	HFREE_NULL(sw->tid);
+	sw->magic = 0;
+	WFREE(sw);
+	*sw_ptr = NULL;
+}
+
+/**
+ * Start walking the shared directories.
+ *
+ * @param base_dirs		the list of shared directories (atoms)
+ * @param count			the amount of walker threads to launch
+ *
+ * @return the walker pool, NULL if we could not create any thread.
+ */
+static struct share_walk *
+share_walk_new(const slist_t *base_dirs, uint count)
+{
+	struct share_walk *sw;
+	slist_iter_t *iter;
+	uint i;
+
+	WALLOC0(sw);
+	sw->magic = SHARE_WALK_MAGIC;
+	mutex_init(&sw->lock);
+	cond_init(&sw->work, &sw->lock);
+	cond_init(&sw->ready, &sw->lock);
+	sw->pending = slist_new();
+	sw->done = slist_new();
+	HALLOC_ARRAY(sw->tid, count);
+
+	iter = slist_iter_before_head(base_dirs);
+	while (slist_iter_has_next(iter)) {
+		const char *dir = slist_iter_next(iter);
+		slist_append(sw->pending, share_walk_dir_alloc(dir, h_strdup(dir)));
+	}
+	slist_iter_free(&iter);
+
+	for (i = 0; i < count; i++) {
+		int tid = thread_create(share_walk_thread, sw,
+			THREAD_F_NO_CANCEL | THREAD_F_WARN, THREAD_STACK_MIN);
+
+		if (-1 == tid)
+			break;
+
+		sw->tid[sw->count++] = tid;
+	}
+
+	if (0 == sw->count) {
+		g_warning("%s(): cannot launch directory walkers, "
+			"will read directories sequentially", G_STRFUNC);
+		share_walk_free_null(&sw);
+	} else if (GNET_PROPERTY(share_debug)) {
+		g_debug("SHARE reading directories with %u walker%s",
+			PLURAL(sw->count));
+	}
+
+	return sw;
+}
+
+/**
+ * Get the next directory read by the walkers.
+ *
+ * @param sw		the walker pool
+ * @param wait		whether to wait a little if no directory is ready
+ * @param finished	set to TRUE when all the directories have been read
+ *
+ * @return a directory read, NULL if none is available.
+ */
+static struct share_walk_dir *
+share_walk_next(struct share_walk *sw, bool wait, bool *finished)
+{
+	struct share_walk_dir *wd;
+
+	share_walk_check(sw);
+
+	mutex_lock(&sw->lock);
+
+	wd = slist_shift(sw->done);
+
+	if (NULL == wd && wait && (sw->busy != 0 || slist_length(sw->pending))) {
+		tm_t timeout;
+
+		timeout.tv_sec = 0;
+		timeout.tv_usec = SHARE_WALK_WAIT * 1000;
+		cond_timed_wait(&sw->ready, &sw->lock, &timeout);
+		wd = slist_shift(sw->done);
+	}
+
+	*finished = NULL == wd && 0 == sw->busy && 0 == slist_length(sw->pending);
+
+	mutex_unlock(&sw->lock);
+
+	return wd;
+}
+
 enum recursive_scan_magic { RECURSIVE_SCAN_MAGIC = 0x16926d87U };
 
 struct recursive_scan {
@@ -1525,6 +2258,10 @@ struct recursive_scan {
 	int idx;					/* iterating index */
 	int ticks;					/* ticks used */
 	size_t ftable_capacity;		/* Amount of entries in ftable[] */
+	htable_t *changes;			/* changed directories, for library updates */
+	slist_t *changed;			/* changed directories still to be scanned */
+	bool flat;					/* whether to skip sub-directories */
+	struct share_walk *walk;	/* directory walkers, for full rescans */
 };
 
 static inline void
@@ -1646,6 +2383,9 @@ recursive_scan_context_free(void *data)
 	}
 
 	shared_file_slist_free_null(&ctx->shared);
+	slist_free(&ctx->changed);
+	share_changes_free_null(&ctx->changes);
+	share_walk_free_null(&ctx->walk);
 
 	ctx->task = NULL;
 	ctx->magic = 0;
@@ -1749,6 +2489,7 @@ recursive_scan_opendir(struct recursive_scan *ctx, const char * const dir)
 		ctx->relative_path = NULL;
 	}
 	ctx->current_dir = atom_str_get(dir);
+	share_watch_add(dir);
 
 	if (GNET_PROPERTY(share_debug) > 5)
 		g_debug("SHARE scanning directory \"%s\"", ctx->current_dir);
@@ -1757,7 +2498,6 @@ recursive_scan_opendir(struct recursive_scan *ctx, const char * const dir)
 static void
 recursive_scan_readdir(struct recursive_scan *ctx)
 {
-	char *fullpath = NULL;
 	struct dirent *dir_entry;
 
 	recursive_scan_check(ctx);
@@ -1765,138 +2505,107 @@ recursive_scan_readdir(struct recursive_scan *ctx)
 
 	dir_entry = readdir(ctx->directory);
 	if (dir_entry) {
-		const char *filename = dir_entry_filename(dir_entry);
 		filestat_t sb;
+		char *fullpath;
 
-		if (GNET_PROPERTY(share_debug) > 19)
-			g_debug("SHARE considering entry \"%s\"", filename);
+		fullpath = recursive_scan_entry(ctx->current_dir, dir_entry,
+			ctx->flat, &sb);
 
-		if ('.' == filename[0]) {
-			/* Hidden file, or "." or ".." */
-			goto finish;
-		}
-
-		sb.st_mode = dir_entry_mode(dir_entry);
-		switch (sb.st_mode) {
-		case 0:
-		case S_IFREG:
-		case S_IFDIR:
-		case S_IFLNK:
-			break;
-		default:
-			if (GNET_PROPERTY(share_debug)) {
-				g_warning("skipping file of unknown type \"%s\" in \"%s\"",
-					ctx->current_dir, filename);
-			}
-			goto finish;
-		}
-
-		if (
-			S_ISLNK(sb.st_mode) &&
-			GNET_PROPERTY(scan_ignore_symlink_dirs) &&
-			GNET_PROPERTY(scan_ignore_symlink_regfiles)
-		) {
-			if (GNET_PROPERTY(share_debug) > 15) {
-				g_debug("SHARE to-be-ignored symlink, discarding \"%s\"",
-					filename);
-			}
-			goto finish;
-		}
-
-		if (
-			S_ISREG(sb.st_mode) &&
-			!shared_file_valid_extension(filename)
-		) {
-			if (GNET_PROPERTY(share_debug) > 15) {
-				g_debug("SHARE unshared extension, discarding \"%s\"",
-					filename);
-			}
-			goto finish;
-		}
+		if (NULL == fullpath)
+			return;
 
 		ctx->ticks += 10;	/* Heavier work */
 
-		fullpath = make_pathname(ctx->current_dir, filename);
-		if (S_ISREG(sb.st_mode) || S_ISDIR(sb.st_mode)) {
-			if (stat(fullpath, &sb)) {
-				g_warning("stat() failed %s: %m", fullpath);
-				goto finish;
-			}
-		} else if (!S_ISLNK(sb.st_mode)) {
-			if (lstat(fullpath, &sb)) {
-				g_warning("lstat() failed %s: %m", fullpath);
-				goto finish;
-			}
-
-			if (
-				S_ISLNK(sb.st_mode) &&
-				GNET_PROPERTY(scan_ignore_symlink_dirs) &&
-				GNET_PROPERTY(scan_ignore_symlink_regfiles)
-			) {
-				/*
-				 * We check this again because dir_entry_mode() does not
-				 * work everywhere.
-				 */
-				if (GNET_PROPERTY(share_debug) > 15) {
-					g_debug("SHARE to-be-ignored symlink, discarding \"%s\"",
-						filename);
-				}
-				goto finish;
-			}
-		}
-
-		/* Get info on the symlinked file */
-		if (S_ISLNK(sb.st_mode)) {
-			if (stat(fullpath, &sb)) {
-				g_warning("broken symlink %s: %m", fullpath);
-				goto finish;
-			}
-
-			/*
-			 * For symlinks, we check whether we are supposed to process
-			 * symlinks for that type of entry, then either proceed or skip the
-			 * entry.
-			 */
-
-			if (
-				S_ISDIR(sb.st_mode) &&
-				GNET_PROPERTY(scan_ignore_symlink_dirs)
-			) {
-				if (GNET_PROPERTY(share_debug) > 15)
-					g_debug("SHARE discarding symlink dir \"%s\"", filename);
-				goto finish;
-			}
-			if (
-				S_ISREG(sb.st_mode) &&
-				GNET_PROPERTY(scan_ignore_symlink_regfiles)
-			) {
-				if (GNET_PROPERTY(share_debug) > 15)
-					g_debug("SHARE discarding symlink file \"%s\"", filename);
-				goto finish;
-			}
-		}
-
 		if (S_ISDIR(sb.st_mode)) {
 			/* If a directory, add to list for later processing */
 			slist_prepend(ctx->sub_dirs, fullpath);
-			fullpath = NULL;
-		} else if (S_ISREG(sb.st_mode)) {
+		} else {
 			shared_file_t *sf;
 
 			if (GNET_PROPERTY(share_debug) > 10)
-				g_debug("SHARE adding file \"%s\"", filename);
+				g_debug("SHARE adding file \"%s\"", fullpath);
 
 			sf = share_scan_add_file(ctx->relative_path, fullpath, &sb);
 			if (sf) {
 				slist_append(ctx->shared_files, shared_file_ref(sf));
 			}
+			HFREE_NULL(fullpath);
 		}
 	} else {
 		recursive_scan_closedir(ctx);
 	}
+}
 
-finish:
-	HFREE_NULL(fullpath);
+/**
+ * Create the shared files for the regular files of a directory read by
+ * the walkers.
+ */
+static void
+recursive_scan_walk_add(struct recursive_scan *ctx, struct share_walk_dir *wd)
+{
+	const char *relative_path = NULL;
+	pslist_t *sl;
+
+	recursive_scan_check(ctx);
+
+	if (GNET_PROPERTY(search_results_expose_relative_paths))
+		relative_path = get_relative_path(wd->base_dir, wd->path);
+
+	PSLIST_FOREACH(wd->files, sl) {
+		struct share_walk_file *f = sl->data;
+		shared_file_t *sf;
+
+		if (GNET_PROPERTY(share_debug) > 10)
+			g_debug("SHARE adding file \"%s\"", f->path);
+
+		sf = share_scan_add_file(relative_path, f->path, &f->sb);
+		if (sf) {
+			slist_append(ctx->shared_files, shared_file_ref(sf));
+		}
+		ctx->ticks += 10;
+	}
+
+	atom_str_free_null(&relative_path);
+}
+
+/**
+ * Collect the directories read by the walkers.
+ */
+static bgret_t
+recursive_scan_step_walk(struct bgtask *bt, struct recursive_scan *ctx,
+	int ticks)
+{
+	bool wait = THREAD_MAIN_ID != share_thread_id;
+
+	/*
+	 * We can wait for the walkers from the library thread, but not when
+	 * the scan runs in the main thread: we come back later instead.
+	 */
+
+	ctx->ticks = 0;
+	do {
+		struct share_walk_dir *wd;
+		bool finished;
+
+		bg_task_cancel_test(ctx->task);
+
+		wd = share_walk_next(ctx->walk, wait, &finished);
+
+		if (NULL == wd) {
+			if (finished) {
+				share_walk_free_null(&ctx->walk);
+				bg_task_ticks_used(bt, ctx->ticks);
+				return BGR_NEXT;
+			}
+			break;
+		}
+
+		recursive_scan_walk_add(ctx, wd);
+		share_walk_dir_free(wd);
+		ctx->ticks++;
+	} while (ctx->ticks < ticks);
+
+	return BGR_MORE;
 }
 
 /**
@@ -2054,6 +2763,9 @@ recursive_scan_step_compute(struct bgtask *bt, void *data, int ticks)
 
 	recursive_scan_check(ctx);
 
+	if (ctx->walk != NULL)
+		return recursive_scan_step_walk(bt, ctx, ticks);
+
 	ctx->ticks = 0;
 	do {
 		if (recursive_scan_next_dir(ctx)) {
@@ -2420,6 +3132,8 @@ recursive_scan_step_install_shared(struct bgtask *bt, void *data, int ticks)
 
 	SHARED_LIBFILE_UNLOCK;
 
+	atomic_uint_inc(&shared_libfile_generation);
+
 	shared_file_slist_free_null(&files);
 
 	/*
@@ -2429,50 +3143,228 @@ recursive_scan_step_install_shared(struct bgtask *bt, void *data, int ticks)
 	 *		--RAM, 2013-10-29
 	 */
 
-	teq_safe_rpc(THREAD_MAIN_ID, recursive_install_shared, NULL);
+	teq_safe_rpc(THREAD_MAIN_ID, recursive_install_shared, NULL);
+
+	/*
+	 * The next step is going to request the SHA1 of all the library files,
+	 * which will fill again the known SHA1 cache.
+	 */
+
+	bg_task_ticks_used(bt, ctx->files_scanned / 10);
+	ctx->idx = 0;		/* Prepare next step */
+	return BGR_NEXT;
+}
+
+/**
+ * Get a snapshot copy (atomically) of all the shared files currently
+ * visible from the application.
+ *
+ * The ctx->ftable[] array is dynamically allocated to hold a reference-counted
+ * shared file, or NULL if the file was de-indexed for some reason since it
+ * was initially scanned.
+ *
+ * The ctx->ftable_capacity variable is set to hold the ftable[] capacity.
+ */
+static void
+recursive_scan_load_ftable(struct recursive_scan *ctx)
+{
+	size_t i;
+
+	g_assert(NULL == ctx->ftable);
+
+	SHARED_LIBFILE_LOCK;
+
+	ctx->ftable_capacity = shared_libfile.files_scanned;
+	XMALLOC0_ARRAY(ctx->ftable, ctx->ftable_capacity);
+
+	for (i = 0; i < ctx->ftable_capacity; i++) {
+		shared_file_t *sf = shared_libfile.file_table[i];
+
+		if (sf != NULL)
+			ctx->ftable[i] = shared_file_ref(sf);
+	}
+
+	SHARED_LIBFILE_UNLOCK;
+
+	ctx->ticks += ctx->ftable_capacity;
+}
+
+/**
+ * Library update: carry over the files of the current library which are not
+ * located in changed directories, and list the directories to scan again.
+ */
+static bgret_t
+recursive_scan_step_watch_load(struct bgtask *bt, void *data, int ticks)
+{
+	struct recursive_scan *ctx = data;
+
+	recursive_scan_check(ctx);
+	g_assert(ctx->changes != NULL);
+
+	ctx->ticks = 0;
+
+	if (0 == ctx->idx) {
+		htable_iter_t *iter;
+		const void *key;
+
+		/*
+		 * Directories located within a changed tree will be scanned when
+		 * that tree is scanned again.
+		 */
+
+		g_assert(NULL == ctx->changed);
+
+		ctx->changed = slist_new();
+		iter = htable_iter_new(ctx->changes);
+
+		while (htable_iter_next(iter, &key, NULL)) {
+			if (!share_changes_contain(ctx->changes, key, TRUE))
+				slist_append(ctx->changed, deconstify_pointer(key));
+		}
+
+		htable_iter_release(&iter);
+		recursive_scan_load_ftable(ctx);
+	}
+
+	while (UNSIGNED(ctx->idx) < ctx->ftable_capacity) {
+		shared_file_t *sf;
+		char *dir;
+		int i = ctx->idx++;
+
+		sf = ctx->ftable[i];
+
+		if (NULL == sf)
+			continue;
+
+		shared_file_check(sf);
+
+		dir = filepath_directory(sf->file_path);
+		if (NULL == dir || !share_changes_contain(ctx->changes, dir, FALSE)) {
+			shared_file_t *cf = shared_file_clone(sf);
+			slist_append(ctx->shared_files, shared_file_ref(cf));
+		}
+		HFREE_NULL(dir);
+
+		shared_file_unref(&ctx->ftable[i]);
+
+		if (ctx->ticks++ >= ticks)
+			return BGR_MORE;
+
+		if (0 == (ctx->ticks & 0xf))
+			bg_task_cancel_test(ctx->task);
+	}
 
-	/*
-	 * The next step is going to request the SHA1 of all the library files,
-	 * which will fill again the known SHA1 cache.
-	 */
+	if (GNET_PROPERTY(share_debug)) {
+		g_debug("SHARE updating library: kept %u file%s, "
+			"%u director%s to scan",
+			PLURAL(slist_length(ctx->shared_files)),
+			PLURAL_Y(slist_length(ctx->changed)));
+	}
 
-	bg_task_ticks_used(bt, ctx->files_scanned / 10);
-	ctx->idx = 0;		/* Prepare next step */
+	XFREE_NULL(ctx->ftable);
+	ctx->ftable_capacity = 0;
+	ctx->idx = 0;			/* Prepare for request_sha1 step */
+
+	bg_task_ticks_used(bt, ctx->ticks);
 	return BGR_NEXT;
 }
 
 /**
- * Get a snapshot copy (atomically) of all the shared files currently
- * visible from the application.
+ * Find the shared directory under which a directory lies.
  *
- * The ctx->ftable[] array is dynamically allocated to hold a reference-counted
- * shared file, or NULL if the file was de-indexed for some reason since it
- * was initially scanned.
- *
- * The ctx->ftable_capacity variable is set to hold the ftable[] capacity.
+ * @return the shared directory (atom), NULL if none.
  */
-static void
-recursive_scan_load_ftable(struct recursive_scan *ctx)
+static const char *
+recursive_scan_watch_root(const struct recursive_scan *ctx, const char *dir)
 {
-	size_t i;
+	slist_iter_t *iter;
+	const char *root = NULL;
+	size_t rootlen = 0;
 
-	g_assert(NULL == ctx->ftable);
+	iter = slist_iter_before_head(ctx->base_dirs);
 
-	SHARED_LIBFILE_LOCK;
+	while (slist_iter_has_next(iter)) {
+		const char *base = slist_iter_next(iter);
+		size_t len = vstrlen(base);
 
-	ctx->ftable_capacity = shared_libfile.files_scanned;
-	XMALLOC0_ARRAY(ctx->ftable, ctx->ftable_capacity);
+		if (
+			len > rootlen && 0 == strncmp(dir, base, len) &&
+			('\0' == dir[len] || G_DIR_SEPARATOR == dir[len])
+		) {
+			root = base;
+			rootlen = len;
+		}
+	}
 
-	for (i = 0; i < ctx->ftable_capacity; i++) {
-		shared_file_t *sf = shared_libfile.file_table[i];
+	slist_iter_free(&iter);
+	return root;
+}
 
-		if (sf != NULL)
-			ctx->ftable[i] = shared_file_ref(sf);
+/**
+ * @return TRUE if finished.
+ */
+static bool
+recursive_scan_watch_next_dir(struct recursive_scan *ctx)
+{
+	recursive_scan_check(ctx);
+
+	bg_task_cancel_test(ctx->task);
+
+	if (ctx->directory) {
+		recursive_scan_readdir(ctx);
+		return FALSE;
+	} else if (slist_length(ctx->sub_dirs) > 0) {
+		char *dir;
+
+		dir = slist_shift(ctx->sub_dirs);
+		recursive_scan_opendir(ctx, dir);
+		HFREE_NULL(dir);
+		return FALSE;
+	} else if (slist_length(ctx->changed) > 0) {
+		const char *dir, *root;
+
+		/*
+		 * Directories that were removed since they changed or which are
+		 * no longer shared are simply skipped: their files are gone.
+		 */
+
+		dir = slist_shift(ctx->changed);
+		root = recursive_scan_watch_root(ctx, dir);
+
+		if (root != NULL && is_directory(dir)) {
+			atom_str_free_null(&ctx->base_dir);
+			ctx->base_dir = atom_str_get(root);
+			ctx->flat = SHARE_CHANGE_DIR ==
+				pointer_to_uint(htable_lookup(ctx->changes, dir));
+			recursive_scan_opendir(ctx, dir);
+		}
+		return FALSE;
+	} else {
+		atom_str_free_null(&ctx->base_dir);
+		return TRUE;
 	}
+}
 
-	SHARED_LIBFILE_UNLOCK;
+/**
+ * Library update: scan the changed directories.
+ */
+static bgret_t
+recursive_scan_step_watch_compute(struct bgtask *bt, void *data, int ticks)
+{
+	struct recursive_scan *ctx = data;
 
-	ctx->ticks += ctx->ftable_capacity;
+	recursive_scan_check(ctx);
+
+	ctx->ticks = 0;
+	do {
+		if (recursive_scan_watch_next_dir(ctx)) {
+			bg_task_ticks_used(bt, ctx->ticks);
+			return BGR_NEXT;
+		}
+		ctx->ticks++;
+	} while (ctx->ticks < ticks);
+
+	return BGR_MORE;
 }
 
 static bgret_t
@@ -2842,6 +3734,17 @@ recursive_scan_finalize(void *arg)
 
 	gnet_prop_set_guint32_val(PROP_QRP_INDEXING_DURATION, elapsed);
 
+	/*
+	 * If we could not watch all the scanned directories, we would miss
+	 * changes: stop watching and let the next rescan be a full one.
+	 */
+
+	if (share_watch.failed) {
+		g_warning("cannot watch all shared directories for changes, "
+			"will do full library rescans");
+		share_watch_close();
+	}
+
 	qrp_finalize_computation(ctx->words);
 	ctx->words = NULL;		/* Gave pointer, QRP computation will free it */
 
@@ -2940,9 +3843,19 @@ share_rescan_create_task(bgsched_t *bs)
 		recursive_scan_step_finalize,
 	};
 	struct recursive_scan *ctx;
+	uint threads;
 
 	ctx = recursive_scan_new(shared_dirs, tm_time());
 
+	/*
+	 * Directories are read in parallel by walker threads when configured
+	 * to use more than one thread.  The walkers start right away.
+	 */
+
+	threads = GNET_PROPERTY(library_scan_threads);
+	if (threads > 1)
+		ctx->walk = share_walk_new(ctx->base_dirs, threads);
+
 	return ctx->task = bg_task_create(bs, "recursive scan",
 				steps, N_ITEMS(steps),
 				ctx, recursive_scan_context_free,
@@ -2979,6 +3892,57 @@ share_update_qrp_create_task(bgsched_t *bs)
 				recursive_scan_done, NULL);
 }
 
+/**
+ * Create a new background task for library update (+ QRP rebuilding).
+ *
+ * This is a library rescan limited to the changed directories.
+ *
+ * @param bs		the scheduler to which task should be inserted into
+ * @param changes	the change set, taken over by the task
+ *
+ * @return a new background task.
+ */
+static struct bgtask *
+share_update_create_task(bgsched_t *bs, htable_t *changes)
+{
+	static const bgstep_cb_t steps[] = {
+		recursive_scan_step_setup,
+		recursive_scan_step_watch_load,
+		recursive_scan_step_watch_compute,
+
+		/*
+		 * The following group of steps is identical to the ones listed in
+		 * share_rescan_create_task().
+		 */
+
+		recursive_scan_step_compute_done,
+		recursive_scan_step_build_search_table,
+		recursive_scan_step_build_file_table,
+		recursive_scan_step_build_basenames,
+		recursive_scan_step_update_scan_timing,
+		recursive_scan_step_build_sorted_table,
+		recursive_scan_step_install_shared,
+		recursive_scan_step_request_sha1,
+		recursive_scan_step_tth_cache_cleanup,
+		recursive_scan_step_load_partials,
+		recursive_scan_step_build_partial_table,
+		recursive_scan_step_install_partials,
+		recursive_scan_step_prepare_qrp,
+		recursive_scan_step_update_qrp_lib,
+		recursive_scan_step_update_qrp_partial,
+		recursive_scan_step_finalize,
+	};
+	struct recursive_scan *ctx;
+
+	ctx = recursive_scan_new(shared_dirs, tm_time());
+	ctx->changes = changes;
+
+	return ctx->task = bg_task_create(bs, "library update",
+				steps, N_ITEMS(steps),
+				ctx, recursive_scan_context_free,
+				recursive_scan_done, NULL);
+}
+
 /*
  * The "share_thread_lib_xxx" routine is the implementation, within the
  * "library" thread, of the corresponding API invoked from the "main" thread.
@@ -2994,6 +3958,7 @@ static void
 share_thread_lib_rescan(void *unused_arg)
 {
 	struct share_thread_vars *v = &share_thread_vars;
+	htable_t *changes;
 
 	(void) unused_arg;
 
@@ -3006,8 +3971,12 @@ share_thread_lib_rescan(void *unused_arg)
 
 	v->qrp_rebuild = FALSE;		/* since rescan takes care of it */
 	v->task = share_rescan_create_task(v->sched);
+	changes = v->changes;		/* rescan also takes care of these */
+	v->changes = NULL;
 
 	spinunlock(&v->lock);
+
+	share_changes_free_null(&changes);
 }
 
 /**
@@ -3039,6 +4008,228 @@ share_thread_lib_qrp_rebuild(void *unused_arg)
 	}
 }
 
+/**
+ * Update the library for the changes made to the shared directories.
+ *
+ * @param data		the change set, taken over
+ */
+static void
+share_thread_lib_update(void *data)
+{
+	struct share_thread_vars *v = &share_thread_vars;
+	htable_t *changes = data;
+	bool pending;
+
+	spinlock(&v->lock);
+
+	if (v->task != NULL) {
+		if (NULL == v->changes)
+			v->changes = changes;		/* record for later */
+		else
+			share_changes_merge(v->changes, &changes);
+		pending = TRUE;
+	} else {
+		v->qrp_rebuild = FALSE;		/* since update takes care of it */
+		v->task = share_update_create_task(v->sched, changes);
+		pending = FALSE;
+	}
+
+	spinunlock(&v->lock);
+
+	if (GNET_PROPERTY(share_debug) > 1) {
+		g_debug("SHARE background library update %s",
+			pending ? "recorded" : "started");
+	}
+}
+
+/**
+ * Callout queue callback to hand the recorded changes to the library thread.
+ */
+static void
+share_watch_flush(cqueue_t *cq, void *unused_arg)
+{
+	struct share_thread_vars *v = &share_thread_vars;
+	bool busy;
+
+	(void) unused_arg;
+
+	cq_zero(cq, &share_changes_ev);
+
+	/*
+	 * Wait for the current library task to complete: when a full rescan is
+	 * running, the changes it will see need not be processed again.
+	 */
+
+	spinlock(&v->lock);
+	busy = v->task != NULL;
+	spinunlock(&v->lock);
+
+	if (busy) {
+		share_changes_ev = cq_main_insert(SHARE_WATCH_DELAY,
+			share_watch_flush, NULL);
+		return;
+	}
+
+	if (GNET_PROPERTY(share_debug)) {
+		g_debug("SHARE %zu director%s changed in library",
+			PLURAL_Y(htable_count(share_changes)));
+	}
+
+	teq_post(share_thread_id, share_thread_lib_update, share_changes);
+	share_changes = NULL;
+}
+
+#ifdef HAS_INOTIFY
+/**
+ * Process an inotify event, recording the change it reports.
+ *
+ * @return TRUE if a change was recorded.
+ */
+static bool
+share_watch_event(const struct inotify_event *ev)
+{
+	struct share_watch *w = &share_watch;
+	const char *dir;
+	bool changed = FALSE;
+
+	mutex_lock(&w->lock);
+
+	dir = htable_lookup(w->dirs, int_to_pointer(ev->wd));
+
+	if (NULL == dir)
+		goto done;
+
+	if (IN_IGNORED & ev->mask) {
+		/* Watch was removed, directory is gone */
+		htable_remove(w->dirs, int_to_pointer(ev->wd));
+		atom_str_free_null(&dir);
+		goto done;
+	}
+
+	if (NULL == share_changes)
+		share_changes = htable_create(HASH_KEY_STRING, 0);
+
+	if ((IN_DELETE_SELF | IN_MOVE_SELF) & ev->mask) {
+		share_changes_record(share_changes, dir, SHARE_CHANGE_TREE);
+		changed = TRUE;
+	} else if (0 == ev->len || '.' == ev->name[0]) {
+		/* Event on the directory itself, or hidden entry */
+	} else if (IN_ISDIR & ev->mask) {
+		char *path = make_pathname(dir, ev->name);
+		share_changes_record(share_changes, path, SHARE_CHANGE_TREE);
+		HFREE_NULL(path);
+		changed = TRUE;
+	} else if (shared_file_valid_extension(ev->name)) {
+		share_changes_record(share_changes, dir, SHARE_CHANGE_DIR);
+		changed = TRUE;
+	}
+
+	if (GNET_PROPERTY(share_debug) > 5 && changed) {
+		g_debug("SHARE change 0x%x in \"%s\" for \"%s\"",
+			ev->mask, dir, ev->len != 0 ? ev->name : "");
+	}
+
+done:
+	mutex_unlock(&w->lock);
+	return changed;
+}
+#endif	/* HAS_INOTIFY */
+
+/**
+ * I/O callback invoked when inotify events can be read.
+ */
+static void
+share_watch_read(void *unused_data, int source, inputevt_cond_t unused_cond)
+{
+#ifdef HAS_INOTIFY
+	union {
+		struct inotify_event ev;
+		char buf[SHARE_WATCH_BUFLEN];
+	} u;
+	bool changed = FALSE, overflow = FALSE;
+	ssize_t r;
+
+	(void) unused_data;
+	(void) unused_cond;
+
+	while ((r = read(source, u.buf, sizeof u.buf)) > 0) {
+		const char *p = u.buf, *end = &u.buf[r];
+
+		while (p < end) {
+			const struct inotify_event *ev = (const void *) p;
+
+			if (IN_Q_OVERFLOW & ev->mask)
+				overflow = TRUE;
+			else if (share_watch_event(ev))
+				changed = TRUE;
+
+			p += sizeof *ev + ev->len;
+		}
+	}
+
+	if (-1 == r && !is_temporary_error(errno))
+		g_warning("%s(): read() failed: %m", G_STRFUNC);
+
+	if (overflow) {
+		/*
+		 * We lost changes, we have to rescan the whole library.
+		 */
+
+		if (GNET_PROPERTY(share_debug))
+			g_debug("SHARE lost track of changes, rescanning library");
+
+		share_scan();
+	} else if (changed && NULL == share_changes_ev) {
+		share_changes_ev = cq_main_insert(SHARE_WATCH_DELAY,
+			share_watch_flush, NULL);
+	}
+#else
+	(void) unused_data;
+	(void) source;
+	(void) unused_cond;
+	g_assert_not_reached();
+#endif	/* HAS_INOTIFY */
+}
+
+/**
+ * Start watching the library for changes, if configured to.
+ *
+ * Directories are watched as they are scanned by the library thread.
+ */
+static void
+share_watch_open(void)
+{
+	struct share_watch *w = &share_watch;
+	int fd;
+
+	g_assert(-1 == w->fd);
+
+	if (!GNET_PROPERTY(library_watch))
+		return;
+
+#ifdef HAS_INOTIFY
+	fd = inotify_init();
+#else
+	fd = -1;
+	errno = ENOSYS;
+#endif	/* HAS_INOTIFY */
+
+	if (-1 == fd) {
+		g_warning("cannot watch library for changes: %m");
+		return;
+	}
+
+	fd_set_nonblocking(fd);
+	fd_set_close_on_exec(fd);
+
+	mutex_lock(&w->lock);
+	w->fd = fd;
+	w->dirs = htable_create(HASH_KEY_SELF, 0);
+	mutex_unlock(&w->lock);
+
+	share_watch_id = inputevt_add(fd, INPUT_EVENT_RX, share_watch_read, NULL);
+}
+
 /*
  * The "share_lib_xxx" routine constitute the API from the "main" thread to the
  * "library" thread.
@@ -3046,10 +4237,15 @@ share_thread_lib_qrp_rebuild(void *unused_arg)
 
 /**
  * Start a library scan.
+ *
+ * When watching the library, the watch is restarted since the rescan will
+ * install new watches on all the directories it scans.
  */
 static void
 share_lib_rescan(void)
 {
+	share_watch_close();
+	share_watch_open();
 	teq_post_unique(share_thread_id, share_thread_lib_rescan, NULL);
 }
 
@@ -3140,6 +4336,7 @@ share_thread_main(void *arg)
 
 	while (!atomic_bool_get(&v->exiting)) {
 		struct bgtask *bt;
+		htable_t *changes;
 		bool qrp_rebuild;
 
 		if (GNET_PROPERTY(share_debug))
@@ -3171,14 +4368,24 @@ share_thread_main(void *arg)
 		spinlock(&v->lock);
 		if (v->task == bt)
 			v->task = NULL;				/* Finished running previous task */
+		changes = v->changes;
+		v->changes = NULL;
 		qrp_rebuild = v->qrp_rebuild;
 		spinunlock(&v->lock);
 
-		if (qrp_rebuild)
+		/*
+		 * Library changes can also have been recorded, and updating the
+		 * library will also rebuild the QRP table.
+		 */
+
+		if (changes != NULL)
+			share_thread_lib_update(changes);
+		else if (qrp_rebuild)
 			share_thread_lib_qrp_rebuild(NULL);
 	}
 
 	bg_sched_destroy_null(&v->sched);
+	share_changes_free_null(&v->changes);
 
 	g_debug("library thread exiting");
 	return NULL;
@@ -3263,6 +4470,8 @@ share_close(void)
 	if (THREAD_MAIN_ID != share_thread_id)
 		thread_kill(share_thread_id, TSIG_TERM);
 
+	share_watch_close();
+
 	/*
 	 * This call must happen after node_close() to ensure the UDP TX scheduler
 	 * has been released and that no messages there could invoked callbacks
@@ -3280,6 +4489,7 @@ share_close(void)
 	oob_close();			/* References hits, so needs ``sha1_to_share'' */
 	qhit_close();
 	st_free(&shared_libfile.partial_table);
+	st_close();
 	htable_free_null(&share_media_types);
 	hset_free_null(&partial_files);
 	hikset_free_null(&sha1_to_share);
@@ -3320,6 +4530,9 @@ shared_file_set_sha1(shared_file_t *sf, const struct sha1 *sha1)
 
 	atom_sha1_change(&sf->sha1, sha1);
 
+	if (SHARE_F_INDEXED & sf->flags)
+		atomic_uint_inc(&shared_libfile_generation);	/* Hits will differ */
+
 	/*
 	 * If the file is no longer in the index table, it must not be
 	 * put into the tree again. This might happen if a SHA-1 calculation
@@ -3386,6 +4599,9 @@ shared_file_set_tth(shared_file_t *sf, const struct tth *tth)
 
 	atom_tth_change(&sf->tth, tth);
 
+	if (SHARE_F_INDEXED & sf->flags)
+		atomic_uint_inc(&shared_libfile_generation);	/* Hits will differ */
+
 	/*
 	 * If the file is seeded, notify the fileinfo layer that the TTH was
 	 * recomputed and now lies in the cache!  That way we can update the
@@ -4097,6 +5313,19 @@ shared_files_scanned(void)
 	return files_scanned();
 }
 
+/**
+ * Get the library generation number.
+ *
+ * It changes each time the set of shared files changes, or when a shared
+ * file gets its SHA1 or TTH computed, so that callers caching anything
+ * derived from the library can know when their data became stale.
+ */
+uint
+shared_files_generation(void)
+{
+	return atomic_uint_get(&shared_libfile_generation);
+}
+
 /**
  * Request asynchronous partial file table (for pattern matching) and QRP
  * table rebuild if necessary.
@@ -4176,6 +5405,7 @@ share_init(void)
 	size_t i;
 
 	huge_init();
+	st_init();
 	qrp_init();
 	qhit_init();
 	oob_init();
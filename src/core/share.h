@@ -96,6 +96,7 @@ void share_close(void);
 
 shared_file_t *shared_file(uint idx);
 shared_file_t *shared_file_sorted(uint idx);
+uint shared_files_generation(void);
 shared_file_t *shared_file_by_name(const char *filename);
 shared_file_t *shared_file_ref(const shared_file_t *sf);
 shared_file_t *shared_file_by_sha1(const struct sha1 *sha1);
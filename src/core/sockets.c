@@ -115,6 +115,8 @@
 #define UDP_QUEUED_GUESS	65536	/**< Guess amount of pending RX input */
 #define UDP_QUEUE_DELAY_MS	250		/**< RX queue processing delay */
 #define TLS_BAN_FREQ		300		/**< Avoid TLS for 5 minutes */
+#define ACCEPT_BATCH_MAX	32		/**< Max connections accepted per event */
+#define ACCEPT_BACKLOG		128		/**< Listening queue for TCP sockets */
 
 enum {
 	SOCK_ADNS_PENDING	= 1 << 0,	/**< Don't free() the socket too early */
@@ -2513,37 +2515,19 @@ socket_local_port(const struct gnutella_socket *s)
 }
 
 /**
- * Someone is connecting to us.
+ * Accept one pending connection on listening socket.
+ *
+ * @return TRUE if a connection was dequeued from the listening queue,
+ * FALSE if the queue is empty or accept() failed.
  */
-static void
-socket_accept(void *data, int unused_source, inputevt_cond_t cond)
+static bool
+socket_accept_one(struct gnutella_socket *s)
 {
 	socket_addr_t addr;
 	socklen_t addr_len;
-	struct gnutella_socket *s = data;
 	struct gnutella_socket *t = NULL;
 	int fd;
 
-	(void) unused_source;
-	socket_check(s);
-	g_assert(s->flags & (SOCK_F_TCP | SOCK_F_LOCAL));
-
-	if G_UNLIKELY(cond & INPUT_EVENT_EXCEPTION) {
-		g_warning("%s(): input exception on TCP listening socket #%d!",
-			G_STRFUNC, s->file_desc);
-		return;		/* Ignore it, what else can we do? */
-	}
-
-	switch (s->type) {
-	case SOCK_TYPE_CONTROL:
-		break;
-	default:
-		g_warning("%s(): unknown listening socket type %d !",
-			G_STRFUNC, s->type);
-		socket_destroy(s, NULL);
-		return;
-	}
-
 	addr_len = socket_addr_init(&addr, s->net);
 	fd = compat_accept(s->file_desc,
 			socket_addr_get_sockaddr(&addr), &addr_len);
@@ -2574,15 +2558,38 @@ socket_accept(void *data, int unused_source, inputevt_cond_t cond)
 					socket_evt_clear(s);
 				}
 			}
-			return;
+			return FALSE;
 		}
 
 		g_warning("had to close a banned fd to accept new connection");
 	}
+
+	/*
+	 * Close connections from known hostile addresses right away, before
+	 * allocating anything for them: during an accept storm this keeps the
+	 * listening queue drained for legitimate peers.
+	 */
+
+	if (SOCK_F_TCP & s->flags) {
+		host_addr_t ha = socket_addr_get_addr(&addr);
+
+		if (is_host_addr(ha) && hostiles_is_bad(ha)) {
+			if (GNET_PROPERTY(socket_debug) > 1) {
+				g_debug("%s(): closing incoming TCP connection from "
+					"hostile %s", G_STRFUNC, host_addr_to_string(ha));
+			}
+			s_close(fd);
+			gnet_stats_inc_general(GNR_TCP_ACCEPT_HOSTILE_CLOSED);
+			return TRUE;
+		}
+	}
+
 	fd = fd_get_non_stdio(fd);
 
-	if (s->flags & SOCK_F_TCP)
+	if (s->flags & SOCK_F_TCP) {
 		bws_sock_accepted(SOCK_TYPE_HTTP);	/* Do not charge Gnet for that */
+		gnet_stats_inc_general(GNR_TCP_ACCEPTED);
+	}
 
 	/*
 	 * Create a new struct socket for this incoming connection
@@ -2613,14 +2620,14 @@ socket_accept(void *data, int unused_source, inputevt_cond_t cond)
 		if (socket_addr_getpeername(&addr, t->file_desc)) {
 			g_warning("getpeername() failed: %m");
 			socket_free_null(&t);
-			return;
+			return TRUE;
 		}
 		t->addr = socket_addr_get_addr(&addr);
 		t->port = socket_addr_get_port(&addr);
 		if (!is_host_addr(t->addr)) {
 			g_warning("incoming TCP connection from unidentifiable source");
 			socket_free_null(&t);
-			return;
+			return TRUE;
 		}
 		g_warning("had to use getpeername() after accept(): peer=%s",
 			host_addr_port_to_string(t->addr, t->port));
@@ -2635,8 +2642,9 @@ socket_accept(void *data, int unused_source, inputevt_cond_t cond)
 				G_STRFUNC, host_addr_port_to_string(t->addr, t->port),
 				gip_country_cc(t->addr));
 		}
+		gnet_stats_inc_general(GNR_TCP_ACCEPT_CTL_CLOSED);
 		socket_free_null(&t);
-		return;
+		return TRUE;
 	}
 
 	t->tls.enabled = s->tls.enabled; /* Inherit from listening socket */
@@ -2690,6 +2698,51 @@ socket_accept(void *data, int unused_source, inputevt_cond_t cond)
 	inet_got_incoming(t->addr);	/* Signal we got an incoming connection */
 	if (!GNET_PROPERTY(force_local_ip))
 		guess_local_addr(t);
+
+	return TRUE;
+}
+
+/**
+ * Someone is connecting to us.
+ *
+ * The listening socket is non-blocking, so we drain its queue by batches
+ * of at most ACCEPT_BATCH_MAX connections per event: a single wakeup per
+ * connection would let the kernel queue overflow when we are hammered.
+ */
+static void
+socket_accept(void *data, int unused_source, inputevt_cond_t cond)
+{
+	struct gnutella_socket *s = data;
+	uint n;
+
+	(void) unused_source;
+	socket_check(s);
+	g_assert(s->flags & (SOCK_F_TCP | SOCK_F_LOCAL));
+
+	if G_UNLIKELY(cond & INPUT_EVENT_EXCEPTION) {
+		g_warning("%s(): input exception on TCP listening socket #%d!",
+			G_STRFUNC, s->file_desc);
+		return;		/* Ignore it, what else can we do? */
+	}
+
+	switch (s->type) {
+	case SOCK_TYPE_CONTROL:
+		break;
+	default:
+		g_warning("%s(): unknown listening socket type %d !",
+			G_STRFUNC, s->type);
+		socket_destroy(s, NULL);
+		return;
+	}
+
+	gnet_stats_inc_general(GNR_TCP_ACCEPT_EVENTS);
+
+	for (n = 0; n < ACCEPT_BATCH_MAX; n++) {
+		if (!socket_accept_one(s) || 0 == s->gdk_tag)
+			return;
+	}
+
+	gnet_stats_inc_general(GNR_TCP_ACCEPT_FULL_BATCHES);
 }
 
 #if defined(CMSG_FIRSTHDR) && defined(CMSG_NXTHDR)
@@ -4271,7 +4324,7 @@ socket_tcp_listen(host_addr_t bind_addr, uint16 port)
 
 	/* listen() the socket */
 
-	if (listen(fd, 5) == -1) {
+	if (listen(fd, ACCEPT_BACKLOG) == -1) {
 		g_warning("%s(): unable to listen() on the socket: %m", G_STRFUNC);
 		socket_destroy(s, "Unable to listen on socket");
 		return NULL;
@@ -28,12 +28,10 @@
  *
  * Caching of tigertree data.
  *
- * The tigertree data for each shared file is stored in a file in the directory
- * GTK_GNUTELLA_DIR/tth_cache/ in raw binary form. For example, if the root
- * hash is 5EDB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ, the tigertree data is
- * stored in
- * $GTK_GNUTELLA_DIR/tth_cache/5E/DB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ.
- * This avoids storing too many files per directory.
+ * The tigertree leaves for each shared file are stored in raw binary form
+ * in a packed database, keyed by the root hash.  A second, much smaller,
+ * database indexes the amount of leaves and the insertion time of each
+ * entry, so that lookups and cleanups never need to load the leaves.
  *
  * Only the leaves at TTH_MAX_DEPTH or above are stored. The root hash and the
  * nodes at each level between above these leaves can be calculated from the
@@ -41,6 +39,14 @@
  *
  * If the depth is 1 (root only), nothing is stored.
  *
+ * Former versions stored the tigertree data for each shared file in its
+ * own file under the GTK_GNUTELLA_DIR/tth_cache/ directory.  For example,
+ * if the root hash is 5EDB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ, the data
+ * were stored in
+ * $GTK_GNUTELLA_DIR/tth_cache/5E/DB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ.
+ * These legacy entries are imported into the database when looked up, and
+ * by the cleanup thread, which removes the directory tree once empty.
+ *
  * @author Christian Biere
  * @date 2007
  * @author Raphael Manfredi
@@ -56,20 +62,26 @@
 
 #include "lib/atoms.h"
 #include "lib/base32.h"
+#include "lib/bstr.h"
+#include "lib/cq.h"
+#include "lib/dbmw.h"
+#include "lib/dbstore.h"
 #include "lib/fd.h"
 #include "lib/file.h"
 #include "lib/ftw.h"
 #include "lib/halloc.h"
 #include "lib/hset.h"
 #include "lib/hstrfn.h"
+#include "lib/mutex.h"
 #include "lib/path.h"
+#include "lib/pmsg.h"
 #include "lib/pslist.h"
-#include "lib/spinlock.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
 #include "lib/thread.h"
 #include "lib/tigertree.h"
 #include "lib/timestamp.h"
+#include "lib/tm.h"
 #include "lib/walloc.h"
 
 #include "if/gnet_property_priv.h"
@@ -77,20 +89,42 @@
 
 #include "lib/override.h"       /* Must be the last header included */
 
-#if defined(S_IROTH)
-#define TTH_FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) /* 0644 */
-#else
-#define TTH_FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP) /* 0640 */
-#endif
+#define TTH_CACHE_SYNC_PERIOD	(60 * 1000)	/**< 1 minute, in ms */
+#define TTH_CACHE_LEAVES_CACHED	16		/**< Leaf vectors cached in memory */
+#define TTH_CACHE_BATCH			256		/**< Removals per locked batch */
+#define TTH_INDEX_VERSION		0		/**< Serialization version number */
 
 /**
- * This lock is used to protect the creation / removal of directories
- * under the TTH cache.
+ * DBM wrappers holding the leaves, and the index of known entries.
  */
-static spinlock_t tth_path_lk = SPINLOCK_INIT;
+static dbmw_t *db_tth_leaves;
+static char db_leaves_base[] = "tth_leaves";
+static char db_leaves_what[] = "TTH leaves";
 
-#define TTH_PATH_LOCK		spinlock(&tth_path_lk)
-#define TTH_PATH_UNLOCK		spinunlock(&tth_path_lk)
+static dbmw_t *db_tth_index;
+static char db_index_base[] = "tth_index";
+static char db_index_what[] = "TTH leaves index";
+
+/**
+ * Index entry, stored to disk for each cached TTH.
+ * The structure is serialized first, not written as-is.
+ */
+struct tth_index {
+	time_t stamp;			/**< When entry was inserted */
+	uint32 nleaves;			/**< Amount of leaves stored */
+};
+
+static cperiodic_t *tth_cache_sync_ev;
+static bool tth_cache_legacy;	/**< Whether the legacy directory exists */
+
+/**
+ * The databases are accessed from the main thread (THEX uploads), from the
+ * verify thread (insertions) and from the cleanup thread.
+ */
+static mutex_t tth_cache_mtx = MUTEX_INIT;
+
+#define TTH_CACHE_LOCK		mutex_lock(&tth_cache_mtx)
+#define TTH_CACHE_UNLOCK	mutex_unlock(&tth_cache_mtx)
 
 static const char *
 tth_cache_directory(void)
@@ -116,74 +150,188 @@ tth_cache_pathname(const struct tth *tth)
 			&hash[0], G_DIR_SEPARATOR, &hash[2]);
 }
 
-static int
-tth_cache_file_create(const struct tth *tth)
+/**
+ * Serialization routine for tth_index.
+ */
+static void
+serialize_tth_index(pmsg_t *mb, const void *data)
 {
-	char *pathname;
-	int accmode;
-	int fd;
+	const struct tth_index *ti = data;
 
-	g_return_val_if_fail(tth, -1);
+	pmsg_write_u8(mb, TTH_INDEX_VERSION);
+	pmsg_write_time(mb, ti->stamp);
+	pmsg_write_be32(mb, ti->nleaves);
+}
 
-	accmode = O_WRONLY | O_TRUNC;
-	pathname = tth_cache_pathname(tth);
+/**
+ * Deserialization routine for tth_index.
+ */
+static void
+deserialize_tth_index(bstr_t *bs, void *valptr, size_t len)
+{
+	struct tth_index *ti = valptr;
+	uint8 version;
 
-	/*
-	 * Critical section required since we could have a concurrent thread
-	 * deciding to remove empty directories whilst we are attempting
-	 * to create a new directory to store the new cached entry!
-	 */
+	g_assert(sizeof *ti == len);
+
+	bstr_read_u8(bs, &version);
+	bstr_read_time(bs, &ti->stamp);
+	bstr_read_be32(bs, &ti->nleaves);
+}
+
+/**
+ * Store leaves into the database.
+ *
+ * @param tth		the root hash
+ * @param leaves	the leaves
+ * @param n_leaves	amount of leaves
+ * @param stamp		creation time of the entry
+ */
+static void
+tth_cache_store(const struct tth *tth,
+	const struct tth *leaves, size_t n_leaves, time_t stamp)
+{
+	struct tth_index ti;
 
-	TTH_PATH_LOCK;
+	STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
 
-	fd = file_create_missing(pathname, accmode, TTH_FILE_MODE);
-	if (fd < 0 && ENOENT == errno) {
-		char *dir = filepath_directory(pathname);
-		if (0 == create_directory(dir, DEFAULT_DIRECTORY_MODE)) {
-			fd = file_create(pathname, accmode, TTH_FILE_MODE);
-		}
-		HFREE_NULL(dir);
+	ti.stamp = stamp;
+	ti.nleaves = n_leaves;
+
+	TTH_CACHE_LOCK;
+
+	if (db_tth_leaves != NULL) {
+		/*
+		 * Leaves are written without being cached: they are only read
+		 * back when serving THEX requests.
+		 */
+
+		dbmw_write_nocache(db_tth_leaves, tth,
+			deconstify_pointer(leaves), TTH_RAW_SIZE * n_leaves);
+		dbmw_write(db_tth_index, tth, VARLEN(ti));
 	}
 
-	TTH_PATH_UNLOCK;
+	TTH_CACHE_UNLOCK;
+}
 
-	HFREE_NULL(pathname);
-	return fd;
+/**
+ * Compute amount of leaves held in a legacy cached file.
+ */
+static size_t
+tth_cache_leave_count(const struct tth *tth, const filestat_t *sb)
+{
+	g_return_val_if_fail(tth, 0);
+	g_return_val_if_fail(sb, 0);
+
+	if (!S_ISREG(sb->st_mode)) {
+		g_warning("%s(%s): not a regular file", G_STRFUNC, tth_base32(tth));
+		return 0;
+	}
+	if (
+		sb->st_size % TTH_RAW_SIZE ||
+		sb->st_size < TTH_RAW_SIZE ||
+		sb->st_size > TTH_MAX_LEAVES * TTH_RAW_SIZE
+	) {
+		g_warning("%s(%s): bad filesize %s", G_STRFUNC,
+			tth_base32(tth), fileoffset_t_to_string(sb->st_size));
+		return 0;
+	}
+
+	return sb->st_size / TTH_RAW_SIZE;
 }
 
-static int
-tth_cache_file_open(const struct tth *tth)
+/**
+ * Import legacy cached file into the database, then remove the file.
+ *
+ * @param tth		the root hash
+ * @param pathname	the path of the legacy file holding its leaves
+ *
+ * @return the amount of leaves imported, 0 if none.
+ */
+static size_t
+tth_cache_legacy_import_path(const struct tth *tth, const char *pathname)
 {
-	char *pathname;
+	size_t n_leaves = 0;
 	int fd;
 
-	g_return_val_if_fail(tth, -1);
-
-	pathname = tth_cache_pathname(tth);
 	fd = file_open_missing(pathname, O_RDONLY);
-	HFREE_NULL(pathname);
-	return fd;
+	if (fd >= 0) {
+		filestat_t sb;
+
+		if (fstat(fd, &sb)) {
+			g_warning("%s(%s): fstat() failed: %m", G_STRFUNC, tth_base32(tth));
+		} else {
+			n_leaves = tth_cache_leave_count(tth, &sb);
+			if (n_leaves > 0) {
+				size_t size = TTH_RAW_SIZE * n_leaves;
+				struct tth *leaves = halloc(size);
+
+				if ((ssize_t) size == read(fd, leaves, size))
+					tth_cache_store(tth, leaves, n_leaves, sb.st_mtime);
+				else
+					n_leaves = 0;
+
+				HFREE_NULL(leaves);
+			}
+		}
+		fd_forget_and_close(&fd);
+		unlink(pathname);
+	}
+
+	return n_leaves;
 }
 
-static bool
-tth_cache_file_exists(const struct tth *tth)
+/**
+ * Import legacy cached entry for the TTH, if any.
+ *
+ * @return the amount of leaves imported, 0 if none.
+ */
+static size_t
+tth_cache_legacy_import(const struct tth *tth)
 {
-	bool ret;
 	char *pathname;
+	size_t n_leaves;
 
-	g_return_val_if_fail(tth, FALSE);
+	if G_LIKELY(!tth_cache_legacy)
+		return 0;
 
 	pathname = tth_cache_pathname(tth);
-	ret = file_exists(pathname);
+	n_leaves = tth_cache_legacy_import_path(tth, pathname);
 	HFREE_NULL(pathname);
-	return ret;
+
+	return n_leaves;
+}
+
+/**
+ * Get the amount of leaves recorded in the index for the TTH.
+ *
+ * @return the amount of leaves, 0 if the TTH is not cached.
+ */
+static size_t
+tth_cache_index_nleaves(const struct tth *tth)
+{
+	const struct tth_index *ti;
+	size_t n_leaves = 0;
+
+	TTH_CACHE_LOCK;
+
+	if (db_tth_index != NULL) {
+		ti = dbmw_read(db_tth_index, tth, NULL);
+		if (ti != NULL)
+			n_leaves = ti->nleaves;
+	}
+
+	TTH_CACHE_UNLOCK;
+
+	if G_UNLIKELY(0 == n_leaves)
+		n_leaves = tth_cache_legacy_import(tth);
+
+	return n_leaves;
 }
 
 void
 tth_cache_insert(const struct tth *tth, const struct tth *leaves, int n_leaves)
 {
-	int fd;
-
 	g_return_if_fail(tth);
 	g_return_if_fail(leaves);
 	g_return_if_fail(n_leaves >= 1);
@@ -198,45 +346,9 @@ tth_cache_insert(const struct tth *tth, const struct tth *leaves, int n_leaves)
 	if (1 == n_leaves)
 		return;
 
-	fd = tth_cache_file_create(tth);
-	if (fd >= 0) {
-		size_t size;
-		ssize_t ret;
-
-		STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
+	g_return_if_fail(n_leaves <= TTH_MAX_LEAVES);
 
-		size = TTH_RAW_SIZE * n_leaves;
-		ret = write(fd, leaves, size);
-		if ((ssize_t) -1 == ret) {
-			g_warning("%s(%s): write() failed: %m", G_STRFUNC, tth_base32(tth));
-		} else if ((size_t) ret != size) {
-			g_warning("%s(%s): incomplete write()", G_STRFUNC, tth_base32(tth));
-		}
-		fd_forget_and_close(&fd);
-	}
-}
-
-static size_t
-tth_cache_leave_count(const struct tth *tth, const filestat_t *sb)
-{
-	g_return_val_if_fail(tth, 0);
-	g_return_val_if_fail(sb, 0);
-
-	if (!S_ISREG(sb->st_mode)) {
-		g_warning("%s(%s): not a regular file", G_STRFUNC, tth_base32(tth));
-		return 0;
-	}
-	if (
-		sb->st_size % TTH_RAW_SIZE ||
-		sb->st_size < TTH_RAW_SIZE ||
-		sb->st_size > TTH_MAX_LEAVES * TTH_RAW_SIZE
-	) {
-		g_warning("%s(%s): bad filesize %s", G_STRFUNC,
-			tth_base32(tth), fileoffset_t_to_string(sb->st_size));
-		return 0;
-	}
-
-	return sb->st_size / TTH_RAW_SIZE;
+	tth_cache_store(tth, leaves, n_leaves, tm_time());
 }
 
 /**
@@ -245,26 +357,13 @@ tth_cache_leave_count(const struct tth *tth, const filestat_t *sb)
 size_t
 tth_cache_lookup(const struct tth *tth, filesize_t filesize)
 {
-	size_t expected, leave_count = 0;
+	size_t expected, leave_count;
 
 	g_return_val_if_fail(tth, 0);
 
 	expected = tt_good_node_count(filesize);
 	if (expected > 1) {
-		filestat_t sb;
-		char *pathname;
-
-		pathname = tth_cache_pathname(tth);
-		if (stat(pathname, &sb)) {
-			leave_count = 0;
-			if (ENOENT != errno) {
-				g_warning("%s(%s): stat(\"%s\") failed: %m",
-					G_STRFUNC, tth_base32(tth), pathname);
-			}
-		} else {
-			leave_count = tth_cache_leave_count(tth, &sb);
-		}
-		HFREE_NULL(pathname);
+		leave_count = tth_cache_index_nleaves(tth);
 	} else {
 		leave_count = 1;
 	}
@@ -274,50 +373,51 @@ tth_cache_lookup(const struct tth *tth, filesize_t filesize)
 void
 tth_cache_remove(const struct tth *tth)
 {
-	char *pathname;
-
 	g_return_if_fail(tth);
 
-	pathname = tth_cache_pathname(tth);
-	unlink(pathname);
-	HFREE_NULL(pathname);
+	TTH_CACHE_LOCK;
+
+	if (db_tth_leaves != NULL) {
+		dbmw_delete(db_tth_leaves, tth);
+		dbmw_delete(db_tth_index, tth);
+	}
+
+	TTH_CACHE_UNLOCK;
 }
 
 static size_t
 tth_cache_get_leaves(const struct tth *tth,
 	struct tth leaves[TTH_MAX_LEAVES], size_t n)
 {
-	int fd, num_leaves = 0;
+	size_t num_leaves = 0;
+	bool retried = FALSE;
 
 	g_return_val_if_fail(tth, 0);
 	g_return_val_if_fail(leaves, 0);
 
-	fd = tth_cache_file_open(tth);
-	if (fd >= 0) {
-		filestat_t sb;
-
-		if (fstat(fd, &sb)) {
-			g_warning("%s(%s): fstat() failed: %m", G_STRFUNC, tth_base32(tth));
-		} else {
-			size_t n_leaves;
+retry:
+	TTH_CACHE_LOCK;
 
-			n_leaves = tth_cache_leave_count(tth, &sb);
-			n_leaves = MIN(n, n_leaves);
-			if (n_leaves > 0) {
-				size_t size;
-				ssize_t ret;
+	if (db_tth_leaves != NULL) {
+		const void *data;
+		size_t len;
 
-				STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
+		data = dbmw_read(db_tth_leaves, tth, &len);
 
-				size = TTH_RAW_SIZE * n_leaves;
-				ret = read(fd, &leaves[0].data, size);
-				if ((size_t) ret == size) {
-					num_leaves = n_leaves;
-				}
-			}
+		if (data != NULL && len != 0 && 0 == len % TTH_RAW_SIZE) {
+			num_leaves = MIN(n, len / TTH_RAW_SIZE);
+			memcpy(&leaves[0].data, data, TTH_RAW_SIZE * num_leaves);
 		}
-		fd_forget_and_close(&fd);
 	}
+
+	TTH_CACHE_UNLOCK;
+
+	if G_UNLIKELY(0 == num_leaves && !retried) {
+		retried = TRUE;
+		if (tth_cache_legacy_import(tth) != 0)
+			goto retry;
+	}
+
 	return num_leaves;
 }
 
@@ -364,7 +464,7 @@ tth_cache_get_tree(const struct tth *tth, filesize_t filesize,
 		}
 	}
 
-	if (tth_cache_file_exists(tth)) {
+	if (tth_cache_index_nleaves(tth) != 0) {
 		g_warning("%s(): removing corrupted tigertree for %s",
 			G_STRFUNC, tth_base32(tth));
 		tth_cache_remove(tth);
@@ -382,26 +482,9 @@ tth_cache_get_tree(const struct tth *tth, filesize_t filesize,
 size_t
 tth_cache_get_nleaves(const struct tth *tth)
 {
-	int fd;
-	filesize_t nleaves = 0;
-
 	g_return_val_if_fail(tth != NULL, 0);
 
-	fd = tth_cache_file_open(tth);
-
-	if (fd >= 0) {
-		filestat_t sb;
-
-		if (fstat(fd, &sb)) {
-			g_warning("%s(%s): fstat() failed: %m", G_STRFUNC, tth_base32(tth));
-		} else {
-			nleaves = tth_cache_leave_count(tth, &sb);
-		}
-
-		fd_forget_and_close(&fd);
-	}
-
-	return nleaves;
+	return tth_cache_index_nleaves(tth);
 }
 
 /**
@@ -415,23 +498,15 @@ tth_cache_dir_rmdir(const char *path)
 		g_message("%s(): removing TTH cache directory %s", G_STRFUNC, path);
 
 	/*
-	 * To avoid any conflicts with another thread attempting to create a
-	 * file under that directory, take a lock.
-	 *
-	 * Note that there is a race condition between the traversal that detects
-	 * the directory is empty and the time we actually attempt to remove it.
-	 * Hence, we silence any error having to deal with the directory being
-	 * non-empty and therefore non-removable.
+	 * Nothing is created under the legacy directory any more, but we
+	 * silence any error having to deal with the directory being non-empty
+	 * and therefore non-removable, should the user put files there.
 	 */
 
-	TTH_PATH_LOCK;
-
 	if (-1 == rmdir(path) && ENOTEMPTY != errno) {
 		g_warning("%s(): cannot remove TTH cache directory %s: %m",
 			G_STRFUNC, path);
 	}
-
-	TTH_PATH_UNLOCK;
 }
 
 
@@ -493,7 +568,8 @@ tth_cache_file_remove(const char *path, const char *reason)
 }
 
 /**
- * ftw_foreach() callback to remove obsolete / spurious files.
+ * ftw_foreach() callback to import legacy files into the database, removing
+ * obsolete / spurious files.
  */
 static ftw_status_t
 tth_cache_cleanup_unlink(
@@ -547,7 +623,7 @@ tth_cache_cleanup_unlink(
 		/*
 		 * At this point, we have a valid TTH cache filename.
 		 *
-		 * We want to only process files created before the session started.
+		 * We want to only discard files created before the session started.
 		 *
 		 * The rationale is that users could start unsharing directories,
 		 * moving files around, add new files, etc..  Each time a new library
@@ -559,13 +635,15 @@ tth_cache_cleanup_unlink(
 		 * we have a higher likelyhood of processing an obsolete cache entry.
 		 */
 
-		if (delta_time(sb->st_mtime, GNET_PROPERTY(session_start_stamp)) >= 0)
-			goto done;		/* Created after session started, skip */
-
-		if (!hset_contains(shared, &tth)) {
+		if (
+			delta_time(sb->st_mtime, GNET_PROPERTY(session_start_stamp)) < 0 &&
+			!hset_contains(shared, &tth)
+		) {
 			if (debugging(0))
 				g_debug("%s(): unshared TTH (%s)", G_STRFUNC, info->rpath);
 			(void) tth_cache_file_unlink(info->fpath, "unshared");
+		} else {
+			(void) tth_cache_legacy_import_path(&tth, info->fpath);
 		}
 
 		/* FALL THROUGH */
@@ -582,37 +660,75 @@ tth_cache_cleanup_unlink(
 static int tth_cache_cleanups;
 
 /**
- * Main entry point for the thread that cleans up the TTH cache.
+ * Context for the cleanup of the database index.
  */
-static void *
-tth_cache_cleanup_thread(void *unused_arg)
+struct tth_cache_cleanup_ctx {
+	hset_t *shared;				/**< TTHs of shared files */
+	pslist_t *stale;			/**< TTH atoms of removed entries */
+};
+
+/**
+ * dbmw_foreach_remove() callback to remove obsolete index entries.
+ */
+static bool
+tth_cache_cleanup_index(void *key, void *value, size_t len, void *data)
+{
+	struct tth_cache_cleanup_ctx *ctx = data;
+	const struct tth *tth = key;
+	const struct tth_index *ti = value;
+
+	g_assert(sizeof *ti == len);
+
+	/*
+	 * As for legacy files, we only process entries created before the
+	 * session started.
+	 */
+
+	if (delta_time(ti->stamp, GNET_PROPERTY(session_start_stamp)) >= 0)
+		return FALSE;		/* Created after session started, skip */
+
+	if (hset_contains(ctx->shared, tth))
+		return FALSE;
+
+	if (debugging(0))
+		g_debug("%s(): unshared TTH %s", G_STRFUNC, tth_base32(tth));
+
+	ctx->stale =
+		pslist_prepend(ctx->stale, deconstify_pointer(atom_tth_get(tth)));
+	return TRUE;
+}
+
+/**
+ * Cleanup the legacy per-file cache, importing entries we want to keep.
+ *
+ * @param shared		the set of TTHs of shared files
+ */
+static void
+tth_cache_cleanup_legacy(hset_t *shared)
 {
-	hset_t *shared;
 	const char *rootdir = tth_cache_directory();
 	pslist_t *dirstack;
 	uint32 flags;
 	ftw_status_t res;
 
-	(void) unused_arg;
-
-	if (!is_directory(rootdir))
-		goto done;			/* No TTH cache */
+	if (!is_directory(rootdir)) {
+		tth_cache_legacy = FALSE;
+		return;
+	}
 
 	/*
 	 * First pass: spot all file entries that are older than our start
 	 * time (i.e. were created in another session) and which cannot be
-	 * associated with a shared file.
+	 * associated with a shared file, importing the others.
 	 */
 
-	shared = share_tthset_get();
 	flags = FTW_O_PHYS | FTW_O_MOUNT | FTW_O_ALL;
 	res = ftw_foreach(rootdir, flags, 0, tth_cache_cleanup_unlink, shared);
-	share_tthset_free(shared);
 
 	if (res != FTW_STATUS_OK) {
 		g_warning("%s(): initial traversal failed with %d, aborting",
 			G_STRFUNC, res);
-		goto done;
+		return;
 	}
 
 	/*
@@ -624,9 +740,72 @@ tth_cache_cleanup_thread(void *unused_arg)
 	(void) ftw_foreach(rootdir, flags, 0, tth_cache_cleanup_rmdir, &dirstack);
 	pslist_free(dirstack);
 
-	/* FALL THROUGH */
+	/*
+	 * Once everything was imported, the legacy root directory goes.
+	 */
+
+	if (0 == rmdir(rootdir)) {
+		g_message("removed legacy TTH cache directory %s", rootdir);
+		tth_cache_legacy = FALSE;
+	}
+}
+
+/**
+ * Main entry point for the thread that cleans up the TTH cache.
+ */
+static void *
+tth_cache_cleanup_thread(void *unused_arg)
+{
+	struct tth_cache_cleanup_ctx ctx;
+	pslist_t *sl;
+	size_t n = 0;
+
+	(void) unused_arg;
+
+	ZERO(&ctx);
+	ctx.shared = share_tthset_get();
+
+	if (tth_cache_legacy)
+		tth_cache_cleanup_legacy(ctx.shared);
+
+	/*
+	 * Spot all the index entries that are older than our start time and
+	 * which cannot be associated with a shared file.
+	 *
+	 * The index is small, so this is done in one single pass.  The leaves,
+	 * which are much larger, are then removed by batches, releasing the
+	 * lock regularily so that THEX requests are not delayed.
+	 */
+
+	TTH_CACHE_LOCK;
+	if (db_tth_index != NULL)
+		dbmw_foreach_remove(db_tth_index, tth_cache_cleanup_index, &ctx);
+	TTH_CACHE_UNLOCK;
+
+	share_tthset_free(ctx.shared);
+
+	TTH_CACHE_LOCK;
+
+	PSLIST_FOREACH(ctx.stale, sl) {
+		const struct tth *tth = sl->data;
+
+		if (db_tth_leaves != NULL)
+			dbmw_delete(db_tth_leaves, tth);
+		atom_tth_free(tth);
+
+		if (0 == ++n % TTH_CACHE_BATCH) {
+			TTH_CACHE_UNLOCK;
+			thread_yield();
+			TTH_CACHE_LOCK;
+		}
+	}
+
+	TTH_CACHE_UNLOCK;
 
-done:
+	if (debugging(0) && n != 0)
+		g_debug("%s(): removed %zu unshared TTH entries", G_STRFUNC, n);
+
+	pslist_free(ctx.stale);
 	atomic_int_dec(&tth_cache_cleanups);
 	return NULL;
 }
@@ -648,16 +827,68 @@ tth_cache_cleanup(void)
 	}
 }
 
-void
+/**
+ * Callout queue periodic event to synchronize the disk image.
+ */
+static bool
+tth_cache_periodic_sync(void *unused_obj)
+{
+	(void) unused_obj;
+
+	TTH_CACHE_LOCK;
+	dbstore_sync_flush(db_tth_leaves);
+	dbstore_sync_flush(db_tth_index);
+	TTH_CACHE_UNLOCK;
+
+	return TRUE;		/* Keep calling */
+}
+
+/**
+ * Initialize the TTH cache.
+ */
+void G_COLD
 tth_cache_init(void)
 {
-	/* NOTHING */
+	dbstore_kv_t leaves_kv =
+		{ TTH_RAW_SIZE, NULL, TTH_MAX_LEAVES * TTH_RAW_SIZE, 0 };
+	dbstore_kv_t index_kv = {
+		TTH_RAW_SIZE, NULL, sizeof(struct tth_index),
+		1 + sizeof(struct tth_index)	/* Version byte not held in structure */
+	};
+	dbstore_packing_t no_packing = { NULL, NULL, NULL };
+	dbstore_packing_t index_packing =
+		{ serialize_tth_index, deserialize_tth_index, NULL };
+
+	g_assert(NULL == db_tth_leaves);
+	g_assert(NULL == db_tth_index);
+
+	db_tth_leaves = dbstore_open(db_leaves_what, settings_gnet_db_dir(),
+		db_leaves_base, leaves_kv, no_packing, TTH_CACHE_LEAVES_CACHED,
+		tth_hash, tth_eq, FALSE);
+
+	db_tth_index = dbstore_open(db_index_what, settings_gnet_db_dir(),
+		db_index_base, index_kv, index_packing, 1,
+		tth_hash, tth_eq, FALSE);
+
+	tth_cache_legacy = is_directory(tth_cache_directory());
+
+	tth_cache_sync_ev = cq_periodic_main_add(
+		TTH_CACHE_SYNC_PERIOD, tth_cache_periodic_sync, NULL);
 }
 
-void
+/**
+ * Close the TTH cache.
+ */
+void G_COLD
 tth_cache_close(void)
 {
-	/* NOTHING */
+	cq_periodic_remove(&tth_cache_sync_ev);
+
+	TTH_CACHE_LOCK;
+	dbstore_close(db_tth_leaves, settings_gnet_db_dir(), db_leaves_base);
+	dbstore_close(db_tth_index, settings_gnet_db_dir(), db_index_base);
+	db_tth_leaves = db_tth_index = NULL;
+	TTH_CACHE_UNLOCK;
 }
 
 /* vi: set ts=4 sw=4 cindent: */
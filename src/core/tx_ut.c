@@ -211,6 +211,7 @@
 #define TX_UT_GOOD_FREQ		900		/* Remember good hosts for 15 minutes */
 #define TX_UT_REQUEUE_DELAY	5000	/* Time to requeue message after drop */
 #define TX_UT_ALPHA			3		/* Initial parallelism */
+#define TX_UT_TIMER_SLACK	20		/* ms: fragment timers firing together */
 
 #define TX_UT_EXPIRE_MS		(60*1000)	/* Expiration time for packets, in ms */
 #define TX_UT_LINGER_MS		(45*1000)	/* Lingering time for packets, in ms */
@@ -276,13 +277,14 @@ struct ut_msg;
 struct ut_frag {
 	enum ut_frag_magic magic;
 	struct ut_msg *msg;				/* Message where fragment belongs */
-	cevent_t *resend_ev;			/* Timer for fragment retransmission */
 	pmsg_t *fb;						/* Fragment message block */
 	link_t lk;						/* Link in "resend" queue */
+	tm_t resend_at;					/* Retransmission time, when timed */
 	uint8 fragno;					/* Fragment number, zero-based */
 	uint8 txcnt;					/* Amount of times fragment was sent */
 	uint resend:1;					/* Enqueued for resending */
 	uint pending:1;					/* Pending ACK on resending */
+	uint timed:1;					/* Waiting for ACK until resend_at */
 };
 
 static void
@@ -316,7 +318,9 @@ struct ut_msg {
 	cevent_t *expire_ev;			/* Expire timer for the whole message */
 	cevent_t *iterate_ev;			/* Recorded iterate event */
 	cevent_t *ear_ev;				/* Expire timer for EARs */
+	cevent_t *resend_ev;			/* Earliest fragment retransmission */
 	struct ut_frag **fragments;		/* Fragments to send (NULL when ACK-ed) */
+	struct ut_frag *frags;			/* Storage for all the fragments */
 	struct attr *attr;				/* TX layer private attributes */
 	elist_t resend;					/* Fragments to resend */
 	uint16 seqno;					/* Sequence ID number */
@@ -384,6 +388,7 @@ static bool ut_frag_free(struct ut_frag *uf, bool free_message);
 static void ut_frag_send(const struct ut_frag *uf);
 static void ut_ack_send(pmsg_t *mb);
 static void ut_resend_async(struct ut_msg *um);
+static void ut_msg_resend(cqueue_t *cq, void *obj);
 
 /**
  * Add a new reference to the message set.
@@ -669,8 +674,10 @@ ut_msg_free(struct ut_msg *um, bool free_sequence)
 	cq_cancel(&um->expire_ev);
 	cq_cancel(&um->iterate_ev);
 	cq_cancel(&um->ear_ev);
+	cq_cancel(&um->resend_ev);
 	atom_host_free_null(&um->to);
 	WFREE_ARRAY(um->fragments, um->fragcnt);
+	WFREE_ARRAY(um->frags, um->fragcnt);
 	hevset_remove(ut_mset, &um->mid);
 	pmsg_free_null(&um->mb);
 
@@ -718,7 +725,7 @@ ut_frag_free(struct ut_frag *uf, bool free_message)
 	ut_msg_check(uf->msg);
 
 	um = uf->msg;
-	cq_cancel(&uf->resend_ev);
+	uf->timed = FALSE;
 	pmsg_free_null(&uf->fb);
 
 	g_assert(uf->fragno < um->fragcnt);
@@ -744,8 +751,7 @@ ut_frag_free(struct ut_frag *uf, bool free_message)
 			gnet_host_to_string(um->to));
 	}
 
-	uf->magic = 0;
-	WFREE(uf);
+	uf->magic = 0;				/* Storage is released with the message */
 
 	/*
 	 * When the last fragment is freed, we're done with the message.
@@ -892,7 +898,7 @@ ut_send_remaining(struct ut_msg *um)
 				elist_remove(&um->resend, uf);
 				uf->resend = FALSE;
 			}
-			cq_cancel(&uf->resend_ev);
+			uf->timed = FALSE;
 			ut_frag_send(uf);
 		}
 	}
@@ -1008,10 +1014,10 @@ ut_send_unacknowleged(struct ut_msg *um)
 
 			/*
 			 * Since the fragment is now part of the um->resend list, we must
-			 * make sure it has no resend_ev on ACK timeout.  Indeed, we will
-			 * iterate over the list and resend this fragment.  It would break
-			 * the pre-condition of ut_frag_send() if it had already a resend
-			 * event registered.
+			 * make sure it is no longer timed for ACK timeout.  Indeed, we
+			 * will iterate over the list and resend this fragment.  It would
+			 * break the pre-condition of ut_frag_send() if it was still
+			 * waiting for its retransmission time.
 			 *
 			 * If, by chance, we get the ACK for this fragment before we were
 			 * able to resend it, then ut_frag_free() will remove it from the
@@ -1020,7 +1026,7 @@ ut_send_unacknowleged(struct ut_msg *um)
 			 * 		--RAM, 2018-07-22
 			 */
 
-			cq_cancel(&uf->resend_ev);
+			uf->timed = FALSE;
 		}
 	}
 
@@ -1098,19 +1104,19 @@ ut_ear_resend(cqueue_t *cq, void *obj)
 }
 
 /**
- * Callout queue callback invoked when no acknowledgment was received.
+ * Handle fragment for which no acknowledgment was received in time.
+ *
+ * @return TRUE if the whole message was freed.
  */
-static void
-ut_frag_resend(cqueue_t *cq, void *obj)
+static bool
+ut_frag_resend(struct ut_frag *uf)
 {
-	struct ut_frag *uf = obj;
 	struct ut_msg *um;
 
 	ut_frag_check(uf);
 	ut_msg_check(uf->msg);
-	g_assert(uf->resend_ev != NULL);
+	g_assert(!uf->timed);
 
-	cq_zero(cq, &uf->resend_ev);	/* Callback triggered */
 	um = uf->msg;
 
 	/*
@@ -1145,7 +1151,7 @@ ut_frag_resend(cqueue_t *cq, void *obj)
 		}
 		gnet_stats_inc_general(GNR_UDP_SR_TX_FRAGMENTS_LINGER_UNSENT);
 		ut_resend_async(um);	/* Keep sending pending fragments though */
-		return;
+		return FALSE;
 	}
 
 	if (tx_ut_debugging(TX_UT_DBG_FRAG | TX_UT_DBG_TIMEOUT, uf->msg->to)) {
@@ -1162,7 +1168,7 @@ ut_frag_resend(cqueue_t *cq, void *obj)
 
 	if (ut_to_banned(um->attr, um->to)) {
 		ut_msg_free(um, TRUE);
-		return;
+		return TRUE;
 	}
 
 	/*
@@ -1188,7 +1194,7 @@ ut_frag_resend(cqueue_t *cq, void *obj)
 		if (give_up) {
 			gnet_stats_inc_general(GNR_UDP_SR_TX_FRAGMENTS_OVERSENT_GIVEUP);
 			ut_msg_free(um, TRUE);
-			return;
+			return TRUE;
 		}
 	}
 
@@ -1203,6 +1209,86 @@ ut_frag_resend(cqueue_t *cq, void *obj)
 	uf->pending = FALSE;			/* No longer pending, awaiting retransmit */
 	elist_append(&um->resend, uf);
 	ut_resend_async(um);
+
+	return FALSE;
+}
+
+/**
+ * Callout queue callback invoked when the retransmission timer of the
+ * message fires: handle all the fragments whose ACK did not come in time
+ * and re-arm the timer for the next deadline, if any.
+ */
+static void
+ut_msg_resend(cqueue_t *cq, void *obj)
+{
+	struct ut_msg *um = obj;
+	long next = -1;
+	unsigned i;
+
+	ut_msg_check(um);
+	g_assert(um->resend_ev != NULL);
+
+	cq_zero(cq, &um->resend_ev);	/* Callback triggered */
+
+	for (i = 0; i < um->fragcnt; i++) {
+		struct ut_frag *uf = um->fragments[i];
+		long remain;
+
+		if (NULL == uf || !uf->timed)
+			continue;
+
+		remain = tm_remaining_ms(&uf->resend_at);
+
+		if (remain > TX_UT_TIMER_SLACK) {
+			if (next < 0 || remain < next)
+				next = remain;
+			continue;
+		}
+
+		uf->timed = FALSE;
+		if (ut_frag_resend(uf))
+			return;			/* Message was freed */
+	}
+
+	if (next < 0)
+		return;
+
+	if (NULL == um->resend_ev)
+		um->resend_ev = cq_main_insert(next, ut_msg_resend, um);
+	else if (cq_remaining(um->resend_ev) > UNSIGNED(next))
+		cq_resched(um->resend_ev, next);
+}
+
+/**
+ * Arm the retransmission timer of a fragment.
+ *
+ * Fragments have no callout queue event of their own: the message keeps
+ * a single timer, firing at the earliest deadline of its fragments, which
+ * saves one event per fragment sent.
+ *
+ * @param uf		the fragment
+ * @param delay		delay in ms before resending if not acknowledged
+ */
+static void
+ut_frag_timer_set(struct ut_frag *uf, int delay)
+{
+	struct ut_msg *um;
+	tm_t d;
+
+	ut_frag_check(uf);
+	ut_msg_check(uf->msg);
+	g_assert(delay > 0);
+
+	um = uf->msg;
+	tm_now_exact(&uf->resend_at);
+	tm_fill_ms(&d, delay);
+	tm_add(&uf->resend_at, &d);
+	uf->timed = TRUE;
+
+	if (NULL == um->resend_ev)
+		um->resend_ev = cq_main_insert(delay, ut_msg_resend, um);
+	else if (cq_remaining(um->resend_ev) > UNSIGNED(delay))
+		cq_resched(um->resend_ev, delay);
 }
 
 /**
@@ -1332,28 +1418,26 @@ ut_frag_pmsg_free(pmsg_t *mb, void *arg)
 			}
 
 			/*
-			 * We now explicitly cancel any pending uf->resend_ev event
+			 * We now explicitly re-arm any pending fragment timer
 			 * instead of simply asserting there is no such event registered.
 			 *
 			 * With the introduction of explicit flush before the message
 			 * times out for transmission, it could be possible that a single
 			 * fragment is enqueued several times for transmission, and
 			 * that would cause an assertion failure here when both instances
-			 * get sent and try to install the ut_frag_resend() callout
+			 * get sent and try to arm the fragment retransmission timer
 			 * when this callback fires on them.
 			 *
 			 * Aim for robustness by not asserting something that is only
 			 * an internal property at some given time and could become false
 			 * due to the TX logic being refactored, without damaging our
 			 * operations  The only thing we want is avoid duplicate processing
-			 * if a previous uf->resend_ev was scheduled.  So simply cancel any
-			 * previous event we find.
+			 * if a previous timer was armed.  So simply supersede any
+			 * previous deadline we find.
 			 * 		--RAM, 2018-11-08
 			 */
 
-			cq_cancel(&uf->resend_ev);
-			uf->resend_ev =
-				cq_main_insert(ut_frag_delay(uf), ut_frag_resend, uf);
+			ut_frag_timer_set(uf, ut_frag_delay(uf));
 
 			/*
 			 * If this is the first fragment being sent, reschedule the
@@ -1386,9 +1470,7 @@ ut_frag_pmsg_free(pmsg_t *mb, void *arg)
 		 *		--RAM, 2015-10-02
 		 */
 
-		cq_cancel(&uf->resend_ev);		/* Same rationale as above */
-		uf->resend_ev =
-			cq_main_insert(TX_UT_REQUEUE_DELAY, ut_frag_resend, uf);
+		ut_frag_timer_set(uf, TX_UT_REQUEUE_DELAY);	/* Same as above */
 	}
 
 	/* FALL THROUGH */
@@ -1571,7 +1653,7 @@ ut_frag_send(const struct ut_frag *uf)
 
 	ut_frag_check(uf);
 	ut_msg_check(uf->msg);
-	g_assert(NULL == uf->resend_ev);
+	g_assert(!uf->timed);
 
 	um = uf->msg;
 	attr = um->attr;
@@ -1832,7 +1914,7 @@ ut_frag_create(const struct attr *attr, unsigned fragno,
 
 	mb = pmsg_new(pmsg_prio(um->mb), NULL, pdulen + UDP_RELIABLE_HEADER_SIZE);
 
-	WALLOC0(uf);
+	uf = &um->frags[fragno];	/* Zeroed storage allocated with message */
 	uf->magic = UT_FRAG_MAGIC;
 	uf->msg = um;
 	uf->fragno = fragno;		/* Index base is 0 here, not 1 */
@@ -2140,6 +2222,7 @@ ut_msg_create(struct attr *attr, pmsg_t *mb, const gnet_host_t *to)
 	if (pdulen != UNSIGNED(um->fragcnt * TX_UT_MTU))
 		um->fragcnt++;
 	WALLOC_ARRAY(um->fragments, um->fragcnt);
+	WALLOC0_ARRAY(um->frags, um->fragcnt);
 
 	/*
 	 * The sequence ID (seqno) is going to be echoed back by the receiving
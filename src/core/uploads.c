@@ -7018,6 +7018,7 @@ upload_close(void)
 	aging_destroy(&push_requests);
 	aging_destroy(&push_conn_failed);
 	ripening_destroy(&retry_after);
+	browse_host_shutdown();
 	wd_free_null(&early_stall_wd);
 	wd_free_null(&stall_wd);
 	pattern_free_null(&pat_http);
@@ -1202,36 +1202,28 @@ vmsg_build_oob_reply_ind(const struct guid *muid, uint8 hits, bool secure)
 static struct array
 extract_token(const char *data, size_t size, char token[MAX_OOB_TOKEN_SIZE])
 {
-	extvec_t exv[MAX_EXTVEC];
-	int i, exvcnt;
+	extvec_t exv[1];
 	size_t token_size = 0;
 
-	ext_prepare(exv, MAX_EXTVEC);
-	exvcnt = ext_parse(data, size, exv, MAX_EXTVEC);
+	ext_prepare(exv, N_ITEMS(exv));
 
-	for (i = 0; i < exvcnt; i++) {
-		const extvec_t *e = &exv[i];
-
-		if (EXT_T_GGEP_SO == e->ext_token) {
-			size_t len = ext_paylen(e);
+	if (ext_ggep_find(data, size, EXT_T_GGEP_SO, &exv[0])) {
+		const extvec_t *e = &exv[0];
+		size_t len = ext_paylen(e);
 
-			if (len < 1) {
-				if (GNET_PROPERTY(vmsg_debug))
-					g_warning("empty GGEP \"SO\"");
-			} else if (len > MAX_OOB_TOKEN_SIZE) {
-				if (GNET_PROPERTY(vmsg_debug))
-					g_warning("GGEP \"SO\" too large");
-				len = MAX_OOB_TOKEN_SIZE;	/* truncate it */
-			}
-			if (len > 0 && len <= MAX_OOB_TOKEN_SIZE) {
-				memcpy(token, ext_payload(e), MAX_OOB_TOKEN_SIZE);
-				token_size = len;
-			}
-			break;
+		if (len < 1) {
+			if (GNET_PROPERTY(vmsg_debug))
+				g_warning("empty GGEP \"SO\"");
+		} else if (len > MAX_OOB_TOKEN_SIZE) {
+			if (GNET_PROPERTY(vmsg_debug))
+				g_warning("GGEP \"SO\" too large");
+			len = MAX_OOB_TOKEN_SIZE;	/* truncate it */
 		}
-	}
-	if (exvcnt) {
-		ext_reset(exv, MAX_EXTVEC);
+		if (len > 0 && len <= MAX_OOB_TOKEN_SIZE) {
+			memcpy(token, ext_payload(e), len);
+			token_size = len;
+		}
+		ext_reset(exv, N_ITEMS(exv));
 	}
 	return token_size > 0 ? array_init(token, token_size) : zero_array;
 }
@@ -348,6 +348,18 @@
 #define G_FAST
 #endif
 
+/**
+ * G_TARGET() can be used to compile a function for a specific instruction
+ * set (e.g. "avx2") regardless of the global compiler flags.  The caller
+ * is then responsible for checking, at runtime, that the CPU supports it.
+ */
+#if defined(HASATTRIBUTE) && HAS_GCC(4, 9)
+#define G_TARGET(x)	__attribute__((target(x)))
+#define HAS_G_TARGET
+#else
+#define G_TARGET(x)
+#endif
+
 /**
  * G_NO_OPTIMIZE can be used to turn-off optimizations for a function.
  */
@@ -25,6 +25,7 @@
 #define _if_core_bsched_h_
 
 #include "if/core/wrap.h"	/* For wrap_io_t */
+#include "lib/elist.h"		/* For link_t */
 #include "lib/inputevt.h"	/* For inputevt_handler_t */
 
 typedef struct bsched bsched_t;
@@ -71,6 +72,7 @@ typedef struct bio_source {
 	int64 bw_last_bps;				/**< B/w used last period (bps) */
 	int64 bw_fast_ema;				/**< Fast EMA of actual bandwidth used */
 	int64  bw_slow_ema;				/**< Slow EMA of actual bandwidth used */
+	link_t live_lk;					/**< Links sources needing heartbeat */
 } bio_source_t;
 
 /*
@@ -83,6 +85,7 @@ typedef struct bio_source {
 #define BIO_F_USED			(1 << 3)	/**< Source used this period */
 #define BIO_F_FAVOUR		(1 << 4)	/**< Try to favour source this period */
 #define BIO_F_PASSIVE		(1 << 5)	/**< Don't insert source for events */
+#define BIO_F_LIVE			(1 << 6)	/**< Source in scheduler's live list */
 
 #define BIO_F_RW			(BIO_F_READ|BIO_F_WRITE)
 
@@ -56,6 +56,20 @@ bool debugging(uint t);
 char *main_command_line(void);
 const char *gtk_version_string(void);
 
+/**
+ * Callback for main_phase_foreach().
+ *
+ * @param name		stringified initialization call (not NUL-terminated)
+ * @param len		length of the routine name at the start of `name'
+ * @param us		time spent in the step, in micro-seconds
+ * @param deferred	whether step was run after startup
+ * @param udata		user-supplied data
+ */
+typedef void (*main_phase_cb_t)(const char *name, size_t len,
+	ulong us, bool deferred, void *udata);
+
+void main_phase_foreach(main_phase_cb_t cb, void *udata);
+
 #endif /* CORE_SOURCES */
 #endif /* _if_core_main_h_ */
 
@@ -1,5 +1,5 @@
 /*
- * Generated on Sun Mar 10 21:55:45 2019 by enum-msg.pl -- DO NOT EDIT
+ * Generated on Sat Oct 17 07:58:48 2026 by enum-msg.pl -- DO NOT EDIT
  *
  * Command: ../../../scripts/enum-msg.pl stats.lst
  */
@@ -73,6 +73,9 @@ static const char *stats_symbols[] = {
 	"query_g2_utf8",
 	"query_g2_sha1",
 	"query_aliased_words",
+	"query_norm_cache_hits",
+	"query_norm_cache_misses",
+	"query_norm_cache_entries",
 	"query_guess",
 	"query_guess_02",
 	"guess_link_cache",
@@ -430,6 +433,15 @@ static const char *stats_symbols[] = {
 	"stats_digest",
 	"stats_tcp_digest",
 	"stats_udp_digest",
+	"tcp_accepted",
+	"tcp_accept_events",
+	"tcp_accept_full_batches",
+	"tcp_accept_hostile_closed",
+	"tcp_accept_ctl_closed",
+	"oob_hits_sent_within_5s",
+	"oob_hits_sent_within_15s",
+	"oob_hits_sent_within_60s",
+	"oob_hits_sent_after_60s",
 };
 
 /**
@@ -509,6 +521,9 @@ static const char *stats_text[] = {
 	N_("UTF8 G2 queries"),
 	N_("SHA1 G2 queries"),
 	N_("Queries with aliased words"),
+	N_("Query normalization cache hits"),
+	N_("Query normalization cache misses"),
+	N_("Query normalization cache entries"),
 	N_("GUESS queries"),
 	N_("GUESS queries (0.2)"),
 	N_("GUESS link cache size"),
@@ -866,6 +881,15 @@ static const char *stats_text[] = {
 	N_("Digests computed on general statistics"),
 	N_("Digests computed on TCP statistics"),
 	N_("Digests computed on UDP statistics"),
+	N_("Incoming TCP connections accepted"),
+	N_("Listening socket events processed"),
+	N_("Listening socket events hitting the accept batch limit"),
+	N_("Incoming TCP connections from hostile IP closed"),
+	N_("Incoming TCP connections closed by country limits"),
+	N_("OOB hits sent within 5 seconds of their claim"),
+	N_("OOB hits sent 5 to 15 seconds after their claim"),
+	N_("OOB hits sent 15 to 60 seconds after their claim"),
+	N_("OOB hits sent more than 60 seconds after their claim"),
 };
 
 /**
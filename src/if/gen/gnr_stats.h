@@ -1,5 +1,5 @@
 /*
- * Generated on Sun Mar 10 21:55:45 2019 by enum-msg.pl -- DO NOT EDIT
+ * Generated on Sat Oct 17 07:58:48 2026 by enum-msg.pl -- DO NOT EDIT
  *
  * Command: ../../../scripts/enum-msg.pl stats.lst
  */
@@ -8,7 +8,7 @@
 #define _if_gen_gnr_stats_h_
 
 /*
- * Enum count: 415
+ * Enum count: 427
  */
 typedef enum {
 	GNR_ROUTING_ERRORS = 0,
@@ -69,6 +69,9 @@ typedef enum {
 	GNR_QUERY_G2_UTF8,
 	GNR_QUERY_G2_SHA1,
 	GNR_QUERY_ALIASED_WORDS,
+	GNR_QUERY_NORM_CACHE_HITS,
+	GNR_QUERY_NORM_CACHE_MISSES,
+	GNR_QUERY_NORM_CACHE_ENTRIES,
 	GNR_QUERY_GUESS,
 	GNR_QUERY_GUESS_02,
 	GNR_GUESS_LINK_CACHE,
@@ -426,6 +429,15 @@ typedef enum {
 	GNR_STATS_DIGEST,
 	GNR_STATS_TCP_DIGEST,
 	GNR_STATS_UDP_DIGEST,
+	GNR_TCP_ACCEPTED,
+	GNR_TCP_ACCEPT_EVENTS,
+	GNR_TCP_ACCEPT_FULL_BATCHES,
+	GNR_TCP_ACCEPT_HOSTILE_CLOSED,
+	GNR_TCP_ACCEPT_CTL_CLOSED,
+	GNR_OOB_HITS_SENT_WITHIN_5S,
+	GNR_OOB_HITS_SENT_WITHIN_15S,
+	GNR_OOB_HITS_SENT_WITHIN_60S,
+	GNR_OOB_HITS_SENT_AFTER_60S,
 
 	GNR_TYPE_COUNT
 } gnr_stats_t;
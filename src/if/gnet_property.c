@@ -1164,6 +1164,22 @@ guint64  gnet_property_variable_bc_loopback_in		= 0;
 static const guint64  gnet_property_variable_bc_loopback_in_default = 0;
 guint64  gnet_property_variable_bc_private_in		= 0;
 static const guint64  gnet_property_variable_bc_private_in_default = 0;
+gboolean gnet_property_variable_library_watch		= FALSE;
+static const gboolean gnet_property_variable_library_watch_default = FALSE;
+guint32  gnet_property_variable_library_scan_threads		= 4;
+static const guint32  gnet_property_variable_library_scan_threads_default = 4;
+guint32  gnet_property_variable_bw_weight_http		= 10;
+static const guint32  gnet_property_variable_bw_weight_http_default = 10;
+guint32  gnet_property_variable_bw_weight_gnet		= 10;
+static const guint32  gnet_property_variable_bw_weight_gnet_default = 10;
+guint32  gnet_property_variable_bw_weight_leaf		= 10;
+static const guint32  gnet_property_variable_bw_weight_leaf_default = 10;
+guint32  gnet_property_variable_bw_weight_udp		= 10;
+static const guint32  gnet_property_variable_bw_weight_udp_default = 10;
+guint32  gnet_property_variable_bw_weight_dht		= 10;
+static const guint32  gnet_property_variable_bw_weight_dht_default = 10;
+guint32  gnet_property_variable_oob_deliver_delay		= 2500;
+static const guint32  gnet_property_variable_oob_deliver_delay_default = 2500;
 
 static prop_set_t *gnet_property;
 
@@ -11778,6 +11794,179 @@ gnet_prop_init(void) {
 	gnet_property->props[503].data.guint64.max	= (guint64) -1;
 	gnet_property->props[503].data.guint64.min	= 0x0000000000000000;
 
+
+	/*
+	 * PROP_LIBRARY_WATCH:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[504].name = "library_watch";
+	gnet_property->props[504].desc = _("Watch the shared directories for changes and only rescan the directories that changed, instead of rescanning the whole library.  Relies on inotify, and falls back to full rescans when the directories cannot be watched.  Takes effect at the next rescan.");
+	gnet_property->props[504].ev_changed = event_new("library_watch_changed");
+	gnet_property->props[504].save = TRUE;
+	gnet_property->props[504].internal = FALSE;
+	gnet_property->props[504].vector_size = 1;
+	mutex_init(&gnet_property->props[504].lock);
+
+	/* Type specific data: */
+	gnet_property->props[504].type				= PROP_TYPE_BOOLEAN;
+	gnet_property->props[504].data.boolean.def	= (void *) &gnet_property_variable_library_watch_default;
+	gnet_property->props[504].data.boolean.value = (void *) &gnet_property_variable_library_watch;
+
+
+	/*
+	 * PROP_LIBRARY_SCAN_THREADS:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[505].name = "library_scan_threads";
+	gnet_property->props[505].desc = _("Amount of threads reading the shared directories in parallel during a full library rescan.  Several threads hide the latency of network filesystems and large disk arrays.  Use 1 to read directories one at a time from the library thread.");
+	gnet_property->props[505].ev_changed = event_new("library_scan_threads_changed");
+	gnet_property->props[505].save = TRUE;
+	gnet_property->props[505].internal = FALSE;
+	gnet_property->props[505].vector_size = 1;
+	mutex_init(&gnet_property->props[505].lock);
+
+	/* Type specific data: */
+	gnet_property->props[505].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[505].data.guint32.def	= (void *) &gnet_property_variable_library_scan_threads_default;
+	gnet_property->props[505].data.guint32.value = (void *) &gnet_property_variable_library_scan_threads;
+	gnet_property->props[505].data.guint32.choices = NULL;
+	gnet_property->props[505].data.guint32.max	= 32;
+	gnet_property->props[505].data.guint32.min	= 1;
+
+
+	/*
+	 * PROP_BW_WEIGHT_HTTP:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[506].name = "bw_weight_http";
+	gnet_property->props[506].desc = _("Relative weight of HTTP uploads and downloads when distributing the bandwidth left unused by other traffic classes.");
+	gnet_property->props[506].ev_changed = event_new("bw_weight_http_changed");
+	gnet_property->props[506].save = TRUE;
+	gnet_property->props[506].internal = FALSE;
+	gnet_property->props[506].vector_size = 1;
+	mutex_init(&gnet_property->props[506].lock);
+
+	/* Type specific data: */
+	gnet_property->props[506].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[506].data.guint32.def	= (void *) &gnet_property_variable_bw_weight_http_default;
+	gnet_property->props[506].data.guint32.value = (void *) &gnet_property_variable_bw_weight_http;
+	gnet_property->props[506].data.guint32.choices = NULL;
+	gnet_property->props[506].data.guint32.max	= 100;
+	gnet_property->props[506].data.guint32.min	= 1;
+
+
+	/*
+	 * PROP_BW_WEIGHT_GNET:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[507].name = "bw_weight_gnet";
+	gnet_property->props[507].desc = _("Relative weight of Gnutella TCP connections between ultrapeers when distributing the bandwidth left unused by other traffic classes.");
+	gnet_property->props[507].ev_changed = event_new("bw_weight_gnet_changed");
+	gnet_property->props[507].save = TRUE;
+	gnet_property->props[507].internal = FALSE;
+	gnet_property->props[507].vector_size = 1;
+	mutex_init(&gnet_property->props[507].lock);
+
+	/* Type specific data: */
+	gnet_property->props[507].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[507].data.guint32.def	= (void *) &gnet_property_variable_bw_weight_gnet_default;
+	gnet_property->props[507].data.guint32.value = (void *) &gnet_property_variable_bw_weight_gnet;
+	gnet_property->props[507].data.guint32.choices = NULL;
+	gnet_property->props[507].data.guint32.max	= 100;
+	gnet_property->props[507].data.guint32.min	= 1;
+
+
+	/*
+	 * PROP_BW_WEIGHT_LEAF:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[508].name = "bw_weight_leaf";
+	gnet_property->props[508].desc = _("Relative weight of Gnutella TCP leaf connections when distributing the bandwidth left unused by other traffic classes.");
+	gnet_property->props[508].ev_changed = event_new("bw_weight_leaf_changed");
+	gnet_property->props[508].save = TRUE;
+	gnet_property->props[508].internal = FALSE;
+	gnet_property->props[508].vector_size = 1;
+	mutex_init(&gnet_property->props[508].lock);
+
+	/* Type specific data: */
+	gnet_property->props[508].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[508].data.guint32.def	= (void *) &gnet_property_variable_bw_weight_leaf_default;
+	gnet_property->props[508].data.guint32.value = (void *) &gnet_property_variable_bw_weight_leaf;
+	gnet_property->props[508].data.guint32.choices = NULL;
+	gnet_property->props[508].data.guint32.max	= 100;
+	gnet_property->props[508].data.guint32.min	= 1;
+
+
+	/*
+	 * PROP_BW_WEIGHT_UDP:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[509].name = "bw_weight_udp";
+	gnet_property->props[509].desc = _("Relative weight of Gnutella UDP traffic when distributing the bandwidth left unused by other traffic classes.");
+	gnet_property->props[509].ev_changed = event_new("bw_weight_udp_changed");
+	gnet_property->props[509].save = TRUE;
+	gnet_property->props[509].internal = FALSE;
+	gnet_property->props[509].vector_size = 1;
+	mutex_init(&gnet_property->props[509].lock);
+
+	/* Type specific data: */
+	gnet_property->props[509].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[509].data.guint32.def	= (void *) &gnet_property_variable_bw_weight_udp_default;
+	gnet_property->props[509].data.guint32.value = (void *) &gnet_property_variable_bw_weight_udp;
+	gnet_property->props[509].data.guint32.choices = NULL;
+	gnet_property->props[509].data.guint32.max	= 100;
+	gnet_property->props[509].data.guint32.min	= 1;
+
+
+	/*
+	 * PROP_BW_WEIGHT_DHT:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[510].name = "bw_weight_dht";
+	gnet_property->props[510].desc = _("Relative weight of DHT traffic when distributing the bandwidth left unused by other traffic classes.");
+	gnet_property->props[510].ev_changed = event_new("bw_weight_dht_changed");
+	gnet_property->props[510].save = TRUE;
+	gnet_property->props[510].internal = FALSE;
+	gnet_property->props[510].vector_size = 1;
+	mutex_init(&gnet_property->props[510].lock);
+
+	/* Type specific data: */
+	gnet_property->props[510].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[510].data.guint32.def	= (void *) &gnet_property_variable_bw_weight_dht_default;
+	gnet_property->props[510].data.guint32.value = (void *) &gnet_property_variable_bw_weight_dht;
+	gnet_property->props[510].data.guint32.choices = NULL;
+	gnet_property->props[510].data.guint32.max	= 100;
+	gnet_property->props[510].data.guint32.min	= 1;
+
+
+	/*
+	 * PROP_OOB_DELIVER_DELAY:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[511].name = "oob_deliver_delay";
+	gnet_property->props[511].desc = _("Base delay, in milliseconds, between two messages carrying out-of-band query hits to the same host. A random delay of up to twice that amount is added. Lower values deliver hits faster, larger values spread the UDP traffic over time.");
+	gnet_property->props[511].ev_changed = event_new("oob_deliver_delay_changed");
+	gnet_property->props[511].save = TRUE;
+	gnet_property->props[511].internal = FALSE;
+	gnet_property->props[511].vector_size = 1;
+	mutex_init(&gnet_property->props[511].lock);
+
+	/* Type specific data: */
+	gnet_property->props[511].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[511].data.guint32.def	= (void *) &gnet_property_variable_oob_deliver_delay_default;
+	gnet_property->props[511].data.guint32.value = (void *) &gnet_property_variable_oob_deliver_delay;
+	gnet_property->props[511].data.guint32.choices = NULL;
+	gnet_property->props[511].data.guint32.max	= 30000;
+	gnet_property->props[511].data.guint32.min	= 250;
+
 	gnet_property->by_name = htable_create(HASH_KEY_STRING, 0);
 	for (n = 0; n < GNET_PROPERTY_NUM; n ++) {
 		htable_insert(gnet_property->by_name,
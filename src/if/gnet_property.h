@@ -540,6 +540,14 @@ typedef enum {
 	PROP_BC_DHT_IN,
 	PROP_BC_LOOPBACK_IN,
 	PROP_BC_PRIVATE_IN,
+	PROP_LIBRARY_WATCH,
+	PROP_LIBRARY_SCAN_THREADS,
+	PROP_BW_WEIGHT_HTTP,
+	PROP_BW_WEIGHT_GNET,
+	PROP_BW_WEIGHT_LEAF,
+	PROP_BW_WEIGHT_UDP,
+	PROP_BW_WEIGHT_DHT,
+	PROP_OOB_DELIVER_DELAY,
 	GNET_PROPERTY_END
 } gnet_property_t;
 
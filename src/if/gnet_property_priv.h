@@ -554,6 +554,14 @@ extern const guint64	gnet_property_variable_bc_gnet_udp_in;
 extern const guint64	gnet_property_variable_bc_dht_in;
 extern const guint64	gnet_property_variable_bc_loopback_in;
 extern const guint64	gnet_property_variable_bc_private_in;
+extern const gboolean gnet_property_variable_library_watch;
+extern const guint32	gnet_property_variable_library_scan_threads;
+extern const guint32	gnet_property_variable_bw_weight_http;
+extern const guint32	gnet_property_variable_bw_weight_gnet;
+extern const guint32	gnet_property_variable_bw_weight_leaf;
+extern const guint32	gnet_property_variable_bw_weight_udp;
+extern const guint32	gnet_property_variable_bw_weight_dht;
+extern const guint32	gnet_property_variable_oob_deliver_delay;
 
 
 prop_set_t *gnet_prop_init(void);
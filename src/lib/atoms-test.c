@@ -0,0 +1,310 @@
+/*
+ * atoms-test -- tests the fixed-size atom store.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "atoms.h"
+#include "log.h"
+#include "progname.h"
+#include "random.h"
+#include "xmalloc.h"
+
+#define GUID_LEN	16
+
+/*
+ * A GUID value, along with the atom we got for it and the amount of
+ * references we hold on that atom.
+ */
+struct item {
+	char guid[GUID_LEN];
+	const void *atom;
+	size_t refcnt;
+};
+
+static size_t item_count = 20000;
+static bool verbose = FALSE;
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+			"Usage: %s [-hv] [-n count]\n"
+			"  -h : prints this help message\n"
+			"  -n : amount of atoms to create (default %zu)\n"
+			"  -v : verbose, trace each testing phase\n"
+			, getprogname(), item_count);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Fill items with distinct random GUIDs.
+ *
+ * Random 128-bit values will not collide, but we need distinct values
+ * for our reference counting to be exact, so check anyway through the
+ * atom layer itself.
+ */
+static void
+fill_items(struct item *items, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		struct item *it = &items[i];
+
+		do {
+			random_bytes(it->guid, sizeof it->guid);
+		} while (atom_exists(ATOM_GUID, it->guid));
+
+		it->atom = NULL;
+		it->refcnt = 0;
+	}
+}
+
+/**
+ * Take a reference on the atom of an item.
+ */
+static void
+item_get(struct item *it)
+{
+	const void *atom = atom_get(ATOM_GUID, it->guid);
+
+	g_assert(atom != NULL);
+	g_assert(atom != it->guid);
+	g_assert(0 == memcmp(atom, it->guid, GUID_LEN));
+	g_assert(atom_is_atom(ATOM_GUID, atom));
+
+	if (0 == it->refcnt)
+		it->atom = atom;
+	else
+		g_assert(atom == it->atom);		/* Same atom as long as referenced */
+
+	it->refcnt++;
+}
+
+/**
+ * Drop a reference on the atom of an item.
+ */
+static void
+item_free(struct item *it)
+{
+	g_assert(it->refcnt != 0);
+
+	atom_free(ATOM_GUID, it->atom);
+	it->refcnt--;
+
+	g_assert(booleanize(it->refcnt != 0) == atom_exists(ATOM_GUID, it->guid));
+}
+
+/**
+ * Create atoms spanning many slab pages, check that they are all distinct
+ * and that getting them again yields the same atoms.
+ */
+static void
+test_get(struct item *items, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		g_assert(!atom_exists(ATOM_GUID, items[i].guid));
+		g_assert(!atom_is_atom(ATOM_GUID, items[i].guid));
+		item_get(&items[i]);
+	}
+
+	for (i = 1; i < n; i++)
+		g_assert(items[i].atom != items[i - 1].atom);
+
+	for (i = 0; i < n; i++)
+		item_get(&items[i]);
+}
+
+/**
+ * Drop references so that only the atoms at even indices remain alive,
+ * then check that freed slots are reused without disturbing live atoms.
+ */
+static void
+test_refcount(struct item *items, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		item_free(&items[i]);
+		g_assert(atom_exists(ATOM_GUID, items[i].guid));
+		if (i & 1)
+			item_free(&items[i]);
+	}
+
+	for (i = 0; i < n; i++) {
+		const struct item *it = &items[i];
+
+		if (it->refcnt != 0) {
+			g_assert(atom_is_atom(ATOM_GUID, it->atom));
+			g_assert(0 == memcmp(it->atom, it->guid, GUID_LEN));
+		}
+	}
+
+	/*
+	 * Odd items are re-created in freed slots, live atoms must not move.
+	 */
+
+	for (i = 1; i < n; i += 2)
+		item_get(&items[i]);
+
+	for (i = 0; i < n; i++) {
+		const struct item *it = &items[i];
+
+		g_assert(1 == it->refcnt);
+		g_assert(atom_is_atom(ATOM_GUID, it->atom));
+		g_assert(0 == memcmp(it->atom, it->guid, GUID_LEN));
+	}
+}
+
+/**
+ * Interleave random gets and frees, checking the atoms against our own
+ * reference counts.
+ */
+static void
+test_churn(struct item *items, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < 8 * n; i++) {
+		struct item *it = &items[random_value(n - 1)];
+
+		if (0 == it->refcnt || random_value(2) != 0)
+			item_get(it);
+		else
+			item_free(it);
+	}
+
+	for (i = 0; i < n; i++) {
+		const struct item *it = &items[i];
+
+		g_assert(booleanize(it->refcnt != 0) ==
+			atom_exists(ATOM_GUID, it->guid));
+	}
+}
+
+/**
+ * Drop all the remaining references.
+ */
+static void
+test_release(struct item *items, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		struct item *it = &items[i];
+
+		while (it->refcnt != 0)
+			item_free(it);
+	}
+
+	for (i = 0; i < n; i++)
+		g_assert(!atom_exists(ATOM_GUID, items[i].guid));
+}
+
+static void
+run(size_t n)
+{
+	struct item *items;
+
+	items = xmalloc(n * sizeof items[0]);
+
+	atoms_init();
+	fill_items(items, n);
+
+	if (verbose)
+		s_info("%s(): creating %zu GUID atoms", G_STRFUNC, n);
+	test_get(items, n);
+
+	if (verbose)
+		s_info("%s(): checking reference counts", G_STRFUNC);
+	test_refcount(items, n);
+
+	if (verbose)
+		s_info("%s(): random gets and frees", G_STRFUNC);
+	test_churn(items, n);
+
+	if (verbose)
+		s_info("%s(): releasing all atoms", G_STRFUNC);
+	test_release(items, n);
+
+	/*
+	 * All slots are free now: creating the atoms again must reuse them.
+	 */
+
+	test_get(items, n);
+	test_release(items, n);
+
+	xfree(items);
+
+	s_info("%s(): all tests passed with %zu atoms", G_STRFUNC, n);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	int c;
+	const char options[] = "hn:v";
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, options)) != EOF) {
+		switch (c) {
+		case 'n':			/* amount of atoms */
+			item_count = atol(optarg);
+			break;
+		case 'v':			/* verbose */
+			verbose = TRUE;
+			break;
+		case 'h':			/* show help */
+			/* FALL THROUGH */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (0 != (argc -= optind))
+		usage();
+
+	if (item_count < 2)
+		usage();
+
+	run(item_count);
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -48,9 +48,11 @@
 #include "misc.h"
 #include "omalloc.h"
 #include "once.h"
+#include "pow2.h"
 #include "spinlock.h"
 #include "str.h"
 #include "stringify.h"
+#include "vmm.h"
 #include "walloc.h"
 #include "xmalloc.h"
 
@@ -85,6 +87,15 @@ typedef enum {
 #define ATOM_CLEAR_MAGIC(a)
 #endif	/* ATOMS_HAVE_MAGIC */
 
+/*
+ * Unless we are debugging atoms, fixed-size atoms are kept in slabs.
+ */
+
+#if !defined(TRACK_ATOMS) && !defined(PROTECT_ATOMS) && \
+	!defined(ATOMS_HAVE_MAGIC)
+#define ATOMS_FIXED
+#endif
+
 union mem_chunk {
   void *next;
   char align[MEM_ALIGNBYTES];
@@ -542,6 +553,7 @@ typedef struct atom_desc {
 	eq_fn_t eq_func;			/**< Atom equality function */
 	len_func_t len_func;		/**< Atom length function */
 	str_func_t str_func;		/**< Atom to human-readable string */
+	struct atom_fixed *fixed;	/**< Store for fixed-size atoms, if any */
 } atom_desc_t;
 
 #define ATOM_TABLE_LOCK(t)		spinlock(&(t)->lock)
@@ -586,15 +598,15 @@ static const char *packed_host_addr_str(const void *v);
  * The set of all atom types we know about.
  */
 static atom_desc_t atoms[] = {
-	{ S, "String", N, str_hash,    str_eq,     str_xlen,   str_str  }, /* 0 */
-	{ S, "GUID",   N, guid_hash,   guid_eq,    guid_len,   guid_str }, /* 1 */
-	{ S, "SHA1",   N, sha1_hash,   sha1_eq,	   sha1_len,   sha1_str }, /* 2 */
-	{ S, "TTH",    N, tth_hash,    tth_eq,	   tth_len,    tth_str },  /* 3 */
-	{ S, "uint64", N, uint64_hash, uint64_eq,  uint64_len, uint64_str},/* 4 */
-	{ S, "filesize", N, fs_hash,   fs_eq,      fs_len,     fs_str },   /* 5 */
-	{ S, "uint32", N, uint32_hash, uint32_eq,  uint32_len, uint32_str},/* 6 */
-	{ S, "host",   N, gnh_hash,    gnh_eq,     gnh_len,    gnh_str },  /* 7 */
-	{ S, "addr",   N, pha_hash,    pha_eq,     pha_len,    pha_str },  /* 8 */
+	{ S, "String", N, str_hash,    str_eq,    str_xlen,   str_str,   N }, /* 0 */
+	{ S, "GUID",   N, guid_hash,   guid_eq,   guid_len,   guid_str,  N }, /* 1 */
+	{ S, "SHA1",   N, sha1_hash,   sha1_eq,   sha1_len,   sha1_str,  N }, /* 2 */
+	{ S, "TTH",    N, tth_hash,    tth_eq,    tth_len,    tth_str,   N }, /* 3 */
+	{ S, "uint64", N, uint64_hash, uint64_eq, uint64_len, uint64_str,N }, /* 4 */
+	{ S, "filesize", N, fs_hash,   fs_eq,     fs_len,     fs_str,    N }, /* 5 */
+	{ S, "uint32", N, uint32_hash, uint32_eq, uint32_len, uint32_str,N }, /* 6 */
+	{ S, "host",   N, gnh_hash,    gnh_eq,    gnh_len,    gnh_str,   N }, /* 7 */
+	{ S, "addr",   N, pha_hash,    pha_eq,    pha_len,    pha_str,   N }, /* 8 */
 };
 
 #undef str_hash
@@ -953,6 +965,520 @@ uint32_str(const void *v)
 	return p;
 }
 
+#ifdef ATOMS_FIXED
+
+/*
+ * Fixed-size atoms.
+ *
+ * GUIDs, SHA1s, TTHs and integers are by far the most numerous atoms, and
+ * their length is known from their type.  Rather than allocating each of
+ * them separately and indexing them with a chained hash table, we store
+ * their values contiguously in page-sized slabs, with the reference counts
+ * held in an array at the head of each slab.
+ *
+ * Atoms are indexed by an open-addressing table with linear probing, where
+ * each bucket holds the 32-bit hash of the value along with the slot number,
+ * so that probing seldom needs to look at the atom value itself.
+ *
+ * Given an atom pointer, its slab is found by aligning the pointer down to
+ * the slab size, which lets atom_free() update the reference count without
+ * hashing the value, unless the atom has to be disposed of.  The slab is
+ * looked up in an address-sorted array of slabs before being accessed, so
+ * that freeing a pointer which is not an atom fails an assertion.
+ *
+ * Freed slots are chained through their value area and reused first.
+ * Slabs are never released until shutdown.
+ */
+
+#define ATOM_FIXED_NONE		((uint32) -1)	/**< End of free list */
+#define ATOM_FIXED_INDEX	64				/**< Minimum index size */
+
+struct atom_slab {
+	uint32 base;				/**< Slot number of the first slot */
+	uint32 refcnt[1];			/**< Reference counts, extends to per_slab */
+};
+
+struct atom_bucket {
+	uint32 hash;				/**< Hash of the atom value */
+	uint32 slot;				/**< Slot number + 1, 0 if bucket empty */
+};
+
+struct atom_fixed {
+	size_t len;					/**< Atom length */
+	size_t stride;				/**< Distance between two atoms in a slab */
+	size_t keys;				/**< Offset of first atom within slab */
+	size_t slab_size;			/**< Size of a slab (power of 2) */
+	uint32 per_slab;			/**< Amount of slots per slab */
+	uint32 nslabs;				/**< Amount of allocated slabs */
+	uint32 free;				/**< Head of free slot list */
+	uint32 count;				/**< Amount of live atoms */
+	uint32 mask;				/**< Index size - 1 */
+	struct atom_slab **slabs;	/**< Allocated slabs */
+	struct atom_slab **sorted;	/**< Allocated slabs, sorted by address */
+	struct atom_bucket *index;	/**< Open-addressing index */
+};
+
+/**
+ * @return the length of fixed-size atoms of given type, 0 for variable-sized.
+ */
+static size_t
+atom_fixed_length(enum atom_type type)
+{
+	switch (type) {
+	case ATOM_GUID:		return GUID_RAW_SIZE;
+	case ATOM_SHA1:		return SHA1_RAW_SIZE;
+	case ATOM_TTH:		return TTH_RAW_SIZE;
+	case ATOM_UINT64:	return sizeof(uint64);
+	case ATOM_FILESIZE:	return sizeof(filesize_t);
+	case ATOM_UINT32:	return sizeof(uint32);
+	case ATOM_STRING:
+	case ATOM_HOST:
+	case ATOM_ADDR:
+	case NUM_ATOM_TYPES:
+		break;
+	}
+
+	return 0;
+}
+
+/**
+ * Allocate the fixed-size atom store for atoms of given length.
+ */
+static struct atom_fixed *
+atom_fixed_make(size_t len)
+{
+	struct atom_fixed *af;
+	size_t align, n;
+
+	g_assert(len >= sizeof(uint32));	/* Free list is chained via values */
+
+	/*
+	 * Atoms are aligned according to their length: the integers are
+	 * properly aligned for direct access, and byte arrays whose length is
+	 * not a power of 2 are not padded needlessly.
+	 */
+
+	for (align = MEM_ALIGNBYTES; 0 != len % align; align /= 2)
+		/* empty */;
+
+	OMALLOC0(af);
+	af->len = len;
+	af->stride = len;
+	af->slab_size = compat_pagesize();
+	af->free = ATOM_FIXED_NONE;
+
+	n = (af->slab_size - offsetof(struct atom_slab, refcnt)) /
+		(sizeof(uint32) + af->stride);
+
+	for (;;) {
+		af->keys = round_size(align,
+			offsetof(struct atom_slab, refcnt) + n * sizeof(uint32));
+		if (af->keys + n * af->stride <= af->slab_size)
+			break;
+		n--;
+	}
+
+	g_assert(n > 0);
+	af->per_slab = n;
+
+	af->mask = ATOM_FIXED_INDEX - 1;
+	XMALLOC0_ARRAY(af->index, ATOM_FIXED_INDEX);
+
+	return af;
+}
+
+/**
+ * @return the slab holding given slot.
+ */
+static inline struct atom_slab *
+atom_fixed_slab(const struct atom_fixed *af, uint32 slot)
+{
+	return af->slabs[slot / af->per_slab];
+}
+
+/**
+ * @return pointer to the atom value of given slot.
+ */
+static inline void *
+atom_fixed_value(const struct atom_fixed *af, uint32 slot)
+{
+	const struct atom_slab *s = atom_fixed_slab(af, slot);
+
+	return ptr_add_offset_const(s, af->keys + (slot - s->base) * af->stride);
+}
+
+/**
+ * Check whether slab belongs to the store, without accessing it.
+ *
+ * @return TRUE if ``s'' is one of the allocated slabs.
+ */
+static bool
+atom_fixed_has_slab(const struct atom_fixed *af, const struct atom_slab *s)
+{
+	uint32 lo = 0, hi = af->nslabs;
+
+	while (lo < hi) {
+		uint32 mid = lo + (hi - lo) / 2;
+		const struct atom_slab *m = af->sorted[mid];
+
+		if (m == s)
+			return TRUE;
+		if (pointer_to_ulong(m) < pointer_to_ulong(s))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Compute the slot of an atom value, along with its slab.
+ *
+ * The pointer is checked to lie on a slot boundary within one of our slabs
+ * before anything is read from the slab.
+ *
+ * @param ad	the atom table description
+ * @param key	the atom value
+ * @param sp	where the slab is written
+ *
+ * @return the slot number of the atom.
+ */
+static inline uint32
+atom_fixed_slot(const atom_desc_t *ad, const void *key,
+	struct atom_slab **sp)
+{
+	const struct atom_fixed *af = ad->fixed;
+	struct atom_slab *s;
+	size_t offset;
+	uint32 slot;
+
+	s = ulong_to_pointer(pointer_to_ulong(key) & ~(af->slab_size - 1));
+	offset = ptr_diff(key, s);
+
+	g_assert_log(atom_fixed_has_slab(af, s) &&
+		offset >= af->keys && 0 == (offset - af->keys) % af->stride,
+		"attempting to free unknown %s atom at %p", ad->type, key);
+
+	slot = s->base + (offset - af->keys) / af->stride;
+
+	g_assert(slot / af->per_slab < af->nslabs);
+	g_assert(atom_fixed_slab(af, slot) == s);
+
+	*sp = s;
+	return slot;
+}
+
+/**
+ * Lookup atom value in the index.
+ *
+ * @return the bucket where the atom is indexed, NULL if not found.
+ */
+static struct atom_bucket *
+atom_fixed_lookup(const atom_desc_t *ad, const void *key, uint32 hash)
+{
+	const struct atom_fixed *af = ad->fixed;
+	uint32 i;
+
+	for (i = hash & af->mask; /* empty */; i = (i + 1) & af->mask) {
+		struct atom_bucket *b = &af->index[i];
+
+		if (0 == b->slot)
+			return NULL;
+
+		if (
+			b->hash == hash &&
+			(*ad->eq_func)(key, atom_fixed_value(af, b->slot - 1))
+		)
+			return b;
+	}
+}
+
+/**
+ * Record slot in the index, which must have room for it.
+ */
+static void
+atom_fixed_index_put(struct atom_bucket *index, uint32 mask,
+	uint32 hash, uint32 slot)
+{
+	uint32 i;
+
+	for (i = hash & mask; index[i].slot != 0; i = (i + 1) & mask)
+		/* empty */;
+
+	index[i].hash = hash;
+	index[i].slot = slot + 1;
+}
+
+/**
+ * Resize the index to hold `size' buckets.
+ */
+static void
+atom_fixed_index_resize(struct atom_fixed *af, uint32 size)
+{
+	struct atom_bucket *index;
+	uint32 i;
+
+	g_assert(is_pow2(size));
+	g_assert(size > af->count);
+
+	XMALLOC0_ARRAY(index, size);
+
+	for (i = 0; i <= af->mask; i++) {
+		const struct atom_bucket *b = &af->index[i];
+
+		if (b->slot != 0)
+			atom_fixed_index_put(index, size - 1, b->hash, b->slot - 1);
+	}
+
+	xfree(af->index);
+	af->index = index;
+	af->mask = size - 1;
+}
+
+/**
+ * Remove bucket from the index, shifting back the entries that follow
+ * it in the probing sequence so that no tombstones are needed.
+ */
+static void
+atom_fixed_index_remove(struct atom_fixed *af, struct atom_bucket *b)
+{
+	uint32 i = b - af->index, j = i;
+
+	for (;;) {
+		uint32 k;
+
+		j = (j + 1) & af->mask;
+
+		if (0 == af->index[j].slot)
+			break;
+
+		/*
+		 * Entry at j can move to i if its home bucket k does not lie
+		 * cyclically within ]i, j].
+		 */
+
+		k = af->index[j].hash & af->mask;
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+
+		af->index[i] = af->index[j];
+		i = j;
+	}
+
+	af->index[i].slot = 0;
+}
+
+/**
+ * Allocate a new slot, with a reference count of 1.
+ *
+ * @return the slot number.
+ */
+static uint32
+atom_fixed_slot_alloc(struct atom_fixed *af)
+{
+	struct atom_slab *s;
+	uint32 slot, i;
+
+	if (af->free != ATOM_FIXED_NONE) {
+		slot = af->free;
+		af->free = *(uint32 *) atom_fixed_value(af, slot);
+		s = atom_fixed_slab(af, slot);
+		goto found;
+	}
+
+	/*
+	 * Allocate a new slab, chaining all its slots but the first one
+	 * in the free list.
+	 */
+
+	s = vmm_core_alloc(af->slab_size);
+	g_assert(0 == pointer_to_ulong(s) % af->slab_size);
+
+	XREALLOC_ARRAY(af->slabs, af->nslabs + 1);
+	af->slabs[af->nslabs] = s;
+	s->base = af->nslabs * af->per_slab;
+
+	XREALLOC_ARRAY(af->sorted, af->nslabs + 1);
+	for (i = af->nslabs; i > 0; i--) {
+		if (pointer_to_ulong(af->sorted[i - 1]) < pointer_to_ulong(s))
+			break;
+		af->sorted[i] = af->sorted[i - 1];
+	}
+	af->sorted[i] = s;
+	af->nslabs++;
+
+	for (i = af->per_slab - 1; i > 0; i--) {
+		uint32 n = s->base + i;
+
+		*(uint32 *) atom_fixed_value(af, n) = af->free;
+		s->refcnt[i] = 0;
+		af->free = n;
+	}
+
+	slot = s->base;
+
+found:
+	s->refcnt[slot - s->base] = 1;
+	af->count++;
+
+	return slot;
+}
+
+/**
+ * Get fixed-size atom, creating it if needed.
+ *
+ * Must be called with the table description locked.
+ *
+ * @return the atom's value.
+ */
+static const void *
+atom_fixed_get(atom_desc_t *ad, const void *key)
+{
+	struct atom_fixed *af = ad->fixed;
+	struct atom_bucket *b;
+	uint32 hash, slot;
+	void *value;
+
+	hash = (*ad->hash_func)(key);
+	b = atom_fixed_lookup(ad, key, hash);
+
+	if (b != NULL) {
+		struct atom_slab *s;
+
+		slot = b->slot - 1;
+		s = atom_fixed_slab(af, slot);
+		g_assert(s->refcnt[slot - s->base] > 0);
+		g_assert(s->refcnt[slot - s->base] < ATOM_SIZE_MAX);
+		s->refcnt[slot - s->base]++;
+
+		return atom_fixed_value(af, slot);
+	}
+
+	/*
+	 * Keep the index load factor under 3/4.
+	 */
+
+	if ((af->count + 1) > (af->mask + 1) / 4 * 3)
+		atom_fixed_index_resize(af, (af->mask + 1) * 2);
+
+	slot = atom_fixed_slot_alloc(af);
+	value = atom_fixed_value(af, slot);
+	memcpy(value, key, af->len);
+	atom_fixed_index_put(af->index, af->mask, hash, slot);
+
+	return value;
+}
+
+/**
+ * Remove one reference from fixed-size atom, disposing of it when the
+ * last reference goes.
+ *
+ * Must be called with the table description locked.
+ */
+static void
+atom_fixed_free(atom_desc_t *ad, const void *key)
+{
+	struct atom_fixed *af = ad->fixed;
+	struct atom_slab *s;
+	uint32 slot, *refcnt;
+
+	slot = atom_fixed_slot(ad, key, &s);
+	refcnt = &s->refcnt[slot - s->base];
+
+	g_assert_log(*refcnt != 0,
+		"attempting to free unknown %s atom at %p", ad->type, key);
+
+	if (1 == *refcnt) {
+		struct atom_bucket *b;
+
+		b = atom_fixed_lookup(ad, key, (*ad->hash_func)(key));
+
+		g_assert_log(b != NULL && b->slot - 1 == slot,
+			"attempt to free %s atom copy at %p", ad->type, key);
+
+		atom_fixed_index_remove(af, b);
+		*refcnt = 0;
+		*(uint32 *) deconstify_pointer(key) = af->free;
+		af->free = slot;
+		af->count--;
+
+		/*
+		 * Shrink the index when it becomes sparse.
+		 */
+
+		if (af->mask + 1 > ATOM_FIXED_INDEX && af->count < (af->mask + 1) / 8)
+			atom_fixed_index_resize(af, (af->mask + 1) / 2);
+	} else {
+		(*refcnt)--;
+	}
+}
+
+/**
+ * Check whether a fixed-size atom exists.
+ *
+ * Must be called with the table description locked.
+ *
+ * @return the atom if ``key'' is a known atom, NULL otherwise.
+ */
+static const void *
+atom_fixed_exists(const atom_desc_t *ad, const void *key)
+{
+	const struct atom_bucket *b;
+
+	b = atom_fixed_lookup(ad, key, (*ad->hash_func)(key));
+
+	return NULL == b ? NULL : atom_fixed_value(ad->fixed, b->slot - 1);
+}
+
+/**
+ * Warn about remaining fixed-size atoms at shutdown, then dispose of the
+ * store if empty.
+ *
+ * Must be called with the table description locked.
+ */
+static void
+atom_fixed_close(atom_desc_t *ad)
+{
+	struct atom_fixed *af = ad->fixed;
+	uint32 i;
+
+	for (i = 0; i <= af->mask; i++) {
+		const struct atom_bucket *b = &af->index[i];
+		const struct atom_slab *s;
+		uint32 slot;
+
+		if (0 == b->slot)
+			continue;
+
+		slot = b->slot - 1;
+		s = atom_fixed_slab(af, slot);
+
+		g_warning("found remaining %s atom %p, refcnt=%u: \"%s\"",
+			ad->type, atom_fixed_value(af, slot), s->refcnt[slot - s->base],
+			(*ad->str_func)(atom_fixed_value(af, slot)));
+	}
+
+	XFREE_NULL(af->index);
+
+	/*
+	 * Don't free the slabs if there were remaining atoms, so that we know
+	 * where the leak originates from.
+	 */
+
+	if (0 == af->count) {
+		for (i = 0; i < af->nslabs; i++)
+			vmm_core_free(af->slabs[i], af->slab_size);
+		XFREE_NULL(af->slabs);
+		XFREE_NULL(af->sorted);
+		af->nslabs = 0;
+	}
+
+	ad->fixed = NULL;
+}
+
+#endif	/* ATOMS_FIXED */
+
 /**
  * Initialize atom structures.
  */
@@ -982,6 +1508,17 @@ atoms_init_once(void)
 		atom_desc_t *ad = &atoms[i];
 
 		ad->table = htable_create_any(ad->hash_func, NULL, ad->eq_func);
+
+#ifdef ATOMS_FIXED
+		{
+			size_t len = atom_fixed_length(i);
+
+			if (len != 0) {
+				g_assert(len == (*ad->len_func)(NULL));	/* Ignores its arg */
+				ad->fixed = atom_fixed_make(len);
+			}
+		}
+#endif	/* ATOMS_FIXED */
 	}
 
 	/*
@@ -1028,12 +1565,30 @@ atoms_init(void)
 bool
 atom_exists(enum atom_type type, const void *key)
 {
+	atom_desc_t *ad;
+	bool found;
+
 	g_assert(key != NULL);
 
 	if G_UNLIKELY(!ONCE_DONE(atoms_inited))
 		return FALSE;
 
-	return htable_contains(atoms[type].table, key);
+	ad = &atoms[type];
+
+#ifdef ATOMS_FIXED
+	if (ad->fixed != NULL) {
+		ATOM_TABLE_LOCK(ad);
+		found = NULL != atom_fixed_exists(ad, key);
+		ATOM_TABLE_UNLOCK(ad);
+		return found;
+	}
+#endif	/* ATOMS_FIXED */
+
+	ATOM_TABLE_LOCK(ad);
+	found = htable_contains(ad->table, key);
+	ATOM_TABLE_UNLOCK(ad);
+
+	return found;
 }
 
 /**
@@ -1044,15 +1599,31 @@ atom_exists(enum atom_type type, const void *key)
 bool
 atom_is_atom(enum atom_type type, const void *key)
 {
-	const void *atom;
+	atom_desc_t *ad;
+	const void *atom = NULL;
+	bool found;
 
 	g_assert(key != NULL);
 
 	if G_UNLIKELY(!ONCE_DONE(atoms_inited))
 		return FALSE;
 
-	return htable_lookup_extended(atoms[type].table, key, &atom, NULL)
-		&& key == atom;
+	ad = &atoms[type];
+	ATOM_TABLE_LOCK(ad);
+
+#ifdef ATOMS_FIXED
+	if (ad->fixed != NULL) {
+		atom = atom_fixed_exists(ad, key);
+		found = atom != NULL;
+	} else
+#endif	/* ATOMS_FIXED */
+	{
+		found = htable_lookup_extended(ad->table, key, &atom, NULL);
+	}
+
+	ATOM_TABLE_UNLOCK(ad);
+
+	return found && key == atom;
 }
 
 /**
@@ -1110,6 +1681,14 @@ atom_get(enum atom_type type, const void *key)
 	ad = &atoms[type];		/* Where atoms of this type are held */
 	ATOM_TABLE_LOCK(ad);
 
+#ifdef ATOMS_FIXED
+	if (ad->fixed != NULL) {
+		orig_key = atom_fixed_get(ad, key);
+		ATOM_TABLE_UNLOCK(ad);
+		return orig_key;
+	}
+#endif	/* ATOMS_FIXED */
+
 	if (htable_lookup_extended(ad->table, key, &orig_key, &value)) {
 		size_t refcnt;
 
@@ -1190,6 +1769,14 @@ atom_free(enum atom_type type, const void *key)
 	ad = &atoms[type];		/* Where atoms of this type are held */
 	ATOM_TABLE_LOCK(ad);
 
+#ifdef ATOMS_FIXED
+	if (ad->fixed != NULL) {
+		atom_fixed_free(ad, key);
+		ATOM_TABLE_UNLOCK(ad);
+		return;
+	}
+#endif	/* ATOMS_FIXED */
+
 	found = htable_lookup_extended(ad->table, key, &orig_key, &value);
 
 	g_assert_log(found,
@@ -1473,6 +2060,10 @@ atoms_close(void)
 		atom_desc_t *ad = &atoms[i];
 
 		ATOM_TABLE_LOCK(ad);
+#ifdef ATOMS_FIXED
+		if (ad->fixed != NULL)
+			atom_fixed_close(ad);
+#endif	/* ATOMS_FIXED */
 		htable_foreach(ad->table, atom_warn_free, ad);
 		htable_free_null(&ad->table);
 		ATOM_TABLE_UNLOCK(ad);
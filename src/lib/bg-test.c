@@ -0,0 +1,373 @@
+/*
+ * bg-test -- tests background tasks run by a threaded scheduler.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "atomic.h"
+#include "bg.h"
+#include "log.h"
+#include "progname.h"
+#include "pslist.h"
+#include "stringify.h"		/* For PLURAL() */
+#include "thread.h"
+
+#define SCHED_NAME		"bg-test"
+#define SCHED_LIFE		10000		/**< Scheduler slice, in usecs */
+#define WAIT_STEP		10			/**< Polling period, in ms */
+#define WAIT_MAX		10000		/**< Maximum waiting time, in ms */
+#define STALL_MS		50			/**< Stalling step duration, in ms */
+
+/*
+ * Context of the counting task.
+ */
+struct count_ctx {
+	uint total;			/**< Amount of units to process */
+	uint done;			/**< Processed units */
+	uint runs;			/**< Amount of step runs */
+	uint stid;			/**< Thread running the steps */
+	bgstatus_t status;	/**< Task exit status */
+	bool ended;			/**< Set by done callback */
+	bool freed;			/**< Set when context is freed */
+};
+
+/*
+ * Context of the summing daemon.
+ */
+struct sum_ctx {
+	uint item;			/**< Item being processed */
+	uint sum;			/**< Sum of processed items */
+	uint processed;		/**< Amount of processed items */
+	uint stid;			/**< Thread running the steps */
+	bool freed;			/**< Set when context is freed */
+};
+
+static uint unit_count = 100000;
+static uint item_count = 100;
+static bool verbose = FALSE;
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+			"Usage: %s [-hv] [-i items] [-n units]\n"
+			"  -h : prints this help message\n"
+			"  -i : amount of items given to the daemon (default %u)\n"
+			"  -n : amount of units processed by the task (default %u)\n"
+			"  -v : verbose, trace each testing phase\n"
+			, getprogname(), item_count, unit_count);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Wait until the boolean is set by the scheduler thread.
+ */
+static void
+wait_for(const bool *flag, const char *what)
+{
+	uint waited = 0;
+
+	while (!atomic_bool_get(flag)) {
+		if (waited >= WAIT_MAX)
+			s_error("timeout waiting for %s", what);
+		thread_sleep_ms(WAIT_STEP);
+		waited += WAIT_STEP;
+	}
+}
+
+/**
+ * Counting step: process as many units as we are given ticks.
+ *
+ * The very first run stalls for STALL_MS to make sure it overruns its
+ * time budget.
+ */
+static bgret_t
+count_step(bgtask_t *bt, void *ctx, int ticks)
+{
+	struct count_ctx *cc = ctx;
+	uint n;
+
+	(void) bt;
+
+	atomic_uint_set(&cc->stid, thread_small_id());
+
+	if (0 == cc->runs++)
+		thread_sleep_ms(STALL_MS);
+
+	n = MIN(UNSIGNED(ticks), cc->total - cc->done);
+	cc->done += n;
+
+	return cc->done == cc->total ? BGR_DONE : BGR_MORE;
+}
+
+static void
+count_done(bgtask_t *bt, void *ctx, bgstatus_t status, void *arg)
+{
+	struct count_ctx *cc = ctx;
+
+	(void) bt;
+	(void) arg;
+
+	cc->status = status;
+	atomic_bool_set(&cc->ended, TRUE);
+}
+
+static void
+count_free(void *ctx)
+{
+	struct count_ctx *cc = ctx;
+
+	atomic_bool_set(&cc->freed, TRUE);
+}
+
+static void
+sum_start(bgtask_t *bt, void *ctx, void *item)
+{
+	struct sum_ctx *sc = ctx;
+
+	(void) bt;
+
+	sc->item = pointer_to_uint(item);
+}
+
+/**
+ * Summing step: add the current item to the sum.
+ */
+static bgret_t
+sum_step(bgtask_t *bt, void *ctx, int ticks)
+{
+	struct sum_ctx *sc = ctx;
+
+	(void) bt;
+	(void) ticks;
+
+	atomic_uint_set(&sc->stid, thread_small_id());
+	sc->sum += sc->item;
+
+	return BGR_DONE;
+}
+
+static void
+sum_end(bgtask_t *bt, void *ctx, void *item)
+{
+	struct sum_ctx *sc = ctx;
+
+	(void) bt;
+
+	g_assert(sc->item == pointer_to_uint(item));
+
+	atomic_uint_inc(&sc->processed);
+}
+
+static void
+sum_free(void *ctx)
+{
+	struct sum_ctx *sc = ctx;
+
+	atomic_bool_set(&sc->freed, TRUE);
+}
+
+/**
+ * Run a task to completion in the threaded scheduler.
+ */
+static void
+test_task(bgsched_t *bs, uint total)
+{
+	static struct count_ctx cc;
+	bgstep_cb_t step = count_step;
+
+	cc.total = total;
+
+	(void) bg_task_create(bs, "count", &step, 1,
+		&cc, count_free, count_done, NULL);
+
+	wait_for(&cc.ended, "task completion");
+	wait_for(&cc.freed, "task context cleanup");
+
+	g_assert(BGS_OK == cc.status);
+	g_assert(cc.done == cc.total);
+	g_assert(cc.runs > 1);
+	g_assert(atomic_uint_get(&cc.stid) != thread_small_id());
+
+	if (verbose) {
+		s_info("%s(): %u units processed in %u runs by %s",
+			G_STRFUNC, cc.done, cc.runs, thread_id_name(cc.stid));
+	}
+}
+
+/**
+ * Feed items to a daemon in the threaded scheduler, then cancel it.
+ */
+static void
+test_daemon(bgsched_t *bs, uint count)
+{
+	static struct sum_ctx sc;
+	bgstep_cb_t step = sum_step;
+	bgtask_t *bt;
+	uint i, waited = 0;
+
+	bt = bg_daemon_create(bs, "sum", &step, 1,
+		&sc, sum_free, sum_start, sum_end, NULL, NULL);
+
+	for (i = 1; i <= count; i++)
+		bg_daemon_enqueue(bt, uint_to_pointer(i));
+
+	while (atomic_uint_get(&sc.processed) != count) {
+		if (waited >= WAIT_MAX)
+			s_error("%s(): timeout waiting for items", G_STRFUNC);
+		thread_sleep_ms(WAIT_STEP);
+		waited += WAIT_STEP;
+	}
+
+	g_assert(sc.sum == count * (count + 1) / 2);
+	g_assert(atomic_uint_get(&sc.stid) != thread_small_id());
+
+	/*
+	 * The daemon is going back to sleep: cancelling it from a foreign thread
+	 * must wake up the scheduler thread, which processes the cancellation.
+	 */
+
+	bg_task_cancel(bt);
+	wait_for(&sc.freed, "daemon cancellation");
+
+	if (verbose)
+		s_info("%s(): %u items processed", G_STRFUNC, sc.processed);
+}
+
+/**
+ * Check the statistics of the threaded scheduler.
+ */
+static void
+test_stats(void)
+{
+	pslist_t *sl, *s;
+	bool found = FALSE;
+
+	sl = bg_sched_info_list();
+
+	PSLIST_FOREACH(sl, s) {
+		const bgsched_info_t *bsi = s->data;
+
+		bgsched_info_check(bsi);
+
+		if (0 != strcmp(bsi->name, SCHED_NAME))
+			continue;
+
+		found = TRUE;
+
+		g_assert(bsi->thread);
+		g_assert(bsi->stid != thread_small_id());
+		g_assert(bsi->completed >= 1);
+
+		/*
+		 * The first run of the counting task stalled for many times its
+		 * budget, which must have been accounted as an overrun.
+		 */
+
+		g_assert(bsi->overruns >= 1);
+		g_assert(bsi->lat_max >= STALL_MS * 1000);
+
+		if (verbose) {
+			s_info("%s(): %u overrun%s, max latency %'d usecs",
+				G_STRFUNC, PLURAL(bsi->overruns), bsi->lat_max);
+		}
+	}
+
+	bg_sched_info_list_free_null(&sl);
+
+	g_assert(found);
+}
+
+static void
+run(void)
+{
+	bgsched_t *bs;
+
+	bs = bg_sched_thread_create(SCHED_NAME, SCHED_LIFE);
+
+	if (verbose)
+		s_info("%s(): running task", G_STRFUNC);
+	test_task(bs, unit_count);
+
+	if (verbose)
+		s_info("%s(): running daemon", G_STRFUNC);
+	test_daemon(bs, item_count);
+
+	if (verbose)
+		s_info("%s(): checking statistics", G_STRFUNC);
+	test_stats();
+
+	bg_sched_destroy_null(&bs);
+
+	s_info("%s(): all tests passed", G_STRFUNC);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	int c;
+	const char options[] = "hi:n:v";
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, options)) != EOF) {
+		switch (c) {
+		case 'i':			/* amount of daemon items */
+			item_count = atoi(optarg);
+			break;
+		case 'n':			/* amount of task units */
+			unit_count = atoi(optarg);
+			break;
+		case 'v':			/* verbose */
+			verbose = TRUE;
+			break;
+		case 'h':			/* show help */
+			/* FALL THROUGH */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (0 != (argc -= optind))
+		usage();
+
+	if (0 == item_count || 0 == unit_count)
+		usage();
+
+	run();
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -106,6 +106,8 @@
 #include "bg.h"
 
 #include "atoms.h"
+#include "barrier.h"
+#include "constants.h"
 #include "cq.h"
 #include "elist.h"
 #include "entropy.h"
@@ -119,6 +121,8 @@
 #include "stacktrace.h"
 #include "str.h"
 #include "stringify.h"		/* For short_time_ascii() and plural() */
+#include "teq.h"
+#include "thread.h"
 #include "tm.h"
 #include "walloc.h"
 
@@ -126,6 +130,8 @@
 
 #define MAX_LIFE		50000UL			/**< In usecs, MUST be << 250 ms */
 #define DELTA_FACTOR	2				/**< Max variations are 200% */
+#define BG_OVERRUN		2				/**< Overrun above twice budget */
+#define BG_HICCUP		100000			/**< In usecs, main loop hiccup */
 
 #define BG_TICK_IDLE	1000			/**< Tick every second when idle */
 #define BG_TICK_BUSY	250				/**< Tick every 250 ms when busy */
@@ -143,7 +149,9 @@ enum bgsched_magic {
  * Scheduling of tasks held in the scheduler is done by bg_sched_timer().
  *
  * A scheduler can have a periodic event scheduled in the main callout queue
- * or can be manually triggered periodically from an auxiliary thread.
+ * or can be manually triggered periodically from an auxiliary thread.  It can
+ * also be given its own dedicated thread, which runs it whenever it has some
+ * runnable tasks, see bg_sched_thread_create().
  *
  * A scheduler must be run by the same thread: once it has begun to run tasks
  * in a thread, it can only be called for that thread.  This constraint is
@@ -163,6 +171,10 @@ struct bgsched {
 	int runcount;				/**< Amount of runnable tasks */
 	int period;					/**< Scheduling period for callout, in ms */
 	unsigned stid;				/**< Thread running scheduler, -1 if unknown */
+	uint overruns;				/**< Overrunning task runs */
+	int lat_max;				/**< Longest task run, in usecs */
+	bool thread;				/**< Whether scheduler has a dedicated thread */
+	volatile bool exiting;		/**< Signals dedicated thread to exit */
 	cperiodic_t *pev;			/**< Ticker periodic event */
 	mutex_t lock;				/**< Thread-safe lock */
 	link_t lnk;					/**< Links all active schedulers */
@@ -229,6 +241,11 @@ struct bgtask {
 	int prev_ticks;			/**< Ticks used when measuring `elapsed' below */
 	int elapsed;			/**< Elapsed during last run, in usec */
 	double tick_cost;		/**< Time in ms. spent by each tick */
+	int budget;				/**< Time budget given to last run, in usec */
+	int lat_avg;			/**< Slow EMA of run latency, in usec */
+	int lat_max;			/**< Maximum run latency, in usec */
+	uint overruns;			/**< Runs exceeding BG_OVERRUN times their budget */
+	uint64 runs;			/**< Amount of scheduled runs */
 	bgsig_cb_t sigh[BG_SIG_COUNT];	/**< Signal handlers */
 	spinlock_t lock;		/**< Thread-safe lock */
 	slink_t bgt_link;		/**< Links task in appropriate list */
@@ -267,6 +284,21 @@ bg_task_is_daemon(const bgtask_t * const bt)
 
 #define BG_DAEMON(t)	(bg_task_is_daemon(t) ? (struct bgdaemon *) (t) : NULL)
 
+/**
+ * Did the last run of the task overrun its time budget?
+ *
+ * A run overruns when it lasts more than BG_OVERRUN times the budget it was
+ * given: such runs are accounted in the task and scheduler statistics, and
+ * the tick calibration then shrinks the next run at once instead of going
+ * down progressively.  A run within BG_OVERRUN times its budget is normal
+ * jitter, which the progressive calibration already absorbs.
+ */
+static inline bool
+bg_task_overran(const bgtask_t * const bt)
+{
+	return bt->budget != 0 && bt->elapsed > BG_OVERRUN * bt->budget;
+}
+
 /**
  * Operating flags.
  */
@@ -741,6 +773,37 @@ bg_task_suspend(bgtask_t *bt, int target)
 	bt->elapsed = elapsed;
 	bt->wtime += (elapsed + 500) / 1000;	/* wtime is in ms */
 	bt->prev_ticks = bt->ticks_used;
+	bt->budget = target;
+
+	/*
+	 * Update latency statistics.
+	 *
+	 * A run that lasted more than BG_OVERRUN times its budget is an overrun
+	 * (see bg_task_overran()): the task is not splitting its work finely
+	 * enough, or its tick cost estimate was way off.  When this happens in
+	 * a scheduler driven from the main callout queue and the run was long
+	 * enough to be noticeable, we loudly warn since this introduces a
+	 * hiccup in the main loop.
+	 */
+
+	bt->runs++;
+	bt->lat_avg = 1 == bt->runs ? elapsed : (7 * bt->lat_avg + elapsed) / 8;
+	bt->lat_max = MAX(bt->lat_max, elapsed);
+	bt->sched->lat_max = MAX(bt->sched->lat_max, elapsed);
+
+	if (bg_task_overran(bt)) {
+		bt->overruns++;
+		bt->sched->overruns++;
+
+		if (bt->sched->pev != NULL && elapsed > BG_HICCUP) {
+			s_warning_once_per(LOG_PERIOD_MINUTE,
+				"%s(): %s\"%s\" step #%d (%s) ran for %'d ms "
+				"with %d tick%s, budget was %'d us",
+				G_STRFUNC, bg_task_daemon_str(bt), bt->name, bt->step,
+				bg_task_step_name(bt), (int) (elapsed / 1000),
+				PLURAL(bt->ticks_used), target);
+		}
+	}
 
 	/*
 	 * Now update the tick cost, if elapsed is not null.
@@ -861,6 +924,36 @@ bg_sched_wakeup(bgtask_t *bt)
 	BG_SCHED_UNLOCK(bs);
 }
 
+/**
+ * Thread event callback, invoked in the dedicated scheduler thread.
+ */
+static void
+bg_sched_thread_kicked(void *arg)
+{
+	/*
+	 * Nothing to do: receiving the event made the thread leave teq_wait(),
+	 * and bg_sched_thread_has_work() will now see the runnable tasks.
+	 * The scheduler may be gone already if we were asked to exit.
+	 */
+
+	(void) arg;
+}
+
+/**
+ * Signal the dedicated thread of a scheduler that it has work to do.
+ *
+ * This must be called without holding any task or scheduler lock, after
+ * a task was made runnable.
+ */
+static void
+bg_sched_kick(bgsched_t *bs)
+{
+	bg_sched_check(bs);
+
+	if (bs->thread && thread_small_id() != bs->stid)
+		(void) teq_post_unique(bs->stid, bg_sched_thread_kicked, bs);
+}
+
 /**
  * Switch to new task `bt'.
  * If argument is NULL, suspends current task.
@@ -985,6 +1078,9 @@ bg_task_create_internal(
 		bg_sched_sleep(bt);				/* Record sleeping task */
 	BG_SCHED_UNLOCK(bt->sched);
 
+	if (running)
+		bg_sched_kick(bt->sched);
+
 	if (bg_debug > 1) {
 		s_debug("BGTASK created task \"%s\" %p (%d step%s) in %s scheduler",
 			name, bt, PLURAL(stepcnt), bt->sched->name);
@@ -1091,6 +1187,8 @@ bg_task_run(bgtask_t *bt)
 	if G_UNLIKELY(!awoken) {
 		s_carp("%s(): task %p \"%s\" was already running",
 			G_STRFUNC, bt, bt->name);
+	} else {
+		bg_sched_kick(bt->sched);
 	}
 }
 
@@ -1199,6 +1297,9 @@ bg_daemon_enqueue(bgtask_t *bt, void *item)
 
 	BG_TASK_UNLOCK(bt);
 
+	if (awoken)
+		bg_sched_kick(bt->sched);
+
 	if (awoken && bg_debug > 1)
 		s_debug("BGTASK waking up daemon \"%s\" task %p", bt->name, bt);
 
@@ -1765,6 +1866,7 @@ bg_task_cancel(bgtask_t *bt)
 
 	if (thread_small_id() != bs->stid) {
 		BG_TASK_UNLOCK(bt);
+		bg_sched_kick(bs);			/* So that it can process cancellation */
 		if (bg_debug > 1)
 			s_debug("BGTASK recorded foreign cancel for \"%s\" %p, "
 				"currently in %s()", bt->name, bt, bg_task_step_name(bt));
@@ -1953,6 +2055,9 @@ bg_task_wakeup(bgtask_t *bt)
 
 	BG_SCHED_UNLOCK(bs);
 	BG_TASK_UNLOCK(bt);
+
+	if (!only_requested)
+		bg_sched_kick(bs);
 }
 
 /**
@@ -2208,10 +2313,16 @@ bg_sched_timer(void *arg)
 		 * Compute how many ticks we can ask for this processing step.
 		 *
 		 * We don't allow brutal variations of the amount of ticks larger
-		 * than DELTA_FACTOR.
+		 * than DELTA_FACTOR, except when the last run overran its budget
+		 * (see bg_task_overran()): the tick cost was then recomputed and
+		 * we immediately shrink the amount of ticks to fit the current
+		 * budget.  Growing back is done progressively, so a single fast run
+		 * does not cause the next one to stall the scheduler.
 		 */
 
 		if (bt->tick_cost > 0.0) {
+			bool overran = bg_task_overran(bt);
+
 			g_assert(bt->prev_ticks >= 0);
 			g_assert(bt->prev_ticks <= INT_MAX / DELTA_FACTOR);
 
@@ -2223,7 +2334,7 @@ bg_sched_timer(void *arg)
 			if (bt->prev_ticks) {
 				if (ticks > bt->prev_ticks * DELTA_FACTOR) {
 					ticks = bt->prev_ticks * DELTA_FACTOR;
-				} else if (ticks < bt->prev_ticks / DELTA_FACTOR) {
+				} else if (ticks < bt->prev_ticks / DELTA_FACTOR && !overran) {
 					if (bt->prev_ticks > DELTA_FACTOR)
 						ticks = bt->prev_ticks / DELTA_FACTOR;
 					else
@@ -2627,11 +2738,134 @@ bg_sched_destroy_null(bgsched_t **bs_ptr)
 	bgsched_t *bs = *bs_ptr;
 
 	if (bs != NULL) {
-		bg_sched_destroy(bs);
+		/*
+		 * A scheduler with a dedicated thread is destroyed by that thread,
+		 * which we signal to exit.
+		 */
+
+		if (bs->thread && thread_small_id() != bs->stid) {
+			bs->exiting = TRUE;
+			bg_sched_kick(bs);
+		} else {
+			bg_sched_destroy(bs);
+		}
 		*bs_ptr = NULL;
 	}
 }
 
+/**
+ * Arguments passed to the dedicated scheduler thread.
+ */
+struct bg_sched_thread_arg {
+	bgsched_t *bs;				/**< Scheduler to run */
+	const char *name;			/**< Thread name */
+	barrier_t *b;				/**< Setup barrier */
+};
+
+/**
+ * Is there work pending in the scheduler, or must the thread exit?
+ */
+static bool
+bg_sched_thread_has_work(void *arg)
+{
+	bgsched_t *bs = arg;
+
+	/*
+	 * When the thread should exit, we return TRUE to make sure we leave
+	 * the teq_wait() call.
+	 */
+
+	return bs->exiting || 0 != bg_sched_runcount(bs);
+}
+
+/**
+ * Dedicated scheduler thread main loop.
+ */
+static void *
+bg_sched_thread_main(void *p)
+{
+	struct bg_sched_thread_arg *args = p;
+	bgsched_t *bs = args->bs;
+
+	bg_sched_check(bs);
+
+	thread_set_name(args->name);
+	teq_create();				/* Queue to receive wakeup events */
+	bs->stid = thread_small_id();
+	barrier_wait(args->b);		/* Thread has initialized */
+	barrier_free_null(&args->b);
+	WFREE(args);
+
+	if (bg_debug)
+		s_debug("BGTASK %s scheduler started in %s", bs->name, thread_name());
+
+	/*
+	 * Run tasks until the scheduler is destroyed.
+	 *
+	 * Since we are not competing with the main loop, tasks are run as soon
+	 * as they are runnable and we only block when nothing is left to do.
+	 */
+
+	while (!bs->exiting) {
+		teq_wait(bg_sched_thread_has_work, bs);
+
+		while (!bs->exiting && 0 != bg_sched_run(bs))
+			thread_check_suspended();
+	}
+
+	if (bg_debug)
+		s_debug("BGTASK %s scheduler exiting from %s", bs->name, thread_name());
+
+	bg_sched_destroy(bs);
+
+	return NULL;
+}
+
+/**
+ * Create a new background task scheduler running in its own thread.
+ *
+ * Tasks and daemons created in that scheduler are run by the dedicated
+ * thread as soon as they become runnable, without disturbing the main loop.
+ * The task callbacks must therefore be thread-safe.
+ *
+ * The thread exits when the scheduler is destroyed by bg_sched_destroy_null().
+ *
+ * @param name		scheduler name (for logging purposes, also thread name)
+ * @param max_life	maximum life time of a scheduling tick, in usecs
+ */
+bgsched_t *
+bg_sched_thread_create(const char *name, ulong max_life)
+{
+	struct bg_sched_thread_arg *args;
+	bgsched_t *bs;
+	barrier_t *b;
+
+	bs = bg_sched_alloc(name, max_life, FALSE);
+	bs->thread = TRUE;
+
+	b = barrier_new(2);
+
+	WALLOC(args);
+	args->bs = bs;
+	args->name = constant_str(name);
+	args->b = barrier_refcnt_inc(b);
+
+	/*
+	 * The thread is detached since we do not expect any result from it,
+	 * and it cannot be cancelled: it exits when the scheduler is destroyed.
+	 */
+
+	thread_create(bg_sched_thread_main, args,
+		THREAD_F_DETACH | THREAD_F_NO_CANCEL |
+			THREAD_F_NO_POOL | THREAD_F_PANIC,
+		THREAD_STACK_DFLT);
+
+	barrier_wait(b);		/* Wait for thread to initialize */
+	barrier_free_null(&b);
+
+	return bs;
+}
+
 struct bg_info_list_vars {
 	pslist_t *sl;
 	bgsched_t *bs;
@@ -2672,6 +2906,10 @@ bg_info_get(void *data, void *udata)
 	bi->step = bt->step;
 	bi->seqno = bt->seqno;
 	bi->stepcnt = bt->stepcnt;
+	bi->runs = bt->runs;
+	bi->overruns = bt->overruns;
+	bi->lat_avg = bt->lat_avg;
+	bi->lat_max = bt->lat_max;
 	if (locked)
 		bi->signals = pslist_length(bt->signals);	/* Expecting low amount */
 	flags = bt->flags;								/* Read all bits once */
@@ -2784,6 +3022,9 @@ bg_sched_info_list(void)
 		bsi->runcount = bs->runcount;
 		bsi->max_life = bs->max_life;
 		bsi->period = bs->period;
+		bsi->overruns = bs->overruns;
+		bsi->lat_max = bs->lat_max;
+		bsi->thread = booleanize(bs->thread);
 		BG_SCHED_UNLOCK(bs);
 
 		sl = pslist_prepend(sl, bsi);
@@ -91,6 +91,10 @@ typedef struct {
 	size_t signals;			/**< Signals pending delivery */
 	size_t wq_count;		/**< Work queue count, for daemon tasks */
 	size_t wq_done;			/**< Processed items, for daemon tasks */
+	uint64 runs;			/**< Amount of scheduled step runs */
+	uint overruns;			/**< Runs lasting over twice their time budget */
+	int lat_avg;			/**< Average run latency, in usecs */
+	int lat_max;			/**< Maximum run latency, in usecs */
 	uint running:1;			/**< Is task running? */
 	uint daemon:1;			/**< Is task a daemon? */
 	uint cancelled:1;		/**< Is task cancelled? */
@@ -119,6 +123,9 @@ typedef struct {
 	int runcount;			/**< Amount of runnable tasks */
 	uint max_life;			/**< Maximum schedule life, in usecs */
 	int period;				/**< Scheduling period for callout, in ms */
+	uint overruns;			/**< Task runs lasting over twice their budget */
+	int lat_max;			/**< Maximum task run latency, in usecs */
+	uint thread:1;			/**< Whether scheduler runs in its own thread */
 } bgsched_info_t;
 
 static inline void
@@ -158,6 +165,7 @@ void bg_set_debug(unsigned level);
 void bg_close(void);
 
 bgsched_t *bg_sched_create(const char *name, ulong max_life);
+bgsched_t *bg_sched_thread_create(const char *name, ulong max_life);
 void bg_sched_destroy_null(bgsched_t **bs_ptr);
 int bg_sched_run(bgsched_t *bs);
 int bg_sched_runcount(const bgsched_t *bs);
@@ -30,12 +30,14 @@
  * @author Raphael Manfredi
  * @date 2002-2003
  * @date 2009
+ * @date 2026
  */
 
 #include "common.h"
 
 #include "cq.h"
 
+#include "atomic.h"
 #include "atoms.h"
 #include "buf.h"
 #include "elist.h"
@@ -81,9 +83,10 @@ enum cevent_magic {
  */
 struct cevent {
 	enum cevent_magic ce_magic;	/**< Magic number (must be at the top) */
+	uint ce_slot;				/**< Wheel slot, CQ_SLOT_NONE if off-wheel */
 	cq_time_t ce_time;			/**< Absolute trigger time (virtual cq time) */
-	struct cevent *ce_bnext;	/**< Next item in hash bucket */
-	struct cevent *ce_bprev;	/**< Prev item in hash bucket */
+	struct cevent *ce_next;		/**< Next item in wheel slot */
+	struct cevent **ce_pprev;	/**< Link pointing to us, NULL if unlinked */
 	cqueue_t *ce_cq;			/**< Callout queue where event is registered */
 	cq_service_t ce_fn;			/**< Callback routine */
 	void *ce_arg;				/**< Argument to pass to said callback */
@@ -114,6 +117,11 @@ cevent_check(const struct cevent * const ce)
  * regardless of whether it was already scheduled, unless it does not call
  * cq_zero(), in which case it will be freed upon return.  This would happen
  * if the caller does not (need to) remember the value returned by cq_insert().
+ *
+ * Extended events are not linked into the wheel by the registering thread:
+ * they are posted to the queue's incoming list without taking any lock, and
+ * moved to the wheel by the next thread locking the queue, usually the one
+ * running it.  Until then, ce_time holds the requested delay.
  */
 struct cevent_ext {
 	struct cevent event;
@@ -144,18 +152,27 @@ cevent_has_triggered(const cevent_t *ce)
  *
  * Callout queue descriptor.
  *
- * A callout queue is really a sorted linked list of events that are to
- * happen in the near future, most recent coming first.
+ * A callout queue holds events that are to happen in the near future.
+ * With hundreds of thousands of events registered (RPC timeouts, resending
+ * timers, etc...), insertion, cancellation and rescheduling must be cheap,
+ * and so must be the periodic processing of expired events.
+ *
+ * To do that, events are stored in a hierarchical timing wheel.  Time is
+ * divided into ticks of CQ_TICK_UNITS units.  Level 0 of the wheel has one
+ * slot per tick, for the next CQ_WHEEL_SLOTS ticks.  Each upper level has
+ * slots CQ_WHEEL_SLOTS times coarser than the level below it.  An event is
+ * put at the lowest level whose span covers its distance to the current
+ * tick, in the slot given by its trigger time.  Slots are unsorted lists,
+ * so insertion and removal are O(1).
  *
- * Naturally, the insertion/deletion of items has to be relatively efficient.
- * We don't want to go through all the items in the list to find the proper
- * position for insertion.
+ * As the wheel turns, each time level 0 wraps around, the current slot of
+ * the next level is "cascaded": its events are redistributed to the lower
+ * levels, now that they are closer.  The level 0 slot of the current tick
+ * therefore always holds all the events due during that tick.
  *
- * To do that, we maintain a parallel hash list of all the events, each event
- * being inserted in the bucket i, where i is computed by abs_time % size,
- * abs_time being the absolute time where the event is to be triggered
- * and size being the size of the hash list. All the items under the bucket
- * list are further sorted by increasing trigger time.
+ * Each level has a bitmap of its non-empty slots, letting us skip over
+ * empty slots when the clock moves by several ticks, and quickly locate
+ * the next event in cq_delay().
  *
  * To be completely generic, the callout queue "absolute time" is a mere
  * unsigned long value. It can represent an amount of ms, or an amount of
@@ -164,10 +181,16 @@ cevent_has_triggered(const cevent_t *ce)
  * regular intervals and giving it the "elasped time" since the last call.
  */
 
-struct chash {
-	cevent_t *ch_head;			/**< Bucket list head */
-	cevent_t *ch_tail;			/**< Bucket list tail */
-};
+#define CQ_TICK_SHIFT	5		/**< A tick is 2^5 = 32 time units */
+#define CQ_TICK_UNITS	(1U << CQ_TICK_SHIFT)
+#define CQ_WHEEL_BITS	6		/**< 64 slots per wheel level */
+#define CQ_WHEEL_SLOTS	(1U << CQ_WHEEL_BITS)
+#define CQ_WHEEL_MASK	(CQ_WHEEL_SLOTS - 1)
+#define CQ_WHEEL_LEVELS	5		/**< Covers 2^30 ticks, more than INT_MAX units */
+#define CQ_WHEEL_SIZE	(CQ_WHEEL_LEVELS * CQ_WHEEL_SLOTS)
+#define CQ_SLOT_NONE	((uint) -1)
+
+#define CQ_TICK(t)		((t) >> CQ_TICK_SHIFT)
 
 enum cqueue_magic  {
 	CQUEUE_MAGIC    = 0x140332ddU,
@@ -178,18 +201,24 @@ struct cqueue {
 	enum cqueue_magic cq_magic;
 	tm_t cq_last_heartbeat;		/**< Real time of last heartbeat */
 	cq_time_t cq_time;			/**< "current time" */
+	cq_time_t cq_tick;			/**< Current wheel tick */
 	const char *cq_name;		/**< Queue name, for logging */
-	struct chash *cq_hash;		/**< Array of buckets for hash list */
-	struct chash *cq_current;	/**< Current bucket scanned in cq_clock() */
+	cevent_t *cq_incoming;		/**< Events posted by foreign threads */
+	cevent_t **cq_wheel;		/**< Wheel slots, all levels */
+	uint64 cq_used[CQ_WHEEL_LEVELS];	/**< Bitmaps of non-empty slots */
 	elist_t cq_periodic;		/**< Periodic events registered */
 	hset_t *cq_idle;			/**< Idle events registered */
 	const cevent_t *cq_call;	/**< Event being called out, for cq_zero() */
 	cq_service_t cq_call_fn;	/**< Routine being called out, for cq_zero() */
 	size_t cq_triggered;		/**< Events triggered */
+	size_t cq_walked;			/**< Wheel ticks walked through */
+	size_t cq_cascaded;			/**< Events moved down the wheel */
+	size_t cq_peak;				/**< Max events triggered by one cq_clock() */
+	size_t cq_posted;			/**< Events posted by foreign threads */
 	unsigned cq_stid;			/**< Thread where callout queue runs */
+	unsigned cq_running;		/**< Recursion depth within cq_clock() */
 	int cq_ticks;				/**< Number of cq_clock() calls processed */
 	int cq_items;				/**< Amount of recorded events */
-	int cq_last_bucket;			/**< Last bucket slot we were at */
 	int cq_period;				/**< Regular callout period, in ms */
 	uint8 cq_call_extended;		/**< Is cq_call an extended event? */
 	time_t cq_last_idle;		/**< Last time we ran the idle callbacks */
@@ -206,18 +235,6 @@ cqueue_check(const struct cqueue * const cq)
 	g_assert(CQUEUE_MAGIC == cq->cq_magic || CSUBQUEUE_MAGIC == cq->cq_magic);
 }
 
-#define HASH_SIZE	2048		/**< Hash list size, must be a power of 2 */
-#define HASH_MASK	(HASH_SIZE - 1)
-
-/*
- * The hashing function divides the time by 2^5 or 32, to avoid cq_clock()
- * scanning too many hash buckets each time.  This means our time resolution
- * is at least 32 units.  If we increment cq_clock() with milliseconds, we
- * won't trigger any queue run unless at least 32 milliseconds have elapsed.
- */
-#define EV_HASH(x) (((x) >> 5) & HASH_MASK)
-#define EV_OVER(x) (((x) >> 5) & ~HASH_MASK)
-
 /**
  * Locking of the callout queue for short period of time, in sections that
  * do not encompass memory allocation or do not call other routines that may
@@ -237,6 +254,14 @@ static spinlock_t cq_vars_slk = SPINLOCK_INIT;
 #define CQ_VARS_LOCK		spinlock(&cq_vars_slk)
 #define CQ_VARS_UNLOCK		spinunlock(&cq_vars_slk)
 
+/**
+ * Per-thread timer statistics.
+ *
+ * Each counter is only ever updated by the thread it belongs to, hence
+ * there is no need for locks or atomic operations.
+ */
+static cq_thread_stats_t cq_thread_stats[THREAD_MAX];
+
 static cqueue_t *callout_queue;			/**< The main callout queue */
 static once_flag_t cq_global_inited;	/**< Records global initialization */
 static void cq_global_init(void);
@@ -305,15 +330,11 @@ cq_main_thread_id(void)
 static cqueue_t *
 cq_initialize(cqueue_t *cq, const char *name, cq_time_t now, int period)
 {
-	/*
-	 * The cq_hash hash list is used to speed up insert/delete operations.
-	 */
-
 	cq->cq_magic = CQUEUE_MAGIC;
 	cq->cq_name = atom_str_get(name);
-	XMALLOC0_ARRAY(cq->cq_hash, HASH_SIZE);
+	XMALLOC0_ARRAY(cq->cq_wheel, CQ_WHEEL_SIZE);
 	cq->cq_time = now;
-	cq->cq_last_bucket = EV_HASH(now);
+	cq->cq_tick = CQ_TICK(now);
 	cq->cq_period = period;
 	cq->cq_stid = THREAD_INVALID_ID;
 	mutex_init(&cq->cq_lock);
@@ -376,6 +397,45 @@ cq_name(const cqueue_t *cq)
 	return cq->cq_name;
 }
 
+static void ev_link(cevent_t *ev);
+
+/**
+ * Move events posted by foreign threads to the wheel.
+ *
+ * This needs to be done before looking at the wheel, so that we never
+ * have to handle events that are not linked yet.
+ */
+static void
+cq_incoming_flush(cqueue_t *cq)
+{
+	cevent_t *ev, *next;
+
+	assert_mutex_is_owned(&cq->cq_lock);
+
+	if G_LIKELY(NULL == cq->cq_incoming)
+		return;
+
+	/*
+	 * Grab the whole list at once: other threads can keep posting new
+	 * events concurrently, they will be handled during next flush.
+	 */
+
+	do {
+		ev = cq->cq_incoming;
+	} while (!atomic_ptr_xchg_if_eq((void **) &cq->cq_incoming, ev, NULL));
+
+	for (; ev != NULL; ev = next) {
+		cevent_check(ev);
+		g_assert(cevent_is_extended(ev));
+
+		next = ev->ce_next;
+		ev->ce_next = NULL;
+		ev->ce_time += cq->cq_time;		/* Was holding the delay */
+		ev_link(ev);
+		cq->cq_posted++;
+	}
+}
+
 /**
  * Fetch the callout queue associated with the event.
  *
@@ -390,7 +450,7 @@ EV_CQ_LOCK(const cevent_t *ev)
 
 	/*
 	 * An extended event is referenced twice: once by the callout queue
-	 * while it is linked into its bucket, awaiting trigger, and once by
+	 * while it is linked into its wheel slot, awaiting trigger, and once by
 	 * the thread that registered the event.
 	 *
 	 * This prevents freing race conditions since both parties need to
@@ -407,6 +467,7 @@ EV_CQ_LOCK(const cevent_t *ev)
 	cqueue_check(cq);
 
 	CQ_LOCK(cq);
+	cq_incoming_flush(cq);
 	return cq;
 }
 
@@ -469,111 +530,139 @@ ev_free(cevent_t *ev)
 {
 	cevent_check(ev);
 	/* Event must no longer be part of a callout queue list */
-	g_assert(NULL == ev->ce_bnext && NULL == ev->ce_bprev);
+	g_assert(NULL == ev->ce_pprev);
 
 	ev_forced_free(ev);
 }
 
 /**
- * Link event into the callout queue.
+ * Insert event at the head of the list, recording the wheel slot it belongs
+ * to (CQ_SLOT_NONE when the list is not a wheel slot).
  */
-static void
-ev_link(cevent_t *ev)
+static inline void
+ev_list_push(cevent_t **head, cevent_t *ev, uint slot)
 {
-	struct chash *ch;		/* Hashing bucket */
-	cq_time_t trigger;		/* Trigger time */
-	cevent_t *hev;			/* To loop through the hash bucket */
-	cqueue_t *cq;
+	g_assert(NULL == ev->ce_pprev);
 
-	cevent_check(ev);
+	ev->ce_slot = slot;
+	ev->ce_next = *head;
+	if (*head != NULL)
+		(*head)->ce_pprev = &ev->ce_next;
+	ev->ce_pprev = head;
+	*head = ev;
+}
 
-	cq = ev->ce_cq;
+/**
+ * Remove event from the list where it is linked.
+ */
+static inline void
+ev_list_remove(cevent_t *ev)
+{
+	g_assert(ev->ce_pprev != NULL);
 
-	cqueue_check(cq);
-	g_assert(ev->ce_time >= cq->cq_time);
-	g_assert(NULL == ev->ce_bnext && NULL == ev->ce_bprev);
-	assert_mutex_is_owned(&cq->cq_lock);
+	*ev->ce_pprev = ev->ce_next;
+	if (ev->ce_next != NULL)
+		ev->ce_next->ce_pprev = ev->ce_pprev;
 
-	trigger = ev->ce_time;
-	cq->cq_items++;
-	ch = &cq->cq_hash[EV_HASH(trigger)];
+	/* Flag event as removed, for ev_list_push() assertions */
+	ev->ce_next = NULL;
+	ev->ce_pprev = NULL;
+}
 
-	g_assert(ch != NULL);
+/**
+ * Move all the events of a wheel slot to a new list.
+ *
+ * The list head being the caller's variable, events can still be unlinked
+ * from that list (via cq_cancel() for instance) whilst it is processed.
+ *
+ * @param cq		the callout queue
+ * @param slot		the wheel slot to empty
+ * @param list		where the list of events is returned
+ */
+static void
+ev_slot_detach(cqueue_t *cq, uint slot, cevent_t **list)
+{
+	cevent_t *ev;
 
-	/*
-	 * If bucket is empty, the event is the new head.
-	 */
+	*list = cq->cq_wheel[slot];
+	cq->cq_wheel[slot] = NULL;
+	cq->cq_used[slot >> CQ_WHEEL_BITS] &=
+		~((uint64) 1 << (slot & CQ_WHEEL_MASK));
 
-	if (NULL == ch->ch_head) {
-		g_assert(NULL == ch->ch_tail);
-		ch->ch_tail = ch->ch_head = ev;
-		/* This is a precondition: ev->ce_bnext = ev->ce_bprev = NULL; */
+	if (NULL == *list)
 		return;
+
+	(*list)->ce_pprev = list;
+
+	for (ev = *list; ev != NULL; ev = ev->ce_next) {
+		cevent_check(ev);
+		ev->ce_slot = CQ_SLOT_NONE;
 	}
+}
 
-	/*
-	 * If item is larger than the tail, insert at the end right away.
-	 */
+/**
+ * Put event in the wheel slot corresponding to its trigger time, given the
+ * current wheel tick.
+ */
+static void
+ev_wheel_insert(cqueue_t *cq, cevent_t *ev)
+{
+	cq_time_t tick = CQ_TICK(ev->ce_time);
+	uint level, slot;
 
-	hev = ch->ch_tail;
+	if G_UNLIKELY(tick <= cq->cq_tick) {
+		/* Due now, can only happen in the middle of cq_clock() */
+		level = 0;
+		slot = cq->cq_tick & CQ_WHEEL_MASK;
+	} else {
+		cq_time_t delta = tick - cq->cq_tick;
 
-	cevent_check(hev);
-	g_assert(NULL == hev->ce_bnext);
+		level = highest_bit_set64(delta) / CQ_WHEEL_BITS;
 
-	if (trigger >= hev->ce_time) {
-		hev->ce_bnext = ev;
-		/* This is a precondition: ev->ce_bnext = NULL; */
-		ev->ce_bprev = hev;
-		ch->ch_tail = ev;
-		return;
-	}
+		g_assert_log(level < CQ_WHEEL_LEVELS,
+			"%s(): delta=%s ticks for %s(%p) in cq \"%s\"",
+			G_STRFUNC, uint64_to_string(delta),
+			stacktrace_function_name(ev->ce_fn), ev->ce_arg, cq->cq_name);
 
-	/*
-	 * If item is smaller than the head...
-	 */
+		slot = (tick >> (level * CQ_WHEEL_BITS)) & CQ_WHEEL_MASK;
+	}
 
-	hev = ch->ch_head;
+	cq->cq_used[level] |= (uint64) 1 << slot;
+	ev_list_push(&cq->cq_wheel[level * CQ_WHEEL_SLOTS + slot], ev,
+		level * CQ_WHEEL_SLOTS + slot);
+}
 
-	cevent_check(hev);
-	g_assert(NULL == hev->ce_bprev);
+/**
+ * Link event into the callout queue.
+ */
+static void
+ev_link(cevent_t *ev)
+{
+	cqueue_t *cq;
 
-	if (trigger < hev->ce_time) {
-		hev->ce_bprev = ev;
-		ev->ce_bnext = hev;
-		/* This is a precondition: ev->ce_bprev = NULL; */
-		ch->ch_head = ev;
-		return;
-	}
+	cevent_check(ev);
 
-	/*
-	 * Insert before the first item whose trigger will come after ours.
-	 */
+	cq = ev->ce_cq;
 
-	for (hev = hev->ce_bnext; hev != NULL; hev = hev->ce_bnext) {
-		cevent_check(hev);
-		g_assert(hev->ce_bprev != NULL);
-
-		if (trigger < hev->ce_time) {
-			/* Inserting `ev' before `hev', which is not the head of list */
-			hev->ce_bprev->ce_bnext = ev;
-			ev->ce_bprev = hev->ce_bprev;
-			ev->ce_bnext = hev;
-			hev->ce_bprev = ev;
-			return;
-		}
-	}
+	cqueue_check(cq);
+	g_assert(ev->ce_time >= cq->cq_time);
+	assert_mutex_is_owned(&cq->cq_lock);
 
-	g_assert_not_reached();	/* Must have found an event to insert before */
+	cq->cq_items++;
+	ev_wheel_insert(cq, ev);
 }
 
 /**
  * Unlink event from callout queue.
+ *
+ * The event may be linked in a wheel slot or in a transient list whilst
+ * cq_clock() is processing it.
  */
 static void
 ev_unlink(cevent_t *ev)
 {
-	struct chash *ch;			/* Hashing bucket */
 	cqueue_t *cq;
+	uint slot;
 
 	cevent_check(ev);
 
@@ -582,54 +671,52 @@ ev_unlink(cevent_t *ev)
 	cqueue_check(cq);
 	assert_mutex_is_owned(&cq->cq_lock);
 
-	ch = &cq->cq_hash[EV_HASH(ev->ce_time)];
+	/* Event must be linked or it is not part of the callout queue! */
+	g_assert_log(ev->ce_pprev != NULL,
+		"%s(): ev%s=%p %s(%p) in cq \"%s\" is not linked",
+		G_STRFUNC, cevent_is_extended(ev) ? "x" : "", ev,
+		stacktrace_function_name(ev->ce_fn), ev->ce_arg, cq->cq_name);
+
 	cq->cq_items--;
+	slot = ev->ce_slot;
+	ev_list_remove(ev);
 
-	/* Bucket cannot be empty or `ev' is not part of the callout list! */
-	g_assert_log(ch->ch_head != NULL && ch->ch_tail != NULL,
-		"%s(): bucket #%u for ev%s=%p %s(%p) in cq \"%s\" has head=%p, tail=%p",
-		G_STRFUNC, (uint) EV_HASH(ev->ce_time),
-		cevent_is_extended(ev) ? "x" : "", ev,
-		stacktrace_function_name(ev->ce_fn), ev->ce_arg, cq->cq_name,
-		ch->ch_head, ch->ch_tail);
+	if (slot != CQ_SLOT_NONE && NULL == cq->cq_wheel[slot]) {
+		cq->cq_used[slot >> CQ_WHEEL_BITS] &=
+			~((uint64) 1 << (slot & CQ_WHEEL_MASK));
+	}
+}
 
-	/* Since bucket is not empty, verify pointers are valid */
-	cevent_check(ch->ch_head);
-	cevent_check(ch->ch_tail);
+/**
+ * Cascade the events of upper wheel levels down as the current tick
+ * crosses the boundary of their slot.
+ *
+ * Called each time the level 0 index wraps around to 0.
+ */
+static void
+cq_cascade(cqueue_t *cq)
+{
+	uint level;
 
-	/* Head has no previous, tail has no next, by definition */
-	g_assert(NULL == ch->ch_head->ce_bprev);
-	g_assert(NULL == ch->ch_tail->ce_bnext);
+	g_assert(0 == (cq->cq_tick & CQ_WHEEL_MASK));
 
-	/*
-	 * Unlinking the item is straigthforward, unlike insertion!
-	 */
+	for (level = 1; level < CQ_WHEEL_LEVELS; level++) {
+		uint idx = (cq->cq_tick >> (level * CQ_WHEEL_BITS)) & CQ_WHEEL_MASK;
+		cevent_t *list, *ev;
 
-	if (ch->ch_head == ev) {
-		g_assert(NULL == ev->ce_bprev);
-		ch->ch_head = ev->ce_bnext;
-	}
-	if (ch->ch_tail == ev) {
-		g_assert(NULL == ev->ce_bnext);
-		ch->ch_tail = ev->ce_bprev;
-	}
+		ev_slot_detach(cq, level * CQ_WHEEL_SLOTS + idx, &list);
 
-	if (ev->ce_bprev != NULL) {
-		cevent_check(ev->ce_bprev);
-		ev->ce_bprev->ce_bnext = ev->ce_bnext;
-	}
-	if (ev->ce_bnext != NULL) {
-		cevent_check(ev->ce_bnext);
-		ev->ce_bnext->ce_bprev = ev->ce_bprev;
-	}
+		while (NULL != (ev = list)) {
+			ev_list_remove(ev);
+			ev_wheel_insert(cq, ev);
+			cq->cq_cascaded++;
+		}
 
-	/* Flag event as removed, for ev_link() assertions */
-	ev->ce_bnext = NULL;
-	ev->ce_bprev = NULL;
+		/* Upper level only turns when this one wraps around */
 
-	/* Postcondition: head and tail are still correct */
-	g_assert(NULL == ch->ch_head || NULL == ch->ch_head->ce_bprev);
-	g_assert(NULL == ch->ch_tail || NULL == ch->ch_tail->ce_bnext);
+		if (idx != 0)
+			break;
+	}
 }
 
 /**
@@ -669,6 +756,50 @@ cq_insert_internal(cqueue_t *cq, cevent_t *ev,
 	return ev;
 }
 
+/**
+ * Post extended event to the callout queue from a foreign thread.
+ *
+ * This does not take the queue lock: the event is pushed to the incoming
+ * list, a multiple-producer single-consumer stack, and will be linked into
+ * the wheel by cq_incoming_flush().  The queue's thread does not contend
+ * with threads registering events, nor do these threads between them.
+ *
+ * @param cq		the callout queue
+ * @param ev		the allocated extended event
+ * @param delay		the delay, expressed in cq's "virtual time" (see cq_clock)
+ * @param fn		the callback function
+ * @param arg		the argument to be passed to the callback function
+ *
+ * @returns the event handle.
+ */
+static cevent_t *
+cq_post(cqueue_t *cq, cevent_t *ev, int delay, cq_service_t fn, void *arg)
+{
+	cevent_t *head;
+	uint stid = thread_small_id();
+
+	cqueue_check(cq);
+	g_assert(cevent_is_extended(ev));
+	g_assert(fn);
+	g_assert(delay >= 0);
+
+	ev->ce_fn = fn;
+	ev->ce_arg = arg;
+	ev->ce_cq = cq;
+	ev->ce_time = delay;		/* Made absolute when linked */
+	ev->ce_slot = CQ_SLOT_NONE;
+
+	do {
+		head = cq->cq_incoming;
+		ev->ce_next = head;
+	} while (!atomic_ptr_xchg_if_eq((void **) &cq->cq_incoming, head, ev));
+
+	if G_LIKELY(stid < THREAD_MAX)
+		cq_thread_stats[stid].posted++;
+
+	return ev;
+}
+
 /**
  * Insert a new event in the callout queue and return an opaque handle that
  * can be used to cancel the event.
@@ -695,13 +826,14 @@ cevent_t *
 cq_insert(cqueue_t *cq, int delay, cq_service_t fn, void *arg)
 {
 	cevent_t *ev;				/* Event to insert */
+	uint stid = thread_small_id();
 
 	/*
 	 * If we are called from a "foreign" thread, i.e. not from the thread
 	 * that runs the callout queue, we create extended events.
 	 */
 
-	if (thread_small_id() != cq->cq_stid) {
+	if (stid != cq->cq_stid) {
 		struct cevent_ext *evx;				/* Event to insert */
 
 		/*
@@ -714,9 +846,14 @@ cq_insert(cqueue_t *cq, int delay, cq_service_t fn, void *arg)
 		ev = &evx->event;
 		ev->ce_magic = CEVENT_EXT_MAGIC;
 		evx->cex_refcnt = 2;				/* One by queue, one by thread */
+
+		if G_LIKELY(atomic_ops_available())
+			return cq_post(cq, ev, delay, fn, arg);
 	} else {
 		WALLOC0(ev);
 		ev->ce_magic = CEVENT_MAGIC;
+		if G_LIKELY(stid < THREAD_MAX)
+			cq_thread_stats[stid].inserted++;
 	}
 
 	return cq_insert_internal(cq, ev, delay, fn, arg);
@@ -941,8 +1078,13 @@ cq_cancel(cevent_t **handle_ptr)
 		triggered = ev_triggered(ev);
 
 		if G_LIKELY(!triggered) {
+			uint stid = thread_small_id();
+
 			g_assert(cq->cq_items > 0);
 			ev_unlink(ev);
+
+			if G_LIKELY(stid < THREAD_MAX)
+				cq_thread_stats[stid].cancelled++;
 		}
 
 		CQ_UNLOCK(cq);
@@ -985,14 +1127,11 @@ cq_resched(cevent_t *ev, int delay)
 	}
 
 	/*
-	 * Events are sorted into the callout queue by trigger time, and are also
-	 * put into a hash list depending on that trigger time.
+	 * Events are put into the wheel slot corresponding to their trigger time.
 	 *
 	 * Therefore, since we are updating the trigger time, we need to remove
-	 * the event from the queue lists first, update the firing delay, and relink
-	 * the event. It's possible that it will end up being relinked at the exact
-	 * same place, but determining that in advance would probably cost as much
-	 * as doing the unlink/link blindly anyway.
+	 * the event from its slot first, update the firing delay, and relink
+	 * the event.  Both operations are O(1).
 	 *
 	 * For performance reasons, use hidden locks: we know the ev_link() and
 	 * ev_unlink() routines are not going to take locks, so it is safe.
@@ -1186,6 +1325,99 @@ cq_replace(cevent_t *ev, cq_service_t fn, void *arg)
 	return TRUE;
 }
 
+/**
+ * Trigger the events due in the level 0 slot of the current tick.
+ *
+ * @param cq		the callout queue
+ * @param now		the current time
+ *
+ * @return the amount of events triggered.
+ */
+static size_t
+cq_expire_slot(cqueue_t *cq, cq_time_t now)
+{
+	uint slot = cq->cq_tick & CQ_WHEEL_MASK;
+	cevent_t *expiring, *deferred = NULL, *ev;
+	size_t processed = 0;
+
+	/*
+	 * The slot covers a whole tick, so it can also hold events due later
+	 * than `now': these are put aside in the deferred list.
+	 *
+	 * Callbacks can register new events for the current tick, which land
+	 * in the slot we just emptied, hence the outer loop.  Events put aside
+	 * are not in the slot, which ensures we terminate.
+	 */
+
+	for (;;) {
+		ev_slot_detach(cq, slot, &expiring);
+
+		if (NULL == expiring)
+			break;
+
+		while (NULL != (ev = expiring)) {
+			if (ev->ce_time <= now) {
+				cq_expire_internal(cq, ev);
+				processed++;
+			} else {
+				ev_list_remove(ev);
+				ev_list_push(&deferred, ev, CQ_SLOT_NONE);
+			}
+		}
+	}
+
+	/*
+	 * The current tick may have moved if a callback recursively called
+	 * cq_clock(), so put back deferred events where they now belong.
+	 */
+
+	while (NULL != (ev = deferred)) {
+		ev_list_remove(ev);
+		ev_wheel_insert(cq, ev);
+	}
+
+	return processed;
+}
+
+/**
+ * Move the wheel forward to the next tick holding events, or to the
+ * target tick, whichever comes first.
+ *
+ * We never move past the end of the current level 0 round: upper levels
+ * need to be cascaded then, and this may bring new events to level 0.
+ *
+ * @param cq		the callout queue
+ * @param target	the tick we need to reach
+ */
+static void
+cq_advance(cqueue_t *cq, cq_time_t target)
+{
+	cq_time_t next = cq->cq_tick + 1;
+	cq_time_t limit = (cq->cq_tick | CQ_WHEEL_MASK) + 1;	/* Next round */
+	uint64 used;
+
+	g_assert(cq->cq_tick < target);
+
+	limit = MIN(limit, target);
+
+	/*
+	 * All the ticks from `next' up to `limit' (excluded) are in the same
+	 * round, so there is no wrapping around within the level 0 bitmap.
+	 */
+
+	if (next < limit) {
+		used = cq->cq_used[0] >> (next & CQ_WHEEL_MASK);
+		used &= ((uint64) 1 << (limit - next)) - 1;
+		next = 0 == used ? limit : next + ctz64(used);
+	}
+
+	cq->cq_walked += next - cq->cq_tick;
+	cq->cq_tick = next;
+
+	if (0 == (next & CQ_WHEEL_MASK))
+		cq_cascade(cq);
+}
+
 /**
  * The heartbeat of our callout queue.
  *
@@ -1202,14 +1434,11 @@ cq_replace(cevent_t *ev, cq_service_t fn, void *arg)
 static size_t
 cq_clock(cqueue_t *cq, int elapsed)
 {
-	int bucket;
-	int last_bucket, old_last_bucket;
-	struct chash *ch, *old_current;
-	cevent_t *ev;
 	const cevent_t *old_call;
 	bool old_call_extended, force_idle = FALSE;
-	cq_time_t now;
+	cq_time_t now, target;
 	size_t processed = 0;
+	uint stid = thread_small_id();
 
 	cqueue_check(cq);
 	g_assert(elapsed >= 0);
@@ -1219,92 +1448,62 @@ cq_clock(cqueue_t *cq, int elapsed)
 	 * Recursive calls are possible: in the middle of an event, we could
 	 * trigger something that will call cq_dispatch() manually for instance.
 	 *
-	 * Therefore, we save the cq_current and cq_last_bucket fields upon
-	 * entry and restore them at the end as appropriate. If cq_current is
-	 * NULL initially, it means we were not in the middle of any recursion
-	 * so we won't have to restore cq_last_bucket.
+	 * The wheel state is only held in the queue, and every event is always
+	 * linked somewhere, so a recursive call simply moves the wheel further
+	 * and we resume from wherever it left it.  We only need to save the
+	 * event being called out.
 	 *
 	 * Note that we enforce recursive calls to cq_clock() to be on the
 	 * same thread due to the use of a mutex. However, each initial run of
 	 * cq_clock() could happen on a different thread each time.
 	 */
 
-	old_current = cq->cq_current;
 	old_call = cq->cq_call;
 	old_call_extended = cq->cq_call_extended;
-	old_last_bucket = cq->cq_last_bucket;
 
+	cq_incoming_flush(cq);		/* Before moving the clock */
+
+	cq->cq_running++;
 	cq->cq_ticks++;
 	cq->cq_time += elapsed;
 	now = cq->cq_time;
-
-	bucket = cq->cq_last_bucket;		/* Bucket we traversed last time */
-	ch = &cq->cq_hash[bucket];
-	last_bucket = EV_HASH(now);			/* Last bucket to traverse now */
+	target = CQ_TICK(now);
 
 	/*
-	 * If `elapsed' has overflowed the hash size, then we'll need to look at
-	 * all the buckets in the table (wrap around).
+	 * Process the current tick first: it may hold events that were not
+	 * due yet the last time we were called, during that same tick.
+	 * Then move forward, tick by tick, skipping empty ones.
 	 */
 
-	if (EV_OVER(elapsed))
-		last_bucket = bucket;
+	for (;;) {
+		processed += cq_expire_slot(cq, now);
 
-	/*
-	 * Since the hashed time is a not a strictly monotonic function of time,
-	 * we have to rescan the last bucket, in case the earliest event have
-	 * expired now, before moving forward.
-	 */
-
-	cq->cq_current = ch;
+		if (cq->cq_tick >= target)
+			break;
 
-	while ((ev = ch->ch_head) && ev->ce_time <= now) {
-		cq_expire_internal(cq, ev);
-		processed++;
+		cq_advance(cq, target);
 	}
 
-	/*
-	 * If we don't have to move forward (elapsed is too small), we're done.
-	 */
-
-	if (cq->cq_last_bucket == last_bucket && !EV_OVER(elapsed))
-		goto done;
-
-	cq->cq_last_bucket = last_bucket;
-
-	do {
-		ch++;
-		if (++bucket >= HASH_SIZE) {
-			bucket = 0;
-			ch = cq->cq_hash;
-		}
-
-		/*
-		 * Since each bucket is sorted, we can stop our walkthrough as
-		 * soon as we reach an event scheduled after `now'.
-		 */
-
-		cq->cq_current = ch;
-
-		while ((ev = ch->ch_head) && ev->ce_time <= now) {
-			cq_expire_internal(cq, ev);
-			processed++;
-		}
-
-	} while (bucket != last_bucket);
-
-done:
-	cq->cq_current = old_current;
+	cq->cq_running--;
 	cq->cq_call = old_call;
 	cq->cq_call_extended = old_call_extended;
 
-	if G_UNLIKELY(old_current != NULL)
-		cq->cq_last_bucket = old_last_bucket;	/* Was in recursive call */
+	if (processed > cq->cq_peak)
+		cq->cq_peak = processed;
+
+	/*
+	 * Account triggered events to the thread clocking the queue, which is
+	 * not necessarily the one to which the queue belongs (e.g. the callout
+	 * thread clocks the main queue), to keep counters thread-private.
+	 */
+
+	if G_LIKELY(stid < THREAD_MAX)
+		cq_thread_stats[stid].triggered += processed;
 
 	if (cq_debugging(5)) {
 		s_debug("CQ: %squeue \"%s\" %striggered %zu event%s (%d item%s)",
 			cq->cq_magic == CSUBQUEUE_MAGIC ? "sub" : "",
-			cq->cq_name, NULL == old_current ? "" : "recursively",
+			cq->cq_name, 0 == cq->cq_running ? "" : "recursively ",
 			PLURAL(processed), PLURAL(cq->cq_items));
 	}
 
@@ -1342,6 +1541,54 @@ done:
 	return processed;		/* Do not count idle events */
 }
 
+/**
+ * Compute the earliest trigger time of the events held in a wheel level.
+ *
+ * @param cq		the callout queue
+ * @param level		the wheel level
+ * @param earliest	where the earliest trigger time is written
+ *
+ * @return TRUE if the level holds events, FALSE if it is empty.
+ */
+static bool
+cq_level_earliest(const cqueue_t *cq, uint level, cq_time_t *earliest)
+{
+	uint64 used = cq->cq_used[level];
+	uint start, idx;
+	const cevent_t *ev;
+	cq_time_t t = MAX_INT_VAL(cq_time_t);
+
+	if (0 == used)
+		return FALSE;
+
+	/*
+	 * At level 0, the current slot holds the events of the current tick.
+	 * At upper levels, the current slot was cascaded when we entered it and
+	 * can only hold events a full round away: it comes last.
+	 *
+	 * The first non-empty slot, in that order, holds the earliest events of
+	 * the level.
+	 */
+
+	start = (cq->cq_tick >> (level * CQ_WHEEL_BITS)) & CQ_WHEEL_MASK;
+	if (level != 0)
+		start = (start + 1) & CQ_WHEEL_MASK;
+
+	used = (used >> start) | (0 == start ? 0 : used << (64 - start));
+	idx = (start + ctz64(used)) & CQ_WHEEL_MASK;
+
+	for (
+		ev = cq->cq_wheel[level * CQ_WHEEL_SLOTS + idx];
+		ev != NULL;
+		ev = ev->ce_next
+	) {
+		t = MIN(t, ev->ce_time);
+	}
+
+	*earliest = t;
+	return TRUE;
+}
+
 /**
  * Compute delay until the next registered event, expressed in units of the
  * callout queue "virtual time".
@@ -1361,8 +1608,7 @@ int
 cq_delay(const cqueue_t *cq)
 {
 	int delay = MAX_INT_VAL(int);
-	int last_bucket;
-	int i;
+	uint level;
 	cq_time_t now;
 	bool adjusted = FALSE;
 
@@ -1370,36 +1616,27 @@ cq_delay(const cqueue_t *cq)
 
 	mutex_lock_const(&cq->cq_lock);
 
-	last_bucket = cq->cq_last_bucket;	/* Last bucket scanned */
+	cq_incoming_flush(deconstify_pointer(cq));
 	now = cq->cq_time;
 
-	for (i = 0; i < HASH_SIZE; i++) {
-		int b = (last_bucket + i) & HASH_MASK;
-		struct chash *ch = &cq->cq_hash[b];
-		cevent_t *ev = ch->ch_head;
-		int edelay;
-
-		/*
-		 * If the delay we have so far is not too large (does not overflow
-		 * the size of the hashing array) and we have moved away from the
-		 * last scanned bucket by an amount that is large-enough, we know
-		 * we cannot find a smaller delay ahead in the buckets.
-		 */
+	/*
+	 * Events at a given level can trigger before events registered later
+	 * in lower levels, so we need to look at all the levels.
+	 */
 
-		if (!EV_OVER(delay) && i > EV_HASH(delay))
-			break;
+	for (level = 0; level < CQ_WHEEL_LEVELS; level++) {
+		cq_time_t earliest;
 
-		if (NULL == ev)
+		if (!cq_level_earliest(cq, level, &earliest))
 			continue;
 
-		edelay = ev->ce_time - now;
-
-		if G_UNLIKELY(edelay <= 0) {
+		if G_UNLIKELY(earliest <= now) {
 			delay = 0;
 			break;
 		}
 
-		delay = MIN(delay, edelay);
+		if (earliest - now < (cq_time_t) delay)
+			delay = earliest - now;
 	}
 
 	/*
@@ -1427,9 +1664,8 @@ cq_delay(const cqueue_t *cq)
 	mutex_unlock_const(&cq->cq_lock);
 
 	if (cq_debugging(4)) {
-		s_debug("%s(%s): %smin delay is %d, scanned %d bucket%s",
-			G_STRFUNC, cq->cq_name, adjusted ? "adjusted " : "",
-			delay, PLURAL(i));
+		s_debug("%s(%s): %smin delay is %d", G_STRFUNC, cq->cq_name,
+			adjusted ? "adjusted " : "", delay);
 	}
 
 	return delay;
@@ -1836,7 +2072,7 @@ cq_periodic_remove(cperiodic_t **cp_ptr)
  *** out of the main callout queue.
  ***
  *** The aim is to be able to have different scheduling periods for different
- *** activitie and not clutter the hash buckets of the main callout queue with
+ *** activitie and not clutter the wheel slots of the main callout queue with
  *** too many entries.
  ***
  *** Sub-systems making an heavy usage of callout events or which can
@@ -2221,7 +2457,8 @@ cq_global_init(void)
 void
 cq_init(cq_invoke_t idle, const uint32 *debug)
 {
-	STATIC_ASSERT(IS_POWER_OF_2(HASH_SIZE));
+	STATIC_ASSERT(64 == CQ_WHEEL_SLOTS);	/* cq_used[] are 64-bit bitmaps */
+	STATIC_ASSERT(CQ_WHEEL_LEVELS * CQ_WHEEL_BITS + CQ_TICK_SHIFT > 32);
 
 	/*
 	 * Loudly warn if the callout queue already exists when this routine
@@ -2318,27 +2555,32 @@ cq_free(cqueue_t *cq)
 {
 	cevent_t *ev;
 	cevent_t *ev_next;
-	int i;
-	struct chash *ch;
+	uint i;
 
 	cqueue_check(cq);
 
 	cq_vars_remove(cq);
 
-	if (cq->cq_current != NULL) {
+	if (cq->cq_running != 0) {
 		s_carp("%s(): %squeue \"%s\" still within cq_clock()", G_STRFUNC,
 			CSUBQUEUE_MAGIC == cq->cq_magic ? "sub" : "", cq->cq_name);
 	}
 
 	mutex_lock(&cq->cq_lock);
 
-	for (ch = cq->cq_hash, i = 0; i < HASH_SIZE; i++, ch++) {
-		for (ev = ch->ch_head; ev; ev = ev_next) {
-			ev_next = ev->ce_bnext;
+	for (i = 0; i < CQ_WHEEL_SIZE; i++) {
+		for (ev = cq->cq_wheel[i]; ev; ev = ev_next) {
+			ev_next = ev->ce_next;
 			ev_forced_free(ev);
 		}
 	}
 
+	for (ev = cq->cq_incoming; ev; ev = ev_next) {
+		ev_next = ev->ce_next;
+		ev_forced_free(ev);
+	}
+	cq->cq_incoming = NULL;
+
 	if (elist_is_initialized(&cq->cq_periodic)) {
 		elist_foreach_remove(&cq->cq_periodic, cq_free_periodic, NULL);
 		elist_discard(&cq->cq_periodic);
@@ -2349,7 +2591,7 @@ cq_free(cqueue_t *cq)
 		hset_free_null(&cq->cq_idle);
 	}
 
-	XFREE_NULL(cq->cq_hash);
+	XFREE_NULL(cq->cq_wheel);
 	atom_str_free_null(&cq->cq_name);
 
 	/*
@@ -2411,11 +2653,32 @@ cq_close(void)
 	if G_LIKELY(ONCE_DONE(cq_global_inited)) {
 		cq_halt();
 		/* No warning if we were recursing */
-		callout_queue->cq_current = NULL;
+		callout_queue->cq_running = 0;
 		cq_free_null(&callout_queue);
 	}
 }
 
+/**
+ * Retrieve timer statistics for a thread.
+ *
+ * @param stid		the thread small ID
+ * @param cts		where statistics are written
+ *
+ * @return TRUE if the thread used callout queues, FALSE otherwise.
+ */
+bool
+cq_thread_stats_get(uint stid, cq_thread_stats_t *cts)
+{
+	g_assert(cts != NULL);
+
+	if G_UNLIKELY(stid >= THREAD_MAX)
+		return FALSE;
+
+	*cts = cq_thread_stats[stid];		/* struct copy, racy but harmless */
+
+	return 0 != (cts->inserted | cts->posted | cts->triggered | cts->cancelled);
+}
+
 /**
  * Retrieve callout queue information.
  *
@@ -2439,6 +2702,7 @@ cq_info_list(void)
 		cqi->magic = CQ_INFO_MAGIC;
 
 		CQ_LOCK(cq);
+		cq_incoming_flush(cq);
 		cqi->name = atom_str_get(cq->cq_name);
 		if (CSUBQUEUE_MAGIC == cq->cq_magic) {
 			struct csubqueue *csq = (struct csubqueue *) cq;
@@ -2457,6 +2721,10 @@ cq_info_list(void)
 		cqi->period = cq->cq_period;
 		cqi->heartbeat_count = cq->cq_ticks;
 		cqi->triggered_count = cq->cq_triggered;
+		cqi->walked_count = cq->cq_walked;
+		cqi->cascaded_count = cq->cq_cascaded;
+		cqi->peak_count = cq->cq_peak;
+		cqi->posted_count = cq->cq_posted;
 		cqi->last_idle = cq->cq_last_idle;
 		CQ_UNLOCK(cq);
 
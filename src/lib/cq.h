@@ -75,6 +75,10 @@ typedef struct {
 	size_t event_count;			/**< Amount of registered events */
 	size_t heartbeat_count;		/**< Amount of heartbeats */
 	size_t triggered_count;		/**< Amount of triggered events */
+	size_t walked_count;		/**< Amount of wheel ticks walked through */
+	size_t cascaded_count;		/**< Amount of events cascaded in the wheel */
+	size_t peak_count;			/**< Max events triggered by one heartbeat */
+	size_t posted_count;		/**< Amount of events posted by other threads */
 	int period;					/**< Period, in ms */
 	time_t last_idle;			/**< Last idle scheduling */
 } cq_info_t;
@@ -86,6 +90,16 @@ cq_info_check(const cq_info_t * const cqi)
 	g_assert(CQ_INFO_MAGIC == cqi->magic);
 }
 
+/**
+ * Per-thread callout queue statistics.
+ */
+typedef struct {
+	size_t inserted;			/**< Events inserted in queues we run */
+	size_t posted;				/**< Events posted to queues of other threads */
+	size_t triggered;			/**< Events triggered by queues we clocked */
+	size_t cancelled;			/**< Events cancelled */
+} cq_thread_stats_t;
+
 /*
  * Interface routines.
  */
@@ -131,6 +145,8 @@ void cq_idle_remove(cidle_t **ci_ptr);
 
 const char *cq_time_to_string(cq_time_t t);
 
+bool cq_thread_stats_get(uint stid, cq_thread_stats_t *cts);
+
 struct pslist *cq_info_list(void);
 void cq_info_list_free_null(struct pslist **sl_ptr);
 
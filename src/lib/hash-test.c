@@ -0,0 +1,342 @@
+/*
+ * hash-test -- tests and benchmarks the hash table probing.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "hikset.h"
+#include "host_addr.h"
+#include "log.h"
+#include "progname.h"
+#include "random.h"
+#include "tm.h"
+#include "xmalloc.h"
+
+#define GUID_LEN	16
+#define SHA1_LEN	20
+
+/*
+ * Items stored in the sets: each key type lives at its own offset, so that
+ * the same items can be indexed by GUID, by SHA1 or by host address.
+ */
+struct item {
+	char guid[GUID_LEN];
+	char sha1[SHA1_LEN];
+	struct packed_host_addr addr;
+};
+
+enum key_type {
+	KEY_GUID,
+	KEY_SHA1,
+	KEY_ADDR
+};
+
+static const char *key_type_name[] = { "GUID", "SHA1", "host_addr" };
+
+static size_t item_count = 100000;
+static bool verbose = FALSE;
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+			"Usage: %s [-hv] [-n count]\n"
+			"  -h : prints this help message\n"
+			"  -n : amount of items to insert (default %zu)\n"
+			"  -v : verbose, trace each benchmarking phase\n"
+			, getprogname(), item_count);
+	exit(EXIT_FAILURE);
+}
+
+static void
+fill_items(struct item *items, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		struct item *it = &items[i];
+
+		ZERO(it);
+		random_bytes(it->guid, sizeof it->guid);
+		random_bytes(it->sha1, sizeof it->sha1);
+		it->addr = host_addr_pack(host_addr_get_ipv4(random_u32()));
+	}
+}
+
+static hikset_t *
+make_set(enum key_type kt)
+{
+	switch (kt) {
+	case KEY_GUID:
+		return hikset_create(offsetof(struct item, guid),
+			HASH_KEY_FIXED, GUID_LEN);
+	case KEY_SHA1:
+		return hikset_create(offsetof(struct item, sha1),
+			HASH_KEY_FIXED, SHA1_LEN);
+	case KEY_ADDR:
+		return hikset_create_any(offsetof(struct item, addr),
+			packed_host_addr_hash, packed_host_addr_equal);
+	}
+
+	g_assert_not_reached();
+}
+
+static const void *
+item_key(const struct item *it, enum key_type kt)
+{
+	switch (kt) {
+	case KEY_GUID:	return it->guid;
+	case KEY_SHA1:	return it->sha1;
+	case KEY_ADDR:	return &it->addr;
+	}
+
+	g_assert_not_reached();
+}
+
+struct timing {
+	double insert;
+	double hit;
+	double miss;
+	double remove;
+};
+
+/**
+ * Time the insertion, successful lookup, failed lookup and removal of
+ * all the items, averaged per operation.
+ *
+ * @param kt		the key type to index items with
+ * @param items		the items to insert
+ * @param others	items that are never inserted, for failed lookups
+ * @param n			amount of items in each array
+ * @param t			where timings are written
+ */
+static void
+benchmark_set(enum key_type kt,
+	const struct item *items, const struct item *others, size_t n,
+	struct timing *t)
+{
+	hikset_t *hs;
+	tm_nano_t start, end;
+	size_t i, found = 0;
+
+	hs = make_set(kt);
+
+	tm_precise_time(&start);
+	for (i = 0; i < n; i++) {
+		hikset_insert(hs, &items[i]);
+	}
+	tm_precise_time(&end);
+	t->insert = tm_precise_elapsed_f(&end, &start) / n;
+
+	g_assert(n == hikset_count(hs));
+
+	tm_precise_time(&start);
+	for (i = 0; i < n; i++) {
+		if (hikset_lookup(hs, item_key(&items[i], kt)) == &items[i])
+			found++;
+	}
+	tm_precise_time(&end);
+	t->hit = tm_precise_elapsed_f(&end, &start) / n;
+
+	g_assert_log(n == found, "%s(): found=%zu, n=%zu", G_STRFUNC, found, n);
+
+	found = 0;
+	tm_precise_time(&start);
+	for (i = 0; i < n; i++) {
+		if (hikset_contains(hs, item_key(&others[i], kt)))
+			found++;
+	}
+	tm_precise_time(&end);
+	t->miss = tm_precise_elapsed_f(&end, &start) / n;
+
+	/* Random IPv4 addresses can collide, GUIDs and SHA1s will not */
+
+	g_assert(KEY_ADDR == kt || 0 == found);
+
+	found = 0;
+	tm_precise_time(&start);
+	for (i = 0; i < n; i++) {
+		if (hikset_remove(hs, item_key(&items[i], kt)))
+			found++;
+	}
+	tm_precise_time(&end);
+	t->remove = tm_precise_elapsed_f(&end, &start) / n;
+
+	g_assert(n == found);
+	g_assert(0 == hikset_count(hs));
+
+	hikset_free_null(&hs);
+}
+
+/**
+ * Exercise interleaved insertions and removals, which leave tombstones
+ * behind, checking that the set always agrees with what we inserted.
+ */
+static void
+test_churn(enum key_type kt, const struct item *items, size_t n)
+{
+	hikset_t *hs;
+	bool *present;
+	size_t i, count = 0;
+
+	hs = make_set(kt);
+	present = xmalloc0(n * sizeof present[0]);
+
+	for (i = 0; i < 4 * n; i++) {
+		size_t j = random_value(n - 1);
+		const struct item *it = &items[j];
+
+		if (present[j]) {
+			g_assert(hikset_lookup(hs, item_key(it, kt)) == it);
+			if (random_value(1)) {
+				g_assert(hikset_remove(hs, item_key(it, kt)));
+				present[j] = FALSE;
+				count--;
+			}
+		} else {
+			g_assert(!hikset_contains(hs, item_key(it, kt)));
+			hikset_insert(hs, it);
+			present[j] = TRUE;
+			count++;
+		}
+		g_assert(count == hikset_count(hs));
+	}
+
+	for (i = 0; i < n; i++) {
+		g_assert(booleanize(present[i]) ==
+			hikset_contains(hs, item_key(&items[i], kt)));
+	}
+
+	xfree(present);
+	hikset_free_null(&hs);
+}
+
+static void
+report(enum key_type kt, const char *what, const struct timing *t)
+{
+	s_info("%s(): %s keys, %s probing:", G_STRFUNC, key_type_name[kt], what);
+	s_info("\tinsert:  %6.1f ns", t->insert * 1e9);
+	s_info("\thit:     %6.1f ns", t->hit * 1e9);
+	s_info("\tmiss:    %6.1f ns", t->miss * 1e9);
+	s_info("\tremove:  %6.1f ns", t->remove * 1e9);
+}
+
+static void
+run(size_t n)
+{
+	struct item *items, *others;
+	enum key_type kt;
+	size_t i;
+
+	items = xmalloc(n * sizeof items[0]);
+	others = xmalloc(n * sizeof others[0]);
+
+	fill_items(items, n);
+	fill_items(others, n);
+
+	/*
+	 * Random IPv4 addresses may be duplicated, which would break our
+	 * counting assertions: keep only distinct ones in the inserted set.
+	 */
+
+	{
+		hikset_t *hs = make_set(KEY_ADDR);
+
+		for (i = 0; i < n; i++) {
+			while (hikset_contains(hs, &items[i].addr)) {
+				items[i].addr =
+					host_addr_pack(host_addr_get_ipv4(random_u32()));
+			}
+			hikset_insert(hs, &items[i]);
+		}
+		hikset_free_null(&hs);
+	}
+
+	for (kt = KEY_GUID; kt <= KEY_ADDR; kt++) {
+		struct timing grouped, legacy;
+
+		if (verbose)
+			s_info("%s(): checking %s keys", G_STRFUNC, key_type_name[kt]);
+
+		hash_legacy_probing(TRUE);
+		test_churn(kt, items, MIN(n, 10000));
+		benchmark_set(kt, items, others, n, &legacy);
+
+		hash_legacy_probing(FALSE);
+		test_churn(kt, items, MIN(n, 10000));
+		benchmark_set(kt, items, others, n, &grouped);
+
+		report(kt, "double hashing", &legacy);
+		report(kt, "group", &grouped);
+	}
+
+	xfree(items);
+	xfree(others);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	int c;
+	const char options[] = "hn:v";
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, options)) != EOF) {
+		switch (c) {
+		case 'n':			/* amount of items */
+			item_count = atol(optarg);
+			break;
+		case 'v':			/* verbose */
+			verbose = TRUE;
+			break;
+		case 'h':			/* show help */
+			/* FALL THROUGH */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (0 != (argc -= optind))
+		usage();
+
+	if (item_count < 2)
+		usage();
+
+	run(item_count);
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
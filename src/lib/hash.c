@@ -92,6 +92,22 @@
  * also allows for flagging empty slots and tombstones, at the cost of
  * reserving two hash values for that purpose: 0 and 1.
  *
+ * Probing was originally done slot by slot with double hashing, as described
+ * above.  It is now done by groups of HASH_GROUP consecutive slots, using a
+ * parallel array of control bytes which mirrors the hashes array: each
+ * control byte holds either a free or tomb marker, or the 7 upper bits of
+ * the hashed value of the key in that slot.  A whole group of control bytes
+ * can be compared with the looked-up key at once (with SSE2 when available),
+ * and only the slots whose control byte matches need to have their full
+ * hash and key compared.  Groups are visited using a triangular sequence,
+ * which visits all the groups when their amount is a power of 2.  The
+ * lookup ends at the first group holding a free slot.
+ *
+ * This is the same idea as SwissTable, retrofitted into our arena layout
+ * so that the existing table, set and iterator code is unchanged.  Tables
+ * smaller than a group are simply scanned entirely.  The former double
+ * hashing probing is kept for comparison purposes, see hash_legacy_probing().
+ *
  * The code contained here allows for hash tables and hash sets.  Most of the
  * logic is shared, but the API for iteration and insertion is slightly
  * different given that there is no value associated with a key within a set,
@@ -109,6 +125,7 @@
 
 #include "endian.h"
 #include "hashing.h"
+#include "pow2.h"				/* For ctz() */
 #include "rand31.h"
 #include "random.h"
 #include "unsigned.h"
@@ -117,8 +134,16 @@
 
 #include "override.h"			/* Must be the last header included */
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define HASH_HOPS_MIN	4		/* Theoretical hops when full at 75% */
 
+#define HASH_GROUP_BITS	4		/* log2 of slots per probing group */
+#define HASH_GROUP		(1U << HASH_GROUP_BITS)
+#define HASH_GROUP_HOPS	2		/* Extra groups probed before resizing */
+
 /*
  * The following definitions help control the amount of hash codes we can keep
  * in a single CPU cacheline, whose size is estimated by HASH_CACHELINE.
@@ -162,6 +187,11 @@ hash_check(const void * const p)
 static unsigned hash_offset_primary;
 static unsigned hash_offset_secondary;
 
+/**
+ * Whether new tables use double hashing instead of group probing.
+ */
+static bool hash_legacy;
+
 /**
  * Initialize random hash offset if not already done.
  */
@@ -230,14 +260,15 @@ hash_arena_size(size_t items, bool has_values)
 	 *
 	 * When the hash table has values, the layout in memory is:
 	 *
-	 *     key array | value array | hashes array
+	 *     key array | value array | hashes array | control array
 	 *
 	 * When the hash table has no values, the layout is:
 	 *
-	 *     key array | hashes array
+	 *     key array | hashes array | control array
 	 *
 	 * This allows the hashes array to be correctly aligned since the size
 	 * of a pointer is always larger or equal to the size of an unsigned value.
+	 * The control bytes need no alignment.
 	 */
 
 	STATIC_ASSERT(sizeof(void *) >= sizeof(unsigned));
@@ -246,7 +277,7 @@ hash_arena_size(size_t items, bool has_values)
 	size = items * sizeof(void *);
 	if (has_values)
 		size *= 2;
-	size += items * sizeof(unsigned);
+	size += items * (sizeof(unsigned) + sizeof(uint8));
 
 	return size;
 }
@@ -268,6 +299,8 @@ hash_update_arena_pointers(struct hash *h, void *arena)
 		arena = ptr_add_offset(arena, hk->size * sizeof(void *));
 	}
 	hk->hashes = arena;
+	arena = ptr_add_offset(arena, hk->size * sizeof(unsigned));
+	hk->ctrl = arena;
 
 	hk->relocate = 0;
 }
@@ -311,6 +344,7 @@ hash_arena_allocate(struct hash *h, size_t bits)
 
 	hash_update_arena_pointers(h, arena);
 	memset(hk->hashes, 0, hk->size * sizeof(unsigned));
+	memset(hk->ctrl, HASH_CTRL_EMPTY, hk->size);
 }
 
 /**
@@ -422,6 +456,7 @@ hash_keyhash_setup(struct hkeys *hk, enum hash_key_type ktype, size_t keysize)
 	g_assert(hk != NULL);
 
 	hk->type = ktype;
+	hk->legacy = hash_legacy;
 
 	switch (ktype) {
 	case HASH_KEY_SELF:
@@ -462,6 +497,7 @@ hash_keyhash_any_setup(struct hkeys *hk,
 	g_assert(primary != NULL);
 
 	hk->type = HASH_KEY_ANY;
+	hk->legacy = hash_legacy;
 	hk->uh.h.hash = primary;
 	hk->uh.h.hash2 = secondary;
 	hk->uk.eq = NULL == eq ? pointer_eq : eq;
@@ -484,6 +520,7 @@ hash_keyhash_data_setup(struct hkeys *hk,
 	g_assert(eq != NULL);
 
 	hk->type = HASH_KEY_ANY_DATA;	/* Union discriminent for uh */
+	hk->legacy = hash_legacy;
 	hk->uh.hd.hash = hash;
 	hk->uh.hd.data = data;
 	hk->uk.eq_data = eq;
@@ -557,24 +594,25 @@ hash_keyset_equals(const struct hkeys *hk, const void *k1, const void *k2)
 }
 
 /**
- * Lookup key in the key set.
- *
- * Because a lookup is the initial operation before one can insert anything,
- * we keep track of some important parameters that are gathered during the
- * lookup operation: the primary hashed value of the key, the index where
- * the key could be inserted at or where the key is located.
- *
- * @param hk		the keyset structure
- * @param key		the key we are looking for
- * @param hv		the hashed value for the key (primary hash)
- * @param kidx		where the key was found or can be inserted
- * @param tombidx	index of the first tomb in the lookup path, -1 if none
+ * Record hashed value (or HASH_FREE / HASH_TOMB marker) at given index,
+ * updating the control byte accordingly.
+ */
+static inline void
+hash_keyset_set(struct hkeys *hk, size_t idx, unsigned hv)
+{
+	hk->hashes[idx] = hv;
+	hk->ctrl[idx] = HASH_IS_REAL(hv) ? HASH_CTRL(hv) :
+		HASH_IS_TOMB(hv) ? HASH_CTRL_TOMB : HASH_CTRL_EMPTY;
+}
+
+/**
+ * Lookup key in the key set, using double hashing probing.
  *
- * @return TRUE if key was found with kidx now holding the index of the key,
- * FALSE otherwise with kidx now holding the insertion index for the key.
+ * This is the former probing algorithm, kept for comparison purposes.
+ * See hash_keyset_lookup() for the parameters.
  */
-static bool G_HOT
-hash_keyset_lookup(struct hkeys *hk, const void *key, unsigned hv,
+static bool
+hash_keyset_lookup_double(struct hkeys *hk, const void *key, unsigned hv,
 	size_t *kidx, size_t *tombidx)
 {
 	unsigned inc, ih;
@@ -702,6 +740,186 @@ hash_keyset_lookup(struct hkeys *hk, const void *key, unsigned hv,
 	return found;
 }
 
+/**
+ * Compare the control bytes of a probing group.
+ *
+ * @param ctrl		start of the group in the control array
+ * @param c			the control byte of the key we are looking for
+ * @param empty		where bitmap of free slots is written
+ * @param tomb		where bitmap of tombs is written
+ *
+ * @return bitmap of the slots whose control byte matches ``c''.
+ */
+static inline uint
+hash_group_scan(const uint8 *ctrl, uint8 c, uint *empty, uint *tomb)
+{
+#ifdef __SSE2__
+	__m128i g = _mm_loadu_si128((const __m128i *) ctrl);
+
+	STATIC_ASSERT(16 == HASH_GROUP);
+
+	*empty = _mm_movemask_epi8(_mm_cmpeq_epi8(g,
+		_mm_set1_epi8((char) HASH_CTRL_EMPTY)));
+	*tomb = _mm_movemask_epi8(_mm_cmpeq_epi8(g,
+		_mm_set1_epi8((char) HASH_CTRL_TOMB)));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char) c)));
+#else
+	uint i, match = 0, e = 0, t = 0;
+
+	for (i = 0; i < HASH_GROUP; i++) {
+		uint8 b = ctrl[i];
+
+		if (b == c)
+			match |= 1U << i;
+		else if (HASH_CTRL_EMPTY == b)
+			e |= 1U << i;
+		else if (HASH_CTRL_TOMB == b)
+			t |= 1U << i;
+	}
+
+	*empty = e;
+	*tomb = t;
+	return match;
+#endif	/* __SSE2__ */
+}
+
+/**
+ * Lookup key in a key set smaller than a probing group.
+ *
+ * The whole hashes array fits in a CPU cacheline, so we just scan all of it.
+ * See hash_keyset_lookup() for the parameters.
+ */
+static bool
+hash_keyset_lookup_small(struct hkeys *hk, const void *key, unsigned hv,
+	size_t *kidx, size_t *tombidx)
+{
+	size_t i, first_tomb = (size_t) -1, first_free = (size_t) -1;
+
+	for (i = 0; i < hk->size; i++) {
+		unsigned ih = hk->hashes[i];
+
+		if (ih == hv && hash_keyset_equals(hk, hk->keys[i], key)) {
+			*kidx = i;
+			if (tombidx != NULL)
+				*tombidx = first_tomb;
+			return TRUE;
+		} else if (HASH_IS_TOMB(ih)) {
+			if ((size_t) -1 == first_tomb)
+				first_tomb = i;
+		} else if (HASH_IS_FREE(ih)) {
+			if ((size_t) -1 == first_free)
+				first_free = i;
+		}
+	}
+
+	if (tombidx != NULL)
+		*tombidx = first_tomb;
+
+	if ((size_t) -1 != first_tomb) {
+		*kidx = first_tomb;
+	} else if ((size_t) -1 != first_free) {
+		*kidx = first_free;
+	} else {
+		*kidx = 0;
+		hk->resize = TRUE;		/* Table is full */
+	}
+
+	return FALSE;
+}
+
+/**
+ * Lookup key in the key set.
+ *
+ * Because a lookup is the initial operation before one can insert anything,
+ * we keep track of some important parameters that are gathered during the
+ * lookup operation: the primary hashed value of the key, the index where
+ * the key could be inserted at or where the key is located.
+ *
+ * @param hk		the keyset structure
+ * @param key		the key we are looking for
+ * @param hv		the hashed value for the key (primary hash)
+ * @param kidx		where the key was found or can be inserted
+ * @param tombidx	index of the first tomb in the lookup path, -1 if none
+ *
+ * @return TRUE if key was found with kidx now holding the index of the key,
+ * FALSE otherwise with kidx now holding the insertion index for the key.
+ */
+static bool G_HOT
+hash_keyset_lookup(struct hkeys *hk, const void *key, unsigned hv,
+	size_t *kidx, size_t *tombidx)
+{
+	size_t idx, first_tomb = (size_t) -1;
+	size_t g, gmask, hops, ngroups;
+	uint8 c;
+
+	if G_UNLIKELY(hk->legacy)
+		return hash_keyset_lookup_double(hk, key, hv, kidx, tombidx);
+
+	if G_UNLIKELY(hk->size < HASH_GROUP)
+		return hash_keyset_lookup_small(hk, key, hv, kidx, tombidx);
+
+	idx = hashing_keep(hv, hk->bits);
+	ngroups = hk->size >> HASH_GROUP_BITS;
+	gmask = ngroups - 1;
+	g = idx >> HASH_GROUP_BITS;
+	c = HASH_CTRL(hv);
+
+	for (hops = 0; hops < ngroups; hops++) {
+		size_t base = g << HASH_GROUP_BITS;
+		uint match, empty, tomb;
+
+		match = hash_group_scan(&hk->ctrl[base], c, &empty, &tomb);
+
+		while (match != 0) {
+			size_t i = base + ctz(match);
+
+			match &= match - 1;		/* Clear lowest bit set */
+
+			if (
+				hk->hashes[i] == hv &&
+				hash_keyset_equals(hk, hk->keys[i], key)
+			) {
+				*kidx = i;
+				if (tombidx != NULL)
+					*tombidx = first_tomb;
+				return TRUE;
+			}
+		}
+
+		if (tomb != 0 && (size_t) -1 == first_tomb)
+			first_tomb = base + ctz(tomb);
+
+		/*
+		 * A free slot in the group means the key cannot be further away
+		 * in the probing sequence: it would have been inserted here.
+		 */
+
+		if (empty != 0) {
+			if G_UNLIKELY(hops > HASH_GROUP_HOPS)
+				hk->resize = TRUE;
+			if (tombidx != NULL)
+				*tombidx = first_tomb;
+			*kidx = (size_t) -1 == first_tomb ? base + ctz(empty) : first_tomb;
+			return FALSE;
+		}
+
+		g = (g + hops + 1) & gmask;		/* Triangular probing */
+	}
+
+	/*
+	 * We went through all the groups without finding any free slot: the
+	 * table is full of items and tombs.
+	 */
+
+	hk->resize = TRUE;
+
+	if (tombidx != NULL)
+		*tombidx = first_tomb;
+	*kidx = (size_t) -1 == first_tomb ? idx : first_tomb;
+
+	return FALSE;
+}
+
 /**
  * Erect a new tombstone at the specified key index.
  *
@@ -722,7 +940,7 @@ hash_erect_tombstone(struct hash *h, size_t idx)
 	if G_UNLIKELY(HASH_TOMB == hk->hashes[idx])
 		return FALSE;
 
-	hk->hashes[idx] = HASH_TOMB;
+	hash_keyset_set(hk, idx, HASH_TOMB);
 	hk->tombs++;
 	return TRUE;
 }
@@ -740,6 +958,7 @@ hash_resize_min(struct hash *h)
 	if G_UNLIKELY(HASH_MIN_BITS == h->kset.bits) {
 		memset(h->kset.hashes, 0,
 			(1U << HASH_MIN_BITS) * sizeof h->kset.hashes[0]);
+		memset(h->kset.ctrl, HASH_CTRL_EMPTY, 1U << HASH_MIN_BITS);
 		h->kset.tombs = 0;
 		h->kset.relocate = 0;
 		h->kset.resize = FALSE;
@@ -828,7 +1047,7 @@ size_computed:
 
 			keys++;
 			h->kset.keys[idx] = *hk;
-			h->kset.hashes[idx] = *hp;
+			hash_keyset_set(&h->kset, idx, *hp);
 			if (old_values != NULL)
 				new_values[idx] = old_values[i];
 		}
@@ -1020,7 +1239,7 @@ hash_insert_key(struct hash *h, const void *key)
 			h->kset.tombs--;
 		}
 		h->kset.items++;
-		h->kset.hashes[idx] = hv;
+		hash_keyset_set(&h->kset, idx, hv);
 	}
 
 	h->kset.keys[idx] = key;	/* Could be a new pointer, so always update */
@@ -1096,11 +1315,11 @@ no_resize:
 			g_assert(size_is_positive(h->kset.tombs));
 
 			h->kset.keys[tombidx] = h->kset.keys[idx];
-			h->kset.hashes[tombidx] = hv;
+			hash_keyset_set(&h->kset, tombidx, hv);
 			if (values != NULL)
 				values[tombidx] = values[idx];
 
-			h->kset.hashes[idx] = HASH_TOMB;
+			hash_keyset_set(&h->kset, idx, HASH_TOMB);
 			return tombidx;
 		}
 
@@ -1315,6 +1534,20 @@ hash_free(struct hash *h)
 	(*h->ops->hash_free)(h);
 }
 
+/**
+ * Select the probing algorithm used by hash tables and sets created from
+ * now on, existing ones being left untouched.
+ *
+ * This is meant for benchmarking and testing only.
+ *
+ * @param on	TRUE to use the former double hashing probing
+ */
+void
+hash_legacy_probing(bool on)
+{
+	hash_legacy = booleanize(on);
+}
+
 /**
  * Mark the hash as thread-safe.
  *
@@ -77,6 +77,7 @@ struct hkeys {
 	size_t tombs;				/* Amount of deleted items (tombstones) */
 	const void **keys;			/* Array of keys */
 	unsigned *hashes;			/* Array of hashed keys */
+	uint8 *ctrl;				/* Array of control bytes, for probing */
 	union {
 		struct {
 			hash_fn_t hash;			/* Primary key hashing function */
@@ -97,6 +98,7 @@ struct hkeys {
 	unsigned has_values:1;		/* Whether keys have associated values */
 	unsigned raw_memory:1;		/* Don't use walloc(), use VMM and xpmalloc() */
 	unsigned relocate:10;		/* Attempts for arena relocation */
+	unsigned legacy:1;			/* Use double hashing probing */
 };
 
 #define HASH(x)		((struct hash *) (x))
@@ -113,6 +115,17 @@ struct hkeys {
 #define HASH_IS_TOMB(x)			(HASH_TOMB == (x))
 #define HASH_IS_REAL(x)			((x) >= HASH_REAL)
 
+/*
+ * Control bytes (ctrl[] from key set), mirroring the hashes[] array.
+ *
+ * Real items record the 7 upper bits of their hashed value, so that a whole
+ * group of slots can be matched against the looked-up key at once.
+ */
+
+#define HASH_CTRL_EMPTY			0x80	/* Free slot */
+#define HASH_CTRL_TOMB			0xfe	/* Deleted item */
+#define HASH_CTRL(x)			((uint8) ((x) >> 25))	/* Real item */
+
 /**
  * Redefined routines in each heir.
  *
@@ -222,6 +235,8 @@ size_t hash_count(const struct hash *h);
 size_t hash_random(const struct hash *h, const void **keyptr);
 void hash_free(struct hash *h);
 
+void hash_legacy_probing(bool on);
+
 #endif /* _hash_h_ */
 
 /* vi: set ts=4 sw=4 cindent: */
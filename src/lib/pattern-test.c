@@ -34,6 +34,7 @@
 
 #include "common.h"
 
+#include "ascii.h"
 #include "log.h"
 #include "pattern.h"
 #include "progname.h"
@@ -62,13 +63,14 @@ usage(void)
 			"  -L : sets lower limit for alphabet size (absolute min 1)\n"
 			"  -a : run all tests\n"
 			"  -b : what to benchmark: s or S = strstr(), p or P = pattern_*()\n"
+			"       t or T = throughput of pattern_*() across needle lengths\n"
 			"  -i : verbose level for pattern_init()\n"
 			"  -h : prints this help message\n"
 			"  -u : use un-matchable patterns\n"
 			"  -z : all letters of pattern are 1st alphabet letter\n"
 			, getprogname(), CONST_STRLEN(alphabet));
 	fprintf(stderr,
-			"s/p use large %zu-letter alphabet, S/P use %d-letter alphabet\n"
+			"s/p/t use large %zu-letter alphabet, S/P/T use %d-letter alphabet\n"
 			, CONST_STRLEN(alphabet), SMALL_ALPHABET);
 	exit(EXIT_FAILURE);
 }
@@ -171,7 +173,8 @@ timeit_strstr(const struct matchinfo *mi, double *elapsed)
 enum patinfo_type {
 	PATTERN_INFO_ROUTINE,
 	PATTERN_INFO_MATCH,
-	PATTERN_INFO_QSEARCH
+	PATTERN_INFO_QSEARCH,
+	PATTERN_INFO_SIMD
 };
 
 struct patinfo {
@@ -216,6 +219,12 @@ timeit_pattern(const struct patinfo *pi, double *elapsed)
 						pi->haystack_len, 0, qs_any);
 			}
 			break;
+		case PATTERN_INFO_SIMD:
+			for (j = 0; j < ATTEMPTS; j++) {
+				v = pattern_simd_force(pi->pat, pi->haystack,
+						pi->haystack_len, 0, qs_any);
+			}
+			break;
 		}
 
 		tm_precise_time(&end);
@@ -346,6 +355,88 @@ benchmark_pattern(size_t asize)
 	xfree(haystack);
 }
 
+/**
+ * Compute throughput in MiB/s for a haystack of `hlen' bytes.
+ */
+static double
+throughput(size_t hlen, double elapsed)
+{
+	if (elapsed <= 0.0)
+		return 0.0;
+
+	return hlen / elapsed / (1024.0 * 1024.0);
+}
+
+static void
+benchmark_throughput(size_t asize)
+{
+	size_t hlen = 65536;
+	char *haystack;
+	struct patinfo pi;
+	size_t i;
+	static const size_t needle_len[] = { 2, 3, 4, 6, 8, 12, 16, 24, 32, 48 };
+
+	STATIC_ASSERT(48 < NEEDLE_MAXLEN);
+
+	haystack = xmalloc(hlen + 1);
+
+	/*
+	 * The needles are not taken from the haystack: with an unmatchable
+	 * last character, all the routines have to scan the whole haystack,
+	 * which is what we want to measure.
+	 */
+
+	fill_random_asize_string(haystack, hlen + 1, asize);
+	pi.haystack = haystack;
+	pi.haystack_len = hlen;
+
+	for (i = 0; i < N_ITEMS(needle_len); i++) {
+		size_t nlen = needle_len[i];
+		char needle[NEEDLE_MAXLEN];
+		int icase;
+
+		fill_random_asize_string(needle, nlen + 1, asize);
+		needle[nlen - 1] = unmatchable_char;
+
+		for (icase = 0; icase <= 1; icase++) {
+			double elapsed1, elapsed2, elapsed3;
+			char *rq, *rm, *rv;
+			cpattern_t *pat;
+
+			pat = pattern_compile_fast(needle, nlen, icase);
+			pi.needle = needle;
+			pi.pat = pat;
+
+			pi.type = PATTERN_INFO_QSEARCH;
+			rq = timeit_pattern(&pi, &elapsed1);
+
+			pi.type = PATTERN_INFO_MATCH;
+			rm = timeit_pattern(&pi, &elapsed2);
+
+			pi.type = PATTERN_INFO_SIMD;
+			rv = timeit_pattern(&pi, &elapsed3);
+
+			g_assert_log(rq == rm && rm == rv,
+				"%s(): rq=%p, rm=%p, rv=%p, nlen=%zu, icase=%d",
+				G_STRFUNC, rq, rm, rv, nlen, icase);
+
+			s_info("%s(%zu): %s needle length of %zu:",
+				G_STRFUNC, asize, icase ? "case-insensitive" : "case-sensitive",
+				nlen);
+			s_info("\tqsearch():  %'10.1f MiB/s",
+				throughput(hlen, elapsed1));
+			s_info("\tmatch():    %'10.1f MiB/s",
+				throughput(hlen, elapsed2));
+			s_info("\tsimd():     %'10.1f MiB/s",
+				throughput(hlen, elapsed3));
+
+			pattern_free(pat);
+		}
+	}
+
+	xfree(haystack);
+}
+
 static void
 benchmark_strstr(size_t asize)
 {
@@ -929,6 +1020,81 @@ qs2str(qsearch_mode_t m)
 	return "?";
 }
 
+/*
+ * Check that the SIMD kernels return the same results as the 2-way
+ * algorithm, for random haystacks of all lengths, starting offsets and
+ * matching modes, with case-sensitive and case-insensitive patterns.
+ */
+static void
+test_simd(bool low_letters)
+{
+	size_t i;
+	size_t try = 0, matches = 0;
+	size_t asize = low_letters ? SMALL_ALPHABET : CONST_STRLEN(alphabet);
+	static const qsearch_mode_t modes[] = {
+		qs_any, qs_begin, qs_end, qs_whole
+	};
+
+	for (i = 0; i < 20000; i++) {
+		size_t hlen = 1 + random_value(200);
+		size_t nlen = 1 + random_value(MIN(hlen, 20) - 1);
+		size_t noff = random_value(hlen - nlen);
+		size_t hoff = random_value(hlen);
+		char *haystack = xmalloc(hlen + 1);
+		char *needle = xmalloc(nlen + 1);
+		cpattern_t *pc, *pi;
+		size_t j;
+
+		/* Needle is taken from haystack, to get some matches */
+
+		fill_random_asize_string(haystack, hlen + 1, asize);
+		clamp_strncpy(needle, nlen + 1, &haystack[noff], nlen);
+
+		/* Flip the case of a character, to exercise case-insensitivity */
+
+		j = random_value(nlen - 1);
+		if (is_ascii_alpha(needle[j])) {
+			needle[j] = is_ascii_upper(needle[j]) ?
+				ascii_tolower(needle[j]) : ascii_toupper(needle[j]);
+		}
+
+		pc = pattern_compile(needle, FALSE);
+		pi = pattern_compile(needle, TRUE);
+
+		for (j = 0; j < N_ITEMS(modes); j++) {
+			const char *rm, *rv;
+
+			rm = pattern_match_force(pc, haystack, hlen, hoff, modes[j]);
+			rv = pattern_simd_force(pc, haystack, hlen, hoff, modes[j]);
+
+			g_assert_log(rm == rv,
+				"%s(%zu): rm=%p, rv=%p, hlen=%zu, hoff=%zu, "
+				"nlen=%zu, qs_%s (case)",
+				G_STRFUNC, asize, rm, rv, hlen, hoff, nlen, qs2str(modes[j]));
+
+			rm = pattern_match_force(pi, haystack, hlen, hoff, modes[j]);
+			rv = pattern_simd_force(pi, haystack, hlen, hoff, modes[j]);
+
+			g_assert_log(rm == rv,
+				"%s(%zu): rm=%p, rv=%p, hlen=%zu, hoff=%zu, "
+				"nlen=%zu, qs_%s (icase)",
+				G_STRFUNC, asize, rm, rv, hlen, hoff, nlen, qs2str(modes[j]));
+
+			try++;
+			if (rv != NULL)
+				matches++;
+		}
+
+		pattern_free(pc);
+		pattern_free(pi);
+		xfree(haystack);
+		xfree(needle);
+	}
+
+	s_info("%s(%zu): %'zu match%s over %'zu attempt%s",
+		G_STRFUNC, asize, PLURAL_ES(matches), PLURAL(try));
+}
+
 static void
 test_qs_flags(pattern_search_fn_t *fn, const char *name)
 {
@@ -1038,7 +1204,7 @@ main(int argc, char **argv)
 	extern char *optarg;
 	int c;
 	const char options[] = "A:L:ab:i:huz";
-	const char all_benchmarks[] = "spSP";
+	const char all_benchmarks[] = "spSPtT";
 	int default_init_level = PATTERN_INIT_PROGRESS | PATTERN_INIT_SELECTED;
 	int init_level = default_init_level;
 	const char *benchmarks = "";
@@ -1127,6 +1293,15 @@ main(int argc, char **argv)
 	test_qs_flags(FN(pattern_qsearch));
 	test_qs_flags(FN(pattern_match));
 
+	/*
+	 * The SIMD kernels must behave exactly as the 2-way algorithm.
+	 */
+
+	test_pattern_case(FN(pattern_simd));
+	test_qs_flags(FN(pattern_simd));
+	test_simd(FALSE);
+	test_simd(TRUE);
+
 	/*
 	 * OK, seems the above are correct, benchmark our routines.
 	 */
@@ -1147,6 +1322,12 @@ main(int argc, char **argv)
 		case 'P':
 			benchmark_pattern(MIN(alphabet_min, small_size));
 			break;
+		case 't':
+			benchmark_throughput(MIN(alphabet_max, CONST_STRLEN(alphabet)));
+			break;
+		case 'T':
+			benchmark_throughput(MIN(alphabet_min, small_size));
+			break;
 		default:
 			s_warning("skipping unknown benchmark code '%c'", c);
 			break;
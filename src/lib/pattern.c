@@ -35,11 +35,22 @@
 
 #include <math.h>		/* For fabs() */
 
+/*
+ * The SIMD kernels are compiled through the target attribute, regardless of
+ * the -march flags used, the proper kernel being selected at runtime
+ * depending on what the CPU supports.
+ */
+#if defined(HAS_G_TARGET) && (defined(__x86_64__) || defined(__i386__))
+#define PATTERN_SIMD
+#include <immintrin.h>
+#endif
+
 #include "pattern.h"
 
 #include "ascii.h"
 #include "endian.h"
 #include "misc.h"
+#include "once.h"
 #include "op.h"
 #include "pow2.h"
 #include "random.h"
@@ -86,6 +97,10 @@ static const char *pattern_match_known(
 static const char *pattern_qsearch_known(
 	const cpattern_t *p, const uchar *h, size_t hl, size_t ho, qsearch_mode_t m);
 
+static pattern_dflt_known_t *pattern_simd_known;	/* NULL if no SIMD kernel */
+static const char *pattern_simd_name;
+static once_flag_t pattern_simd_inited;
+
 /*
  * These macros allow to switch benchmarked default routines easily.
  *
@@ -1645,6 +1660,267 @@ pattern_match_force(
 	}
 }
 
+/*
+ * SIMD substring search kernels.
+ *
+ * These use the classic "first and last character" filtering: the first
+ * and last characters of the pattern are broadcast into vector registers,
+ * and we compare them against the text at all the candidate positions of
+ * a vector at once, i.e. against text[i] and text[i + plen - 1].  Only the
+ * positions where both characters match are then verified, which with
+ * natural text happens rarely enough that the whole scan proceeds at
+ * nearly the speed of memory.
+ *
+ * For case-insensitive patterns, each character is compared against both
+ * its ASCII lowercase and uppercase forms.
+ *
+ * These kernels require a known text length, since they read whole vectors
+ * from the text.  When there is not enough text left to fill a vector, we
+ * back off to the 2-way algorithm.
+ */
+
+/**
+ * Verify that the whole pattern matches at `c', once the SIMD kernel has
+ * established that its first and last characters are there.
+ */
+static inline bool
+pattern_simd_verify(const cpattern_t *p, const uchar *c)
+{
+	size_t plen = p->len;
+
+	if G_UNLIKELY(plen <= 2)
+		return TRUE;
+
+	if (p->icase)
+		return 0 == ascii_strncasecmp((char *) c + 1, p->pattern + 1, plen - 2);
+
+	return 0 == memcmp(c + 1, p->pattern + 1, plen - 2);
+}
+
+#ifdef PATTERN_SIMD
+
+#define PATTERN_SIMD_EQ_CASE(v, x1, x2, cmpeq, or)	cmpeq((v), (x1))
+#define PATTERN_SIMD_EQ_ICASE(v, x1, x2, cmpeq, or)	\
+	or(cmpeq((v), (x1)), cmpeq((v), (x2)))
+
+/*
+ * Computes the mask of candidate positions for the `width' positions
+ * starting at `s', then verifies each of them in turn, ignoring the
+ * positions for which the corresponding bit is cleared in `ignore'.
+ */
+#define PATTERN_SIMD_PROBE(cmp, vtype, load, cmpeq, and, or, movemask, ignore)	\
+	{																			\
+		vtype a = load((const vtype *) s);										\
+		vtype b = load((const vtype *) &s[plen_m1]);							\
+		uint32 m = (uint32) movemask(and(										\
+			PATTERN_SIMD_EQ_ ## cmp(a, f1, f2, cmpeq, or),						\
+			PATTERN_SIMD_EQ_ ## cmp(b, l1, l2, cmpeq, or)));					\
+		m &= (ignore);															\
+		while G_UNLIKELY(m != 0) {												\
+			const uchar *c = &s[ctz(m)];										\
+			if (																\
+				pattern_simd_verify(p, c) &&									\
+				pattern_has_matched(p, c, h, end, word)							\
+			)																	\
+				return (char *) c;												\
+			m &= m - 1;		/* Clear lowest bit set */							\
+		}																		\
+	}
+
+/*
+ * Scans the text `width' positions at a time, then handles the remaining
+ * positions by probing an overlapping vector that ends exactly at the last
+ * possible match position, ignoring the positions we already probed.
+ */
+#define PATTERN_SIMD_SCAN(cmp, width, vtype, load, cmpeq, and, or, movemask)	\
+	while (s + (width) <= endtp) {												\
+		PATTERN_SIMD_PROBE(cmp, vtype, load, cmpeq, and, or, movemask,		\
+			~(uint32) 0)														\
+		s += (width);															\
+	}																			\
+	if (s < endtp) {															\
+		size_t seen = s - (endtp - (width));									\
+		s = endtp - (width);													\
+		PATTERN_SIMD_PROBE(cmp, vtype, load, cmpeq, and, or, movemask,		\
+			~(uint32) 0 << seen)												\
+	}
+
+/*
+ * Common prologue for the SIMD kernels, handling the trivial cases and
+ * computing the characters to broadcast.
+ */
+#define PATTERN_SIMD_SETUP(width)												\
+	pattern_check(p);															\
+	if G_UNLIKELY(0 == p->len)													\
+		return pattern_match_known(p, h, hlen, ho, word);						\
+	if G_UNLIKELY(hlen < p->len || hlen - p->len < ho)							\
+		return NULL;															\
+	plen_m1 = p->len - 1;														\
+	s = h + ho;																	\
+	end = h + hlen;																\
+	endtp = end - plen_m1;		/* One past the last possible match start */	\
+	if G_UNLIKELY(ptr_diff(endtp, s) < (width))									\
+		goto short_text;														\
+	fc = ((const uchar *) p->pattern)[0];										\
+	lc = ((const uchar *) p->pattern)[plen_m1];									\
+	if (p->icase) {																\
+		fc = ascii_tolower(fc);													\
+		lc = ascii_tolower(lc);													\
+	}
+
+/**
+ * SSE2 kernel, processing 16 candidate positions at a time.
+ *
+ * @param p			compiled pattern
+ * @param h			text we're scanning
+ * @param hlen		known text length
+ * @param ho		offset within text for search start
+ * @param word		which word delimiter we care about on matched text?
+ *
+ * @return pointer to beginning of matching substring, NULL if not found.
+ */
+static const char * G_HOT G_TARGET("sse2")
+pattern_simd_sse2(
+	const cpattern_t *p, const uchar *h, size_t hlen, size_t ho,
+	qsearch_mode_t word)
+{
+	const uchar *s, *end, *endtp;
+	size_t plen_m1;
+	uchar fc, lc;
+	__m128i f1, f2, l1, l2;
+
+	PATTERN_SIMD_SETUP(16)
+
+	f1 = _mm_set1_epi8(fc);
+	l1 = _mm_set1_epi8(lc);
+
+	if (p->icase) {
+		f2 = _mm_set1_epi8(ascii_toupper(fc));
+		l2 = _mm_set1_epi8(ascii_toupper(lc));
+		PATTERN_SIMD_SCAN(ICASE, 16, __m128i, _mm_loadu_si128,
+			_mm_cmpeq_epi8, _mm_and_si128, _mm_or_si128, _mm_movemask_epi8)
+	} else {
+		f2 = f1;
+		l2 = l1;
+		PATTERN_SIMD_SCAN(CASE, 16, __m128i, _mm_loadu_si128,
+			_mm_cmpeq_epi8, _mm_and_si128, _mm_or_si128, _mm_movemask_epi8)
+	}
+
+	return NULL;
+
+short_text:
+	return pattern_match_known(p, h, hlen, ho, word);
+}
+
+/**
+ * AVX2 kernel, processing 32 candidate positions at a time.
+ *
+ * @param p			compiled pattern
+ * @param h			text we're scanning
+ * @param hlen		known text length
+ * @param ho		offset within text for search start
+ * @param word		which word delimiter we care about on matched text?
+ *
+ * @return pointer to beginning of matching substring, NULL if not found.
+ */
+static const char * G_HOT G_TARGET("avx2")
+pattern_simd_avx2(
+	const cpattern_t *p, const uchar *h, size_t hlen, size_t ho,
+	qsearch_mode_t word)
+{
+	const uchar *s, *end, *endtp;
+	size_t plen_m1;
+	uchar fc, lc;
+	__m256i f1, f2, l1, l2;
+
+	PATTERN_SIMD_SETUP(32)
+
+	f1 = _mm256_set1_epi8(fc);
+	l1 = _mm256_set1_epi8(lc);
+
+	if (p->icase) {
+		f2 = _mm256_set1_epi8(ascii_toupper(fc));
+		l2 = _mm256_set1_epi8(ascii_toupper(lc));
+		PATTERN_SIMD_SCAN(ICASE, 32, __m256i, _mm256_loadu_si256,
+			_mm256_cmpeq_epi8, _mm256_and_si256, _mm256_or_si256,
+			_mm256_movemask_epi8)
+	} else {
+		f2 = f1;
+		l2 = l1;
+		PATTERN_SIMD_SCAN(CASE, 32, __m256i, _mm256_loadu_si256,
+			_mm256_cmpeq_epi8, _mm256_and_si256, _mm256_or_si256,
+			_mm256_movemask_epi8)
+	}
+
+	return NULL;
+
+short_text:
+	/* Not enough text for a 32-byte vector, maybe enough for 16 */
+	return pattern_simd_sse2(p, h, hlen, ho, word);
+}
+
+#endif	/* PATTERN_SIMD */
+
+/**
+ * Select the best SIMD kernel supported by the running CPU, if any.
+ */
+static void
+pattern_simd_select(void)
+{
+#ifdef PATTERN_SIMD
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		pattern_simd_known = pattern_simd_avx2;
+		pattern_simd_name  = "pattern_simd_avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		pattern_simd_known = pattern_simd_sse2;
+		pattern_simd_name  = "pattern_simd_sse2";
+	}
+#endif	/* PATTERN_SIMD */
+}
+
+/**
+ * SIMD substring search.  It looks for the already compiled pattern,
+ * within the text, according to the word-matching directives.
+ *
+ * This is intended to be used by benchmarking tests and for correctness
+ * tests.  When the CPU has no usable SIMD instruction set, this falls
+ * back to the 2-way algorithm.
+ *
+ * This version is immune to benchmarking!
+ *
+ * @return pointer to beginning of matching substring, NULL if not found.
+ */
+const char *
+pattern_simd_force(
+	const cpattern_t *cpat,	/**< Compiled pattern */
+	const char *text,		/**< Text we're scanning */
+	size_t tlen,			/**< Text length, 0 = unknown */
+	size_t toffset,			/**< Offset within text for search start */
+	qsearch_mode_t word)	/**< Beginning/whole word matching? */
+{
+	pattern_dflt_known_t *fn;
+
+	ONCE_FLAG_RUN(pattern_simd_inited, pattern_simd_select);
+
+	fn = NULL == pattern_simd_known ? pattern_match_known : pattern_simd_known;
+
+	if (0 == tlen) {
+		g_assert_log(0 == toffset,
+			"%s(): toffset=%'zu, must be 0 when text length is unknown",
+			G_STRFUNC, toffset);
+		tlen = vstrlen(text);	/* Kernels need to know the text length */
+	} else {
+		g_assert_log(toffset <= tlen,
+			"%s(): toffset=%'zu, tlen=%'zu",
+			G_STRFUNC, toffset, tlen);
+	}
+
+	G_PREFETCH_R(text + toffset);
+	return (*fn)(cpat, (uchar *) text, tlen, toffset, word);
+}
+
 /*
  * @note
  *
@@ -3183,10 +3459,63 @@ pattern_benchmark_dflt(int verbose, struct pattern_benchmark_context *ctx)
 	/*
 	 * With known text lengths, always use the 2-Way String Matching
 	 * algorithm since it is guaranteed to be O(n) and is consistently
-	 * faster anyway.
+	 * faster anyway, unless a SIMD kernel beats it: this is determined
+	 * by pattern_benchmark_simd().
 	 */
 }
 
+/**
+ * Benchmark the SIMD kernel, if the CPU supports one, against the 2-Way
+ * algorithm for matching with known text lengths.
+ *
+ * The SIMD kernel becomes the default for known text lengths if it proves
+ * faster, which has to be done before computing the cut-off with strstr().
+ */
+static void
+pattern_benchmark_simd(int verbose, struct pattern_benchmark_context *ctx)
+{
+	size_t n;
+	char needle[PATTERN_NEEDLE_LEN + 1];
+	size_t sum = 0;
+	size_t winner = 0;
+
+	ONCE_FLAG_RUN(pattern_simd_inited, pattern_simd_select);
+
+	if (NULL == pattern_simd_known) {
+		if (verbose & PATTERN_INIT_SELECTED)
+			s_info("no SIMD kernel available, will use %s()", pattern_dflt_name_k);
+		return;
+	}
+
+	ctx->needle = needle;
+	ctx->use_text = TRUE;	/* More representative of real text */
+
+	ctx->name[0] = pattern_dflt_name_k;
+	ctx->u.pk[0] = pattern_dflt_known;
+	ctx->name[1] = pattern_simd_name;
+	ctx->u.pk[1] = pattern_simd_known;
+
+	ctx->direction = PATTERN_FORWARD;
+
+	for (n = 3; n < 3 + PATTERN_BENCH_DFLT_NEEDLES; n++) {
+		ctx->nlen = n;		/* Typical needle length */
+		sum += pattern_benchmark_n_times(3,
+			PATTERN_BENCH_DFLT_KNOWN, verbose, ctx);
+	}
+
+	if (sum > PATTERN_BENCH_DFLT_NEEDLES / 2)
+		winner = 1;
+
+	if (verbose & PATTERN_INIT_SELECTED) {
+		g_assert(winner <= 1);
+		s_info("will use %s() over %s()",
+			ctx->name[winner], ctx->name[1 - winner]);
+	}
+
+	pattern_dflt_known = ctx->u.pk[winner];
+	pattern_dflt_name_k = ctx->name[winner];
+}
+
 #define PATTERN_BENCH_CUTOFF_CLOSE		8	/* When are we closing-in? */
 #define PATTERN_BENCH_CUTOFF_LOW		2	/* Lowest needle length */
 #define PATTERN_BENCH_RETRIES			3
@@ -3410,6 +3739,7 @@ pattern_init(int verbose)
 	pattern_benchmark_strrchr(verbose, &ctx);
 	pattern_benchmark_strlen(verbose, &ctx);
 	pattern_benchmark_dflt(verbose, &ctx);
+	pattern_benchmark_simd(verbose, &ctx);
 	pattern_benchmark_cutoff_strstr_len(verbose, &ctx);
 	pattern_benchmark_cutoff_strstr(verbose, &ctx);
 
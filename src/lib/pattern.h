@@ -71,6 +71,8 @@ const char *pattern_qsearch_force(const cpattern_t *cpat,
 	const char *text, size_t tlen, size_t toffset, qsearch_mode_t word);
 const char *pattern_match_force(const cpattern_t *cpat,
 	const char *text, size_t tlen, size_t toffset, qsearch_mode_t word);
+const char *pattern_simd_force(const cpattern_t *cpat,
+	const char *text, size_t tlen, size_t toffset, qsearch_mode_t word);
 
 void *pattern_memchr(const void *s, int c, size_t n);
 void *pattern_memrchr(const void *s, int c, size_t n);
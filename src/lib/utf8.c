@@ -61,6 +61,11 @@
 
 #include "utf8_tables.h"
 
+#if defined(HAS_G_TARGET) && (defined(__x86_64__) || defined(__i386__))
+#define UTF8_SIMD
+#include <immintrin.h>
+#endif
+
 #include "utf8.h"
 
 #include "ascii.h"
@@ -75,6 +80,7 @@
 #include "mempcpy.h"
 #include "misc.h"
 #include "path.h"
+#include "pow2.h"				/* For ctz() */
 #include "pslist.h"
 #include "random.h"
 #include "str.h"
@@ -971,6 +977,187 @@ utf8_char_len_probe(const char *s)
 	return 0xE0 == uc ? 3 : 4;
 }
 
+/*
+ * ASCII fast path.
+ *
+ * Most of the strings we validate, count or normalize (queries, filenames,
+ * search results) are plain ASCII, possibly with a few Latin characters.
+ * Rather than decoding these one byte at a time, we locate the next byte
+ * with its high bit set a whole word, or a whole SIMD vector, at a time.
+ * Multi-byte sequences are still checked by the regular decoder, so that
+ * the set of strings we accept is left unchanged.
+ */
+
+typedef size_t (utf8_ascii_span_t)(const char *s, size_t len);
+
+#define UTF8_HIGHMASK	(((size_t) -1 / 0xff) * 0x80)	/* 0x80808080... */
+
+/**
+ * Portable ASCII span, processing one machine word at a time.
+ *
+ * @param s		the start of the buffer
+ * @param len	length of the buffer
+ *
+ * @return amount of leading ASCII bytes in the buffer.
+ */
+static size_t
+utf8_ascii_span_word(const char *s, size_t len)
+{
+	size_t i = 0;
+
+	while (i + sizeof(size_t) <= len) {
+		size_t w;
+
+		memcpy(&w, &s[i], sizeof w);	/* Unaligned read, compiles to a load */
+		if (w & UTF8_HIGHMASK)
+			break;
+		i += sizeof(size_t);
+	}
+
+	while (i < len && UTF8_IS_ASCII(s[i]))
+		i++;
+
+	return i;
+}
+
+#ifdef UTF8_SIMD
+
+/**
+ * SSE2 ASCII span: the high bits of 16 bytes are collected at once.
+ */
+static size_t G_HOT G_TARGET("sse2")
+utf8_ascii_span_sse2(const char *s, size_t len)
+{
+	size_t i = 0;
+
+	while (i + 16 <= len) {
+		uint m = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) &s[i]));
+		if (m != 0)
+			return i + ctz(m);
+		i += 16;
+	}
+
+	return i + utf8_ascii_span_word(&s[i], len - i);
+}
+
+/**
+ * AVX2 ASCII span: the high bits of 32 bytes are collected at once.
+ */
+static size_t G_HOT G_TARGET("avx2")
+utf8_ascii_span_avx2(const char *s, size_t len)
+{
+	size_t i = 0;
+
+	while (i + 32 <= len) {
+		uint m = _mm256_movemask_epi8(
+			_mm256_loadu_si256((const __m256i *) &s[i]));
+		if (m != 0)
+			return i + ctz(m);
+		i += 32;
+	}
+
+	return i + utf8_ascii_span_sse2(&s[i], len - i);
+}
+
+#endif	/* UTF8_SIMD */
+
+static utf8_ascii_span_t utf8_ascii_span_select;
+static utf8_ascii_span_t *utf8_ascii_span = utf8_ascii_span_select;
+
+/**
+ * Select the best ASCII span routine for the running CPU on first call,
+ * then install it so that subsequent calls go there directly.
+ *
+ * This is thread-safe: all threads end up selecting the same routine.
+ */
+static size_t
+utf8_ascii_span_select(const char *s, size_t len)
+{
+	utf8_ascii_span_t *fn = utf8_ascii_span_word;
+
+#ifdef UTF8_SIMD
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		fn = utf8_ascii_span_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		fn = utf8_ascii_span_sse2;
+#endif	/* UTF8_SIMD */
+
+	utf8_ascii_span = fn;
+	return (*fn)(s, len);
+}
+
+/**
+ * Length of the valid UTF-8 character at the start of the buffer.
+ *
+ * Two-byte sequences, which encode the Latin, Greek, Cyrillic, Hebrew and
+ * Arabic blocks, cannot be surrogates or illegal code points: they are
+ * valid as soon as the lead byte is not an overlong one and the trailing
+ * byte is a continuation.  Longer sequences go through the decoder.
+ *
+ * @param s		the start of the character
+ * @param len	remaining length in the buffer, including `s'
+ *
+ * @return the length of the character, 0 if invalid or truncated.
+ */
+static inline uint
+utf8_data_char_len(const char *s, size_t len)
+{
+	uchar c = *s;
+	uint clen;
+
+	if (c >= 0xc2 && c <= 0xdf)
+		return (len >= 2 && UTF8_IS_CONTINUATION(s[1])) ? 2 : 0;
+
+	clen = utf8_skip(c);
+	if (0 == clen || clen > len)
+		return 0;
+
+	return utf8_char_len(s);
+}
+
+/**
+ * Validate the UTF-8 buffer and count its characters.
+ *
+ * @param src		the buffer
+ * @param len		length of buffer
+ * @param valid		where the amount of leading bytes forming valid UTF-8
+ *					characters is written
+ *
+ * @return the amount of characters in the valid part of the buffer.
+ */
+static size_t
+utf8_data_scan(const char *src, size_t len, size_t *valid)
+{
+	size_t i = 0, n = 0;
+
+	while (i < len) {
+		size_t span;
+		uint clen;
+
+		span = (*utf8_ascii_span)(&src[i], len - i);
+		i += span;
+		n += span;
+
+		/*
+		 * Handle the run of non-ASCII characters that follows, until we
+		 * reach the next ASCII byte where the fast scan resumes.
+		 */
+
+		while (i < len && !UTF8_IS_ASCII(src[i])) {
+			if (0 == (clen = utf8_data_char_len(&src[i], len - i)))
+				goto done;
+			i += clen;
+			n++;
+		}
+	}
+
+done:
+	*valid = i;
+	return n;
+}
+
 /**
  * Determine whether a string is UTF-8 encoded.
  *
@@ -981,15 +1168,7 @@ utf8_char_len_probe(const char *s)
 bool
 utf8_is_valid_string(const char *src)
 {
-	const char *s;
-	uint clen;
-
-	for (s = src; '\0' != *s; s += clen) {
-		if (0 == (clen = utf8_char_len(s)))
-			return FALSE;
-	}
-
-	return TRUE;
+	return utf8_is_valid_data(src, vstrlen(src));
 }
 
 /**
@@ -999,22 +1178,16 @@ utf8_is_valid_string(const char *src)
 bool
 utf8_is_valid_data(const char *src, size_t len)
 {
-	g_assert(src);
+	size_t valid;
 
-	while (len > 0) {
-		size_t clen;
+	g_assert(src);
 
-		clen = utf8_skip(*src);
-		if (clen > len || 0 == utf8_char_len(src))
-			break;
-		len -= clen;
-		src += clen;
-	}
-	return 0 == len;
+	(void) utf8_data_scan(src, len, &valid);
+	return valid == len;
 }
 
 /**
- * Slowly count the amount of UTF-8 codepoints in the string, validating
+ * Count the amount of UTF-8 codepoints in the string, validating
  * each codepoint for valid encoding.
  *
  * @param src		a NUL-terminated string buffer
@@ -1025,21 +1198,21 @@ utf8_is_valid_data(const char *src, size_t len)
 size_t
 utf8_char_count(const char *src)
 {
-	const char *s;
-	uint clen;
-	size_t n;
+	size_t len, valid, n;
 
-	for (s = src, n = 0; '\0' != *s; s += clen, n++)
-		if (0 == (clen = utf8_char_len(s)))
-			return (size_t) -1;
+	len = vstrlen(src);
+	n = utf8_data_scan(src, len, &valid);
 
-	return n;
+	return valid == len ? n : (size_t) -1;
 }
 
 /**
- * Slowly count the amount of UTF-8 codepoints in the string, validating
+ * Count the amount of UTF-8 codepoints in the string, validating
  * each codepoint for valid encoding.
  *
+ * A truncated character at the end of the buffer is not counted and
+ * does not make the buffer invalid.
+ *
  * @param src		a string buffer (not necessarily NUL-terminated)
  * @param len		length of buffer
  *
@@ -1049,18 +1222,21 @@ utf8_char_count(const char *src)
 size_t
 utf8_data_char_count(const char *src, size_t len)
 {
-	const char *s;
-	size_t rlen;
-	uint clen;
-	size_t n;
+	size_t valid, n;
+
+	n = utf8_data_scan(src, len, &valid);
+
+	if (valid != len) {
+		uint clen = utf8_skip(src[valid]);
+
+		/*
+		 * Only a trailing character whose length points past the end of
+		 * the buffer is tolerated: it was truncated.
+		 */
 
-	for (
-		s = src, n = 0, rlen = len;
-		size_is_positive(rlen) && (clen = utf8_skip(*s)) <= rlen;
-		s += clen, n++, rlen -= clen
-	)
-		if (0 == (utf8_char_len(s)))
+		if (0 == clen || clen <= len - valid)
 			return (size_t) -1;
+	}
 
 	return n;
 }
@@ -2659,10 +2835,9 @@ charset_to_utf8(const char *cs, const char *src, size_t src_len)
 bool
 is_ascii_string(const char *s)
 {
-	while (IS_NON_NUL_ASCII(s))
-		++s;
+	size_t len = vstrlen(s);
 
-	return '\0' == *s;
+	return (*utf8_ascii_span)(s, len) == len;
 }
 
 static inline const char *
@@ -5561,6 +5736,64 @@ utf32_normalize(const uint32 *src, uni_norm_t norm)
 	return NULL;
 }
 
+/**
+ * Quick check whether a valid UTF-8 string is already in the requested
+ * normal form, without decoding it.
+ *
+ * This only looks at the lead bytes of non-ASCII characters, between runs
+ * of ASCII bytes skipped by the fast scan:
+ *
+ * - For NFC, all the code points below U+0300 (lead bytes below 0xCC) are
+ *   stable: none of them decomposes or combines with a preceding
+ *   character, and no combining mark can follow them in that range.
+ *
+ * - For NFKC, only U+00C0 to U+00FF (lead byte 0xC3) are kept, since the
+ *   U+00A0 to U+00BF range and Latin Extended hold compatibility
+ *   characters.
+ *
+ * - The decomposed forms require pure ASCII since precomposed Latin
+ *   letters are decomposed.
+ *
+ * A FALSE answer does not mean the string is not normalized, only that
+ * the full normalization process needs to be run.
+ *
+ * @param src	the NUL-terminated UTF-8 string
+ * @param norm	the normalization form
+ *
+ * @return TRUE if the string is known to be normalized already.
+ */
+static bool
+utf8_is_normalized_quick(const char *src, uni_norm_t norm)
+{
+	size_t i, len = vstrlen(src);
+
+	for (i = 0; i < len; /* empty */) {
+		i += (*utf8_ascii_span)(&src[i], len - i);
+
+		while (i < len && !UTF8_IS_ASCII(src[i])) {
+			uchar c = src[i];
+
+			switch (norm) {
+			case UNI_NORM_NFC:
+				if (c >= 0xcc)
+					return FALSE;
+				break;
+			case UNI_NORM_NFKC:
+				if (c != 0xc3 && !UTF8_IS_CONTINUATION(c))
+					return FALSE;
+				break;
+			case UNI_NORM_NFD:
+			case UNI_NORM_NFKD:
+			case NUM_UNI_NORM:
+				return FALSE;
+			}
+			i++;
+		}
+	}
+
+	return TRUE;
+}
+
 /**
  * Normalizes an UTF-8 string to the request normal form and returns
  * it as a newly allocated string.
@@ -5579,8 +5812,10 @@ utf8_normalize(const char *src, uni_norm_t norm)
 	g_assert(utf8_is_valid_string(src));
 	g_assert(UNSIGNED(norm) < NUM_UNI_NORM);
 
-	if (is_ascii_string(src)) {
+	if (utf8_is_normalized_quick(src, norm)) {
 		/*
+		 * Already normalized ASCII or Latin text, the common case.
+		 *
 		 * Optimize this later and return the original src pointer.
 		 */
 		return g_strdup(src);
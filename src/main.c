@@ -95,6 +95,7 @@
 #include "core/tls_common.h"
 #include "core/topless.h"
 #include "core/tsync.h"
+#include "core/tth_cache.h"
 #include "core/tx.h"
 #include "core/udp.h"
 #include "core/uhc.h"
@@ -949,6 +950,7 @@ gtk_gnutella_exit(int exit_code)
 	DO(node_close);
 	DO(g2_node_close);
 	DO(share_close);	/* After node_close() */
+	DO(tth_cache_close);
 	DO(udp_close);
 	DO(urpc_close);
 	DO(g2_rpc_close);
@@ -1854,16 +1856,218 @@ callout_queue_idle(void *unused_data)
 	return TRUE;		/* Keep scheduling this */
 }
 
+/*
+ * Startup profiling.
+ *
+ * Every initialization step run from main() is timed through MAIN_INIT(),
+ * so that we can tell where the time goes when we start with large caches.
+ * The figures are logged once we are up and can be displayed from the
+ * shell with the "startup" command.
+ *
+ * Loads that are not needed to get the node going are deferred and run
+ * one at a time from the callout queue after startup, so that networking
+ * and the GUI come up first.
+ */
+
+#define MAIN_PHASES_MAX		192		/**< Max amount of timed steps */
+#define MAIN_PHASES_SHOW	5		/**< Slowest steps we log */
+#define MAIN_DEFER_DELAY	1000	/**< ms: delay of first deferred step */
+#define MAIN_DEFER_PERIOD	50		/**< ms: delay between deferred steps */
+
+struct main_phase {
+	const char *name;		/**< Stringified call (static string) */
+	size_t len;				/**< Length of routine name in `name' */
+	ulong us;				/**< Elapsed time, in micro-seconds */
+	bool deferred;			/**< Whether step was run after startup */
+};
+
+static struct main_phase main_phases[MAIN_PHASES_MAX];
+static size_t main_phases_count;
+static tm_t main_phase_start;
+
+/**
+ * Time initialization step `call', which must be a routine call.
+ */
+#define MAIN_INIT(call) G_STMT_START {	\
+	main_phase_begin();					\
+	call;								\
+	main_phase_end(#call, FALSE);		\
+} G_STMT_END
+
+/**
+ * Non-critical initialization steps, run after startup in that order.
+ *
+ * Each step names the initialization routine that must have been run
+ * before it can proceed.
+ */
+static const struct main_deferred {
+	const char *name;		/**< Routine name */
+	void (*cb)(void);		/**< Routine to run */
+	const char *after;		/**< Initialization step we depend on */
+} main_deferred[] = {
+	{ "gip_retrieve_all",	gip_retrieve_all,	"gip_init" },
+	{ "share_scan",			share_scan,			"share_init" },
+};
+
+static size_t main_deferred_next;
+
+/**
+ * Record the start of an initialization step.
+ */
+static void
+main_phase_begin(void)
+{
+	tm_now_exact(&main_phase_start);
+}
+
+/**
+ * Record the end of an initialization step.
+ *
+ * @param call		the stringified call, or the routine name
+ * @param deferred	whether the step was run after startup
+ */
+static void
+main_phase_end(const char *call, bool deferred)
+{
+	struct main_phase *mp;
+	tm_t end;
+
+	tm_now_exact(&end);
+
+	if G_UNLIKELY(main_phases_count >= N_ITEMS(main_phases))
+		return;		/* Table full, step not profiled */
+
+	mp = &main_phases[main_phases_count++];
+	mp->name = call;
+	mp->len = strcspn(call, "(");
+	mp->us = tm_elapsed_us(&end, &main_phase_start);
+	mp->deferred = deferred;
+}
+
+/**
+ * @return whether initialization routine `name' was already run.
+ */
+static bool
+main_phase_done(const char *name)
+{
+	size_t i, len = vstrlen(name);
+
+	for (i = 0; i < main_phases_count; i++) {
+		const struct main_phase *mp = &main_phases[i];
+
+		if (mp->len == len && 0 == memcmp(mp->name, name, len))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
 /**
- * Scan files when the GUI is up.
+ * Iterate over all the profiled initialization steps, in execution order.
+ *
+ * @param cb		callback to invoke on each step
+ * @param udata		additional user data for callback
+ */
+void
+main_phase_foreach(main_phase_cb_t cb, void *udata)
+{
+	size_t i;
+
+	g_assert(cb != NULL);
+
+	for (i = 0; i < main_phases_count; i++) {
+		const struct main_phase *mp = &main_phases[i];
+
+		(*cb)(mp->name, mp->len, mp->us, mp->deferred, udata);
+	}
+}
+
+/**
+ * Log how long startup took, along with the slowest steps.
+ *
+ * @param deferred		whether to report on deferred steps
+ */
+static void
+main_phase_log(bool deferred)
+{
+	const struct main_phase *slowest[MAIN_PHASES_SHOW];
+	size_t i, j, n = 0;
+	ulong total = 0;
+	str_t *s;
+
+	for (i = 0; i < main_phases_count; i++) {
+		const struct main_phase *mp = &main_phases[i];
+
+		if (mp->deferred != deferred)
+			continue;
+
+		total += mp->us;
+
+		/* Insertion in the sorted list of slowest steps */
+
+		if (N_ITEMS(slowest) == n) {
+			if (slowest[n - 1]->us >= mp->us)
+				continue;
+			n--;		/* Drop the fastest of the slowest steps */
+		}
+
+		for (j = n; j > 0 && slowest[j - 1]->us < mp->us; j--)
+			slowest[j] = slowest[j - 1];
+
+		slowest[j] = mp;
+		n++;
+	}
+
+	s = str_new(80);
+
+	for (i = 0; i < n; i++) {
+		str_catf(s, "%s%.*s() %lu ms", 0 == i ? "" : ", ",
+			(int) slowest[i]->len, slowest[i]->name, slowest[i]->us / 1000);
+	}
+
+	g_info("%s took %lu ms, slowest: %s",
+		deferred ? "deferred initialization" : "startup",
+		total / 1000, str_2c(s));
+
+	str_destroy_null(&s);
+
+	if (debugging(0)) {
+		for (i = 0; i < main_phases_count; i++) {
+			const struct main_phase *mp = &main_phases[i];
+
+			if (mp->deferred == deferred) {
+				g_debug("%s(): %lu us: %.*s()", G_STRFUNC,
+					mp->us, (int) mp->len, mp->name);
+			}
+		}
+	}
+}
+
+/**
+ * Callout queue callback to run the next deferred initialization step.
  */
 static void
-scan_files_once(cqueue_t *unused_cq, void *unused_data)
+main_deferred_run(cqueue_t *cq, void *unused_data)
 {
-	(void) unused_cq;
+	const struct main_deferred *md;
+
 	(void) unused_data;
 
-	share_scan();
+	g_assert(main_deferred_next < N_ITEMS(main_deferred));
+
+	md = &main_deferred[main_deferred_next++];
+
+	g_assert_log(main_phase_done(md->after),
+		"%s(): %s() must run after %s()", G_STRFUNC, md->name, md->after);
+
+	main_phase_begin();
+	(*md->cb)();
+	main_phase_end(md->name, TRUE);
+
+	if (main_deferred_next < N_ITEMS(main_deferred))
+		cq_insert(cq, MAIN_DEFER_PERIOD, main_deferred_run, NULL);
+	else
+		main_phase_log(TRUE);
 }
 
 /**
@@ -2481,59 +2685,59 @@ main(int argc, char **argv)
 	STATIC_ASSERT(MAX_INT_VALUE(int32) == MAX_INT_VAL(int32));
 	STATIC_ASSERT(MIN_INT_VALUE(int32) == MIN_INT_VAL(int32));
 
-	mem_test();
-	random_init();
-	vsort_init(isatty(STDERR_FILENO) ? 0 : 1);
-	pattern_init(isatty(STDERR_FILENO) ? 0 : dflt_pattern);
-	htable_test();
-	wq_init();
-	inputevt_init(OPT(use_poll));
-	teq_io_create();
+	MAIN_INIT(mem_test());
+	MAIN_INIT(random_init());
+	MAIN_INIT(vsort_init(isatty(STDERR_FILENO) ? 0 : 1));
+	MAIN_INIT(pattern_init(isatty(STDERR_FILENO) ? 0 : dflt_pattern));
+	MAIN_INIT(htable_test());
+	MAIN_INIT(wq_init());
+	MAIN_INIT(inputevt_init(OPT(use_poll)));
+	MAIN_INIT(teq_io_create());
 	teq_set_throttle(70, 50);	/* 70 ms max for TEQ events, every 50 ms */
-	tiger_check();
-	tt_check();
-	tea_test();
-	xxtea_test();
-	patricia_test();
-	strtok_test();
-	locale_init();
-	adns_init();
-	file_object_init();
-	socket_init();
-	gnet_stats_init();
-	iso3166_init();
-	dbus_util_init(OPT(no_dbus));
-	vendor_init();
-	mime_type_init();
-
-	bg_init();
-	upnp_init();
-	udp_init();
-	urpc_init();
-	g2_rpc_init();
-	vmsg_init();
-	tsync_init();
-	ctl_init();
-	hcache_init();			/* before settings_init() */
-	bsched_early_init();	/* before settings_init() */
-	ipp_cache_init();		/* before settings_init() */
-	settings_init(OPT(resume_session));
+	MAIN_INIT(tiger_check());
+	MAIN_INIT(tt_check());
+	MAIN_INIT(tea_test());
+	MAIN_INIT(xxtea_test());
+	MAIN_INIT(patricia_test());
+	MAIN_INIT(strtok_test());
+	MAIN_INIT(locale_init());
+	MAIN_INIT(adns_init());
+	MAIN_INIT(file_object_init());
+	MAIN_INIT(socket_init());
+	MAIN_INIT(gnet_stats_init());
+	MAIN_INIT(iso3166_init());
+	MAIN_INIT(dbus_util_init(OPT(no_dbus)));
+	MAIN_INIT(vendor_init());
+	MAIN_INIT(mime_type_init());
+
+	MAIN_INIT(bg_init());
+	MAIN_INIT(upnp_init());
+	MAIN_INIT(udp_init());
+	MAIN_INIT(urpc_init());
+	MAIN_INIT(g2_rpc_init());
+	MAIN_INIT(vmsg_init());
+	MAIN_INIT(tsync_init());
+	MAIN_INIT(ctl_init());
+	MAIN_INIT(hcache_init());			/* before settings_init() */
+	MAIN_INIT(bsched_early_init());		/* before settings_init() */
+	MAIN_INIT(ipp_cache_init());		/* before settings_init() */
+	MAIN_INIT(settings_init(OPT(resume_session)));
 
 	/*
 	 * From now on, settings_init() was called so properties have been loaded.
 	 * Routines requiring access to properties should therefore be put below.
 	 */
 
-	xmalloc_post_init();	/* after settings_init() */
-	vmm_post_init();		/* after settings_init() */
+	MAIN_INIT(xmalloc_post_init());		/* after settings_init() */
+	MAIN_INIT(vmm_post_init());			/* after settings_init() */
 
 	if (debugging(0) || is_running_on_mingw())
-		stacktrace_load_symbols();
+		MAIN_INIT(stacktrace_load_symbols());
 
 	if (str_discrepancies && debugging(0)) {
 		g_info("found %zu discrepanc%s in string formatting:",
 			str_discrepancies, 1 == str_discrepancies ? "y" : "ies");
-		str_test(TRUE);
+		MAIN_INIT(str_test(TRUE));
 	}
 
 	/*
@@ -2542,71 +2746,73 @@ main(int argc, char **argv)
 	 */
 
 	if (!running_topless) {
-		main_gui_early_init(argc, argv, OPT(no_xshm));
-		main_gui_disable_ancient(OPT(no_expire));
-	}
-
-	upload_stats_load_history();	/* Loads the upload statistics */
-
-	map_test();
-	ipp_cache_load_all();
-	tls_global_init();
-	pmsg_init();
-	hostiles_init();
-	spam_init();
-	bogons_init();
-	gip_init();
-	guid_init();
-	uhc_init();
-	ghc_init();
-	gwc_init();
-	verify_sha1_init();
-	verify_tth_init();
-	move_init();
-	ignore_init();
-	word_vec_init();
-
-	file_info_init();
-	host_init();
-	gmsg_init();
-	bsched_init();
-	dump_init();
-	node_init();
-	g2_node_init();
-    hcache_retrieve_all();	/* after settings_init() and node_init() */
-	routing_init();
-	search_init();
-	share_init();
-	dmesh_init();			/* MUST be done BEFORE download_init() */
-	download_init();		/* MUST be done AFTER file_info_init() */
-	upload_init();
-	shell_init();
-	ban_init();
-	whitelist_init();
-	ext_init();
-	inet_init();
-	crc_init();
-	parq_init();
-	hsep_init();
-	clock_init();
-	dq_init();
-	dh_init();
-	sq_init();
-	gdht_init();
-	pdht_init();
-	publisher_init();
-	guess_init();
-
-	dht_init();
-	upnp_post_init();
+		MAIN_INIT(main_gui_early_init(argc, argv, OPT(no_xshm)));
+		MAIN_INIT(main_gui_disable_ancient(OPT(no_expire)));
+	}
+
+	MAIN_INIT(upload_stats_load_history());	/* Loads the upload statistics */
+
+	MAIN_INIT(map_test());
+	MAIN_INIT(ipp_cache_load_all());
+	MAIN_INIT(tls_global_init());
+	MAIN_INIT(pmsg_init());
+	MAIN_INIT(hostiles_init());
+	MAIN_INIT(spam_init());
+	MAIN_INIT(bogons_init());
+	MAIN_INIT(gip_init());
+	MAIN_INIT(guid_init());
+	MAIN_INIT(tth_cache_init());
+	MAIN_INIT(uhc_init());
+	MAIN_INIT(ghc_init());
+	MAIN_INIT(gwc_init());
+	MAIN_INIT(verify_sha1_init());
+	MAIN_INIT(verify_tth_init());
+	MAIN_INIT(move_init());
+	MAIN_INIT(ignore_init());
+	MAIN_INIT(word_vec_init());
+
+	MAIN_INIT(file_info_init());
+	MAIN_INIT(host_init());
+	MAIN_INIT(gmsg_init());
+	MAIN_INIT(bsched_init());
+	MAIN_INIT(dump_init());
+	MAIN_INIT(node_init());
+	MAIN_INIT(g2_node_init());
+	/* after settings_init() and node_init() */
+	MAIN_INIT(hcache_retrieve_all());
+	MAIN_INIT(routing_init());
+	MAIN_INIT(search_init());
+	MAIN_INIT(share_init());
+	MAIN_INIT(dmesh_init());		/* MUST be done BEFORE download_init() */
+	MAIN_INIT(download_init());		/* MUST be done AFTER file_info_init() */
+	MAIN_INIT(upload_init());
+	MAIN_INIT(shell_init());
+	MAIN_INIT(ban_init());
+	MAIN_INIT(whitelist_init());
+	MAIN_INIT(ext_init());
+	MAIN_INIT(inet_init());
+	MAIN_INIT(crc_init());
+	MAIN_INIT(parq_init());
+	MAIN_INIT(hsep_init());
+	MAIN_INIT(clock_init());
+	MAIN_INIT(dq_init());
+	MAIN_INIT(dh_init());
+	MAIN_INIT(sq_init());
+	MAIN_INIT(gdht_init());
+	MAIN_INIT(pdht_init());
+	MAIN_INIT(publisher_init());
+	MAIN_INIT(guess_init());
+
+	MAIN_INIT(dht_init());
+	MAIN_INIT(upnp_post_init());
 
 	if (!running_topless) {
-		main_gui_init();
+		MAIN_INIT(main_gui_init());
 	}
-	node_post_init();
-	file_info_init_post();
-	download_restore_state();
-	ntp_init();
+	MAIN_INIT(node_post_init());
+	MAIN_INIT(file_info_init_post());
+	MAIN_INIT(download_restore_state());
+	MAIN_INIT(ntp_init());
 	random_added_listener_add(settings_add_randomness);
 
 	/* Some signal handlers */
@@ -2631,7 +2837,8 @@ main(int argc, char **argv)
 	vmm_set_strategy(VMM_STRATEGY_LONG_TERM);
 
 	(void) tm_time_exact();
-	cq_main_insert(1000, scan_files_once, NULL);
+	main_phase_log(FALSE);
+	cq_main_insert(MAIN_DEFER_DELAY, main_deferred_run, NULL);
 	bsched_enable_all();
 	version_ancient_warn();
 	dht_attempt_bootstrap();
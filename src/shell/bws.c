@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup shell
+ * @file
+ *
+ * The "bws" command.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "cmd.h"
+
+#include "core/bsched.h"
+
+#include "if/gnet_property_priv.h"
+
+#include "lib/str.h"
+#include "lib/stringify.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+/**
+ * Display bandwidth scheduler statistics.
+ */
+enum shell_reply
+shell_exec_bws(struct gnutella_shell *sh, int argc, const char *argv[])
+{
+	const bool metric = GNET_PROPERTY(display_metric_units);
+	str_t *s;
+	uint i;
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	shell_write(sh, "100~\n");
+	shell_write(sh, "Scheduler         Limit       Used    Average     Stolen"
+		"  Util%  Wait  W  Srcs  Live\n");
+
+	s = str_new(100);
+
+	for (i = 0; i < NUM_BSCHED_BWS; i++) {
+		bsched_stats_t st;
+
+		bsched_get_stats(i, &st);
+
+		str_printf(s, "%-12s %10s %10s %10s %10s %4u.%u %5u %2u %5u %5u\n",
+			st.name,
+			st.enabled ?
+				short_rate_get_string(st.bw_per_second, metric).str : "-",
+			short_rate_get_string(st.bps, metric).str,
+			short_rate_get_string(st.avg_bps, metric).str,
+			short_rate_get_string(st.stolen_bps, metric).str,
+			st.utilisation / 10, st.utilisation % 10,
+			st.starved_ms, st.weight, st.sources, st.live);
+		shell_write(sh, str_2c(s));
+	}
+
+	str_destroy_null(&s);
+	shell_write(sh, ".\n");
+
+	return REPLY_READY;
+}
+
+const char *
+shell_summary_bws(void)
+{
+	return "Show bandwidth scheduler statistics";
+}
+
+const char *
+shell_help_bws(int argc, const char *argv[])
+{
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	return "bws\n"
+		"show traffic statistics for each bandwidth scheduler:\n"
+		"Limit: configured bandwidth, '-' when unlimited\n"
+		"Util%: average percentage of the allowed bandwidth used\n"
+		"Wait: average time per period during which sources were denied\n"
+		"      bandwidth, in ms\n"
+		"W: weight of the traffic class when distributing unused bandwidth\n"
+		"Srcs / Live: I/O sources, and those processed at each period\n";
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -62,8 +62,8 @@ shell_exec_lib_show_callout(struct gnutella_shell *sh,
 
 	shell_write(sh, "100~\n");
 	shell_write(sh,
-		"T  Events Per. Idle Last  Period  Heartbeat  Triggered Name (Parent)"
-		"\n");
+		"T  Events Per. Idle Last  Period  Heartbeat  Triggered "
+		"    Walked   Cascaded  Peak     Posted Name (Parent)\n");
 
 	info = cq_info_list();
 	s = str_new(80);
@@ -96,6 +96,10 @@ shell_exec_lib_show_callout(struct gnutella_shell *sh,
 		str_catf(s, "%'6d ", cqi->period);
 		str_catf(s, "%10zu ", cqi->heartbeat_count);
 		str_catf(s, "%10zu ", cqi->triggered_count);
+		str_catf(s, "%10zu ", cqi->walked_count);
+		str_catf(s, "%10zu ", cqi->cascaded_count);
+		str_catf(s, "%5zu ", cqi->peak_count);
+		str_catf(s, "%10zu ", cqi->posted_count);
 		str_catf(s, "\"%s\"%*s", cqi->name,
 			(int) (maxlen - vstrlen(cqi->name)), "");
 		if (cqi->parent != NULL)
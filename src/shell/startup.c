@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup shell
+ * @file
+ *
+ * The "startup" command.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "cmd.h"
+
+#include "if/core/main.h"
+
+#include "lib/halloc.h"
+#include "lib/str.h"
+#include "lib/xsort.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+struct shell_startup_step {
+	const char *name;
+	size_t len;
+	ulong us;
+	bool deferred;
+};
+
+struct shell_startup_ctx {
+	struct shell_startup_step *steps;
+	size_t count;
+	size_t capacity;
+};
+
+/**
+ * main_phase_foreach() callback to collect initialization steps.
+ */
+static void
+shell_startup_collect(const char *name, size_t len,
+	ulong us, bool deferred, void *udata)
+{
+	struct shell_startup_ctx *ctx = udata;
+	struct shell_startup_step *step;
+
+	if (ctx->count == ctx->capacity) {
+		ctx->capacity = MAX(32, ctx->capacity * 2);
+		HREALLOC_ARRAY(ctx->steps, ctx->capacity);
+	}
+
+	step = &ctx->steps[ctx->count++];
+	step->name = name;
+	step->len = len;
+	step->us = us;
+	step->deferred = deferred;
+}
+
+/**
+ * Sort initialization steps by decreasing duration.
+ */
+static int
+shell_startup_step_cmp(const void *a, const void *b)
+{
+	const struct shell_startup_step *sa = a, *sb = b;
+
+	return CMP(sb->us, sa->us);		/* Slowest first */
+}
+
+/**
+ * Display the time spent in each initialization step.
+ */
+enum shell_reply
+shell_exec_startup(struct gnutella_shell *sh, int argc, const char *argv[])
+{
+	const char *opt_s;
+	const option_t options[] = {
+		{ "s", &opt_s },
+	};
+	struct shell_startup_ctx ctx;
+	ulong total[2] = { 0, 0 };
+	int parsed;
+	size_t i;
+	str_t *s;
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	parsed = shell_options_parse(sh, argv, options, N_ITEMS(options));
+	if (parsed < 0)
+		return REPLY_ERROR;
+
+	ZERO(&ctx);
+	main_phase_foreach(shell_startup_collect, &ctx);
+
+	if (opt_s != NULL)
+		xsort(ctx.steps, ctx.count, sizeof ctx.steps[0],
+			shell_startup_step_cmp);
+
+	shell_write(sh, "100~\n");
+	shell_write(sh, "      usec  D Step\n");
+
+	s = str_new(80);
+
+	for (i = 0; i < ctx.count; i++) {
+		const struct shell_startup_step *step = &ctx.steps[i];
+
+		total[step->deferred ? 1 : 0] += step->us;
+		str_printf(s, "%'10lu  %c %.*s()\n", step->us,
+			step->deferred ? 'd' : '-', (int) step->len, step->name);
+		shell_write(sh, str_2c(s));
+	}
+
+	str_printf(s, "%'10lu    Total startup\n", total[0]);
+	shell_write(sh, str_2c(s));
+	str_printf(s, "%'10lu    Total deferred\n", total[1]);
+	shell_write(sh, str_2c(s));
+
+	str_destroy_null(&s);
+	HFREE_NULL(ctx.steps);
+	shell_write(sh, ".\n");
+
+	return REPLY_READY;
+}
+
+const char *
+shell_summary_startup(void)
+{
+	return "Show startup initialization timings";
+}
+
+const char *
+shell_help_startup(int argc, const char *argv[])
+{
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	return "startup [-s]\n"
+		"show time spent in each initialization step, in micro-seconds\n"
+		"steps flagged with 'd' were deferred until after startup\n"
+		"-s: sort by decreasing time instead of execution order\n";
+}
+
+/* vi: set ts=4 sw=4 cindent: */
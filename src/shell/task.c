@@ -39,7 +39,7 @@
 #include "lib/bg.h"
 #include "lib/pslist.h"
 #include "lib/str.h"
-#include "lib/stringify.h"			/* For compact_time_ms() */
+#include "lib/stringify.h"			/* For compact_time_ms() and friends */
 #include "lib/thread.h"
 
 #include "lib/override.h"		/* Must be the last header included */
@@ -48,8 +48,9 @@ static enum shell_reply
 shell_exec_task_list(struct gnutella_shell *sh,
 	int argc, const char *argv[])
 {
-	const char *opt_s;
+	const char *opt_l, *opt_s;
 	const option_t options[] = {
+		{ "l", &opt_l },
 		{ "s", &opt_s },
 	};
 	int parsed;
@@ -68,7 +69,12 @@ shell_exec_task_list(struct gnutella_shell *sh,
 	shell_write(sh, "100~\n");
 	if (opt_s != NULL) {
 		shell_write(sh,
-			"T  Tasks Run-Q Sleep-Q Ended Slice Period  Run-time Name\n");
+			"T  Tasks Run-Q Sleep-Q Ended Slice Period Overruns  Max-usec "
+			" Run-time Name\n");
+	} else if (opt_l != NULL) {
+		shell_write(sh,
+			"T  Runs       Overruns  Avg-usec  Max-usec  Run-time "
+			"Name (Sched)\n");
 	} else {
 		shell_write(sh,
 			"T  Flag S Work-Q Handled St Progress  Run-time Name (Sched)\n");
@@ -109,8 +115,26 @@ shell_exec_task_list(struct gnutella_shell *sh,
 				str_catf(s, "%'6d ", bsi->period);
 			else
 				str_catf(s, "%6s ", "-");
+			str_catf(s, "%'8u ", bsi->overruns);
+			str_catf(s, "%'9d ", bsi->lat_max);
 			str_catf(s, "%9s ", compact_time_ms(bsi->wtime));
-			str_catf(s, "\"%s\"", bsi->name);
+			str_catf(s, "\"%s\"%s", bsi->name, bsi->thread ? " (thread)" : "");
+		} else if (opt_l != NULL) {
+			bgtask_info_t *bi = sl->data;
+
+			bgtask_info_check(bi);
+
+			if (THREAD_INVALID_ID == bi->stid)
+				str_printf(s, "%-2s ", "-");
+			else
+				str_printf(s, "%-2d ", bi->stid);
+			str_catf(s, "%-10s ", uint64_to_string(bi->runs));
+			str_catf(s, "%'8u ", bi->overruns);
+			str_catf(s, "%'9d ", bi->lat_avg);
+			str_catf(s, "%'9d ", bi->lat_max);
+			str_catf(s, "%9s ", compact_time_ms(bi->wtime));
+			str_catf(s, "\"%s\"%*s(%s)", bi->tname,
+				(int) (maxlen - vstrlen(bi->tname)), "", bi->sname);
 		} else {
 			bgtask_info_t *bi = sl->data;
 
@@ -199,12 +223,13 @@ shell_help_task(int argc, const char *argv[])
 
 	if (argc > 1) {
 		if (0 == ascii_strcasecmp(argv[1], "list")) {
-			return "task list [-s]\n"
+			return "task list [-ls]\n"
 				"list all running background tasks\n"
+				"-l: show run latencies and time budget overruns\n"
 				"-s: show schedulers instead of tasks\n";
 		}
 	} else {
-		return "task list [-s]\n";
+		return "task list [-ls]\n";
 	}
 	return NULL;
 }
@@ -36,6 +36,7 @@
 #include "cmd.h"
 
 #include "lib/ascii.h"
+#include "lib/cq.h"
 #include "lib/dump_options.h"
 #include "lib/log.h"
 #include "lib/options.h"
@@ -223,6 +224,62 @@ shell_exec_thread_elements(struct gnutella_shell *sh,
 	return REPLY_READY;
 }
 
+static enum shell_reply
+shell_exec_thread_timers(struct gnutella_shell *sh,
+	int argc, const char *argv[])
+{
+	int i;
+	str_t *s;
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	if (1 != argc) {
+		shell_set_formatted(sh, "Invalid parameter count (%d)", argc);
+		return REPLY_ERROR;
+	}
+
+	shell_write(sh, "100~\n");
+	shell_write(sh,
+		"#    Inserted     Posted  Triggered  Cancelled Name\n");
+
+	s = str_new(80);
+
+	for (i = 0; i < THREAD_MAX; i++) {
+		thread_info_t info;
+		cq_thread_stats_t cts;
+
+		if (-1 == thread_get_info(i, &info))
+			continue;
+
+		if (!cq_thread_stats_get(i, &cts))
+			continue;
+
+		str_printf(s, "%-2d ", i);
+		str_catf(s, "%10zu ", cts.inserted);
+		str_catf(s, "%10zu ", cts.posted);
+		str_catf(s, "%10zu ", cts.triggered);
+		str_catf(s, "%10zu ", cts.cancelled);
+		if (info.name != NULL)
+			str_catf(s, "\"%s\"", info.name);
+		else if (info.entry != NULL)
+			str_catf(s, "%s()", stacktrace_function_name(info.entry));
+		else if (info.main_thread)
+			STR_CAT(s, "main()");
+		else
+			str_putc(s, '-');
+
+		str_putc(s, '\n');
+		shell_write(sh, str_2c(s));
+	}
+
+	str_destroy_null(&s);
+	shell_write(sh, ".\n");
+
+	return REPLY_READY;
+}
+
 /**
  * Handles the thread command.
  */
@@ -244,6 +301,7 @@ shell_exec_thread(struct gnutella_shell *sh, int argc, const char *argv[])
 	CMD(list);
 	CMD(stats);
 	CMD(elements);
+	CMD(timers);
 
 #undef CMD
 
@@ -278,11 +336,16 @@ shell_help_thread(int argc, const char *argv[])
 				"show thread global statistics\n"
 				"-p : pretty-print numbers with thousands separators\n";
 		}
+		else if (0 == ascii_strcasecmp(argv[1], "timers")) {
+			return "thread timers\n"
+				"show callout queue event statistics per thread\n";
+		}
 	} else {
 		return
 			"thread list\n"
 			"thread elements [-a]\n"
 			"thread stats [-p]\n"
+			"thread timers\n"
 			;
 	}
 	return NULL;